@@ -1,6 +1,7 @@
 ﻿#include "BakeParams.h"
 #include "PropertyBag.h"
 
+#include "BlockCompressor.h"
 #include "OidnDenoiserDevice.h"
 #include "OptixDenoiserDevice.h"
 
@@ -23,6 +24,16 @@ void BakeParams::load(const PropertyBag& propertyBag)
     light.bounceCount = propertyBag.get(PROP("bakeParams.lightBounceCount"), 10);
     light.sampleCount = propertyBag.get(PROP("bakeParams.lightSampleCount"), 32);
     light.maxRussianRouletteDepth = propertyBag.get(PROP("bakeParams.russianRouletteMaxDepth"), 4);
+    light.localLightSampleCount = propertyBag.get(PROP("bakeParams.localLightSampleCount"), 4);
+    light.tracerType = propertyBag.get(PROP("bakeParams.tracerType"), TracerType::Scalar);
+    light.samplerType = propertyBag.get(PROP("bakeParams.samplerType"), SamplerType::Sobol);
+    light.adaptiveSampling = propertyBag.get(PROP("bakeParams.adaptiveSampling"), false);
+    light.minSampleCount = propertyBag.get(PROP("bakeParams.minSampleCount"), 8);
+    light.sampleBudget = propertyBag.get(PROP("bakeParams.sampleBudget"), 0);
+    light.noiseThreshold = propertyBag.get(PROP("bakeParams.noiseThreshold"), 0.05f);
+    light.radianceCache = propertyBag.get(PROP("bakeParams.radianceCache"), false);
+    light.radianceCacheCellSize = propertyBag.get(PROP("bakeParams.radianceCacheCellSize"), 1.0f);
+    light.radianceCacheWarmUpSampleCount = propertyBag.get(PROP("bakeParams.radianceCacheWarmUpSampleCount"), 32);
 
     shadow.sampleCount = propertyBag.get(PROP("bakeParams.shadowSampleCount"), 64);
     shadow.radius = propertyBag.get(PROP("bakeParams.shadowSearchRadius"), 0.01f);
@@ -38,9 +49,13 @@ void BakeParams::load(const PropertyBag& propertyBag)
     resolution.override = propertyBag.get(PROP("bakeParams.resolutionOverride"), -1);
     resolution.min = propertyBag.get(PROP("bakeParams.resolutionMinimum"), 16);
     resolution.max = propertyBag.get(PROP("bakeParams.resolutionMaximum"), 2048);
+    resolution.subSampleCount = propertyBag.get(PROP("bakeParams.resolutionSubSampleCount"), 1);
+    resolution.tileSize = propertyBag.get(PROP("bakeParams.resolutionTileSize"), 0);
 
     postProcess.denoiseShadowMap = propertyBag.get(PROP("bakeParams.denoiseShadowMap"), true);
+    postProcess.denoiserGuides = propertyBag.get(PROP("bakeParams.denoiserGuides"), false);
     postProcess.optimizeSeams = propertyBag.get(PROP("bakeParams.optimizeSeams"), true);
+    postProcess.compressionQuality = propertyBag.get(PROP("bakeParams.compressionQuality"), BlockCompressionQuality::Normal);
     postProcess.denoiserType = propertyBag.get(PROP("bakeParams.denoiserType"), 
         OptixDenoiserDevice::available ? DenoiserType::Optix : OidnDenoiserDevice::available ? DenoiserType::Oidn : DenoiserType::None);
 
@@ -65,6 +80,16 @@ void BakeParams::store(PropertyBag& propertyBag) const
     propertyBag.set(PROP("bakeParams.lightBounceCount"), light.bounceCount);
     propertyBag.set(PROP("bakeParams.lightSampleCount"), light.sampleCount);
     propertyBag.set(PROP("bakeParams.russianRouletteMaxDepth"), light.maxRussianRouletteDepth);
+    propertyBag.set(PROP("bakeParams.localLightSampleCount"), light.localLightSampleCount);
+    propertyBag.set(PROP("bakeParams.tracerType"), light.tracerType);
+    propertyBag.set(PROP("bakeParams.samplerType"), light.samplerType);
+    propertyBag.set(PROP("bakeParams.adaptiveSampling"), light.adaptiveSampling);
+    propertyBag.set(PROP("bakeParams.minSampleCount"), light.minSampleCount);
+    propertyBag.set(PROP("bakeParams.sampleBudget"), light.sampleBudget);
+    propertyBag.set(PROP("bakeParams.noiseThreshold"), light.noiseThreshold);
+    propertyBag.set(PROP("bakeParams.radianceCache"), light.radianceCache);
+    propertyBag.set(PROP("bakeParams.radianceCacheCellSize"), light.radianceCacheCellSize);
+    propertyBag.set(PROP("bakeParams.radianceCacheWarmUpSampleCount"), light.radianceCacheWarmUpSampleCount);
 
     propertyBag.set(PROP("bakeParams.shadowSampleCount"), shadow.sampleCount);
     propertyBag.set(PROP("bakeParams.shadowSearchRadius"), shadow.radius);
@@ -80,9 +105,13 @@ void BakeParams::store(PropertyBag& propertyBag) const
     propertyBag.set(PROP("bakeParams.resolutionOverride"), resolution.override);
     propertyBag.set(PROP("bakeParams.resolutionMinimum"), resolution.min);
     propertyBag.set(PROP("bakeParams.resolutionMaximum"), resolution.max);
+    propertyBag.set(PROP("bakeParams.resolutionSubSampleCount"), resolution.subSampleCount);
+    propertyBag.set(PROP("bakeParams.resolutionTileSize"), resolution.tileSize);
 
     propertyBag.set(PROP("bakeParams.denoiseShadowMap"), postProcess.denoiseShadowMap);
+    propertyBag.set(PROP("bakeParams.denoiserGuides"), postProcess.denoiserGuides);
     propertyBag.set(PROP("bakeParams.optimizeSeams"), postProcess.optimizeSeams);
+    propertyBag.set(PROP("bakeParams.compressionQuality"), postProcess.compressionQuality);
     propertyBag.set(PROP("bakeParams.denoiserType"), postProcess.denoiserType);
 
     propertyBag.set(PROP("bakeParams.lightFieldMinCellRadius"), lightField.minCellRadius);
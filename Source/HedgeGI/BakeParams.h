@@ -2,6 +2,8 @@
 
 class PropertyBag;
 
+enum class BlockCompressionQuality;
+
 enum class EnvironmentMode
 {
     Color,
@@ -21,11 +23,38 @@ struct EnvironmentParams
     float skyIntensityScale;
 };
 
+enum class TracerType
+{
+    Scalar,
+    Packet,
+    Wavefront
+};
+
+enum class SamplerType
+{
+    Random,
+    Sobol
+};
+
 struct LightParams
 {
     uint32_t sampleCount;
     uint32_t bounceCount;
     uint32_t maxRussianRouletteDepth;
+    uint32_t localLightSampleCount;
+    TracerType tracerType;
+    SamplerType samplerType;
+
+    // Stops sampling a bake point once its noise falls under the threshold, sampleCount becomes the maximum
+    bool adaptiveSampling;
+    uint32_t minSampleCount;
+    uint32_t sampleBudget;
+    float noiseThreshold;
+
+    // Paths end into the cache after their first bounce once the cell they hit is warmed up
+    bool radianceCache;
+    float radianceCacheCellSize;
+    uint32_t radianceCacheWarmUpSampleCount;
 };
 
 struct ShadowParams
@@ -50,6 +79,12 @@ struct ResolutionParams
     uint16_t min;
     uint16_t max;
     int16_t override;
+
+    // Stratified sample positions inside each texel, paths and shadow rays are spread across them
+    uint32_t subSampleCount;
+
+    // Bakes and paints lightmaps in square tiles of this size to bound memory usage, 0 bakes them whole
+    uint16_t tileSize;
 };
 
 enum class DenoiserType
@@ -63,7 +98,9 @@ struct PostProcessParams
 {
     DenoiserType denoiserType;
     bool denoiseShadowMap;
+    bool denoiserGuides;
     bool optimizeSeams;
+    BlockCompressionQuality compressionQuality;
 };
 
 struct LightFieldParams
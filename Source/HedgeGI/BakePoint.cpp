@@ -0,0 +1,281 @@
+﻿#include "BakePoint.h"
+
+namespace
+{
+    constexpr size_t BAKE_POINT_OFFSET_COUNT = _countof(BAKE_POINT_OFFSETS);
+
+    struct TexelCandidate
+    {
+        uint32_t index; // y * size + x
+        uint32_t priority; // Index of the covering offset, the center offset comes last
+        uint32_t meshIndex;
+        uint32_t triangle;
+        Vector2 baryUV;
+        uint16_t subSampleMask; // Only filled for direct coverage
+
+        bool operator<(const TexelCandidate& other) const
+        {
+            // Group by texel and put the winner of each texel first
+            if (index != other.index) return index < other.index;
+            if (priority != other.priority) return priority > other.priority;
+            if (meshIndex != other.meshIndex) return meshIndex > other.meshIndex;
+            return triangle > other.triangle;
+        }
+    };
+
+    // Barycentric weight of a vertex as a linear function of texel space coordinates.
+    struct EdgeFunction
+    {
+        float dx;
+        float dy;
+        float c;
+
+        float evaluate(const float x, const float y) const
+        {
+            return dx * x + dy * y + c;
+        }
+
+        float getShift(const Vector2& offset) const
+        {
+            return dx * offset.x() + dy * offset.y();
+        }
+    };
+
+    struct TriangleSetup
+    {
+        EdgeFunction edges[3];
+
+        // Bounding box padded by the dilation offsets, inclusive
+        int32_t xBegin;
+        int32_t xEnd;
+        int32_t yBegin;
+        int32_t yEnd;
+
+        bool init(const Vector2& aVPos, const Vector2& bVPos, const Vector2& cVPos, const uint16_t size)
+        {
+            const Vector2 aPos = aVPos * (float)size;
+            const Vector2 bPos = bVPos * (float)size;
+            const Vector2 cPos = cVPos * (float)size;
+
+            const float area = (bPos - aPos).x() * (cPos - aPos).y() - (bPos - aPos).y() * (cPos - aPos).x();
+            if (!std::isfinite(area) || std::abs(area) < 1e-12f)
+                return false;
+
+            // Normalizing by the signed area makes the edge functions the barycentric weights of the opposite vertices regardless of winding.
+            const float invArea = 1.0f / area;
+            const Vector2* positions[] = { &aPos, &bPos, &cPos };
+
+            for (size_t i = 0; i < 3; i++)
+            {
+                const Vector2& from = *positions[(i + 1) % 3];
+                const Vector2& to = *positions[(i + 2) % 3];
+
+                edges[i].dx = (from.y() - to.y()) * invArea;
+                edges[i].dy = (to.x() - from.x()) * invArea;
+                edges[i].c = (from.x() * to.y() - from.y() * to.x()) * invArea;
+            }
+
+            const Vector2 begin = aPos.cwiseMin(bPos).cwiseMin(cPos);
+            const Vector2 end = aPos.cwiseMax(bPos).cwiseMax(cPos);
+
+            xBegin = (int32_t)std::max(0.0f, std::floor(begin.x()) - 2.0f);
+            xEnd = (int32_t)std::min((float)(size - 1), std::ceil(end.x()) + 1.0f);
+
+            yBegin = (int32_t)std::max(0.0f, std::floor(begin.y()) - 2.0f);
+            yEnd = (int32_t)std::min((float)(size - 1), std::ceil(end.y()) + 1.0f);
+
+            return xBegin <= xEnd && yBegin <= yEnd;
+        }
+    };
+
+    void rasterizeTriangle(const Mesh& mesh, const uint32_t meshIndex, const uint32_t triangleIndex, const uint16_t size, const uint32_t subSampleCount,
+        const int32_t xMin, const int32_t yMin, const int32_t xMax, const int32_t yMax, std::vector<TexelCandidate>& candidates)
+    {
+        const Triangle& triangle = mesh.triangles[triangleIndex];
+
+        TriangleSetup setup;
+        if (!setup.init(mesh.bakeVertices[triangle.a].vPos, mesh.bakeVertices[triangle.b].vPos, mesh.bakeVertices[triangle.c].vPos, size))
+            return;
+
+        // Offsets are in half texels. Moving the triangle by an offset is the same as moving the texel center by the opposite offset.
+        float shifts[BAKE_POINT_OFFSET_COUNT][3];
+        float minShifts[3] = { INFINITY, INFINITY, INFINITY };
+
+        for (size_t i = 0; i < BAKE_POINT_OFFSET_COUNT; i++)
+        {
+            for (size_t j = 0; j < 3; j++)
+            {
+                shifts[i][j] = setup.edges[j].getShift(BAKE_POINT_OFFSETS[i] * 0.5f);
+                minShifts[j] = std::min(minShifts[j], shifts[i][j]);
+            }
+        }
+
+        // Sub-samples move the sample position itself, so their shifts are added instead
+        float subSampleShifts[BAKE_POINT_MAX_SUB_SAMPLE_COUNT][3];
+
+        for (uint32_t i = 0; i < subSampleCount; i++)
+        {
+            for (size_t j = 0; j < 3; j++)
+                subSampleShifts[i][j] = setup.edges[j].getShift(getBakePointSubSampleOffset(i, subSampleCount));
+        }
+
+        const int32_t xBegin = std::max(setup.xBegin, xMin);
+        const int32_t xEnd = std::min(setup.xEnd, xMax);
+        const int32_t yBegin = std::max(setup.yBegin, yMin);
+        const int32_t yEnd = std::min(setup.yEnd, yMax);
+
+        for (int32_t y = yBegin; y <= yEnd; y++)
+        {
+            float weights[3];
+            for (size_t j = 0; j < 3; j++)
+                weights[j] = setup.edges[j].evaluate((float)xBegin + 0.5f, (float)y + 0.5f);
+
+            for (int32_t x = xBegin; x <= xEnd; x++)
+            {
+                if (weights[0] >= minShifts[0] && weights[1] >= minShifts[1] && weights[2] >= minShifts[2])
+                {
+                    // Later offsets take priority, so the first match from the back wins.
+                    for (size_t i = BAKE_POINT_OFFSET_COUNT; i-- > 0;)
+                    {
+                        const float wa = weights[0] - shifts[i][0];
+                        const float wb = weights[1] - shifts[i][1];
+                        const float wc = weights[2] - shifts[i][2];
+
+                        if (wa < 0 || wb < 0 || wc < 0)
+                            continue;
+
+                        uint16_t subSampleMask = 0;
+
+                        if (subSampleCount > 1 && i == BAKE_POINT_OFFSET_COUNT - 1)
+                        {
+                            for (uint32_t k = 0; k < subSampleCount; k++)
+                            {
+                                if (weights[0] + subSampleShifts[k][0] >= 0 && weights[1] + subSampleShifts[k][1] >= 0 && weights[2] + subSampleShifts[k][2] >= 0)
+                                    subSampleMask |= (uint16_t)(1 << k);
+                            }
+                        }
+
+                        candidates.push_back({ (uint32_t)y * size + (uint32_t)x, (uint32_t)i, meshIndex, triangleIndex, { wb, wc }, subSampleMask });
+                        break;
+                    }
+                }
+
+                for (size_t j = 0; j < 3; j++)
+                    weights[j] += setup.edges[j].dx;
+            }
+        }
+    }
+}
+
+BakePointRasterizer::BakePointRasterizer(const Instance& instance, const uint16_t size, const uint16_t tileSize, const uint32_t subSampleCount)
+    : instance(instance), size(size), tileSize(std::max<uint16_t>(1, std::min(size, tileSize))),
+    subSampleCount(std::max(1u, std::min(BAKE_POINT_MAX_SUB_SAMPLE_COUNT, subSampleCount)))
+{
+    tileCount = (uint16_t)((size + this->tileSize - 1) / this->tileSize);
+
+    triangleOffsets.reserve(instance.meshes.size() + 1);
+    triangleOffsets.push_back(0);
+
+    for (auto& mesh : instance.meshes)
+        triangleOffsets.push_back(triangleOffsets.back() + mesh->triangleCount);
+
+    tileTriangles.resize((size_t)tileCount * tileCount);
+
+    size_t validTriCount = 0;
+
+    for (size_t i = 0; i < instance.meshes.size(); i++)
+    {
+        const Mesh& mesh = *instance.meshes[i];
+
+        for (uint32_t j = 0; j < mesh.triangleCount; j++)
+        {
+            const Triangle& triangle = mesh.triangles[j];
+            const BakeVertex& a = mesh.bakeVertices[triangle.a];
+            const BakeVertex& b = mesh.bakeVertices[triangle.b];
+            const BakeVertex& c = mesh.bakeVertices[triangle.c];
+
+            // Check if the triangle is valid (but keep processing it to avoid false negatives)
+            validTriCount += validateVPos(a.vPos) && validateVPos(b.vPos) && validateVPos(c.vPos) &&
+                !nearlyEqual(a.vPos, b.vPos) && !nearlyEqual(b.vPos, c.vPos) && !nearlyEqual(c.vPos, a.vPos) ? 1u : 0u;
+
+            TriangleSetup setup;
+            if (!setup.init(a.vPos, b.vPos, c.vPos, size))
+                continue;
+
+            for (int32_t y = setup.yBegin / this->tileSize; y <= setup.yEnd / this->tileSize; y++)
+            {
+                for (int32_t x = setup.xBegin / this->tileSize; x <= setup.xEnd / this->tileSize; x++)
+                    tileTriangles[y * tileCount + x].push_back((uint32_t)(triangleOffsets[i] + j));
+            }
+        }
+    }
+
+    // If a good chunk of triangles are invalid, warn the user about it
+    if (validTriCount < triangleOffsets.back() / 2)
+        Logger::logFormatted(LogType::Warning, "Instance \"%s\" has invalid lightmap UV data", instance.name.c_str());
+}
+
+size_t BakePointRasterizer::getTileCount() const
+{
+    return tileTriangles.size();
+}
+
+std::vector<BakePointTexel> BakePointRasterizer::rasterize(const size_t tileIndex) const
+{
+    const std::vector<uint32_t>& triangles = tileTriangles[tileIndex];
+
+    const int32_t xMin = (int32_t)(tileIndex % tileCount) * tileSize;
+    const int32_t yMin = (int32_t)(tileIndex / tileCount) * tileSize;
+    const int32_t xMax = std::min<int32_t>(xMin + tileSize, size) - 1;
+    const int32_t yMax = std::min<int32_t>(yMin + tileSize, size) - 1;
+
+    tbb::combinable<std::vector<TexelCandidate>> threadCandidates;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, triangles.size(), 64), [&](const tbb::blocked_range<size_t>& range)
+    {
+        std::vector<TexelCandidate>& candidates = threadCandidates.local();
+
+        for (size_t i = range.begin(); i < range.end(); i++)
+        {
+            const size_t meshIndex = std::upper_bound(triangleOffsets.begin(), triangleOffsets.end(), triangles[i]) - triangleOffsets.begin() - 1;
+
+            rasterizeTriangle(*instance.meshes[meshIndex], (uint32_t)meshIndex, (uint32_t)(triangles[i] - triangleOffsets[meshIndex]), size, subSampleCount,
+                xMin, yMin, xMax, yMax, candidates);
+        }
+    });
+
+    std::vector<TexelCandidate> candidates;
+
+    threadCandidates.combine_each([&](const std::vector<TexelCandidate>& local)
+    {
+        candidates.insert(candidates.end(), local.begin(), local.end());
+    });
+
+    // The ordering is total, so the result does not depend on how the work was split between threads.
+    tbb::parallel_sort(candidates.begin(), candidates.end());
+
+    std::vector<BakePointTexel> texels;
+    texels.reserve(candidates.size());
+
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        const TexelCandidate& candidate = candidates[i];
+
+        // Sub-samples covered by any other triangle count as well, the winner places them
+        if (i > 0 && candidates[i - 1].index == candidate.index)
+        {
+            texels.back().subSampleMask |= candidate.subSampleMask;
+            continue;
+        }
+
+        texels.push_back({ instance.meshes[candidate.meshIndex], candidate.triangle, candidate.baryUV,
+            (uint16_t)(candidate.index % size), (uint16_t)(candidate.index / size), candidate.subSampleMask });
+    }
+
+    return texels;
+}
+
+std::vector<BakePointTexel> rasterizeBakePoints(const Instance& instance, const uint16_t size)
+{
+    return BakePointRasterizer(instance, size, size).rasterize(0);
+}
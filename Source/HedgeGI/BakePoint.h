@@ -12,11 +12,28 @@ enum BakePointFlags : size_t
     BAKE_POINT_FLAGS_LOCAL_LIGHT = 1 << 1,
     BAKE_POINT_FLAGS_SHADOW = 1 << 2,
     BAKE_POINT_FLAGS_SOFT_SHADOW = 1 << 3,
+    BAKE_POINT_FLAGS_ADAPTIVE_SAMPLING = 1 << 4, // Sample directions do not depend on the sample count
 
     BAKE_POINT_FLAGS_NONE = 0,
     BAKE_POINT_FLAGS_ALL = ~0
 };
 
+// Upper bound of the sub-texel sample positions of a bake point, each one takes a bit of its coverage mask
+constexpr uint32_t BAKE_POINT_MAX_SUB_SAMPLE_COUNT = 16;
+
+// Stratified offset of a sub-texel sample position from the texel center, in texels
+inline Vector2 getBakePointSubSampleOffset(const uint32_t index, const uint32_t count)
+{
+    if (count <= 1)
+        return Vector2::Zero();
+
+    // Evenly spaced along X, spread by the golden ratio along Y
+    const float x = ((float)index + 0.5f) / (float)count;
+    const float y = ((float)index + 0.5f) * 0.618034f;
+
+    return { x - 0.5f, y - std::floor(y) - 0.5f };
+}
+
 template<size_t BasisCount, size_t Flags>
 struct BakePoint
 {
@@ -34,11 +51,26 @@ struct BakePoint
     uint16_t x{ (uint16_t)-1 };
     uint16_t y{ (uint16_t)-1 };
 
+    // Change of position per texel, used to place the sub-texel samples covered by the mesh
+    Vector3 positionDx;
+    Vector3 positionDy;
+    uint16_t subSampleMask{};
+
+    // Average first hit albedo of the samples, painted as a denoiser guide alongside the normal
+    Color3 albedo{};
+
     static Vector3 sampleDirection(size_t index, size_t sampleCount, float u1, float u2);
+    static float pdfDirection(const Vector3& tangentSpaceDirection);
 
     bool valid() const;
     void discard();
 
+    // Number of covered sub-texel sample positions, or 1 for the texel center
+    uint32_t getSubSampleCount() const;
+
+    // Origin of a sample, samples are spread across the covered sub-texel positions in turn
+    Vector3 getSamplePosition(uint32_t index, uint32_t subSampleCount) const;
+
     void begin();
     void addSample(const Color3& color, const Vector3& worldSpaceDirection) = delete;
     void end(uint32_t sampleCount);
@@ -50,6 +82,12 @@ Vector3 BakePoint<BasisCount, Flags>::sampleDirection(const size_t index, const
     return sampleCosineWeightedHemisphere(u1, u2);
 }
 
+template <size_t BasisCount, size_t Flags>
+float BakePoint<BasisCount, Flags>::pdfDirection(const Vector3& tangentSpaceDirection)
+{
+    return std::max(0.0f, tangentSpaceDirection.z()) / PI;
+}
+
 template <size_t BasisCount, size_t Flags>
 bool BakePoint<BasisCount, Flags>::valid() const
 {
@@ -63,6 +101,37 @@ void BakePoint<BasisCount, Flags>::discard()
     y = (uint16_t)-1;
 }
 
+template <size_t BasisCount, size_t Flags>
+uint32_t BakePoint<BasisCount, Flags>::getSubSampleCount() const
+{
+    uint32_t count = 0;
+
+    for (uint32_t mask = subSampleMask; mask != 0; mask &= mask - 1)
+        ++count;
+
+    return std::max(1u, count);
+}
+
+template <size_t BasisCount, size_t Flags>
+Vector3 BakePoint<BasisCount, Flags>::getSamplePosition(const uint32_t index, const uint32_t subSampleCount) const
+{
+    if (subSampleMask == 0)
+        return position;
+
+    // Find the covered sub-sample this sample falls on
+    uint32_t remaining = index % getSubSampleCount();
+    uint32_t subSampleIndex = 0;
+
+    for (uint32_t mask = subSampleMask; ; mask >>= 1, subSampleIndex++)
+    {
+        if ((mask & 1) != 0 && remaining-- == 0)
+            break;
+    }
+
+    const Vector2 offset = getBakePointSubSampleOffset(subSampleIndex, subSampleCount);
+    return position + positionDx * offset.x() + positionDy * offset.y();
+}
+
 template <size_t BasisCount, size_t Flags>
 void BakePoint<BasisCount, Flags>::begin()
 {
@@ -70,6 +139,7 @@ void BakePoint<BasisCount, Flags>::begin()
         colors[i] = Color3::Zero();
 
     shadow = 0.0f;
+    albedo = Color3::Zero();
 }
 
 template <size_t BasisCount, size_t Flags>
@@ -114,82 +184,91 @@ inline bool validateVPos(const Vector2& vPos)
     return vPos.x() >= 0.0f && vPos.x() <= 1.0f && vPos.y() >= 0.0f && vPos.y() <= 1.0f;
 }
 
-template <typename TBakePoint>
-std::vector<TBakePoint> createBakePoints(const RaytracingContext& raytracingContext, const Instance& instance, const uint16_t size)
+// A texel covered by the lightmap UVs of a triangle, either directly or through one of the dilation offsets.
+struct BakePointTexel
 {
-    const float factor = 0.5f * (1.0f / (float)size);
+    const Mesh* mesh;
+    uint32_t triangle;
+    Vector2 baryUV;
+    uint16_t x;
+    uint16_t y;
+    uint16_t subSampleMask; // Sub-texel sample positions covered by any triangle
+};
 
-    std::vector<TBakePoint> bakePoints;
-    bakePoints.resize(size * size);
+// Splits the lightmap of an instance into square tiles and rasterizes one tile at a time, so that
+// only the triangles overlapping a tile are visited and only its covered texels are kept in memory.
+class BakePointRasterizer
+{
+    const Instance& instance;
+    uint16_t size;
+    uint16_t tileSize;
+    uint16_t tileCount; // Per axis
+    uint32_t subSampleCount;
+    std::vector<size_t> triangleOffsets;
+    std::vector<std::vector<uint32_t>> tileTriangles;
+
+public:
+    BakePointRasterizer(const Instance& instance, uint16_t size, uint16_t tileSize, uint32_t subSampleCount = 1);
+
+    size_t getTileCount() const;
+
+    // Returns the covered texels of the tile sorted by texel index.
+    // Direct coverage takes priority over the dilation offsets and overlapping triangles are resolved by their order in the instance.
+    std::vector<BakePointTexel> rasterize(size_t tileIndex) const;
+};
+
+// Rasterizes the whole lightmap as a single tile.
+std::vector<BakePointTexel> rasterizeBakePoints(const Instance& instance, uint16_t size);
 
-    size_t triCount = 0;
-    size_t validTriCount = 0;
+template <typename TBakePoint>
+std::vector<TBakePoint> createBakePoints(const std::vector<BakePointTexel>& texels, const uint16_t size)
+{
+    std::vector<TBakePoint> bakePoints;
+    bakePoints.resize(texels.size());
 
-    for (auto& mesh : instance.meshes)
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, texels.size()), [&](const tbb::blocked_range<size_t>& range)
     {
-        triCount += mesh->triangleCount;
-        
-        for (uint32_t i = 0; i < mesh->triangleCount; i++)
+        for (size_t i = range.begin(); i < range.end(); i++)
         {
-            const Triangle& triangle = mesh->triangles[i];
-            const Vertex& a = mesh->vertices[triangle.a];
-            const Vertex& b = mesh->vertices[triangle.b];
-            const Vertex& c = mesh->vertices[triangle.c];
+            const BakePointTexel& texel = texels[i];
 
-            // Check if the triangle is valid (but keep processing it to avoid false negatives)
-            validTriCount += validateVPos(a.vPos) && validateVPos(b.vPos) && validateVPos(c.vPos) &&
-                !nearlyEqual(a.vPos, b.vPos) && !nearlyEqual(b.vPos, c.vPos) && !nearlyEqual(c.vPos, a.vPos) ? 1u : 0u;
+            const Mesh& mesh = *texel.mesh;
+            const Triangle& triangle = mesh.triangles[texel.triangle];
+            const BakeVertex& a = mesh.bakeVertices[triangle.a];
+            const BakeVertex& b = mesh.bakeVertices[triangle.b];
+            const BakeVertex& c = mesh.bakeVertices[triangle.c];
 
-            for (auto& offset : BAKE_POINT_OFFSETS)
+            const Vector3 position = barycentricLerp(a.position, b.position, c.position, texel.baryUV);
+
+            const Vector3 normal = barycentricLerp(mesh.getNormal(triangle.a), mesh.getNormal(triangle.b), mesh.getNormal(triangle.c), texel.baryUV).normalized();
+            const Vector3 tangent = barycentricLerp(mesh.getTangent(triangle.a), mesh.getTangent(triangle.b), mesh.getTangent(triangle.c), texel.baryUV).normalized();
+            const Vector3 binormal = barycentricLerp(mesh.getBinormal(triangle.a), mesh.getBinormal(triangle.b), mesh.getBinormal(triangle.c), texel.baryUV).normalized();
+
+            bakePoints[i] =
+            {
+                position + position.cwiseAbs().cwiseProduct(normal.cwiseSign()) * 0.0000002f,
+                tangent, binormal, normal, {}, {}, texel.x, texel.y
+            };
+
+            if (texel.subSampleMask != 0)
             {
-                const Vector2 offsetScaled = offset * factor;
-
-                const Vector2 aVPos = a.vPos + offsetScaled;
-                const Vector2 bVPos = b.vPos + offsetScaled;
-                const Vector2 cVPos = c.vPos + offsetScaled;
-
-                const Vector2 begin = aVPos.cwiseMin(bVPos).cwiseMin(cVPos);
-                const Vector2 end = aVPos.cwiseMax(bVPos).cwiseMax(cVPos);
-
-                const uint16_t xBegin = std::max(0, (uint16_t)std::roundf((float)size * begin.x()) - 1);
-                const uint16_t xEnd = std::min(size - 1, (uint16_t)std::roundf((float)size * end.x()) + 1);
-
-                const uint16_t yBegin = std::max(0, (uint16_t)std::roundf((float)size * begin.y()) - 1);
-                const uint16_t yEnd = std::min(size - 1, (uint16_t)std::roundf((float)size * end.y()) + 1);
-
-                for (uint16_t x = xBegin; x <= xEnd; x++)
-                {
-                    for (uint16_t y = yBegin; y <= yEnd; y++)
-                    {
-                        const Vector2 vPos(((float)x + 0.5f) / (float)size, ((float)y + 0.5f) / (float)size);
-                        const Vector2 baryUV = getBarycentricCoords(vPos, aVPos, bVPos, cVPos);
-
-                        if (baryUV[0] < 0 || baryUV[0] > 1 ||
-                            baryUV[1] < 0 || baryUV[1] > 1 ||
-                            1 - baryUV[0] - baryUV[1] < 0 ||
-                            1 - baryUV[0] - baryUV[1] > 1)
-                            continue;
-
-                        const Vector3 position = barycentricLerp(a.position, b.position, c.position, baryUV);
-
-                        const Vector3 normal = barycentricLerp(a.normal, b.normal, c.normal, baryUV).normalized();
-                        const Vector3 tangent = barycentricLerp(a.tangent, b.tangent, c.tangent, baryUV).normalized();
-                        const Vector3 binormal = barycentricLerp(a.binormal, b.binormal, c.binormal, baryUV).normalized();
-
-                        bakePoints[y * size + x] =
-                        {
-                            position + position.cwiseAbs().cwiseProduct(normal.cwiseSign()) * 0.0000002f,
-                            tangent, binormal, normal, {}, {}, x, y
-                        };
-                    }
-                }
+                // Invert the texel space edges of the triangle to get the change of barycentrics per texel
+                const Vector2 uvEdge1 = (b.vPos - a.vPos) * (float)size;
+                const Vector2 uvEdge2 = (c.vPos - a.vPos) * (float)size;
+                const float invDet = 1.0f / (uvEdge1.x() * uvEdge2.y() - uvEdge1.y() * uvEdge2.x());
+
+                bakePoints[i].positionDx = ((b.position - a.position) * uvEdge2.y() - (c.position - a.position) * uvEdge1.y()) * invDet;
+                bakePoints[i].positionDy = ((c.position - a.position) * uvEdge1.x() - (b.position - a.position) * uvEdge2.x()) * invDet;
+                bakePoints[i].subSampleMask = texel.subSampleMask;
             }
         }
-    }
-
-    // If a good chunk of triangles are invalid, warn the user about it
-    if (validTriCount < triCount / 2)
-        Logger::logFormatted(LogType::Warning, "Instance \"%s\" has invalid lightmap UV data", instance.name.c_str());
+    });
 
     return bakePoints;
-}
\ No newline at end of file
+}
+
+template <typename TBakePoint>
+std::vector<TBakePoint> createBakePoints(const RaytracingContext& raytracingContext, const Instance& instance, const uint16_t size)
+{
+    return createBakePoints<TBakePoint>(rasterizeBakePoints(instance, size), size);
+}
@@ -84,6 +84,8 @@ void BakeService::bake()
     if (!params->validateOutputDirectoryPath(true))
         return;
 
+    get<Stage>()->getScene()->resetRadianceCache(*static_cast<BakeParams*>(params));
+
     const auto begin = std::chrono::high_resolution_clock::now();
 
     if (params->mode == BakingFactoryMode::GI)
@@ -95,6 +97,8 @@ void BakeService::bake()
     else if (params->mode == BakingFactoryMode::MetaInstancer)
         bakeMetaInstancer();
 
+    get<Stage>()->getScene()->releaseRadianceCache();
+
     const auto end = std::chrono::high_resolution_clock::now();
     const auto duration = std::chrono::duration_cast<std::chrono::seconds>(end - begin);
 
@@ -122,45 +126,56 @@ void BakeService::bakeGI()
         return std::move(context);
     });
 
-    GIBakerFunctionNode dilate(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
+    // Nothing modifies the combined map before it gets encode ready, so both happen in the same pass
+    const bool fuseEncodeReady = params->targetEngine == TargetEngine::HE1 &&
+        params->getDenoiserType() == DenoiserType::None && !params->postProcess.optimizeSeams;
+
+    GIBakerFunctionNode dilateAndCombine(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
     {
-        context->pair.lightMap = BitmapHelper::dilate(*context->pair.lightMap);
-        context->pair.shadowMap = BitmapHelper::dilate(*context->pair.shadowMap);
+        BitmapHelper::dilateAndCombine(*context->pair.lightMap, *context->pair.shadowMap, fuseEncodeReady, ENCODE_READY_FLAGS_SQRT);
 
-        return std::move(context);
-    });
+        if (context->pair.albedoMap != nullptr)
+        {
+            BitmapHelper::dilate(*context->pair.albedoMap);
+            BitmapHelper::dilate(*context->pair.normalMap);
+        }
+
+        context->combined = std::move(context->pair.lightMap);
+        context->pair.shadowMap = nullptr;
 
-    GIBakerFunctionNode combine(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
-    {
-        context->combined = BitmapHelper::combine(*context->pair.lightMap, *context->pair.shadowMap);
         return std::move(context);
     });
 
-    GIBakerFunctionNode denoise(g, 1, [=](GIBakerContextPtr context)
+    GIBakerFunctionNode denoise(g, BitmapHelper::getDenoiserConcurrency(params->getDenoiserType()), [=](GIBakerContextPtr context)
     {
-        context->combined = BitmapHelper::denoise(*context->combined, params->getDenoiserType(), params->postProcess.denoiseShadowMap);
+        context->combined = BitmapHelper::denoise(*context->combined, params->getDenoiserType(), params->postProcess.denoiseShadowMap,
+            context->pair.albedoMap.get(), context->pair.normalMap.get());
+
+        context->pair.albedoMap = nullptr;
+        context->pair.normalMap = nullptr;
+
         return std::move(context);
     });
 
     GIBakerFunctionNode optimizeSeams(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
     {
-        context->combined = BitmapHelper::optimizeSeams(*context->combined, *context->instance);
+        BitmapHelper::optimizeSeams(*context->combined, *context->instance);
         return std::move(context);
     });
 
     GIBakerFunctionNode encodeReady(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
     {
-        context->combined = BitmapHelper::makeEncodeReady(*context->combined, ENCODE_READY_FLAGS_SQRT);
+        BitmapHelper::makeEncodeReady(*context->combined, ENCODE_READY_FLAGS_SQRT);
         return std::move(context);
     });
 
-    GIBakerFunctionNode saveSeparated(g, 1, [=](GIBakerContextPtr context)
+    GIBakerFunctionNode saveSeparated(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
     {
         context->combined->save(context->lightMapFileName, game == Game::Generations ? DXGI_FORMAT_R16G16B16A16_FLOAT : SGGIBaker::LIGHT_MAP_FORMAT,
-            Bitmap::transformToLightMap, params->resolutionSuperSampleScale);
+            Bitmap::transformToLightMap, 1, params->postProcess.compressionQuality);
 
         context->combined->save(context->shadowMapFileName, game == Game::Generations ? DXGI_FORMAT_R8_UNORM : SGGIBaker::SHADOW_MAP_FORMAT,
-            Bitmap::transformToShadowMap, params->resolutionSuperSampleScale);
+            Bitmap::transformToShadowMap, 1, params->postProcess.compressionQuality);
 
         ++progress;
         lastBakedInstance = context->instance;
@@ -172,12 +187,12 @@ void BakeService::bakeGI()
     {
         if (game == Game::Unleashed || (game == Game::Generations && params->targetEngine == TargetEngine::HE1))
         {
-            context->combined->save(context->lightMapFileName, Bitmap::transformToLightMap, params->resolutionSuperSampleScale);
-            context->combined->save(context->shadowMapFileName, Bitmap::transformToShadowMap, params->resolutionSuperSampleScale);
+            context->combined->save(context->lightMapFileName, Bitmap::transformToLightMap);
+            context->combined->save(context->shadowMapFileName, Bitmap::transformToShadowMap);
         }
         else if (game == Game::LostWorld)
         {
-            context->combined->save(context->lightMapFileName, DXGI_FORMAT_BC3_UNORM, nullptr, params->resolutionSuperSampleScale);
+            context->combined->save(context->lightMapFileName, DXGI_FORMAT_BC3_UNORM, nullptr, 1, params->postProcess.compressionQuality);
         }
         else if (params->targetEngine == TargetEngine::HE2)
         {
@@ -191,11 +206,10 @@ void BakeService::bakeGI()
         return std::move(context);
     });
 
-    // bake -> dilate -> combine -> denoise -> optimizeSeams -> encodeReady -> save
-    tbb::flow::make_edge(bake, dilate);
-    tbb::flow::make_edge(dilate, combine);
+    // bake -> dilateAndCombine -> denoise -> optimizeSeams -> encodeReady -> save
+    tbb::flow::make_edge(bake, dilateAndCombine);
 
-    GIBakerFunctionNode* output = &combine;
+    GIBakerFunctionNode* output = &dilateAndCombine;
 
     if (params->getDenoiserType() != DenoiserType::None)
     {
@@ -209,7 +223,7 @@ void BakeService::bakeGI()
         output = &optimizeSeams;
     }
 
-    if (params->targetEngine == TargetEngine::HE1)
+    if (params->targetEngine == TargetEngine::HE1 && !fuseEncodeReady)
     {
         tbb::flow::make_edge(*output, encodeReady);
         output = &encodeReady;
@@ -229,35 +243,49 @@ void BakeService::bakeGI()
 
     GIBakerFunctionNode dilateSg(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
     {
-        context->pair.lightMap = BitmapHelper::dilate(*context->pair.lightMap);
-        context->pair.shadowMap = BitmapHelper::dilate(*context->pair.shadowMap);
+        // Fully shadowed texels look empty, so the light map has to decide the coverage before it gets dilated itself
+        BitmapHelper::dilate(*context->pair.shadowMap, *context->pair.lightMap);
+        BitmapHelper::dilate(*context->pair.lightMap);
+
+        if (context->pair.albedoMap != nullptr)
+        {
+            BitmapHelper::dilate(*context->pair.albedoMap);
+            BitmapHelper::dilate(*context->pair.normalMap);
+        }
 
         return std::move(context);
     });
 
-    GIBakerFunctionNode denoiseSg(g, 1, [=](GIBakerContextPtr context)
+    GIBakerFunctionNode denoiseSg(g, BitmapHelper::getDenoiserConcurrency(params->getDenoiserType()), [=](GIBakerContextPtr context)
     {
-        context->pair.lightMap = BitmapHelper::denoise(*context->pair.lightMap, params->getDenoiserType());
+        const Bitmap* albedoMap = context->pair.albedoMap.get();
+        const Bitmap* normalMap = context->pair.normalMap.get();
+
+        context->pair.lightMap = BitmapHelper::denoise(*context->pair.lightMap, params->getDenoiserType(), false, albedoMap, normalMap);
 
         if (params->postProcess.denoiseShadowMap)
-            context->pair.shadowMap = BitmapHelper::denoise(*context->pair.shadowMap, params->getDenoiserType());
+            context->pair.shadowMap = BitmapHelper::denoise(*context->pair.shadowMap, params->getDenoiserType(), false, albedoMap, normalMap);
+
+        context->pair.albedoMap = nullptr;
+        context->pair.normalMap = nullptr;
 
         return std::move(context);
     });
 	
     GIBakerFunctionNode optimizeSeamsSg(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
     {
-        const SeamOptimizer seamOptimizer(*context->instance);
-        context->pair.lightMap = seamOptimizer.optimize(*context->pair.lightMap);
-        context->pair.shadowMap = seamOptimizer.optimize(*context->pair.shadowMap);
+        // Both maps share the seams and the texel pairs found for them
+        SeamOptimizer seamOptimizer(*context->instance);
+        seamOptimizer.optimize(*context->pair.lightMap);
+        seamOptimizer.optimize(*context->pair.shadowMap);
 
         return std::move(context);
     });
 	
-    GIBakerFunctionNode saveSgCompressed(g, 1, [=](GIBakerContextPtr context)
+    GIBakerFunctionNode saveSgCompressed(g, tbb::flow::unlimited, [=](GIBakerContextPtr context)
     {
-        context->pair.lightMap->save(context->lightMapFileName, SGGIBaker::LIGHT_MAP_FORMAT, nullptr, params->resolutionSuperSampleScale);
-        context->pair.shadowMap->save(context->shadowMapFileName, SGGIBaker::SHADOW_MAP_FORMAT, nullptr, params->resolutionSuperSampleScale);
+        context->pair.lightMap->save(context->lightMapFileName, SGGIBaker::LIGHT_MAP_FORMAT, nullptr, 1, params->postProcess.compressionQuality);
+        context->pair.shadowMap->save(context->shadowMapFileName, SGGIBaker::SHADOW_MAP_FORMAT, nullptr, 1, params->postProcess.compressionQuality);
 
         ++progress;
         lastBakedInstance = context->instance;
@@ -269,8 +297,8 @@ void BakeService::bakeGI()
     {
         if (game == Game::Generations)
         {
-            context->pair.lightMap->save(context->lightMapFileName, DXGI_FORMAT_R16G16B16A16_FLOAT, nullptr, params->resolutionSuperSampleScale);
-            context->pair.shadowMap->save(context->shadowMapFileName, DXGI_FORMAT_R8_UNORM, nullptr, params->resolutionSuperSampleScale);
+            context->pair.lightMap->save(context->lightMapFileName, DXGI_FORMAT_R16G16B16A16_FLOAT);
+            context->pair.shadowMap->save(context->shadowMapFileName, DXGI_FORMAT_R8_UNORM);
 
             ++progress;
             lastBakedInstance = context->instance;
@@ -351,8 +379,8 @@ void BakeService::bakeGI()
 
         context->instance = instance;
 
-        context->resolution = (uint16_t)((params->resolution.override > 0 ? params->resolution.override :
-            instance->getResolution(params->propertyBag)) * params->resolutionSuperSampleScale);
+        context->resolution = params->resolution.override > 0 ? params->resolution.override :
+            instance->getResolution(params->propertyBag);
 
         context->lightMapFileName = std::move(lightMapFileName);
         context->shadowMapFileName = std::move(shadowMapFileName);
@@ -380,7 +408,7 @@ void BakeService::bakeLightField()
             return std::move(context);
         });      
 
-        SHLFBakerFunctionNode denoise(g, 1, [=](SHLFBakerContextPtr context)
+        SHLFBakerFunctionNode denoise(g, BitmapHelper::getDenoiserConcurrency(params->getDenoiserType()), [=](SHLFBakerContextPtr context)
         {
             context->bitmap = BitmapHelper::denoise(*context->bitmap, params->getDenoiserType());
             return std::move(context);
@@ -7,29 +7,9 @@
 #include "Random.h"
 #include "Utilities.h"
 
-template <TargetEngine targetEngine, bool tracingFromEye>
-Color3 BakingFactory::sampleSky(const RaytracingContext& raytracingContext, const Vector3& direction, const BakeParams& bakeParams, const size_t depth)
+template <TargetEngine targetEngine, bool useLinearFiltering>
+Color3 BakingFactory::traceSky(const RaytracingContext& raytracingContext, const Vector3& direction)
 {
-    const bool skyModelInViewport = tracingFromEye && depth == 0;
-
-    if (!skyModelInViewport && bakeParams.environment.mode == EnvironmentMode::Color)
-    {
-        Color3 color = bakeParams.environment.color;
-        if (targetEngine == TargetEngine::HE2)
-            color *= bakeParams.environment.colorIntensity;
-
-        return color;
-    }
-
-    if (!skyModelInViewport && bakeParams.environment.mode == EnvironmentMode::TwoColor)
-    {
-        Color3 color = lerp(bakeParams.environment.secondaryColor, bakeParams.environment.color, direction.y() * 0.5f + 0.5f);
-        if (targetEngine == TargetEngine::HE2)
-            color *= bakeParams.environment.colorIntensity;
-
-        return color;
-    }
-
     std::array<Color4, 8> colors {};
     std::array<bool, 8> additive {};
     Vector3 position { 0, 0, 0 };
@@ -51,26 +31,27 @@ Color3 BakingFactory::sampleSky(const RaytracingContext& raytracingContext, cons
         if (query.hit.geomID == RTC_INVALID_GEOMETRY_ID)
             break;
 
-        const Mesh& mesh = *raytracingContext.scene->meshes[query.hit.geomID];
+        const Mesh& mesh = *raytracingContext.scene->meshes[getMeshIndex(query.hit.geomID, query.hit.instID[0])];
         const Triangle& triangle = mesh.triangles[query.hit.primID];
-        const Vertex& a = mesh.vertices[triangle.a];
-        const Vertex& b = mesh.vertices[triangle.b];
-        const Vertex& c = mesh.vertices[triangle.c];
+        const TraceGeometry& geometry = mesh.getTraceGeometry();
+
+        position = barycentricLerp(geometry.getPosition(triangle.a), geometry.getPosition(triangle.b), geometry.getPosition(triangle.c), query.hit.u, query.hit.v);
 
-        position = barycentricLerp(a.position, b.position, c.position, query.hit.u, query.hit.v);
+        if (mesh.prototype != nullptr)
+            position = mesh.fromPrototypePosition(position);
 
-        const Vector2 hitUV = barycentricLerp(a.uv, b.uv, c.uv, query.hit.u, query.hit.v);
+        const Vector2 hitUV = barycentricLerp(geometry.getUV(triangle.a), geometry.getUV(triangle.b), geometry.getUV(triangle.c), query.hit.u, query.hit.v);
 
         Color4 diffuse;
 
         if (mesh.material->textures.diffuse != nullptr)
-            diffuse = mesh.material->textures.diffuse->getColor<tracingFromEye>(hitUV);
+            diffuse = mesh.material->textures.diffuse->traceTexture.getColor<useLinearFiltering>(hitUV);
         else
             diffuse = mesh.material->parameters.diffuse;
 
         if (mesh.material->skyType == 3) // Sky3
         {
-            diffuse *= barycentricLerp(a.color, b.color, c.color, query.hit.u, query.hit.v);
+            diffuse *= barycentricLerp(geometry.getColor(triangle.a), geometry.getColor(triangle.b), geometry.getColor(triangle.c), query.hit.u, query.hit.v);
             diffuse.head<3>() *= mesh.material->parameters.diffuse.head<3>();
             diffuse.w() *= mesh.material->parameters.opacityReflectionRefractionSpecType.x();
             srgbToLinear(diffuse);
@@ -87,11 +68,11 @@ Color3 BakingFactory::sampleSky(const RaytracingContext& raytracingContext, cons
 
         else if (targetEngine == TargetEngine::HE1)
         {
-            diffuse *= barycentricLerp(a.color, b.color, c.color, query.hit.u, query.hit.v);
+            diffuse *= barycentricLerp(geometry.getColor(triangle.a), geometry.getColor(triangle.b), geometry.getColor(triangle.c), query.hit.u, query.hit.v);
         }
 
         if (mesh.material->textures.alpha != nullptr)
-            diffuse.w() *= mesh.material->textures.alpha->getColor<tracingFromEye>(hitUV).x();
+            diffuse.w() *= mesh.material->textures.alpha->traceTexture.getColor<useLinearFiltering>(hitUV).x();
 
         colors[i] = diffuse;
         additive[i] = mesh.material->parameters.additive;
@@ -109,304 +90,643 @@ Color3 BakingFactory::sampleSky(const RaytracingContext& raytracingContext, cons
         skyColor = lerp<Color4>(skyColor, color, colors[j].w());
     }
 
+    return skyColor.head<3>().cwiseMax(0);
+}
+
+Color3 BakingFactory::traceSky(const RaytracingContext& raytracingContext, const Vector3& direction, const TargetEngine targetEngine)
+{
+    return targetEngine == TargetEngine::HE2 ?
+        traceSky<TargetEngine::HE2, true>(raytracingContext, direction) :
+        traceSky<TargetEngine::HE1, true>(raytracingContext, direction);
+}
+
+template <TargetEngine targetEngine, bool tracingFromEye>
+Color3 BakingFactory::sampleSky(const RaytracingContext& raytracingContext, const Vector3& direction, const BakeParams& bakeParams, const size_t depth)
+{
+    const bool skyModelInViewport = tracingFromEye && depth == 0;
+
+    if (!skyModelInViewport && bakeParams.environment.mode == EnvironmentMode::Color)
+    {
+        Color3 color = bakeParams.environment.color;
+        if (targetEngine == TargetEngine::HE2)
+            color *= bakeParams.environment.colorIntensity;
+
+        return color;
+    }
+
+    if (!skyModelInViewport && bakeParams.environment.mode == EnvironmentMode::TwoColor)
+    {
+        Color3 color = lerp(bakeParams.environment.secondaryColor, bakeParams.environment.color, direction.y() * 0.5f + 0.5f);
+        if (targetEngine == TargetEngine::HE2)
+            color *= bakeParams.environment.colorIntensity;
+
+        return color;
+    }
+
+    Color3 skyColor;
+
+    // Use the cached sky map unless we are looking at the sky model directly in the viewport
+    if (!skyModelInViewport && raytracingContext.skyMaps != nullptr && raytracingContext.skyMaps[(size_t)targetEngine].valid())
+        skyColor = raytracingContext.skyMaps[(size_t)targetEngine].getRadiance(direction);
+    else
+        skyColor = traceSky<targetEngine, tracingFromEye>(raytracingContext, direction);
+
     if (!skyModelInViewport)
         skyColor *= bakeParams.environment.skyIntensity;
 
     skyColor *= bakeParams.environment.skyIntensityScale;
 
-    return skyColor.head<3>().cwiseMax(0);
+    return skyColor;
 }
 
-template <TargetEngine targetEngine, bool tracingFromEye>
-BakingFactory::TraceResult BakingFactory::pathTrace(const RaytracingContext& raytracingContext, 
-    const Vector3& position, const Vector3& direction, const BakeParams& bakeParams, Random& random)
+template <TargetEngine targetEngine, bool tracingFromEye, TraceMaterialKernel kernel>
+void BakingFactory::shadeMaterial(const TraceMaterial& material, const Vector2& hitUV, const Color4& hitColor, const float textureLod, HitSurface& surface)
 {
-    TraceResult result {};
+    constexpr uint32_t features = getTraceMaterialKernelFeatures(kernel);
 
-    RTCIntersectArguments intersectArgs;
-    rtcInitIntersectArguments(&intersectArgs);
+    if constexpr (kernel == TraceMaterialKernel::IgnoreLight)
+    {
+        surface.diffuse *= hitColor * material.diffuseColor;
 
-    IntersectContext context(raytracingContext, random);
-    intersectArgs.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
-    intersectArgs.context = &context;
-    intersectArgs.filter = intersectContextFilter<targetEngine, tracingFromEye>;
+        if (material.has<features, TRACE_MATERIAL_DIFFUSE>())
+            surface.diffuse *= material.diffuse->getColor<tracingFromEye>(hitUV, textureLod);
 
-    RTCOccludedArguments occludedArgs;
-    rtcInitOccludedArguments(&occludedArgs);
+        if (targetEngine == TargetEngine::HE2)
+        {
+            surface.emission = material.has<features, TRACE_MATERIAL_EMISSION>() ? material.emission->getColor<tracingFromEye>(hitUV, textureLod) : material.emissive;
+            surface.emission *= material.emissionScale;
+        }
+        else if (material.has<features, TRACE_MATERIAL_EMISSION>())
+        {
+            surface.emission = material.emission->getColor<tracingFromEye>(hitUV, textureLod);
+            surface.emission += material.emissionParam;
+            surface.emission *= material.emissionParamScale;
+        }
 
-    occludedArgs.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
-    occludedArgs.context = &context;
-    occludedArgs.filter = intersectContextFilter<targetEngine, tracingFromEye>;
+        return;
+    }
 
-    RTCRayHit query{};
+    float blend;
 
-    setRayOrigin(query.ray, position, 0.001f);
-    setRayDirection(query.ray, direction);
-    query.ray.tfar = INFINITY;
-    query.ray.mask = RAY_MASK_OPAQUE | RAY_MASK_TRANS | RAY_MASK_PUNCH_THROUGH;
+    if (targetEngine == TargetEngine::HE2)
+    {
+        blend = hitColor.w();
+    }
+    else
+    {
+        surface.diffuse *= material.diffuseColor;
+        blend = hitColor.x();
+    }
 
-    query.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-    query.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+    if (material.has<features, TRACE_MATERIAL_DIFFUSE>())
+    {
+        Color4 diffuseTex = material.diffuse->getColor<tracingFromEye>(hitUV, textureLod);
 
-    Color4 throughput = Color4::Ones();
-    Color4 radiance = Color4::Zero();
+        if (targetEngine == TargetEngine::HE2)
+            srgbToLinear(diffuseTex);
 
-    int i;
+        if (material.has<features, TRACE_MATERIAL_DIFFUSE_BLEND>())
+        {
+            Color4 diffuseBlendTex = material.diffuseBlend->getColor<tracingFromEye>(hitUV, textureLod);
 
-    for (i = 0; i < (int32_t)bakeParams.light.bounceCount; i++)
+            if (targetEngine == TargetEngine::HE2)
+                srgbToLinear(diffuseBlendTex);
+
+            diffuseTex = lerp(diffuseTex, diffuseBlendTex, blend);
+        }
+
+        surface.diffuse *= diffuseTex;
+    }
+
+    if (material.has<features, TRACE_MATERIAL_VERTEX_COLOR>() || targetEngine == TargetEngine::HE2)
+        surface.diffuse *= hitColor;
+
+    if (targetEngine == TargetEngine::HE1 && material.has<features, TRACE_MATERIAL_GLOSS>())
     {
-        const Vector3& rayNormal = *(const Vector3*)&query.ray.dir_x; // Can safely do this as W is going to be 0
+        float gloss = material.gloss->getColor<tracingFromEye>(hitUV, textureLod).x();
 
-        rtcIntersect1(raytracingContext.rtcScene, &query, &intersectArgs);
-        if (query.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+        if (material.has<features, TRACE_MATERIAL_GLOSS_BLEND>())
+            gloss = lerp(gloss, material.glossBlend->getColor<tracingFromEye>(hitUV, textureLod).x(), blend);
+
+        surface.glossPower = std::min(1024.0f, std::max(1.0f, gloss * material.glossPowerScale));
+        surface.glossLevel = gloss * material.glossLevelScale;
+
+        surface.specular = material.specularColor;
+
+        if (material.has<features, TRACE_MATERIAL_SPECULAR>())
         {
-            radiance.head<3>() += throughput.head<3>() * sampleSky<targetEngine, tracingFromEye>(raytracingContext, rayNormal, bakeParams, i);
-            break;
+            Color4 specularTex = material.specular->getColor<tracingFromEye>(hitUV, textureLod);
+
+            if (material.has<features, TRACE_MATERIAL_SPECULAR_BLEND>())
+                specularTex = lerp(specularTex, material.specularBlend->getColor<tracingFromEye>(hitUV, textureLod), blend);
+
+            surface.specular *= specularTex;
         }
+    }
 
-        const Vector3 triNormal(query.hit.Ng_x, query.hit.Ng_y, query.hit.Ng_z);
+    else if (targetEngine == TargetEngine::HE2)
+    {
+        if (material.has<features, TRACE_MATERIAL_SPECULAR>())
+        {
+            surface.specular = material.specular->getColor<tracingFromEye>(hitUV, textureLod);
 
-        const Mesh& mesh = *raytracingContext.scene->meshes[query.hit.geomID];
+            if (material.has<features, TRACE_MATERIAL_SPECULAR_BLEND>())
+                surface.specular = lerp(surface.specular, material.specularBlend->getColor<tracingFromEye>(hitUV, textureLod), blend);
 
-        // Break the loop if we hit a backfacing triangle on an opaque mesh.
-        const bool doubleSided = mesh.material && mesh.material->parameters.doubleSided;
+            if (!material.has<features, TRACE_MATERIAL_METALNESS>())
+                surface.specular.w() = surface.specular.x() > 0.9f ? 1.0f : 0.0f;
 
-        if (mesh.type == MeshType::Opaque && !doubleSided && triNormal.dot(rayNormal) >= 0.0f)
+            surface.specular.x() *= 0.25f;
+        }
+        else
         {
-            if (!tracingFromEye)
-                result.backFacing = i == 0;
+            surface.specular.head<2>() = material.pbrFactor;
 
-            break;
+            if (material.has<features, TRACE_MATERIAL_DIFFUSE_BLEND>())
+                surface.specular.head<2>() = lerp<Eigen::Array2f>(material.pbrFactor, material.pbrFactor2, blend);
+
+            surface.specular.z() = 1.0f;
+
+            if (!material.has<features, TRACE_MATERIAL_METALNESS>())
+                surface.specular.w() = surface.specular.x() > 0.9f ? 1.0f : 0.0f;
         }
+    }
 
-        const Triangle& triangle = mesh.triangles[query.hit.primID];
-        const Vertex& a = mesh.vertices[triangle.a];
-        const Vertex& b = mesh.vertices[triangle.b];
-        const Vertex& c = mesh.vertices[triangle.c];
+    if (tracingFromEye && material.has<features, TRACE_MATERIAL_NORMAL>())
+    {
+        Vector2 normalMap = material.normal->getColor<tracingFromEye>(hitUV, textureLod).head<2>();
 
-        const Vector2 hitUV = barycentricLerp(a.uv, b.uv, c.uv, query.hit.u, query.hit.v);
-        const Color4 hitColor = barycentricLerp(a.color, b.color, c.color, query.hit.u, query.hit.v);
+        if (material.has<features, TRACE_MATERIAL_NORMAL_BLEND>())
+            normalMap = lerp<Vector2>(normalMap, material.normalBlend->getColor<tracingFromEye>(hitUV, textureLod).head<2>(), blend);
 
-        Vector3 hitNormal = barycentricLerp(a.normal, b.normal, c.normal, query.hit.u, query.hit.v).normalized();
+        normalMap = normalMap * 2 - Vector2::Ones();
+        surface.normal = (surface.tangent * normalMap.x() + surface.binormal * normalMap.y() + surface.normal * sqrt(1 - saturate(normalMap.dot(normalMap)))).normalized();
+    }
 
-        if ((mesh.type != MeshType::Opaque || doubleSided) && triNormal.dot(hitNormal) < 0)
-            hitNormal *= -1;
+    if (material.has<features, TRACE_MATERIAL_EMISSION>())
+        surface.emission = material.emission->getColor<tracingFromEye>(hitUV, textureLod) * material.emissionScale;
+}
 
-        const Vector3 hitTangent = barycentricLerp(a.tangent, b.tangent, c.tangent, query.hit.u, query.hit.v).normalized();
-        const Vector3 hitBinormal = barycentricLerp(a.binormal, b.binormal, c.binormal, query.hit.u, query.hit.v).normalized();
+template <TargetEngine targetEngine, bool tracingFromEye>
+bool BakingFactory::getHitSurface(const RaytracingContext& raytracingContext, const RTCRayHit& query, const size_t depth, const BakeParams& bakeParams, const float coneWidth, HitSurface& surface)
+{
+    const Vector3 rayNormal(query.ray.dir_x, query.ray.dir_y, query.ray.dir_z);
+    const uint32_t meshIndex = getMeshIndex(query.hit.geomID, query.hit.instID[0]);
+    const Mesh& mesh = *raytracingContext.scene->meshes[meshIndex];
+    const TraceMaterial& traceMaterial = raytracingContext.scene->getTraceMaterial(meshIndex);
 
-        Vector3 hitPosition = barycentricLerp(a.position, b.position, c.position, query.hit.u, query.hit.v);
+    // Embree reports the geometry normal of instanced hits in object space
+    Vector3 triNormal(query.hit.Ng_x, query.hit.Ng_y, query.hit.Ng_z);
 
-        if (i == 0 && tracingFromEye)
-            result.position = hitPosition;
-        
-        Color4 diffuse = Color4::Ones();
-        Color4 specular = Color4::Zero();
-        Color4 emission = Color4::Zero();
+    if (mesh.prototype != nullptr)
+        triNormal = mesh.fromPrototypeGeometryNormal(triNormal);
 
-        float glossPower = 1.0f;
-        float glossLevel = 0.0f;
+    // Break the loop if we hit a backfacing triangle on an opaque mesh.
+    const bool doubleSided = traceMaterial.doubleSided;
 
-        const Material* material = mesh.material;
+    if (mesh.type == MeshType::Opaque && !doubleSided && triNormal.dot(rayNormal) >= 0.0f)
+        return false;
 
-        if (material != nullptr)
-        {
-            if (material->type == MaterialType::Common || material->type == MaterialType::Blend)
-            {
-                float blend;
+    const Triangle& triangle = mesh.triangles[query.hit.primID];
+    const TraceGeometry& geometry = mesh.getTraceGeometry();
 
-                if (targetEngine == TargetEngine::HE2)
-                {
-                    blend = hitColor.w();
-                }
-                else
-                {
-                    diffuse *= material->parameters.diffuse;
-                    blend = hitColor.x();
-                }
+    const Vector2 uvA = geometry.getUV(triangle.a);
+    const Vector2 uvB = geometry.getUV(triangle.b);
+    const Vector2 uvC = geometry.getUV(triangle.c);
 
-                if (material->textures.diffuse != nullptr)
-                {
-                    Color4 diffuseTex = material->textures.diffuse->getColor<tracingFromEye>(hitUV);
+    const Vector2 hitUV = barycentricLerp(uvA, uvB, uvC, query.hit.u, query.hit.v);
+    const Color4 hitColor = barycentricLerp(geometry.getColor(triangle.a), geometry.getColor(triangle.b), geometry.getColor(triangle.c), query.hit.u, query.hit.v);
 
-                    if (targetEngine == TargetEngine::HE2)
-                        srgbToLinear(diffuseTex);
+    // Ray cone footprint over the texture coordinates, each texture adds its own size when picking a level
+    float textureLod = -INFINITY;
 
-                    if (material->type == MaterialType::Blend && material->textures.diffuseBlend != nullptr)
-                    {
-                        Color4 diffuseBlendTex = material->textures.diffuseBlend->getColor<tracingFromEye>(hitUV);
+    if (coneWidth > 0.0f)
+    {
+        const Vector2 uvEdge1 = uvB - uvA;
+        const Vector2 uvEdge2 = uvC - uvA;
 
-                        if (targetEngine == TargetEngine::HE2)
-                            srgbToLinear(diffuseBlendTex);
-                        
-                        diffuseTex = lerp(diffuseTex, diffuseBlendTex, blend);
-                    }
+        // The geometry normal is the unnormalized cross product of the edges, twice the area like the UV one
+        const float uvArea = std::abs(uvEdge1.x() * uvEdge2.y() - uvEdge1.y() * uvEdge2.x());
+        const float area = triNormal.norm();
+        const float cosTheta = std::max(0.01f, std::abs(triNormal.dot(rayNormal)) / area);
 
-                    diffuse *= diffuseTex;
-                }
+        textureLod = log2f(coneWidth / cosTheta) + 0.5f * log2f(uvArea / area);
+    }
 
-                if (!material->ignoreVertexColor || targetEngine == TargetEngine::HE2)
-                    diffuse *= hitColor;
+    Vector3 hitNormal = barycentricLerp(geometry.getNormal(triangle.a), geometry.getNormal(triangle.b), geometry.getNormal(triangle.c), query.hit.u, query.hit.v);
+    Vector3 hitTangent = barycentricLerp(geometry.getTangent(triangle.a), geometry.getTangent(triangle.b), geometry.getTangent(triangle.c), query.hit.u, query.hit.v);
+    Vector3 hitBinormal = barycentricLerp(geometry.getBinormal(triangle.a), geometry.getBinormal(triangle.b), geometry.getBinormal(triangle.c), query.hit.u, query.hit.v);
+    Vector3 hitPosition = barycentricLerp(geometry.getPosition(triangle.a), geometry.getPosition(triangle.b), geometry.getPosition(triangle.c), query.hit.u, query.hit.v);
 
-                if (targetEngine == TargetEngine::HE1 && material->textures.gloss != nullptr)
-                {
-                    float gloss = material->textures.gloss->getColor<tracingFromEye>(hitUV).x();
+    if (mesh.prototype != nullptr)
+    {
+        hitNormal = mesh.fromPrototypeDirection(hitNormal);
+        hitTangent = mesh.fromPrototypeDirection(hitTangent);
+        hitBinormal = mesh.fromPrototypeDirection(hitBinormal);
+        hitPosition = mesh.fromPrototypePosition(hitPosition);
+    }
 
-                    if (material->type == MaterialType::Blend && material->textures.glossBlend != nullptr)
-                        gloss = lerp(gloss, material->textures.glossBlend->getColor<tracingFromEye>(hitUV).x(), blend);
+    hitNormal.normalize();
+    hitTangent.normalize();
+    hitBinormal.normalize();
 
-                    glossPower = std::min(1024.0f, std::max(1.0f, gloss * material->parameters.powerGlossLevel.y() * 500.0f));
-                    glossLevel = gloss * material->parameters.powerGlossLevel.z() * 5.0f;
+    if ((mesh.type != MeshType::Opaque || doubleSided) && triNormal.dot(hitNormal) < 0)
+        hitNormal *= -1;
 
-                    specular = material->parameters.specular;
+    surface.material = traceMaterial.material;
+    surface.normal = hitNormal;
+    surface.tangent = hitTangent;
+    surface.binormal = hitBinormal;
+    surface.diffuse = Color4::Ones();
+    surface.specular = Color4::Zero();
+    surface.emission = Color4::Zero();
+    surface.glossPower = 1.0f;
+    surface.glossLevel = 0.0f;
 
-                    if (material->textures.specular != nullptr)
-                    {
-                        Color4 specularTex = material->textures.specular->getColor<tracingFromEye>(hitUV);
+    switch (traceMaterial.getKernel(targetEngine))
+    {
+    case TraceMaterialKernel::Untextured:
+        shadeMaterial<targetEngine, tracingFromEye, TraceMaterialKernel::Untextured>(traceMaterial, hitUV, hitColor, textureLod, surface);
+        break;
 
-                        if (material->type == MaterialType::Blend && material->textures.specularBlend != nullptr)
-                            specularTex = lerp(specularTex, material->textures.specularBlend->getColor<tracingFromEye>(hitUV), blend);
+    case TraceMaterialKernel::Diffuse:
+        shadeMaterial<targetEngine, tracingFromEye, TraceMaterialKernel::Diffuse>(traceMaterial, hitUV, hitColor, textureLod, surface);
+        break;
 
-                        specular *= specularTex;
-                    }
-                }
+    case TraceMaterialKernel::DiffuseGloss:
+        shadeMaterial<targetEngine, tracingFromEye, TraceMaterialKernel::DiffuseGloss>(traceMaterial, hitUV, hitColor, textureLod, surface);
+        break;
 
-                else if (targetEngine == TargetEngine::HE2)
-                {
-                    if (material->textures.specular != nullptr)
-                    {
-                        specular = material->textures.specular->getColor<tracingFromEye>(hitUV);
+    case TraceMaterialKernel::DiffuseSpecular:
+        shadeMaterial<targetEngine, tracingFromEye, TraceMaterialKernel::DiffuseSpecular>(traceMaterial, hitUV, hitColor, textureLod, surface);
+        break;
 
-                        if (material->type == MaterialType::Blend && material->textures.specularBlend != nullptr)
-                            specular = lerp(specular, material->textures.specularBlend->getColor<tracingFromEye>(hitUV), blend);
+    case TraceMaterialKernel::Generic:
+        shadeMaterial<targetEngine, tracingFromEye, TraceMaterialKernel::Generic>(traceMaterial, hitUV, hitColor, textureLod, surface);
+        break;
 
-                        if (!material->hasMetalness)
-                            specular.w() = specular.x() > 0.9f ? 1.0f : 0.0f;
+    case TraceMaterialKernel::IgnoreLight:
+        shadeMaterial<targetEngine, tracingFromEye, TraceMaterialKernel::IgnoreLight>(traceMaterial, hitUV, hitColor, textureLod, surface);
+        break;
 
-                        specular.x() *= 0.25f;
-                    }
-                    else
-                    {
-                        specular.head<2>() = material->parameters.pbrFactor.head<2>();
+    default:
+        break;
+    }
 
-                        if (material->type == MaterialType::Blend && material->textures.diffuseBlend != nullptr)
-                            specular.head<2>() = lerp<Eigen::Array2f>(specular.head<2>(), material->parameters.pbrFactor2.head<2>(), blend);
+    const bool shouldApplyBakeParam = !tracingFromEye || depth > 0;
 
-                        specular.z() = 1.0f;
+    if (shouldApplyBakeParam)
+        surface.emission *= bakeParams.material.emissionIntensity;
 
-                        if (!material->hasMetalness)
-                            specular.w() = specular.x() > 0.9f ? 1.0f : 0.0f;
-                    }
-                }
+    surface.position = hitPosition + hitPosition.cwiseAbs().cwiseProduct(surface.normal.cwiseSign()) * 0.0000002f;
+    surface.viewDirection = -rayNormal;
+    surface.nDotV = saturate(surface.normal.dot(surface.viewDirection));
 
-                if (tracingFromEye && material->textures.normal != nullptr)
-                {
-                    Vector2 normalMap = material->textures.normal->getColor<tracingFromEye>(hitUV).head<2>();
+    if (targetEngine == TargetEngine::HE2)
+    {
+        surface.metalness = surface.specular.w();
+        surface.roughness = std::max(0.01f, 1 - surface.specular.y());
+        surface.F0 = lerp<Color4>(Color4(surface.specular.x()), surface.diffuse, surface.metalness);
+    }
+    else
+    {
+        // pow(1.0 - nDotV, 5.0) * 0.6 + 0.4
+        float tmp = 1.0f - surface.nDotV;
+        surface.fresnel = tmp * tmp;
+        surface.fresnel *= surface.fresnel;
+        surface.fresnel *= tmp;
+        surface.fresnel = surface.fresnel * 0.6f + 0.4f;
+    }
 
-                    if (material->type == MaterialType::Blend && material->textures.normalBlend != nullptr)
-                        normalMap = lerp<Vector2>(normalMap, material->textures.normalBlend->getColor<tracingFromEye>(hitUV).head<2>(), blend);
+    if (traceMaterial.material == nullptr || traceMaterial.type == MaterialType::Common || traceMaterial.type == MaterialType::Blend)
+    {
+        if (shouldApplyBakeParam && (bakeParams.material.diffuseIntensity != 1.0f || bakeParams.material.diffuseSaturation != 1.0f))
+        {
+            Color3 hsv = rgb2Hsv(surface.diffuse.head<3>());
+            hsv.y() = saturate(hsv.y() * bakeParams.material.diffuseSaturation);
+            hsv.z() = saturate(hsv.z() * bakeParams.material.diffuseIntensity);
+            surface.diffuse.head<3>() = hsv2Rgb(hsv);
+        }
+    }
+    else if (traceMaterial.type == MaterialType::IgnoreLight)
+    {
+        if (shouldApplyBakeParam)
+            surface.diffuse *= bakeParams.material.emissionIntensity;
+    }
 
-                    normalMap = normalMap * 2 - Vector2::Ones();
-                    hitNormal = (hitTangent * normalMap.x() + hitBinormal * normalMap.y() + hitNormal * sqrt(1 - saturate(normalMap.dot(normalMap)))).normalized();
-                }
+    surface.applyBakeParams = shouldApplyBakeParam;
 
-                if (material->textures.emission != nullptr)
-                    emission = material->textures.emission->getColor<tracingFromEye>(hitUV) * material->parameters.ambient * material->parameters.luminance.x();
-            }
+    return true;
+}
 
-            else if (material->type == MaterialType::IgnoreLight)
-            {
-                diffuse *= hitColor * material->parameters.diffuse;
+float BakingFactory::getConeSpreadAngle(const BakeParams& bakeParams)
+{
+    return sqrtf(2 * PI / (float)std::max(1u, bakeParams.light.sampleCount));
+}
 
-                if (material->textures.diffuse != nullptr)
-                    diffuse *= material->textures.diffuse->getColor<tracingFromEye>(hitUV);
+Sampler BakingFactory::createSampler(const Vector3& position, const uint32_t index, const BakeParams& bakeParams)
+{
+    if (bakeParams.light.samplerType == SamplerType::Sobol)
+        return { Sampler::getSeed(position), index };
 
-                if (targetEngine == TargetEngine::HE2)
-                {
-                    emission = (material->textures.emission != nullptr ? material->textures.emission->getColor<tracingFromEye>(hitUV) : material->parameters.emissive);
-                    emission *= material->parameters.ambient * material->parameters.luminance.x();
-                }
-                else if (material->textures.emission != nullptr)
-                {
-                    emission = material->textures.emission->getColor<tracingFromEye>(hitUV);
-                    emission += material->parameters.emissionParam;
-                    emission *= material->parameters.ambient * material->parameters.emissionParam.w();
-                }
-            }
+    return {};
+}
+
+template <TargetEngine targetEngine>
+bool BakingFactory::getLightDirection(const Vector3& position, const Light& light, Vector3& lightDirection, float& attenuation)
+{
+    if (light.type == LightType::Point)
+    {
+        if (targetEngine == TargetEngine::HE1)
+            computeDirectionAndAttenuationHE1(position, light.position, light.range, lightDirection, attenuation);
+
+        else if (targetEngine == TargetEngine::HE2)
+            computeDirectionAndAttenuationHE2(position, light.position, light.range, lightDirection, attenuation);
+
+        return attenuation != 0.0f;
+    }
+
+    lightDirection = light.position;
+    attenuation = 1.0f;
+
+    return true;
+}
+
+template <TargetEngine targetEngine>
+const Light* BakingFactory::sampleLocalLight(const RaytracingContext& raytracingContext, const HitSurface& surface, const BakeParams& bakeParams, Random& random, float& weight)
+{
+    float pdf;
+
+    const Light* light = raytracingContext.lightBVH->sample(surface.position, surface.normal, random.nextSample(), pdf,
+        targetEngine == TargetEngine::HE1 ? computeAttenuationHE1 : computeAttenuationHE2);
+
+    if (light != nullptr)
+        weight = 1.0f / (pdf * (float)bakeParams.light.localLightSampleCount);
+
+    return light;
+}
+
+template <TargetEngine targetEngine>
+Color4 BakingFactory::evaluateDirectLighting(const HitSurface& surface, const Light& light, const Vector3& lightDirection, const float attenuation, const BakeParams& bakeParams)
+{
+    const float nDotL = saturate(surface.normal.dot(-lightDirection));
+
+    if (nDotL <= 0)
+        return Color4::Zero();
+
+    Color4 directLighting;
+
+    if (targetEngine == TargetEngine::HE1)
+    {
+        directLighting = surface.diffuse;
+
+        if (surface.glossLevel > 0.0f)
+        {
+            const Vector3 halfwayDirection = (surface.viewDirection - lightDirection).normalized();
+            directLighting += surface.specular * powf(saturate(halfwayDirection.dot(surface.normal)), surface.glossPower) * surface.glossLevel * surface.fresnel;
         }
+    }
+    else if (targetEngine == TargetEngine::HE2)
+    {
+        const Vector3 halfwayDirection = (surface.viewDirection - lightDirection).normalized();
+        const float nDotH = saturate(surface.normal.dot(halfwayDirection));
 
-        const bool shouldApplyBakeParam = !tracingFromEye || i > 0;
+        const Color4 F = fresnelSchlick(surface.F0, saturate(halfwayDirection.dot(surface.viewDirection)));
+        const float D = ndfGGX(nDotH, surface.roughness);
+        const float Vis = visSchlick(surface.roughness, surface.nDotV, nDotL);
 
-        if (shouldApplyBakeParam)
-            emission *= bakeParams.material.emissionIntensity;
+        const Color4 kd = lerp<Color4>(Color4::Ones() - F, Color4::Zero(), surface.metalness);
 
-        hitPosition += hitPosition.cwiseAbs().cwiseProduct(hitNormal.cwiseSign()) * 0.0000002f;
+        directLighting = kd * (surface.diffuse / PI);
+        directLighting += (D * Vis) * F;
+    }
 
-        const Vector3 viewDirection = -rayNormal;
-        const float nDotV = saturate(hitNormal.dot(viewDirection));
+    directLighting.head<3>() *= nDotL * light.color;
 
-        // HE1
-        float fresnel;
+    if (surface.applyBakeParams)
+        directLighting *= bakeParams.material.lightIntensity;
 
-        // HE2
-        float metalness;
-        float roughness;
-        Color4 F0;
+    directLighting *= attenuation;
 
-        if (targetEngine == TargetEngine::HE2)
+    return directLighting;
+}
+
+template <TargetEngine targetEngine>
+bool BakingFactory::sampleNextDirection(const HitSurface& surface, const size_t depth, const BakeParams& bakeParams, Random& random, Color4& throughput, Vector3& hitDirection)
+{
+    if (targetEngine == TargetEngine::HE2)
+    {
+        const bool isMetallic = surface.metalness == 1.0f;
+        const float probability = isMetallic ? 0.0f : surface.roughness * 0.5f + 0.5f;
+
+        // Randomly select specular BRDF
+        const float selection = random.nextSample();
+        const Vector2 u = random.nextSample2D();
+
+        if (isMetallic || selection > probability)
         {
-            metalness = specular.w();
-            roughness = std::max(0.01f, 1 - specular.y());
-            F0 = lerp<Color4>(Color4(specular.x()), diffuse, metalness);
+            const Vector3 halfwayDirection = microfacetGGX(surface.roughness, u.x(), u.y(), 
+                surface.tangent, surface.binormal, surface.normal).normalized();
+
+            hitDirection = 2 * halfwayDirection.dot(surface.viewDirection) * halfwayDirection - surface.viewDirection;
+
+            const float nDotL = saturate(surface.normal.dot(hitDirection));
+            const float nDotH = saturate(surface.normal.dot(halfwayDirection));
+            const float hDotV = saturate(halfwayDirection.dot(surface.viewDirection));
+
+            if (nDotL == 0 || nDotH == 0 || hDotV == 0)
+                return false;
+
+            const Color4 F = fresnelSchlick(surface.F0, hDotV);
+            const float Vis = visSchlick(surface.roughness, surface.nDotV, nDotL);
+            const float PDF = 4 * hDotV / nDotH;
+
+            throughput *= Vis * F * PDF / (1 - probability);
         }
+
+        // Diffuse BRDF
         else
         {
-            // pow(1.0 - nDotV, 5.0) * 0.6 + 0.4
-            float tmp = 1.0f - nDotV;
-            fresnel = tmp * tmp;
-            fresnel *= fresnel;
-            fresnel *= tmp;
-            fresnel = fresnel * 0.6f + 0.4f;
+            hitDirection = tangentToWorld(sampleCosineWeightedHemisphere(u.x(), u.y()),
+                surface.tangent, surface.binormal, surface.normal).normalized();
+
+            const Color4 kd = lerp<Color4>(1 - surface.F0, Color4::Zero(), surface.metalness);
+            throughput *= kd * surface.diffuse / probability;
+        }
+
+        throughput *= surface.specular.z(); // Ambient occlusion
+    }
+
+    else
+    {
+        const Vector2 u = random.nextSample2D();
+
+        hitDirection = tangentToWorld(sampleCosineWeightedHemisphere(u.x(), u.y()),
+            surface.tangent, surface.binormal, surface.normal).normalized();
+
+        throughput *= surface.diffuse;
+    }
+
+    // Do russian roulette at highest difficulty fuhuhuhuhuhu
+    const float probability = throughput.head<3>().maxCoeff();
+    if (depth >= bakeParams.light.maxRussianRouletteDepth)
+    {
+        if (random.next() > probability)
+            return false;
+
+        throughput /= probability;
+    }
+
+    return true;
+}
+
+template <TargetEngine targetEngine, bool tracingFromEye, uint32_t features>
+BakingFactory::TraceResult BakingFactory::pathTrace(const RaytracingContext& raytracingContext, 
+    const Vector3& position, const Vector3& direction, const BakeParams& bakeParams, Random& random, const RTCRayHit* firstHit)
+{
+    static_assert(!tracingFromEye || features == PATH_TRACE_FEATURE_ALL, "The viewport always uses the generic path tracer");
+
+    TraceResult result {};
+
+    RTCIntersectArguments intersectArgs;
+    rtcInitIntersectArguments(&intersectArgs);
+
+    RTCOccludedArguments occludedArgs;
+    rtcInitOccludedArguments(&occludedArgs);
+
+    IntersectContext context(raytracingContext, random);
+
+    if constexpr ((features & PATH_TRACE_FEATURE_ALPHA_GEOMETRY) != 0)
+    {
+        intersectArgs.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+        intersectArgs.context = &context;
+        intersectArgs.filter = intersectContextFilter<targetEngine, tracingFromEye>;
+
+        occludedArgs.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+        occludedArgs.context = &context;
+        occludedArgs.filter = intersectContextFilter<targetEngine, tracingFromEye>;
+    }
+
+    // Without a direction dependent environment every escaped path sees the same color
+    Color3 environmentColor;
+
+    if constexpr ((features & PATH_TRACE_FEATURE_ENVIRONMENT) == 0)
+        environmentColor = sampleSky<targetEngine, tracingFromEye>(raytracingContext, direction, bakeParams, 0);
+
+    RTCRayHit query{};
+
+    setRayOrigin(query.ray, position, 0.001f);
+    setRayDirection(query.ray, direction);
+    query.ray.tfar = INFINITY;
+    query.ray.mask = RAY_MASK_OPAQUE | RAY_MASK_TRANS | RAY_MASK_PUNCH_THROUGH;
+
+    query.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    query.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+
+    Color4 throughput = Color4::Ones();
+    Color4 radiance = Color4::Zero();
+
+    // Radiance gathered past the first bounce, used to warm up the radiance cache
+    RadianceCache* radianceCache = tracingFromEye ? nullptr : raytracingContext.radianceCache;
+    Vector3 cachePosition;
+    Vector3 cacheNormal;
+    Color4 cacheThroughput = Color4::Zero();
+    Color4 cacheRadiance;
+
+    // Viewport rays keep full texture detail
+    const float coneSpreadAngle = tracingFromEye ? 0.0f : getConeSpreadAngle(bakeParams);
+    float coneWidth = 0.0f;
+
+    int i;
+
+    for (i = 0; i < (int32_t)bakeParams.light.bounceCount; i++)
+    {
+        const Vector3& rayNormal = *(const Vector3*)&query.ray.dir_x; // Can safely do this as W is going to be 0
+
+        if (i == 0 && firstHit != nullptr)
+            query = *firstHit;
+        else
+            rtcIntersect1(raytracingContext.rtcScene, &query, &intersectArgs);
+
+        if (query.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+        {
+            if (i == 0)
+                result.albedo = Color3::Ones();
+
+            if constexpr ((features & PATH_TRACE_FEATURE_ENVIRONMENT) != 0)
+                radiance.head<3>() += throughput.head<3>() * sampleSky<targetEngine, tracingFromEye>(raytracingContext, rayNormal, bakeParams, i);
+            else
+                radiance.head<3>() += throughput.head<3>() * environmentColor;
+
+            break;
+        }
+
+        coneWidth += coneSpreadAngle * query.ray.tfar;
+
+        HitSurface surface;
+
+        if (!getHitSurface<targetEngine, tracingFromEye>(raytracingContext, query, i, bakeParams, coneWidth, surface))
+        {
+            if (!tracingFromEye)
+                result.backFacing = i == 0;
+
+            if (i == 0)
+                result.albedo = Color3::Zero();
+
+            break;
         }
 
-        if (material == nullptr || material->type == MaterialType::Common || material->type == MaterialType::Blend)
+        if (i == 0 && tracingFromEye)
+            result.position = surface.position;
+
+        if (i == 0)
+            result.albedo = surface.diffuse.head<3>();
+
+        if (i == 1 && radianceCache != nullptr)
         {
-            if (shouldApplyBakeParam && (bakeParams.material.diffuseIntensity != 1.0f || bakeParams.material.diffuseSaturation != 1.0f))
+            Color3 cachedRadiance;
+
+            if (radianceCache->get(surface.position, surface.normal, cachedRadiance))
             {
-                Color3 hsv = rgb2Hsv(diffuse.head<3>());
-                hsv.y() = saturate(hsv.y() * bakeParams.material.diffuseSaturation);
-                hsv.z() = saturate(hsv.z() * bakeParams.material.diffuseIntensity);
-                diffuse.head<3>() = hsv2Rgb(hsv);
+                radiance.head<3>() += throughput.head<3>() * cachedRadiance;
+                break;
             }
 
-            std::array<const Light*, 32> lights;
-            size_t lightCount = 0;
+            cachePosition = surface.position;
+            cacheNormal = surface.normal;
+            cacheThroughput = throughput;
+            cacheRadiance = radiance;
+        }
 
-            raytracingContext.lightBVH->traverse(hitPosition, lights, lightCount);
+        if (surface.material == nullptr || surface.material->type == MaterialType::Common || surface.material->type == MaterialType::Blend)
+        {
+            // The sun light is always evaluated, local lights are picked from the light BVH
+            constexpr uint32_t firstLightSample = (features & PATH_TRACE_FEATURE_SUN_LIGHT) != 0 ? 0 : 1;
+            const uint32_t lastLightSample = (features & PATH_TRACE_FEATURE_LOCAL_LIGHTS) != 0 ? bakeParams.light.localLightSampleCount : 0;
 
-            for (size_t j = 0; j < lightCount; j++)
+            // Consume the samples of the skipped local light picks, so the sample sequence matches the generic path tracer
+            if constexpr ((features & PATH_TRACE_FEATURE_LOCAL_LIGHTS) == 0)
             {
-                const Light* light = lights[j];
+                for (uint32_t j = 0; j < bakeParams.light.localLightSampleCount; j++)
+                    random.nextSample();
+            }
 
-                Vector3 lightDirection;
-                float attenuation;
+            for (uint32_t j = firstLightSample; j <= lastLightSample; j++)
+            {
+                const Light* light = raytracingContext.lightBVH->getSunLight();
+                float lightWeight = 1.0f;
 
-                if (light->type == LightType::Point)
-                {
-                    if (targetEngine == TargetEngine::HE1)
-                        computeDirectionAndAttenuationHE1(hitPosition, light->position, light->range, lightDirection, attenuation);
+                if (j > 0)
+                    light = sampleLocalLight<targetEngine>(raytracingContext, surface, bakeParams, random, lightWeight);
 
-                    else if (targetEngine == TargetEngine::HE2)
-                        computeDirectionAndAttenuationHE2(hitPosition, light->position, light->range, lightDirection, attenuation);
+                if (light == nullptr)
+                    continue;
 
-                    if (attenuation == 0.0f)
-                        continue;
-                }
-                else
-                {
-                    lightDirection = light->position;
-                    attenuation = 1.0f;
-                }
+                Vector3 lightDirection;
+                float attenuation;
+
+                if (!getLightDirection<targetEngine>(surface.position, *light, lightDirection, attenuation))
+                    continue;
 
                 if (targetEngine == TargetEngine::HE1 || light->type == LightType::Directional)
                 {
@@ -434,9 +754,9 @@ BakingFactory::TraceResult BakingFactory::pathTrace(const RaytracingContext& ray
 
                     RTCRay ray {};
 
-                    setRayOrigin(ray, hitPosition, bakeParams.shadow.bias);
+                    setRayOrigin(ray, surface.position, bakeParams.shadow.bias);
                     setRayDirection(ray, shadowDirection);
-                    ray.tfar = light->type == LightType::Point ? (light->position - hitPosition).norm() : INFINITY;
+                    ray.tfar = light->type == LightType::Point ? (light->position - surface.position).norm() : INFINITY;
                     ray.mask = RAY_MASK_OPAQUE | RAY_MASK_PUNCH_THROUGH;
 
                     rtcOccluded1(raytracingContext.rtcScene, &ray, &occludedArgs);
@@ -445,124 +765,24 @@ BakingFactory::TraceResult BakingFactory::pathTrace(const RaytracingContext& ray
                         continue;
                 }
 
-                const float nDotL = saturate(hitNormal.dot(-lightDirection));
-
-                if (nDotL > 0)
-                {
-                    Color4 directLighting;
-
-                    if (targetEngine == TargetEngine::HE1)
-                    {
-                        directLighting = diffuse;
-
-                        if (glossLevel > 0.0f)
-                        {
-                            const Vector3 halfwayDirection = (viewDirection - lightDirection).normalized();
-                            directLighting += specular * powf(saturate(halfwayDirection.dot(hitNormal)), glossPower) * glossLevel * fresnel;
-                        }
-                    }
-                    else if (targetEngine == TargetEngine::HE2)
-                    {
-                        const Vector3 halfwayDirection = (viewDirection - lightDirection).normalized();
-                        const float nDotH = saturate(hitNormal.dot(halfwayDirection));
-
-                        const Color4 F = fresnelSchlick(F0, saturate(halfwayDirection.dot(viewDirection)));
-                        const float D = ndfGGX(nDotH, roughness);
-                        const float Vis = visSchlick(roughness, nDotV, nDotL);
-
-                        const Color4 kd = lerp<Color4>(Color4::Ones() - F, Color4::Zero(), metalness);
-
-                        directLighting = kd * (diffuse / PI);
-                        directLighting += (D * Vis) * F;
-                    }
-
-                    directLighting.head<3>() *= nDotL * light->color;
-
-                    if (shouldApplyBakeParam)
-                        directLighting *= bakeParams.material.lightIntensity;
-
-                    directLighting *= attenuation;
-
-                    radiance += throughput * directLighting;
-                }
+                radiance += throughput * evaluateDirectLighting<targetEngine>(surface, *light, lightDirection, attenuation, bakeParams) * lightWeight;
             }
 
-            radiance += throughput * emission;
+            radiance += throughput * surface.emission;
         }
-        else if (material->type == MaterialType::IgnoreLight)
+        else if (surface.material->type == MaterialType::IgnoreLight)
         {
-            if (shouldApplyBakeParam)
-                diffuse *= bakeParams.material.emissionIntensity;
-
-            radiance += throughput * (diffuse + emission);
+            radiance += throughput * (surface.diffuse + surface.emission);
             break;
         }
 
         // Setup next ray
         Vector3 hitDirection;
 
-        if (targetEngine == TargetEngine::HE2)
-        {
-            const bool isMetallic = metalness == 1.0f;
-            const float probability = isMetallic ? 0.0f : roughness * 0.5f + 0.5f;
-
-            // Randomly select specular BRDF
-            const float u1 = random.next();
-            const float u2 = random.next();
-
-            if (isMetallic || u1 > probability)
-            {
-                const Vector3 halfwayDirection = microfacetGGX(roughness, u1, u2, 
-                    hitTangent, hitBinormal, hitNormal).normalized();
-
-                hitDirection = 2 * halfwayDirection.dot(viewDirection) * halfwayDirection - viewDirection;
-
-                const float nDotL = saturate(hitNormal.dot(hitDirection));
-                const float nDotH = saturate(hitNormal.dot(halfwayDirection));
-                const float hDotV = saturate(halfwayDirection.dot(viewDirection));
-
-                if (nDotL == 0 || nDotH == 0 || hDotV == 0)
-                    break;
-
-                const Color4 F = fresnelSchlick(F0, hDotV);
-                const float Vis = visSchlick(roughness, nDotV, nDotL);
-                const float PDF = 4 * hDotV / nDotH;
-
-                throughput *= Vis * F * PDF / (1 - probability);
-            }
-
-            // Diffuse BRDF
-            else
-            {
-                hitDirection = tangentToWorld(sampleCosineWeightedHemisphere(u1, u2),
-                    hitTangent, hitBinormal, hitNormal).normalized();
-
-                const Color4 kd = lerp<Color4>(1 - F0, Color4::Zero(), metalness);
-                throughput *= kd * diffuse / probability;
-            }
-
-            throughput *= specular.z(); // Ambient occlusion
-        }
-
-        else
-        {
-            hitDirection = tangentToWorld(sampleCosineWeightedHemisphere(random.next(), random.next()),
-                hitTangent, hitBinormal, hitNormal).normalized();
-
-            throughput *= diffuse;
-        }
-
-        // Do russian roulette at highest difficulty fuhuhuhuhuhu
-        const float probability = throughput.head<3>().maxCoeff();
-        if (i >= (int32_t)bakeParams.light.maxRussianRouletteDepth)
-        {
-            if (random.next() > probability)
-                break;
-
-            throughput /= probability;
-        }
+        if (!sampleNextDirection<targetEngine>(surface, i, bakeParams, random, throughput, hitDirection))
+            break;
 
-        setRayOrigin(query.ray, hitPosition, 0.001f);
+        setRayOrigin(query.ray, surface.position, 0.001f);
         setRayDirection(query.ray, hitDirection);
         query.ray.tfar = INFINITY;
         query.ray.mask = RAY_MASK_OPAQUE | RAY_MASK_TRANS | RAY_MASK_PUNCH_THROUGH;
@@ -571,6 +791,9 @@ BakingFactory::TraceResult BakingFactory::pathTrace(const RaytracingContext& ray
         query.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
     }
 
+    if ((cacheThroughput.head<3>() > 0.0f).all())
+        radianceCache->add(cachePosition, cacheNormal, (radiance.head<3>() - cacheRadiance.head<3>()) / cacheThroughput.head<3>());
+
     result.color = radiance.head<3>().cwiseMax(0);
 
     if (tracingFromEye)
@@ -580,18 +803,57 @@ BakingFactory::TraceResult BakingFactory::pathTrace(const RaytracingContext& ray
 }
 
 BakingFactory::TraceResult BakingFactory::pathTrace(const RaytracingContext& raytracingContext, const Vector3& position,
-                                                    const Vector3& direction, const BakeParams& bakeParams, Random& random, bool tracingFromEye)
+                                                    const Vector3& direction, const BakeParams& bakeParams, Random& random, bool tracingFromEye, const RTCRayHit* firstHit)
 {
     if (bakeParams.targetEngine == TargetEngine::HE2)
     {
         return tracingFromEye ?
-            pathTrace<TargetEngine::HE2, true>(raytracingContext, position, direction, bakeParams, random) :
-            pathTrace<TargetEngine::HE2, false>(raytracingContext, position, direction, bakeParams, random);
+            pathTrace<TargetEngine::HE2, true>(raytracingContext, position, direction, bakeParams, random, firstHit) :
+            pathTrace<TargetEngine::HE2, false>(raytracingContext, position, direction, bakeParams, random, firstHit);
     }
 
     return tracingFromEye ?
-        pathTrace<TargetEngine::HE1, true>(raytracingContext, position, direction, bakeParams, random) :
-        pathTrace<TargetEngine::HE1, false>(raytracingContext, position, direction, bakeParams, random);
+        pathTrace<TargetEngine::HE1, true>(raytracingContext, position, direction, bakeParams, random, firstHit) :
+        pathTrace<TargetEngine::HE1, false>(raytracingContext, position, direction, bakeParams, random, firstHit);
+}
+
+uint32_t BakingFactory::getPathTraceFeatures(const RaytracingContext& raytracingContext, const BakeParams& bakeParams)
+{
+    uint32_t features = 0;
+
+    if (raytracingContext.lightBVH->getSunLight() != nullptr)
+        features |= PATH_TRACE_FEATURE_SUN_LIGHT;
+
+    if (raytracingContext.lightBVH->hasLocalLights() && bakeParams.light.localLightSampleCount > 0)
+        features |= PATH_TRACE_FEATURE_LOCAL_LIGHTS;
+
+    if (raytracingContext.scene->hasAlphaGeometry())
+        features |= PATH_TRACE_FEATURE_ALPHA_GEOMETRY;
+
+    if (bakeParams.environment.mode != EnvironmentMode::Color)
+        features |= PATH_TRACE_FEATURE_ENVIRONMENT;
+
+    return features;
+}
+
+namespace
+{
+    template<TargetEngine targetEngine, uint32_t... features>
+    BakingFactory::PathTraceFunction getPathTraceFunction(const uint32_t selectedFeatures, std::integer_sequence<uint32_t, features...>)
+    {
+        static constexpr BakingFactory::PathTraceFunction functions[] = { &BakingFactory::pathTrace<targetEngine, false, features>... };
+        return functions[selectedFeatures];
+    }
+}
+
+BakingFactory::PathTraceFunction BakingFactory::getPathTraceFunction(const RaytracingContext& raytracingContext, const BakeParams& bakeParams)
+{
+    const uint32_t features = getPathTraceFeatures(raytracingContext, bakeParams);
+
+    if (bakeParams.targetEngine == TargetEngine::HE2)
+        return ::getPathTraceFunction<TargetEngine::HE2>(features, std::make_integer_sequence<uint32_t, PATH_TRACE_FEATURE_ALL + 1>());
+
+    return ::getPathTraceFunction<TargetEngine::HE1>(features, std::make_integer_sequence<uint32_t, PATH_TRACE_FEATURE_ALL + 1>());
 }
 
 void BakingFactory::bake(const RaytracingContext& raytracingContext, const Bitmap& bitmap, size_t width, size_t height, const Camera& camera, const BakeParams& bakeParams, size_t progress, bool antiAliasing)
@@ -691,13 +953,26 @@ bool BakingFactory::rayCast(const RaytracingContext& raytracingContext, const Ve
     if (query.hit.geomID == RTC_INVALID_GEOMETRY_ID)
         return false;
 
-    const Mesh& mesh = *raytracingContext.scene->meshes[query.hit.geomID];
+    const Mesh& mesh = *raytracingContext.scene->meshes[getMeshIndex(query.hit.geomID, query.hit.instID[0])];
 
     const Triangle& triangle = mesh.triangles[query.hit.primID];
-    const Vertex& a = mesh.vertices[triangle.a];
-    const Vertex& b = mesh.vertices[triangle.b];
-    const Vertex& c = mesh.vertices[triangle.c];
+    const TraceGeometry& geometry = mesh.getTraceGeometry();
 
-    hitPosition = barycentricLerp(a.position, b.position, c.position, query.hit.u, query.hit.v);
+    hitPosition = barycentricLerp(geometry.getPosition(triangle.a), geometry.getPosition(triangle.b), geometry.getPosition(triangle.c), query.hit.u, query.hit.v);
+
+    if (mesh.prototype != nullptr)
+        hitPosition = mesh.fromPrototypePosition(hitPosition);
     return true;
 }
+
+// Shading stages shared with the wavefront tracer
+#define INSTANTIATE_SHADING_STAGES(targetEngine) \
+    template Color3 BakingFactory::sampleSky<targetEngine, false>(const RaytracingContext&, const Vector3&, const BakeParams&, size_t); \
+    template bool BakingFactory::getHitSurface<targetEngine, false>(const RaytracingContext&, const RTCRayHit&, size_t, const BakeParams&, float, HitSurface&); \
+    template bool BakingFactory::getLightDirection<targetEngine>(const Vector3&, const Light&, Vector3&, float&); \
+    template const Light* BakingFactory::sampleLocalLight<targetEngine>(const RaytracingContext&, const HitSurface&, const BakeParams&, Random&, float&); \
+    template Color4 BakingFactory::evaluateDirectLighting<targetEngine>(const HitSurface&, const Light&, const Vector3&, float, const BakeParams&); \
+    template bool BakingFactory::sampleNextDirection<targetEngine>(const HitSurface&, size_t, const BakeParams&, Random&, Color4&, Vector3&);
+
+INSTANTIATE_SHADING_STAGES(TargetEngine::HE1)
+INSTANTIATE_SHADING_STAGES(TargetEngine::HE2)
@@ -8,41 +8,209 @@
 #include "Math.h"
 #include "Mesh.h"
 #include "Random.h"
+#include "RaytracingDevice.h"
 #include "Scene.h"
+#include "SkyMap.h"
 #include "Utilities.h"
+#include "WavefrontTracer.h"
 
 class Camera;
 
+// Scene and bake parameter features a path tracer instantiation handles, the missing ones are compiled out
+enum PathTraceFeature : uint32_t
+{
+    PATH_TRACE_FEATURE_SUN_LIGHT = 1 << 0,
+    PATH_TRACE_FEATURE_LOCAL_LIGHTS = 1 << 1,
+    PATH_TRACE_FEATURE_ALPHA_GEOMETRY = 1 << 2, // Punch-through or transparent meshes, needs the filter function
+    PATH_TRACE_FEATURE_ENVIRONMENT = 1 << 3, // Direction dependent environment, otherwise a constant color
+
+    PATH_TRACE_FEATURE_COUNT = 4,
+    PATH_TRACE_FEATURE_ALL = (1 << PATH_TRACE_FEATURE_COUNT) - 1
+};
+
 class BakingFactory
 {
 public:
+    static constexpr float SKY_MAP_SAMPLE_PROBABILITY = 0.5f;
+    static constexpr size_t BAKE_POINT_BATCH_SIZE = 64;
+    static constexpr float ADAPTIVE_SAMPLING_MIN_LUMINANCE = 0.01f;
+
     struct TraceResult
     {
         Color3 color{};
         bool backFacing{};
 
+        // Diffuse color of the first surface hit, white if the path escaped to the sky. Denoiser guide only
+        Color3 albedo = Color3::Zero();
+
         // tracingFromEye only
         Vector3 position {};
         bool any {};
     };
 
+    // Shading inputs of a path vertex, resolved from the material and the bake parameters
+    struct HitSurface
+    {
+        const Material* material;
+
+        Vector3 position;
+        Vector3 normal;
+        Vector3 tangent;
+        Vector3 binormal;
+        Vector3 viewDirection;
+
+        Color4 diffuse;
+        Color4 specular;
+        Color4 emission;
+
+        float glossPower;
+        float glossLevel;
+        float nDotV;
+
+        // HE1
+        float fresnel;
+
+        // HE2
+        float metalness;
+        float roughness;
+        Color4 F0;
+
+        bool applyBakeParams;
+    };
+
+    struct FirstBounceSample
+    {
+        Vector3 position;
+        Vector3 direction;
+        uint32_t index;
+        float weight;
+        Sampler sampler;
+    };
+
+    // Running luminance sums of the samples a bake point received for each of its bases
+    template<size_t BasisCount>
+    struct AdaptiveSampleState
+    {
+        uint32_t sampleCount{};
+        uint32_t tracedSampleCount{}; // Zero weight sky map samples are drawn but never traced
+        uint32_t backFacing{};
+        std::array<float, BasisCount> sum{};
+        std::array<float, BasisCount> squaredSum{};
+
+        // Returns true if the standard error of every basis is under the threshold relative to its mean
+        bool converged(const float threshold) const
+        {
+            if (sampleCount < 2)
+                return false;
+
+            for (size_t i = 0; i < BasisCount; i++)
+            {
+                const float mean = sum[i] / (float)sampleCount;
+                const float variance = std::max(0.0f, (squaredSum[i] - sum[i] * mean) / (float)(sampleCount - 1));
+
+                if (sqrtf(variance / (float)sampleCount) > threshold * std::max(std::abs(mean), ADAPTIVE_SAMPLING_MIN_LUMINANCE))
+                    return false;
+            }
+
+            return true;
+        }
+    };
+
+    template<TargetEngine targetEngine, bool useLinearFiltering>
+    static Color3 traceSky(const RaytracingContext& raytracingContext, const Vector3& direction);
+
+    static Color3 traceSky(const RaytracingContext& raytracingContext, const Vector3& direction, TargetEngine targetEngine);
+
     template<TargetEngine targetEngine, bool tracingFromEye>
     static Color3 sampleSky(const RaytracingContext& raytracingContext, const Vector3& direction, const BakeParams& bakeParams, const size_t depth);
 
-    template <TargetEngine targetEngine, bool tracingFromEye>
+    // Path footprints widen by this angle per segment, the share of the hemisphere of a single bake point sample
+    static float getConeSpreadAngle(const BakeParams& bakeParams);
+
+    // Material part of getHitSurface, specialized per kernel of the scene's material table
+    template<TargetEngine targetEngine, bool tracingFromEye, TraceMaterialKernel kernel>
+    static void shadeMaterial(const TraceMaterial& material, const Vector2& hitUV, const Color4& hitColor, float textureLod, HitSurface& surface);
+
+    // Returns false if the ray hit the back face of an opaque mesh.
+    // Textures are sampled at the mip level of the path footprint, a cone width of 0 samples the first level
+    template<TargetEngine targetEngine, bool tracingFromEye>
+    static bool getHitSurface(const RaytracingContext& raytracingContext, const RTCRayHit& query, size_t depth, const BakeParams& bakeParams, float coneWidth, HitSurface& surface);
+
+    // Returns false if the light does not reach the position
+    template<TargetEngine targetEngine>
+    static bool getLightDirection(const Vector3& position, const Light& light, Vector3& lightDirection, float& attenuation);
+
+    // Picks one of the local light samples of a surface, weight is the inverse of its probability divided by the sample count.
+    // Returns null if no local light reaches the surface
+    template<TargetEngine targetEngine>
+    static const Light* sampleLocalLight(const RaytracingContext& raytracingContext, const HitSurface& surface, const BakeParams& bakeParams, Random& random, float& weight);
+
+    template<TargetEngine targetEngine>
+    static Color4 evaluateDirectLighting(const HitSurface& surface, const Light& light, const Vector3& lightDirection, float attenuation, const BakeParams& bakeParams);
+
+    // Returns false if the path should be terminated
+    template<TargetEngine targetEngine>
+    static bool sampleNextDirection(const HitSurface& surface, size_t depth, const BakeParams& bakeParams, Random& random, Color4& throughput, Vector3& hitDirection);
+
+    // firstHit can be passed when the first intersection was already resolved, eg. by a ray packet
+    template <TargetEngine targetEngine, bool tracingFromEye, uint32_t features = PATH_TRACE_FEATURE_ALL>
     static TraceResult pathTrace(const RaytracingContext& raytracingContext, 
-        const Vector3& position, const Vector3& direction, const BakeParams& bakeParams, Random& random);
+        const Vector3& position, const Vector3& direction, const BakeParams& bakeParams, Random& random, const RTCRayHit* firstHit = nullptr);
+
+    using PathTraceFunction = TraceResult(*)(const RaytracingContext& raytracingContext,
+        const Vector3& position, const Vector3& direction, const BakeParams& bakeParams, Random& random, const RTCRayHit* firstHit);
+
+    static uint32_t getPathTraceFeatures(const RaytracingContext& raytracingContext, const BakeParams& bakeParams);
+
+    // Bake path tracer specialized for the scene and the bake parameters, meant to be looked up once per bake loop
+    static PathTraceFunction getPathTraceFunction(const RaytracingContext& raytracingContext, const BakeParams& bakeParams);
 
     static TraceResult pathTrace(const RaytracingContext& raytracingContext,
-        const Vector3& position, const Vector3& direction, const BakeParams& bakeParams, Random& random, bool tracingFromEye = false);
+        const Vector3& position, const Vector3& direction, const BakeParams& bakeParams, Random& random, bool tracingFromEye = false, const RTCRayHit* firstHit = nullptr);
 
+    // Spreads the shadow rays across the sub-texel positions of the bake point, at least one ray is cast from each
     template<typename TBakePoint>
     static float sampleShadow(const RaytracingContext& raytracingContext, 
-        const Vector3& position, const Vector3& direction, const Vector3& tangent, const Vector3& binormal, float distance, float radius, const BakeParams& bakeParams, Random& random);
+        const TBakePoint& bakePoint, const Vector3& direction, const Vector3& tangent, const Vector3& binormal, float distance, float radius, const BakeParams& bakeParams, Random& random);
+
+    // Returns the sampler of a sample of the point, or an invalid one if the bake parameters ask for uniform random numbers
+    static Sampler createSampler(const Vector3& position, uint32_t index, const BakeParams& bakeParams);
+
+    template<typename TBakePoint>
+    static Vector3 sampleFirstBounce(const TBakePoint& bakePoint, const SkyMap* skyMap, uint32_t index, const BakeParams& bakeParams, Random& random, float& weight);
+
+    // Appends the samples in [sampleBegin, sampleEnd) of a bake point, index is stored in the samples as is
+    template<typename TBakePoint>
+    static void appendFirstBounces(const TBakePoint& bakePoint, uint32_t index, uint32_t sampleBegin, uint32_t sampleEnd, 
+        const SkyMap* skyMap, const BakeParams& bakeParams, Random& random, std::vector<FirstBounceSample>& samples);
+
+    // Radiance is normalized by every drawn sample, the back face ratio and albedo only by the traced ones
+    template<typename TBakePoint>
+    static void finishBakePoint(const RaytracingContext& raytracingContext, TBakePoint& bakePoint, size_t backFacing, uint32_t sampleCount, uint32_t tracedSampleCount,
+        const Light* sunLight, const Vector3& sunLightTangent, const Vector3& sunLightBinormal, const BakeParams& bakeParams, Random& random);
+
+    // Traces the first bounce of every sample in packets of N rays, then continues each path individually
+    template<typename TBakePoint, int N>
+    static void traceFirstBouncePackets(const RaytracingContext& raytracingContext, const TBakePoint* bakePoints, 
+        const std::vector<FirstBounceSample>& samples, const BakeParams& bakeParams, Random& random, TraceResult* results);
+
+    // Traces the paths of the samples with the tracer selected in the bake parameters
+    template<typename TBakePoint>
+    static void traceFirstBounces(const RaytracingContext& raytracingContext, const TBakePoint* bakePoints, 
+        const std::vector<FirstBounceSample>& samples, const BakeParams& bakeParams, Random& random, std::vector<TraceResult>& results);
+
+    // Traces samples in rounds until every bake point converges, reaches the sample count or the budget runs out
+    template<typename TBakePoint>
+    static void bakeAdaptive(const RaytracingContext& raytracingContext, std::vector<TBakePoint>& bakePoints, const SkyMap* skyMap,
+        const Light* sunLight, const Vector3& sunLightTangent, const Vector3& sunLightBinormal, const BakeParams& bakeParams);
 
     template<typename TBakePoint>
     static void bake(const RaytracingContext& raytracingContext, std::vector<TBakePoint>& bakePoints, const BakeParams& bakeParams);
 
+    // Creates and bakes the bake points of the instance one tile at a time, handing each tile over to the function before moving on
+    template<typename TBakePoint, typename TFunction>
+    static void bakeTiled(const RaytracingContext& raytracingContext, const Instance& instance, uint16_t size, const BakeParams& bakeParams, const TFunction& function);
+
     static void bake(const RaytracingContext& raytracingContext, const Bitmap& bitmap,
         size_t width, size_t height, const Camera& camera, const BakeParams& bakeParams, size_t progress = 0, bool antiAliasing = true);
 
@@ -61,28 +229,61 @@ struct IntersectContext : RTCRayQueryContext
     }
 };
 
+template<int N>
+void intersectPacket(const int* valid, RTCScene scene, RTCRayHitNt<N>& packet, RTCIntersectArguments* args)
+{
+    if constexpr (N == 16)
+        rtcIntersect16(valid, scene, (RTCRayHit16*)&packet, args);
+
+    else if constexpr (N == 8)
+        rtcIntersect8(valid, scene, (RTCRayHit8*)&packet, args);
+
+    else
+        rtcIntersect4(valid, scene, (RTCRayHit4*)&packet, args);
+}
+
+template<int N>
+void occludedPacket(const int* valid, RTCScene scene, RTCRayNt<N>& packet, RTCOccludedArguments* args)
+{
+    if constexpr (N == 16)
+        rtcOccluded16(valid, scene, (RTCRay16*)&packet, args);
+
+    else if constexpr (N == 8)
+        rtcOccluded8(valid, scene, (RTCRay8*)&packet, args);
+
+    else
+        rtcOccluded4(valid, scene, (RTCRay4*)&packet, args);
+}
+
 template<TargetEngine targetEngine, bool useLinearFiltering>
-void intersectContextFilter(const RTCFilterFunctionNArguments* args)
+bool intersectContextFilterAlpha(const IntersectContext& context, const uint32_t meshIndex, const uint32_t primID, const float u, const float v)
 {
-    RTCHit* hit = (RTCHit*)args->hit;
-    IntersectContext* context = (IntersectContext*)args->context;
+    const Mesh& mesh = *context.raytracingContext.scene->meshes[meshIndex];
+    const TraceMaterial& material = context.raytracingContext.scene->getTraceMaterial(meshIndex);
 
-    const Mesh& mesh = *context->raytracingContext.scene->meshes[hit->geomID];
-    if (!mesh.material || mesh.type == MeshType::Opaque)
-        return;
+    if (material.material == nullptr || mesh.type == MeshType::Opaque)
+        return true;
 
-    const Triangle& triangle = mesh.triangles[hit->primID];
-    const Vertex& a = mesh.vertices[triangle.a];
-    const Vertex& b = mesh.vertices[triangle.b];
-    const Vertex& c = mesh.vertices[triangle.c];
-    const Vector2 hitUV = barycentricLerp(a.uv, b.uv, c.uv, hit->u, hit->v);
-    const float hitAlpha = barycentricLerp(a.color.w(), b.color.w(), c.color.w(), hit->u, hit->v);
+    // Regions classified ahead of time skip the texture fetches
+    const OpacityMicromap& opacityMicromap = mesh.getOpacityMicromap(targetEngine);
 
-    float alpha = 1.0f;
+    if (opacityMicromap.valid())
+    {
+        const OpacityState state = opacityMicromap.getState(primID, u, v);
 
-    const Material* material = mesh.material;
+        if (state != OpacityState::Unknown)
+            return state == OpacityState::Opaque;
+    }
 
-    if (material->type == MaterialType::Common || material->type == MaterialType::Blend)
+    const Triangle& triangle = mesh.triangles[primID];
+    const TraceGeometry& geometry = mesh.getTraceGeometry();
+    const Vector2 hitUV = barycentricLerp(geometry.getUV(triangle.a), geometry.getUV(triangle.b), geometry.getUV(triangle.c), u, v);
+    const Color4 hitColor = barycentricLerp(geometry.getColor(triangle.a), geometry.getColor(triangle.b), geometry.getColor(triangle.c), u, v);
+    const float hitAlpha = hitColor.w();
+
+    float alpha = 1.0f;
+
+    if (material.type == MaterialType::Common || material.type == MaterialType::Blend)
     {
         float blend;
 
@@ -92,17 +293,18 @@ void intersectContextFilter(const RTCFilterFunctionNArguments* args)
         }
         else
         {
-            alpha *= material->parameters.opacityReflectionRefractionSpecType.x() * hitAlpha;
-            blend = barycentricLerp(a.color.x(), b.color.x(), c.color.x(), hit->u, hit->v);
+            alpha *= material.opacity * hitAlpha;
+            blend = hitColor.x();
         }
 
-        if (material->textures.diffuse != nullptr)
+        if (material.diffuse != nullptr)
         {
-            float diffuseAlpha = material->textures.diffuse->getAlpha<useLinearFiltering>(hitUV);
+            float diffuseAlpha = material.diffuse->getAlpha<useLinearFiltering>(hitUV);
 
-            if (material->type == MaterialType::Blend && material->textures.diffuseBlend != nullptr)
+            // Only set for blend materials
+            if (material.diffuseBlend != nullptr)
             {
-                const float diffuseBlendAlpha = material->textures.diffuseBlend->getAlpha<useLinearFiltering>(hitUV);
+                const float diffuseBlendAlpha = material.diffuseBlend->getAlpha<useLinearFiltering>(hitUV);
                 diffuseAlpha = lerp(diffuseAlpha, diffuseBlendAlpha, blend);
             }
 
@@ -110,25 +312,43 @@ void intersectContextFilter(const RTCFilterFunctionNArguments* args)
         }
     }
 
-    else if (material->type == MaterialType::IgnoreLight)
+    else if (material.type == MaterialType::IgnoreLight)
     {
-        alpha *= hitAlpha * material->parameters.diffuse.w();
+        alpha *= hitAlpha * material.diffuseColor.w();
 
-        if (material->textures.diffuse != nullptr)
-            alpha *= material->textures.diffuse->getAlpha<useLinearFiltering>(hitUV);
+        if (material.diffuse != nullptr)
+            alpha *= material.diffuse->getAlpha<useLinearFiltering>(hitUV);
 
-        if (material->textures.alpha != nullptr)
-            alpha *= material->textures.alpha->getAlpha<useLinearFiltering>(hitUV);
+        if (material.alpha != nullptr)
+            alpha *= material.alpha->getAlpha<useLinearFiltering>(hitUV);
     }
 
-    if ((mesh.type == MeshType::Punch && alpha < 0.5f) ||
-        (mesh.type == MeshType::Transparent && alpha < context->random.next()))
-        args->valid[0] = false;
+    return !((mesh.type == MeshType::Punch && alpha < 0.5f) ||
+        (mesh.type == MeshType::Transparent && alpha < context.random.next()));
+}
+
+template<TargetEngine targetEngine, bool useLinearFiltering>
+void intersectContextFilter(const RTCFilterFunctionNArguments* args)
+{
+    const IntersectContext& context = *(const IntersectContext*)args->context;
+
+    // Packet queries invoke the filter with N > 1, inactive lanes have valid set to 0
+    for (unsigned int i = 0; i < args->N; i++)
+    {
+        if (args->valid[i] == 0)
+            continue;
+
+        const uint32_t meshIndex = getMeshIndex(RTCHitN_geomID(args->hit, args->N, i), RTCHitN_instID(args->hit, args->N, i, 0));
+
+        if (!intersectContextFilterAlpha<targetEngine, useLinearFiltering>(context, 
+            meshIndex, RTCHitN_primID(args->hit, args->N, i), RTCHitN_u(args->hit, args->N, i), RTCHitN_v(args->hit, args->N, i)))
+            args->valid[i] = 0;
+    }
 }
 
 template <typename TBakePoint>
 float BakingFactory::sampleShadow(const RaytracingContext& raytracingContext,
-    const Vector3& position, const Vector3& direction, const Vector3& tangent, const Vector3& binormal, const float distance, const float radius, const BakeParams& bakeParams, Random& random)
+    const TBakePoint& bakePoint, const Vector3& direction, const Vector3& tangent, const Vector3& binormal, const float distance, const float radius, const BakeParams& bakeParams, Random& random)
 {
     if ((TBakePoint::FLAGS & BAKE_POINT_FLAGS_SHADOW) == 0)
         return 1.0f;
@@ -145,9 +365,15 @@ float BakingFactory::sampleShadow(const RaytracingContext& raytracingContext,
 
     size_t shadowSum = 0;
 
-    const size_t sampleCount = (TBakePoint::FLAGS & BAKE_POINT_FLAGS_SOFT_SHADOW) != 0 ? bakeParams.shadow.sampleCount : 1;
+    const size_t sampleCount = std::max<size_t>(bakePoint.getSubSampleCount(),
+        (TBakePoint::FLAGS & BAKE_POINT_FLAGS_SOFT_SHADOW) != 0 ? bakeParams.shadow.sampleCount : 1);
+
+    // Sobol samples are scrambled through the seed, drawing a rotation would only advance the random stream
+    const bool sobol = bakeParams.light.samplerType == SamplerType::Sobol;
+    const float phi = sobol ? 0.0f : 2 * PI * random.next();
 
-    const float phi = 2 * PI * random.next();
+    // Shadows of different lights are decorrelated through the direction
+    const uint32_t seed = Sampler::hashCombine(Sampler::getSeed(bakePoint.position), Sampler::getSeed(direction));
 
     for (size_t i = 0; i < sampleCount; i++)
     {
@@ -155,11 +381,21 @@ float BakingFactory::sampleShadow(const RaytracingContext& raytracingContext,
 
         if constexpr ((TBakePoint::FLAGS & BAKE_POINT_FLAGS_SOFT_SHADOW) != 0)
         {
-            const Vector2 vogelDiskSample = sampleVogelDisk(i, bakeParams.shadow.sampleCount, phi);
+            Vector2 diskSample;
+
+            if (sobol)
+            {
+                const Vector2 u = Sampler(seed, (uint32_t)i).next2D();
+                diskSample = squareToConcentricDiskMapping(u.x(), u.y());
+            }
+            else
+            {
+                diskSample = sampleVogelDisk(i, sampleCount, phi);
+            }
 
             rayDirection = tangentToWorld(Vector3(
-                vogelDiskSample[0] * radius,
-                vogelDiskSample[1] * radius, 1), tangent, binormal, direction).normalized();
+                diskSample[0] * radius,
+                diskSample[1] * radius, 1), tangent, binormal, direction).normalized();
         }
         else
         {
@@ -168,7 +404,7 @@ float BakingFactory::sampleShadow(const RaytracingContext& raytracingContext,
 
         RTCRay ray {};
 
-        setRayOrigin(ray, position, bakeParams.shadow.bias);
+        setRayOrigin(ray, bakePoint.getSamplePosition((uint32_t)i, bakeParams.resolution.subSampleCount), bakeParams.shadow.bias);
         setRayDirection(ray, -rayDirection);
         ray.tfar = distance;
         ray.mask = RAY_MASK_OPAQUE | RAY_MASK_PUNCH_THROUGH;
@@ -182,6 +418,377 @@ float BakingFactory::sampleShadow(const RaytracingContext& raytracingContext,
     return 1.0f - (float)shadowSum / sampleCount;
 }
 
+template <typename TBakePoint>
+Vector3 BakingFactory::sampleFirstBounce(const TBakePoint& bakePoint, const SkyMap* skyMap, const uint32_t index, const BakeParams& bakeParams, Random& random, float& weight)
+{
+    if (skyMap == nullptr)
+    {
+        weight = 1.0f;
+
+        const Vector2 u = random.nextSample2D();
+
+        const Vector3 tangentSpaceDirection = TBakePoint::sampleDirection(index, bakeParams.light.sampleCount, u.x(), u.y()).normalized();
+        return tangentToWorld(tangentSpaceDirection, bakePoint.tangent, bakePoint.binormal, bakePoint.normal).normalized();
+    }
+
+    Vector3 worldSpaceDirection;
+
+    const float selection = random.nextSample();
+    const Vector2 u = random.nextSample2D();
+
+    if (selection < SKY_MAP_SAMPLE_PROBABILITY)
+        worldSpaceDirection = skyMap->sample(u.x(), u.y());
+    else
+        worldSpaceDirection = tangentToWorld(TBakePoint::sampleDirection(index, bakeParams.light.sampleCount, u.x(), u.y()).normalized(),
+            bakePoint.tangent, bakePoint.binormal, bakePoint.normal).normalized();
+
+    const Vector3 tangentSpaceDirection(
+        worldSpaceDirection.dot(bakePoint.tangent), 
+        worldSpaceDirection.dot(bakePoint.binormal), 
+        worldSpaceDirection.dot(bakePoint.normal));
+
+    // Bake points normalize with their own PDF, so the MIS weight is relative to it
+    const float pdf = TBakePoint::pdfDirection(tangentSpaceDirection);
+
+    weight = pdf / (SKY_MAP_SAMPLE_PROBABILITY * skyMap->pdf(worldSpaceDirection) + (1.0f - SKY_MAP_SAMPLE_PROBABILITY) * pdf);
+    return worldSpaceDirection;
+}
+
+template <typename TBakePoint>
+void BakingFactory::finishBakePoint(const RaytracingContext& raytracingContext, TBakePoint& bakePoint, const size_t backFacing, const uint32_t sampleCount, const uint32_t tracedSampleCount,
+    const Light* sunLight, const Vector3& sunLightTangent, const Vector3& sunLightBinormal, const BakeParams& bakeParams, Random& random)
+{
+    // If most rays point to backfaces, discard the pixel.
+    // This will fix the shadow leaks when dilated.
+    if constexpr ((TBakePoint::FLAGS & BAKE_POINT_FLAGS_DISCARD_BACKFACE) != 0)
+    {
+        if (tracedSampleCount != 0 && (float)backFacing / (float)tracedSampleCount >= 0.5f)
+        {
+            bakePoint.discard();
+            return;
+        }
+    }
+
+    bakePoint.end(sampleCount);
+    bakePoint.albedo /= (float)std::max(1u, tracedSampleCount);
+
+    if ((TBakePoint::FLAGS & BAKE_POINT_FLAGS_LOCAL_LIGHT) != 0 && bakeParams.targetEngine == TargetEngine::HE1)
+    {
+        // Pick local lights from the light BVH, lights picked more than once are shaded once with their weights summed
+        std::vector<std::pair<const Light*, float>> lights;
+        lights.reserve(bakeParams.light.localLightSampleCount);
+
+        for (uint32_t i = 0; i < bakeParams.light.localLightSampleCount; i++)
+        {
+            random.beginSample(createSampler(bakePoint.position, i, bakeParams));
+            const float u = random.nextSample();
+            random.endSample();
+
+            float pdf;
+
+            const Light* light = raytracingContext.lightBVH->sample(bakePoint.position, bakePoint.normal, u, pdf, computeAttenuationHE1);
+            if (light == nullptr) break;
+
+            const float weight = 1.0f / (pdf * (float)bakeParams.light.localLightSampleCount);
+
+            const auto pair = std::find_if(lights.begin(), lights.end(), [&](const auto& item) { return item.first == light; });
+
+            if (pair != lights.end())
+                pair->second += weight;
+            else
+                lights.emplace_back(light, weight);
+        }
+
+        for (auto& [light, weight] : lights)
+        {
+            Vector3 lightDirection;
+            float attenuation;
+            float distance;
+
+            computeDirectionAndAttenuationHE1(bakePoint.position, light->position, light->range, lightDirection, attenuation, &distance);
+
+            attenuation *= saturate(bakePoint.normal.dot(-lightDirection));
+            if (attenuation == 0.0f) continue;
+
+            Vector3 lightTangent, lightBinormal;
+            computeTangent(lightDirection, lightTangent, lightBinormal);
+
+            attenuation *= sampleShadow<TBakePoint>(raytracingContext,
+                bakePoint, lightDirection, lightTangent, lightBinormal, distance, 1.0f / light->range.w(), bakeParams, random);
+
+            bakePoint.addSample(light->color * (attenuation * weight), lightDirection);
+        }
+    }
+
+    if (sunLight)
+    {
+        bakePoint.shadow = sampleShadow<TBakePoint>(raytracingContext,
+            bakePoint, sunLight->position, sunLightTangent, sunLightBinormal, INFINITY, bakeParams.shadow.radius, bakeParams, random);
+    }
+}
+
+template <typename TBakePoint>
+void BakingFactory::appendFirstBounces(const TBakePoint& bakePoint, const uint32_t index, const uint32_t sampleBegin, const uint32_t sampleEnd,
+    const SkyMap* skyMap, const BakeParams& bakeParams, Random& random, std::vector<FirstBounceSample>& samples)
+{
+    for (uint32_t i = sampleBegin; i < sampleEnd; i++)
+    {
+        random.beginSample(createSampler(bakePoint.position, i, bakeParams));
+
+        float weight;
+        const Vector3 worldSpaceDirection = sampleFirstBounce(bakePoint, skyMap, i, bakeParams, random, weight);
+
+        const Sampler sampler = random.endSample();
+
+        if (!(weight > 0.0f))
+            continue;
+
+        samples.push_back({ bakePoint.getSamplePosition(i, bakeParams.resolution.subSampleCount), worldSpaceDirection, index, weight, sampler });
+    }
+}
+
+template <typename TBakePoint, int N>
+void BakingFactory::traceFirstBouncePackets(const RaytracingContext& raytracingContext, const TBakePoint* bakePoints,
+    const std::vector<FirstBounceSample>& samples, const BakeParams& bakeParams, Random& random, TraceResult* results)
+{
+    std::vector<RTCRayHit> queries(samples.size());
+
+    const PathTraceFunction pathTraceFunction = getPathTraceFunction(raytracingContext, bakeParams);
+
+    IntersectContext context(raytracingContext, random);
+
+    RTCIntersectArguments intersectArgs;
+    rtcInitIntersectArguments(&intersectArgs);
+
+    intersectArgs.flags = (RTCRayQueryFlags)(RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER | RTC_RAY_QUERY_FLAG_COHERENT);
+    intersectArgs.context = &context;
+    intersectArgs.filter = bakeParams.targetEngine == TargetEngine::HE2 ?
+        intersectContextFilter<TargetEngine::HE2, false> :
+        intersectContextFilter<TargetEngine::HE1, false>;
+
+    for (size_t i = 0; i < samples.size(); i += N)
+    {
+        alignas(64) RTCRayHitNt<N> packet;
+        alignas(64) int valid[N];
+
+        const size_t count = std::min<size_t>(N, samples.size() - i);
+
+        for (size_t j = 0; j < N; j++)
+        {
+            if (j >= count)
+            {
+                valid[j] = 0;
+                continue;
+            }
+
+            const FirstBounceSample& sample = samples[i + j];
+            const Vector3& position = sample.position;
+
+            valid[j] = -1;
+            packet.ray.org_x[j] = position.x();
+            packet.ray.org_y[j] = position.y();
+            packet.ray.org_z[j] = position.z();
+            packet.ray.tnear[j] = 0.001f;
+            packet.ray.dir_x[j] = sample.direction.x();
+            packet.ray.dir_y[j] = sample.direction.y();
+            packet.ray.dir_z[j] = sample.direction.z();
+            packet.ray.time[j] = 0.0f;
+            packet.ray.tfar[j] = INFINITY;
+            packet.ray.mask[j] = RAY_MASK_OPAQUE | RAY_MASK_TRANS | RAY_MASK_PUNCH_THROUGH;
+            packet.ray.id[j] = 0;
+            packet.ray.flags[j] = 0;
+            packet.hit.geomID[j] = RTC_INVALID_GEOMETRY_ID;
+            packet.hit.instID[0][j] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        intersectPacket<N>(valid, raytracingContext.rtcScene, packet, &intersectArgs);
+
+        for (size_t j = 0; j < count; j++)
+            queries[i + j] = rtcGetRayHitFromRayHitN((RTCRayHitN*)&packet, N, (unsigned int)j);
+    }
+
+    // Shade hits on the same geometry together so material and texture data stays in cache
+    std::vector<uint32_t> order(samples.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    std::sort(order.begin(), order.end(), [&](const uint32_t lhs, const uint32_t rhs)
+    {
+        return getMeshIndex(queries[lhs].hit.geomID, queries[lhs].hit.instID[0]) < getMeshIndex(queries[rhs].hit.geomID, queries[rhs].hit.instID[0]);
+    });
+
+    for (const uint32_t index : order)
+    {
+        random.beginSample(samples[index].sampler);
+        results[index] = pathTraceFunction(raytracingContext, samples[index].position, samples[index].direction, bakeParams, random, &queries[index]);
+        random.endSample();
+    }
+}
+
+template <typename TBakePoint>
+void BakingFactory::traceFirstBounces(const RaytracingContext& raytracingContext, const TBakePoint* bakePoints,
+    const std::vector<FirstBounceSample>& samples, const BakeParams& bakeParams, Random& random, std::vector<TraceResult>& results)
+{
+    results.resize(samples.size());
+
+    switch (bakeParams.light.tracerType)
+    {
+    case TracerType::Packet:
+        switch (RaytracingDevice::getPacketSize())
+        {
+        case 16:
+            traceFirstBouncePackets<TBakePoint, 16>(raytracingContext, bakePoints, samples, bakeParams, random, results.data());
+            break;
+
+        case 8:
+            traceFirstBouncePackets<TBakePoint, 8>(raytracingContext, bakePoints, samples, bakeParams, random, results.data());
+            break;
+
+        default:
+            traceFirstBouncePackets<TBakePoint, 4>(raytracingContext, bakePoints, samples, bakeParams, random, results.data());
+            break;
+        }
+
+        break;
+
+    case TracerType::Wavefront:
+    {
+        std::vector<WavefrontTracer::Path> paths(samples.size());
+
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            paths[i].position = samples[i].position;
+            paths[i].direction = samples[i].direction;
+            paths[i].sampler = samples[i].sampler;
+        }
+
+        WavefrontTracer::trace(raytracingContext, paths, bakeParams, random);
+
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            results[i].color = paths[i].color;
+            results[i].backFacing = paths[i].backFacing;
+            results[i].albedo = paths[i].albedo;
+        }
+
+        break;
+    }
+
+    default:
+    {
+        const PathTraceFunction pathTraceFunction = getPathTraceFunction(raytracingContext, bakeParams);
+
+        for (size_t i = 0; i < samples.size(); i++)
+        {
+            random.beginSample(samples[i].sampler);
+            results[i] = pathTraceFunction(raytracingContext, samples[i].position, samples[i].direction, bakeParams, random, nullptr);
+            random.endSample();
+        }
+
+        break;
+    }
+    }
+}
+
+template <typename TBakePoint>
+void BakingFactory::bakeAdaptive(const RaytracingContext& raytracingContext, std::vector<TBakePoint>& bakePoints, const SkyMap* skyMap,
+    const Light* sunLight, const Vector3& sunLightTangent, const Vector3& sunLightBinormal, const BakeParams& bakeParams)
+{
+    const uint32_t maxSampleCount = bakeParams.light.sampleCount;
+    const uint32_t roundSampleCount = std::max(2u, std::min(bakeParams.light.minSampleCount, maxSampleCount));
+
+    std::vector<AdaptiveSampleState<TBakePoint::BASIS_COUNT>> states(bakePoints.size());
+    std::vector<uint32_t> activeIndices;
+
+    for (size_t i = 0; i < bakePoints.size(); i++)
+    {
+        if (!bakePoints[i].valid())
+            continue;
+
+        bakePoints[i].begin();
+        activeIndices.push_back((uint32_t)i);
+    }
+
+    // The first round always fits as the budget is never below the round sample count
+    std::atomic<size_t> budget = bakeParams.light.sampleBudget != 0 ?
+        activeIndices.size() * std::max(bakeParams.light.sampleBudget, roundSampleCount) : SIZE_MAX;
+
+    while (!activeIndices.empty())
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, activeIndices.size(), BAKE_POINT_BATCH_SIZE), [&](const tbb::blocked_range<size_t>& range)
+        {
+            Random& random = Random::get();
+
+            std::vector<FirstBounceSample> samples;
+            std::vector<TraceResult> results;
+
+            for (size_t r = range.begin(); r < range.end(); r += BAKE_POINT_BATCH_SIZE)
+            {
+                samples.clear();
+
+                for (size_t i = r; i < std::min(r + BAKE_POINT_BATCH_SIZE, range.end()); i++)
+                {
+                    const uint32_t index = activeIndices[i];
+                    auto& state = states[index];
+
+                    size_t available = budget.load();
+                    uint32_t sampleCount;
+
+                    do
+                    {
+                        sampleCount = (uint32_t)std::min<size_t>(std::min(roundSampleCount, maxSampleCount - state.sampleCount), available);
+                    } while (!budget.compare_exchange_weak(available, available - sampleCount));
+
+                    appendFirstBounces(bakePoints[index], index, state.sampleCount, state.sampleCount + sampleCount, skyMap, bakeParams, random, samples);
+                    state.sampleCount += sampleCount;
+                }
+
+                traceFirstBounces(raytracingContext, bakePoints.data(), samples, bakeParams, random, results);
+
+                for (size_t i = 0; i < samples.size(); i++)
+                {
+                    const FirstBounceSample& sample = samples[i];
+                    TBakePoint& bakePoint = bakePoints[sample.index];
+                    auto& state = states[sample.index];
+
+                    Color3 previousColors[TBakePoint::BASIS_COUNT];
+                    std::copy(std::begin(bakePoint.colors), std::end(bakePoint.colors), previousColors);
+
+                    bakePoint.addSample(results[i].color * sample.weight, sample.direction);
+                    bakePoint.albedo += results[i].albedo;
+
+                    for (size_t j = 0; j < TBakePoint::BASIS_COUNT; j++)
+                    {
+                        const float luminance = getLuminance(bakePoint.colors[j] - previousColors[j]);
+
+                        state.sum[j] += luminance;
+                        state.squaredSum[j] += luminance * luminance;
+                    }
+
+                    state.backFacing += results[i].backFacing;
+                    state.tracedSampleCount++;
+                }
+            }
+        });
+
+        activeIndices.erase(std::remove_if(activeIndices.begin(), activeIndices.end(), [&](const uint32_t index)
+        {
+            const auto& state = states[index];
+            return state.sampleCount >= maxSampleCount || budget == 0 || state.converged(bakeParams.light.noiseThreshold);
+        }), activeIndices.end());
+    }
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, bakePoints.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        Random& random = Random::get();
+
+        for (size_t i = range.begin(); i < range.end(); i++)
+        {
+            if (bakePoints[i].valid())
+                finishBakePoint(raytracingContext, bakePoints[i], states[i].backFacing, states[i].sampleCount, states[i].tracedSampleCount, sunLight, sunLightTangent, sunLightBinormal, bakeParams, random);
+        }
+    });
+}
+
 template <typename TBakePoint>
 void BakingFactory::bake(const RaytracingContext& raytracingContext, std::vector<TBakePoint>& bakePoints, const BakeParams& bakeParams)
 {
@@ -191,6 +798,74 @@ void BakingFactory::bake(const RaytracingContext& raytracingContext, std::vector
     if (sunLight != nullptr)
         computeTangent(sunLight->position, sunLightTangent, sunLightBinormal);
 
+    // Importance sample the sky map alongside the bake point's own distribution (one-sample MIS)
+    const SkyMap* skyMap = bakeParams.environment.mode == EnvironmentMode::Sky && raytracingContext.skyMaps != nullptr ?
+        &raytracingContext.skyMaps[(size_t)bakeParams.targetEngine] : nullptr;
+
+    if (skyMap != nullptr && !skyMap->canSample())
+        skyMap = nullptr;
+
+    if constexpr ((TBakePoint::FLAGS & BAKE_POINT_FLAGS_ADAPTIVE_SAMPLING) != 0)
+    {
+        if (bakeParams.light.adaptiveSampling)
+        {
+            bakeAdaptive(raytracingContext, bakePoints, skyMap, sunLight, sunLightTangent, sunLightBinormal, bakeParams);
+            return;
+        }
+    }
+
+    if (bakeParams.light.tracerType != TracerType::Scalar)
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, bakePoints.size(), BAKE_POINT_BATCH_SIZE), [&](const tbb::blocked_range<size_t>& range)
+        {
+            Random& random = Random::get();
+
+            std::vector<FirstBounceSample> samples;
+            std::vector<TraceResult> results;
+            std::array<uint32_t, BAKE_POINT_BATCH_SIZE> backFacing;
+            std::array<uint32_t, BAKE_POINT_BATCH_SIZE> tracedSampleCounts;
+
+            for (size_t r = range.begin(); r < range.end(); r += BAKE_POINT_BATCH_SIZE)
+            {
+                TBakePoint* batchBakePoints = &bakePoints[r];
+                const size_t bakePointCount = std::min(BAKE_POINT_BATCH_SIZE, range.end() - r);
+
+                samples.clear();
+                backFacing.fill(0);
+                tracedSampleCounts.fill(0);
+
+                for (size_t i = 0; i < bakePointCount; i++)
+                {
+                    if (!batchBakePoints[i].valid())
+                        continue;
+
+                    batchBakePoints[i].begin();
+                    appendFirstBounces(batchBakePoints[i], (uint32_t)i, 0, bakeParams.light.sampleCount, skyMap, bakeParams, random, samples);
+                }
+
+                traceFirstBounces(raytracingContext, batchBakePoints, samples, bakeParams, random, results);
+
+                for (size_t i = 0; i < samples.size(); i++)
+                {
+                    backFacing[samples[i].index] += results[i].backFacing;
+                    tracedSampleCounts[samples[i].index]++;
+                    batchBakePoints[samples[i].index].addSample(results[i].color * samples[i].weight, samples[i].direction);
+                    batchBakePoints[samples[i].index].albedo += results[i].albedo;
+                }
+
+                for (size_t i = 0; i < bakePointCount; i++)
+                {
+                    if (batchBakePoints[i].valid())
+                        finishBakePoint(raytracingContext, batchBakePoints[i], backFacing[i], bakeParams.light.sampleCount, tracedSampleCounts[i], sunLight, sunLightTangent, sunLightBinormal, bakeParams, random);
+                }
+            }
+        });
+
+        return;
+    }
+
+    const PathTraceFunction pathTraceFunction = getPathTraceFunction(raytracingContext, bakeParams);
+
     tbb::parallel_for(tbb::blocked_range<size_t>(0, bakePoints.size()), [&](const tbb::blocked_range<size_t>& range)
     {
         for (size_t r = range.begin(); r < range.end(); r++)
@@ -205,66 +880,50 @@ void BakingFactory::bake(const RaytracingContext& raytracingContext, std::vector
             bakePoint.begin();
 
             size_t backFacing = 0;
+            uint32_t tracedSampleCount = 0;
 
             for (uint32_t i = 0; i < bakeParams.light.sampleCount; i++)
             {
-                const Vector3 tangentSpaceDirection = TBakePoint::sampleDirection(i, bakeParams.light.sampleCount, random.next(), random.next()).normalized();
-                const Vector3 worldSpaceDirection = tangentToWorld(tangentSpaceDirection, bakePoint.tangent, bakePoint.binormal, bakePoint.normal).normalized();
-                const TraceResult result = pathTrace(raytracingContext, bakePoint.position, worldSpaceDirection, bakeParams, random);
+                random.beginSample(createSampler(bakePoint.position, i, bakeParams));
 
-                backFacing += result.backFacing;
-                bakePoint.addSample(result.color, worldSpaceDirection);
-            }
+                float weight;
+                const Vector3 worldSpaceDirection = sampleFirstBounce(bakePoint, skyMap, i, bakeParams, random, weight);
 
-            // If most rays point to backfaces, discard the pixel.
-            // This will fix the shadow leaks when dilated.
-            if constexpr ((TBakePoint::FLAGS & BAKE_POINT_FLAGS_DISCARD_BACKFACE) != 0)
-            {
-                if ((float)backFacing / (float)bakeParams.light.sampleCount >= 0.5f)
+                if (!(weight > 0.0f))
                 {
-                    bakePoint.discard();
+                    random.endSample();
                     continue;
                 }
-            }
 
-            bakePoint.end(bakeParams.light.sampleCount);
-
-            if ((TBakePoint::FLAGS & BAKE_POINT_FLAGS_LOCAL_LIGHT) != 0 && bakeParams.targetEngine == TargetEngine::HE1)
-            {
-                std::array<const Light*, 32> lights;
-                size_t lightCount = 0;
+                const TraceResult result = pathTraceFunction(raytracingContext, bakePoint.getSamplePosition(i, bakeParams.resolution.subSampleCount),
+                    worldSpaceDirection, bakeParams, random, nullptr);
 
-                raytracingContext.lightBVH->traverse(bakePoint.position, lights, lightCount);
+                random.endSample();
 
-                for (size_t i = 0; i < lightCount; i++)
-                {
-                    const Light* light = lights[i];
-                    if (light->type != LightType::Point) continue;
-
-                    Vector3 lightDirection;
-                    float attenuation;
-                    float distance;
-
-                    computeDirectionAndAttenuationHE1(bakePoint.position, light->position, light->range, lightDirection, attenuation, &distance);
-
-                    attenuation *= saturate(bakePoint.normal.dot(-lightDirection));
-                    if (attenuation == 0.0f) continue;
-
-                    Vector3 lightTangent, lightBinormal;
-                    computeTangent(lightDirection, lightTangent, lightBinormal);
-
-                    attenuation *= sampleShadow<TBakePoint>(raytracingContext,
-                        bakePoint.position, lightDirection, lightTangent, lightBinormal, distance, 1.0f / light->range.w(), bakeParams, random);
-
-                    bakePoint.addSample(light->color * attenuation, lightDirection);
-                }
+                backFacing += result.backFacing;
+                tracedSampleCount++;
+                bakePoint.addSample(result.color * weight, worldSpaceDirection);
+                bakePoint.albedo += result.albedo;
             }
 
-            if (sunLight)
-            {
-                bakePoint.shadow = sampleShadow<TBakePoint>(raytracingContext,
-                    bakePoint.position, sunLight->position, sunLightTangent, sunLightBinormal, INFINITY, bakeParams.shadow.radius, bakeParams, random);
-            }
+            finishBakePoint(raytracingContext, bakePoint, backFacing, bakeParams.light.sampleCount, tracedSampleCount, sunLight, sunLightTangent, sunLightBinormal, bakeParams, random);
         }
     });
 }
+
+template <typename TBakePoint, typename TFunction>
+void BakingFactory::bakeTiled(const RaytracingContext& raytracingContext, const Instance& instance, const uint16_t size, const BakeParams& bakeParams, const TFunction& function)
+{
+    const BakePointRasterizer rasterizer(instance, size, bakeParams.resolution.tileSize != 0 ? bakeParams.resolution.tileSize : size,
+        bakeParams.resolution.subSampleCount);
+
+    for (size_t i = 0; i < rasterizer.getTileCount(); i++)
+    {
+        std::vector<TBakePoint> bakePoints = createBakePoints<TBakePoint>(rasterizer.rasterize(i), size);
+        if (bakePoints.empty())
+            continue;
+
+        bake(raytracingContext, bakePoints, bakeParams);
+        function(bakePoints);
+    }
+}
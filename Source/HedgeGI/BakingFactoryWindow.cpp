@@ -1,5 +1,7 @@
 ﻿#include "BakingFactoryWindow.h"
 #include "AppData.h"
+#include "BakePoint.h"
+#include "BlockCompressor.h"
 #include "FileDialog.h"
 #include "Math.h"
 #include "OidnDenoiserDevice.h"
@@ -58,6 +60,23 @@ const Label DENOISE_SHADOW_MAP_LABEL = { "Denoise Shadow Map",
     "Please note that this option is not supported by oidn yet.\n\n"
     "Recommended to be enabled." };
 
+const Label DENOISER_GUIDES_LABEL = { "Denoiser Guides",
+    "Bakes the first hit albedo and the surface normal of every pixel alongside the lighting "
+    "and lets the denoiser use them to tell noise apart from detail.\n\n"
+    "This allows for lower sample counts at the cost of slightly longer bakes." };
+
+const Label COMPRESSION_FAST_LABEL = { "Fast",
+    "Fits block endpoints to the bounding box of each block.\n\n"
+    "Useful for quick previews, gradients may show blocking artifacts." };
+
+const Label COMPRESSION_NORMAL_LABEL = { "Normal",
+    "Fits block endpoints along the principal axis of each block and refines them once.\n\n"
+    "Recommended for most bakes." };
+
+const Label COMPRESSION_EXHAUSTIVE_LABEL = { "Exhaustive",
+    "Refines block endpoints repeatedly and searches around them for the lowest error.\n\n"
+    "Noticeably slower, meant for final bakes." };
+
 const Label OPTIMIZE_SEAMS_LABEL = { "Optimize Seams",
     "Tries to smooth hard seams in resulting images.\n\n"
     "You can leave this enabled as it is not a major performance hit.\n\n"
@@ -82,9 +101,14 @@ const Label RESOLUTION_OVERRIDE_LABEL = { "Resolution Override",
     "Makes every instance get baked at the specified resolution, regardless of their original settings.\n\n"
     "Set to -1 to disable this option." };
 
-const Label RESOLUTION_SUPERSAMPLE_SCALE = { "Resolution Supersample Scale",
-    "Makes every instance get baked at a higher resolution than the original, and downscales it back to the original resolution.\n\n"
-    "This is going to make resulting images look cleaner, but it will take significantly longer to bake." };
+const Label RESOLUTION_SUB_SAMPLE_COUNT = { "Sub-Texel Sample Count",
+    "Spreads the samples of every pixel across this many positions inside it.\n\n"
+    "This is going to make shadow edges look cleaner without increasing the resolution. Set to 1 to sample pixel centers only." };
+
+const Label RESOLUTION_TILE_SIZE_LABEL = { "Resolution Tile Size",
+    "Bakes every instance in square tiles of the specified size instead of all at once.\n\n"
+    "This caps the memory used by high resolution instances at a small performance cost.\n\n"
+    "Set to 0 to disable this option." };
 
 const char* const BAKE_DESC = "Bakes the current stage.";
 
@@ -221,7 +245,14 @@ void BakingFactoryWindow::update(const float deltaTime)
             if (beginProperties("##GI Settings"))
             {
                 property(DENOISE_SHADOW_MAP_LABEL, params->postProcess.denoiseShadowMap);
+                property(DENOISER_GUIDES_LABEL, params->postProcess.denoiserGuides);
                 property(OPTIMIZE_SEAMS_LABEL, params->postProcess.optimizeSeams);
+                property("Compression Quality",
+                    {
+                        { COMPRESSION_FAST_LABEL, BlockCompressionQuality::Fast },
+                        { COMPRESSION_NORMAL_LABEL, BlockCompressionQuality::Normal },
+                        { COMPRESSION_EXHAUSTIVE_LABEL, BlockCompressionQuality::Exhaustive },
+                    }, params->postProcess.compressionQuality);
                 property(SKIP_EXISTING_FILES_LABEL, params->skipExistingFiles);
 
                 // Denoiser types need special handling since they might not be available
@@ -258,8 +289,11 @@ void BakingFactoryWindow::update(const float deltaTime)
                 if (property(RESOLUTION_OVERRIDE_LABEL, ImGuiDataType_S16, &params->resolution.override) && params->resolution.override >= 0)
                     params->resolution.override = (int16_t)nextPowerOfTwo(params->resolution.override);
 
-                if (property(RESOLUTION_SUPERSAMPLE_SCALE, ImGuiDataType_U64, &params->resolutionSuperSampleScale))
-                    params->resolutionSuperSampleScale = nextPowerOfTwo(std::max<size_t>(1, params->resolutionSuperSampleScale));
+                if (property(RESOLUTION_SUB_SAMPLE_COUNT, ImGuiDataType_U32, &params->resolution.subSampleCount))
+                    params->resolution.subSampleCount = std::max(1u, std::min(BAKE_POINT_MAX_SUB_SAMPLE_COUNT, params->resolution.subSampleCount));
+
+                if (property(RESOLUTION_TILE_SIZE_LABEL, ImGuiDataType_U16, &params->resolution.tileSize) && params->resolution.tileSize > 0)
+                    params->resolution.tileSize = (uint16_t)nextPowerOfTwo(std::max<uint16_t>(16, params->resolution.tileSize));
 
                 endProperties();
             }
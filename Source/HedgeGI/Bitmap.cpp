@@ -1,6 +1,6 @@
 ﻿#include "Bitmap.h"
 
-#include "D3D11Device.h"
+#include "BitmapWriter.h"
 #include "Math.h"
 
 void Bitmap::transformToLightMap(Color4& color)
@@ -29,16 +29,48 @@ size_t FORCEINLINE Bitmap::getIndex(const Vector2& texCoord, const size_t arrayI
     return getIndex((int64_t)(texCoord.x() * (float)width) % width, (int64_t)(texCoord.y() * (float)height) % height, arrayIndex);
 }
 
+size_t Bitmap::getTexelSize() const
+{
+    switch (format)
+    {
+    case BitmapFormat::F32: return sizeof(Color4);
+    case BitmapFormat::U8: return sizeof(Color4i);
+    case BitmapFormat::F16: return sizeof(DirectX::PackedVector::XMHALF4);
+    case BitmapFormat::R32F: return sizeof(float);
+    case BitmapFormat::R16F: return sizeof(DirectX::PackedVector::HALF);
+    case BitmapFormat::R8: return sizeof(uint8_t);
+    }
+
+    return 0;
+}
+
+DXGI_FORMAT Bitmap::getDxgiFormat() const
+{
+    switch (format)
+    {
+    case BitmapFormat::F32: return DXGI_FORMAT_R32G32B32A32_FLOAT;
+    case BitmapFormat::U8: return DXGI_FORMAT_R8G8B8A8_UNORM;
+    case BitmapFormat::F16: return DXGI_FORMAT_R16G16B16A16_FLOAT;
+    case BitmapFormat::R32F: return DXGI_FORMAT_R32_FLOAT;
+    case BitmapFormat::R16F: return DXGI_FORMAT_R16_FLOAT;
+    case BitmapFormat::R8: return DXGI_FORMAT_R8_UNORM;
+    }
+
+    return DXGI_FORMAT_UNKNOWN;
+}
+
 void* Bitmap::getColorPtr(const size_t index) const
 {
-    return (char*)data + index * (size_t) format;
+    return (char*)data + index * getTexelSize();
 }
 
 Color4 Bitmap::getColor(const size_t index) const
 {
     void* color = getColorPtr(index);
 
-    if (format == BitmapFormat::U8)
+    switch (format)
+    {
+    case BitmapFormat::U8:
     {
         Color4 result;
 
@@ -47,18 +79,60 @@ Color4 Bitmap::getColor(const size_t index) const
 
         return result;
     }
-    else
+
+    case BitmapFormat::F16:
+    {
+        Color4 result;
+
+        DirectX::XMStoreFloat4((DirectX::XMFLOAT4*) &result,
+            DirectX::PackedVector::XMLoadHalf4((const DirectX::PackedVector::XMHALF4*)color));
+
+        return result;
+    }
+
+    case BitmapFormat::R32F:
+    {
+        const float value = *(float*)color;
+        return Color4(value, value, value, 1.0f);
+    }
+
+    case BitmapFormat::R16F:
+    {
+        const float value = DirectX::PackedVector::XMConvertHalfToFloat(*(DirectX::PackedVector::HALF*)color);
+        return Color4(value, value, value, 1.0f);
+    }
+
+    case BitmapFormat::R8:
+    {
+        const float value = (float)*(uint8_t*)color / 255.0f;
+        return Color4(value, value, value, 1.0f);
+    }
+
+    default:
         return *(Color4*)color;
+    }
 }
 
 float Bitmap::getAlpha(const size_t index) const
 {
     void* color = getColorPtr(index);
 
-    if (format == BitmapFormat::U8)
+    switch (format)
+    {
+    case BitmapFormat::U8:
         return (float) ((Color4i*)color)->w() / 255.0f;
-    else
+
+    case BitmapFormat::F16:
+        return DirectX::PackedVector::XMConvertHalfToFloat(((DirectX::PackedVector::XMHALF4*)color)->w);
+
+    case BitmapFormat::R32F:
+    case BitmapFormat::R16F:
+    case BitmapFormat::R8:
+        return 1.0f;
+
+    default:
         return ((Color4*)color)->w();
+    }
 }
 
 Color4 Bitmap::getColor(const size_t x, const size_t y, const size_t arrayIndex) const
@@ -141,20 +215,61 @@ template float Bitmap::getAlpha<true>(const Vector2& texCoord, size_t arrayIndex
 
 void Bitmap::setColor(const Color4& color, const size_t index) const
 {
-    if (format == BitmapFormat::U8)
-        *(Color4i*)getColorPtr(index) = (color * 255.0f).cast<uint8_t>();
+    void* ptr = getColorPtr(index);
 
-    else
-        *(Color4*)getColorPtr(index) = color;
+    switch (format)
+    {
+    case BitmapFormat::U8:
+        *(Color4i*)ptr = (color * 255.0f).cast<uint8_t>();
+        break;
+
+    case BitmapFormat::F16:
+        DirectX::PackedVector::XMStoreHalf4((DirectX::PackedVector::XMHALF4*)ptr,
+            DirectX::XMLoadFloat4((const DirectX::XMFLOAT4*)&color));
+        break;
+
+    // Single channel formats keep the red channel, which is where grayscale colors are written to
+    case BitmapFormat::R32F:
+        *(float*)ptr = color.x();
+        break;
+
+    case BitmapFormat::R16F:
+        *(DirectX::PackedVector::HALF*)ptr = DirectX::PackedVector::XMConvertFloatToHalf(color.x());
+        break;
+
+    case BitmapFormat::R8:
+        *(uint8_t*)ptr = (uint8_t)(saturate(color.x()) * 255.0f + 0.5f);
+        break;
+
+    default:
+        *(Color4*)ptr = color;
+        break;
+    }
 }
 
 void Bitmap::setAlpha(const float alpha, const size_t index) const
 {
-    if (format == BitmapFormat::U8)
-        ((Color4i*)getColorPtr(index))->w() = (uint8_t)(alpha * 255.0f);
+    void* ptr = getColorPtr(index);
 
-    else
-        ((Color4*)getColorPtr(index))->w() = alpha;
+    switch (format)
+    {
+    case BitmapFormat::U8:
+        ((Color4i*)ptr)->w() = (uint8_t)(alpha * 255.0f);
+        break;
+
+    case BitmapFormat::F16:
+        ((DirectX::PackedVector::XMHALF4*)ptr)->w = DirectX::PackedVector::XMConvertFloatToHalf(alpha);
+        break;
+
+    case BitmapFormat::R32F:
+    case BitmapFormat::R16F:
+    case BitmapFormat::R8:
+        break;
+
+    default:
+        ((Color4*)ptr)->w() = alpha;
+        break;
+    }
 }
 
 void Bitmap::setColor(const Color4& color, const size_t x, const size_t y, const size_t arrayIndex) const
@@ -179,26 +294,21 @@ void Bitmap::setAlpha(const float alpha, const Vector2& texCoord, const size_t a
 
 void Bitmap::save(const std::string& filePath, BitmapTransformer* const transformer, const size_t downScaleFactor) const
 {
-    DirectX::ScratchImage scratchImage;
-    {
-        const DirectX::ScratchImage images = toScratchImage(transformer, downScaleFactor);
-
-        Convert(images.GetImages(), images.GetImageCount(), images.GetMetadata(), 
-            DXGI_FORMAT_B8G8R8A8_UNORM, DirectX::TEX_FILTER_DEFAULT, DirectX::TEX_THRESHOLD_DEFAULT, scratchImage);
-    }
-
-    WCHAR wideCharFilePath[MAX_PATH];
-    MultiByteToWideChar(CP_UTF8, NULL, filePath.c_str(), -1, wideCharFilePath, MAX_PATH);
-
-    SaveToWICFile(scratchImage.GetImages(), scratchImage.GetImageCount(), DirectX::WIC_FLAGS_NONE, GetWICCodec(DirectX::WIC_CODEC_PNG), wideCharFilePath);
+    BitmapWriter::savePng(*this, filePath, transformer, downScaleFactor);
 }
 
-void Bitmap::save(const std::string& filePath, const DXGI_FORMAT dxgiFormat, BitmapTransformer* const transformer, const size_t downScaleFactor) const
+void Bitmap::save(const std::string& filePath, const DXGI_FORMAT dxgiFormat, BitmapTransformer* const transformer, const size_t downScaleFactor,
+    const BlockCompressionQuality compressionQuality) const
 {
+    if (BitmapWriter::isSupported(*this, dxgiFormat))
+    {
+        BitmapWriter::saveDds(*this, filePath, dxgiFormat, transformer, downScaleFactor, compressionQuality);
+        return;
+    }
+
     DirectX::ScratchImage scratchImage;
 
-    if ((format == BitmapFormat::F32 && dxgiFormat == DXGI_FORMAT_R32G32B32A32_FLOAT) ||
-        (format == BitmapFormat::U8 && dxgiFormat == DXGI_FORMAT_R8G8B8A8_UNORM))
+    if (dxgiFormat == getDxgiFormat() && (transformer == nullptr || format == BitmapFormat::F32))
         scratchImage = toScratchImage(transformer, downScaleFactor);
 
     else
@@ -221,12 +331,9 @@ void Bitmap::save(const std::string& filePath, const DXGI_FORMAT dxgiFormat, Bit
                 std::swap(images, tmpImage);
             }
 
-            if (dxgiFormat >= DXGI_FORMAT_BC6H_TYPELESS && dxgiFormat <= DXGI_FORMAT_BC7_UNORM_SRGB)
+            if (BlockCompressor::isSupported(dxgiFormat))
             {
-                std::unique_lock<CriticalSection> lock = D3D11Device::lock();
-
-                Compress(D3D11Device::get(), images.GetImages(), images.GetImageCount(), images.GetMetadata(),
-                    dxgiFormat, DirectX::TEX_COMPRESS_PARALLEL, DirectX::TEX_THRESHOLD_DEFAULT, scratchImage);
+                BlockCompressor::compress(images, dxgiFormat, compressionQuality, scratchImage);
             }
 
             else
@@ -250,18 +357,9 @@ void Bitmap::save(const std::string& filePath, const DXGI_FORMAT dxgiFormat, Bit
 
 DirectX::ScratchImage Bitmap::toScratchImage(BitmapTransformer* const transformer, const size_t downScaleFactor) const
 {
-    DXGI_FORMAT dxgiFormat = DXGI_FORMAT_UNKNOWN;
-
-    switch (format)
-    {
-    case BitmapFormat::F32:
-        dxgiFormat = DXGI_FORMAT_R32G32B32A32_FLOAT;
-        break;
-
-    case BitmapFormat::U8:
-        dxgiFormat = DXGI_FORMAT_R8G8B8A8_UNORM;
-        break;
-    }
+    // Transformers work on full colors, so any other format gets expanded on the way
+    const bool expand = transformer != nullptr && format != BitmapFormat::F32;
+    const DXGI_FORMAT dxgiFormat = expand ? DXGI_FORMAT_R32G32B32A32_FLOAT : getDxgiFormat();
 
     DirectX::ScratchImage scratchImage;
 
@@ -282,17 +380,33 @@ DirectX::ScratchImage Bitmap::toScratchImage(BitmapTransformer* const transforme
 
     for (size_t i = 0; i < arraySize; i++)
     {
-        Color4* const pixels = (Color4*)scratchImage.GetImages()[i].pixels;
+        uint8_t* const pixels = scratchImage.GetImages()[i].pixels;
+        const size_t sliceOffset = i * width * height;
 
-        memcpy(pixels, &((Color4*)data)[i * width * height], sizeof(Color4) * width * height);
+        if (expand)
+        {
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, width * height), [&](const tbb::blocked_range<size_t>& range)
+            {
+                for (size_t j = range.begin(); j < range.end(); j++)
+                {
+                    Color4& color = ((Color4*)pixels)[j];
+                    color = getColor(sliceOffset + j);
+                    transformer(color);
+                }
+            });
+
+            continue;
+        }
+
+        memcpy(pixels, getColorPtr(sliceOffset), getTexelSize() * width * height);
 
         if (transformer != nullptr)
         {
-            for (size_t x = 0; x < width; x++)
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, width * height), [&](const tbb::blocked_range<size_t>& range)
             {
-                for (size_t y = 0; y < height; y++)
-                    transformer(pixels[getIndex(x, y, i)]);
-            }
+                for (size_t j = range.begin(); j < range.end(); j++)
+                    transformer(((Color4*)pixels)[j]);
+            });
         }
     }
 
@@ -308,13 +422,14 @@ DirectX::ScratchImage Bitmap::toScratchImage(BitmapTransformer* const transforme
     return scratchImage;
 }
 
-#define MEMORY_SIZE (width * height * arraySize * (size_t)format)
+#define MEMORY_SIZE (width * height * arraySize * getTexelSize())
 
 Bitmap::Bitmap() = default;
 
 Bitmap::Bitmap(const size_t width, const size_t height, const size_t arraySize, const BitmapType type, const BitmapFormat format)
-    : data(operator new(MEMORY_SIZE)), width(width), height(height), arraySize(arraySize), type(type), format(format)
+    : width(width), height(height), arraySize(arraySize), type(type), format(format)
 {
+    data = operator new(MEMORY_SIZE);
     memset(data, 0, MEMORY_SIZE);
 }
 
@@ -329,8 +444,34 @@ Bitmap::Bitmap(const Bitmap& bitmap, const bool copyData)
         memset(data, 0, MEMORY_SIZE);
 }
 
+Bitmap::Bitmap(const Bitmap& bitmap, const BitmapFormat format)
+    : width(bitmap.width), height(bitmap.height), arraySize(bitmap.arraySize), type(bitmap.type), format(format)
+{
+    data = operator new(MEMORY_SIZE);
+
+    if (format == bitmap.format)
+    {
+        memcpy(data, bitmap.data, MEMORY_SIZE);
+        return;
+    }
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, width * height * arraySize), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t i = range.begin(); i < range.end(); i++)
+            setColor(bitmap.getColor(i), i);
+    });
+}
+
 Bitmap::~Bitmap()
 {
-    if (data)
+    if (data && !mapped)
         operator delete(data);
 }
+
+void Bitmap::releaseData()
+{
+    if (data && !mapped)
+        operator delete(data);
+
+    data = nullptr;
+}
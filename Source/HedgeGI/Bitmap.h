@@ -1,5 +1,8 @@
 ﻿#pragma once
 
+#include "BlockCompressor.h"
+#include "TraceTexture.h"
+
 class FileStream;
 
 enum BitmapType : size_t
@@ -11,8 +14,14 @@ enum BitmapType : size_t
 
 enum class BitmapFormat : size_t
 {
-    F32 = sizeof(Color4),
-    U8 = sizeof(Color4i)
+    F32,
+    U8,
+    F16,
+
+    // Single channel formats read back as grayscale with an opaque alpha
+    R32F,
+    R16F,
+    R8
 };
 
 typedef void BitmapTransformer(Color4& color);
@@ -27,6 +36,8 @@ public:
     BitmapType type{};
     BitmapFormat format{};
     std::string name;
+    TraceTexture traceTexture; // Built for material textures by the scene
+    bool mapped{}; // Data points into a scene cache, which owns it
 
     static void transformToLightMap(Color4& color);
     static void transformToShadowMap(Color4& color);
@@ -35,6 +46,9 @@ public:
     size_t getIndex(size_t x, size_t y, size_t arrayIndex = 0) const;
     size_t getIndex(const Vector2& texCoord, size_t arrayIndex = 0) const;
 
+    size_t getTexelSize() const;
+    DXGI_FORMAT getDxgiFormat() const;
+
     void* getColorPtr(size_t index) const;
 
     Color4 getColor(size_t index) const;
@@ -59,12 +73,17 @@ public:
     void setAlpha(float alpha, const Vector2& texCoord, size_t arrayIndex = 0) const;
 
     void save(const std::string& filePath, BitmapTransformer* transformer = nullptr, size_t downScaleFactor = 1) const;
-    void save(const std::string& filePath, DXGI_FORMAT dxgiFormat, BitmapTransformer* transformer = nullptr, size_t downScaleFactor = 1) const;
+    void save(const std::string& filePath, DXGI_FORMAT dxgiFormat, BitmapTransformer* transformer = nullptr, size_t downScaleFactor = 1,
+        BlockCompressionQuality compressionQuality = BlockCompressionQuality::Normal) const;
+
+    // Frees the texels, for material textures once their trace texture is built
+    void releaseData();
 
     DirectX::ScratchImage toScratchImage(BitmapTransformer* transformer = nullptr, size_t downScaleFactor = 1) const;
 
     Bitmap();
     Bitmap(size_t width, size_t height, size_t arraySize = 1, BitmapType type = BITMAP_TYPE_2D, BitmapFormat format = BitmapFormat::F32);
     Bitmap(const Bitmap& bitmap, bool copyData);
+    Bitmap(const Bitmap& bitmap, BitmapFormat format);
     ~Bitmap();
 };
\ No newline at end of file
@@ -6,125 +6,262 @@
 #include "OptixDenoiserDevice.h"
 #include "SeamOptimizer.h"
 
-std::unique_ptr<Bitmap> BitmapHelper::denoise(const Bitmap& bitmap, const DenoiserType denoiserType, const bool denoiseAlpha)
+std::unique_ptr<Bitmap> BitmapHelper::denoise(const Bitmap& bitmap, const DenoiserType denoiserType, const bool denoiseAlpha,
+    const Bitmap* albedoMap, const Bitmap* normalMap)
 {
-    return denoiserType == DenoiserType::Optix && OptixDenoiserDevice::available ? OptixDenoiserDevice::denoise(bitmap, denoiseAlpha) :
+    // Guides only work in pairs
+    if (albedoMap == nullptr || normalMap == nullptr)
+        albedoMap = normalMap = nullptr;
+
+    // Denoisers only take 32-bit floats, narrower maps go through a copy and come back in their own format
+    if (bitmap.format != BitmapFormat::F32)
+    {
+        const std::unique_ptr<Bitmap> denoised = denoise(Bitmap(bitmap, BitmapFormat::F32), denoiserType, denoiseAlpha, albedoMap, normalMap);
+        return denoised != nullptr ? std::make_unique<Bitmap>(*denoised, bitmap.format) : nullptr;
+    }
+
+    return denoiserType == DenoiserType::Optix && OptixDenoiserDevice::available ? OptixDenoiserDevice::denoise(bitmap, denoiseAlpha, albedoMap, normalMap) :
 #if defined(ENABLE_OIDN)
-        denoiserType == DenoiserType::Oidn ? OidnDenoiserDevice::denoise(bitmap, denoiseAlpha) : nullptr;
+        denoiserType == DenoiserType::Oidn ? OidnDenoiserDevice::denoise(bitmap, denoiseAlpha, albedoMap, normalMap) : nullptr;
 #else
         nullptr;
 #endif
 }
 
-std::unique_ptr<Bitmap> BitmapHelper::dilate(const Bitmap& bitmap)
+size_t BitmapHelper::getDenoiserConcurrency(const DenoiserType denoiserType)
 {
-    std::unique_ptr<Bitmap> dilated = std::make_unique<Bitmap>(bitmap, true);
+    // The GPU denoiser serializes every call anyway
+    return denoiserType == DenoiserType::Oidn ? OidnDenoiserDevice::getConcurrency() : 1;
+}
 
-    if (bitmap.width == bitmap.height)
+namespace
+{
+    bool isDilationSeed(const Bitmap& bitmap, const size_t index)
     {
-        for (uint32_t arrayIndex = 0; arrayIndex < bitmap.arraySize; arrayIndex++)
+        const void* color = bitmap.getColorPtr(index);
+
+        // Any positive channel makes the texel valid, U8 channels are positive as soon as they are non-zero
+        switch (bitmap.format)
         {
-            uint32_t blockSize = 2;
+        case BitmapFormat::F32:
+            return DirectX::XMComparisonAnyTrue(DirectX::XMVector4GreaterR(
+                DirectX::XMLoadFloat4((const DirectX::XMFLOAT4*)color), DirectX::XMVectorZero()));
+
+        case BitmapFormat::U8:
+            return *(const uint32_t*)color != 0;
+
+        case BitmapFormat::R8:
+            return *(const uint8_t*)color != 0;
 
-            while (blockSize <= bitmap.width)
+        // Single channel formats read back with an opaque alpha, so only the value itself counts
+        case BitmapFormat::R32F:
+        case BitmapFormat::R16F:
+            return bitmap.getColor(index).x() > 0.0f;
+
+        default:
+            return (bitmap.getColor(index) > 0.0f).any();
+        }
+    }
+
+    void jumpFlood(const uint32_t* source, uint32_t* destination, const int32_t width, const int32_t height, const int32_t step)
+    {
+        tbb::parallel_for(tbb::blocked_range<int32_t>(0, height), [&](const tbb::blocked_range<int32_t>& range)
+        {
+            for (int32_t y = range.begin(); y < range.end(); y++)
             {
-                for (uint32_t x = 0; x < bitmap.width / blockSize; x++)
+                for (int32_t x = 0; x < width; x++)
                 {
-                    for (uint32_t y = 0; y < bitmap.height / blockSize; y++)
+                    uint32_t nearest = source[y * width + x];
+                    int64_t nearestDistance = INT64_MAX;
+
+                    if (nearest != UINT32_MAX)
                     {
-                        size_t count = 0;
-                        Color4 resultColor(0);
+                        const int64_t dx = (int64_t)(nearest % width) - x;
+                        const int64_t dy = (int64_t)(nearest / width) - y;
+                        nearestDistance = dx * dx + dy * dy;
+                    }
 
-                        for (uint32_t i = 0; i < blockSize; i++)
-                        {
-                            for (uint32_t j = 0; j < blockSize; j++)
-                            {
-                                const Color4 color = dilated->getColor(x * blockSize + i, y * blockSize + j, arrayIndex);
-                                if (color.maxCoeff() <= 0.0f)
-                                    continue;
+                    for (int32_t j = -1; j <= 1; j++)
+                    {
+                        const int32_t sampleY = y + j * step;
+                        if (sampleY < 0 || sampleY >= height)
+                            continue;
 
-                                resultColor += color;
-                                ++count;
-                            }
-                        }
+                        for (int32_t i = -1; i <= 1; i++)
+                        {
+                            const int32_t sampleX = x + i * step;
+                            if (sampleX < 0 || sampleX >= width || (i == 0 && j == 0))
+                                continue;
 
-                        if (count == 0 || count == blockSize * blockSize)
-                            continue;
+                            const uint32_t seed = source[sampleY * width + sampleX];
+                            if (seed == UINT32_MAX)
+                                continue;
 
-                        resultColor /= (float)count;
+                            const int64_t dx = (int64_t)(seed % width) - x;
+                            const int64_t dy = (int64_t)(seed / width) - y;
+                            const int64_t distance = dx * dx + dy * dy;
 
-                        for (uint32_t i = 0; i < blockSize; i++)
-                        {
-                            for (uint32_t j = 0; j < blockSize; j++)
+                            if (distance < nearestDistance)
                             {
-                                const Color4& color = dilated->getColor(x * blockSize + i, y * blockSize + j, arrayIndex);
-                                dilated->setColor(color.maxCoeff() > 0.0f ? color : resultColor, x * blockSize + i, y * blockSize + j, arrayIndex);
+                                nearest = seed;
+                                nearestDistance = distance;
                             }
                         }
                     }
-                }
 
-                blockSize *= 2;
+                    destination[y * width + x] = nearest;
+                }
             }
+        });
+    }
+
+    // Points every texel of the slice to its nearest valid texel, or to UINT32_MAX if the slice has none
+    size_t floodDilationSeeds(const Bitmap& bitmap, const size_t arrayIndex, std::unique_ptr<uint32_t[]>& seeds, std::unique_ptr<uint32_t[]>& seedsBuffer)
+    {
+        const int32_t width = (int32_t)bitmap.width;
+        const int32_t height = (int32_t)bitmap.height;
+        const size_t sliceSize = bitmap.width * bitmap.height;
+        const size_t sliceOffset = sliceSize * arrayIndex;
+
+        const size_t seedCount = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, sliceSize), (size_t)0,
+            [&](const tbb::blocked_range<size_t>& range, size_t count)
+            {
+                for (size_t i = range.begin(); i < range.end(); i++)
+                {
+                    const bool seed = isDilationSeed(bitmap, sliceOffset + i);
+                    seeds[i] = seed ? (uint32_t)i : UINT32_MAX;
+                    count += seed ? 1 : 0;
+                }
+
+                return count;
+            }, std::plus<size_t>());
+
+        if (seedCount == 0 || seedCount == sliceSize)
+            return seedCount;
+
+        // Jump flood with halving steps, followed by an extra step of one to fix up most of the remaining errors
+        for (int32_t step = nextPowerOfTwo(std::max(width, height)) / 2; step >= 1; step /= 2)
+        {
+            jumpFlood(seeds.get(), seedsBuffer.get(), width, height, step);
+            std::swap(seeds, seedsBuffer);
         }
+
+        jumpFlood(seeds.get(), seedsBuffer.get(), width, height, 1);
+        std::swap(seeds, seedsBuffer);
+
+        return seedCount;
     }
 
-    return dilated;
+    void encodeColor(Color4& color, const EncodeReadyFlags encodeReadyFlags)
+    {
+        color.head<3>() = ldrReady(color.head<3>());
+
+        if (encodeReadyFlags & ENCODE_READY_FLAGS_SRGB) color.head<3>() = color.head<3>().pow(1.0f / 2.2f);
+        if (encodeReadyFlags & ENCODE_READY_FLAGS_SQRT) color.head<3>() = color.head<3>().sqrt();
+    }
 }
 
-std::unique_ptr<Bitmap> BitmapHelper::optimizeSeams(const Bitmap& bitmap, const Instance& instance)
+void BitmapHelper::dilate(const Bitmap& bitmap)
 {
-    const SeamOptimizer optimizer(instance);
-    return optimizer.optimize(bitmap);
+    dilate(bitmap, bitmap);
 }
 
-std::unique_ptr<Bitmap> BitmapHelper::makeEncodeReady(const Bitmap& bitmap, const EncodeReadyFlags encodeReadyFlags)
+void BitmapHelper::dilate(const Bitmap& bitmap, const Bitmap& coverage)
 {
-    std::unique_ptr<Bitmap> encoded = std::make_unique<Bitmap>(bitmap, false);
+    assert(bitmap.width == coverage.width && bitmap.height == coverage.height && coverage.arraySize >= bitmap.arraySize);
 
-    for (size_t i = 0; i < bitmap.arraySize; i++)
+    const size_t sliceSize = bitmap.width * bitmap.height;
+
+    if (sliceSize == 0)
+        return;
+
+    // Nearest valid texel of every texel, UINT32_MAX until one is found
+    std::unique_ptr<uint32_t[]> seeds = std::make_unique<uint32_t[]>(sliceSize);
+    std::unique_ptr<uint32_t[]> seedsBuffer = std::make_unique<uint32_t[]>(sliceSize);
+
+    for (size_t arrayIndex = 0; arrayIndex < bitmap.arraySize; arrayIndex++)
     {
-        for (size_t x = 0; x < bitmap.width; x++)
-        {
-            for (size_t y = 0; y < bitmap.height; y++)
-            {
-                const size_t index = bitmap.getIndex(x, y, i);
+        const size_t seedCount = floodDilationSeeds(coverage, arrayIndex, seeds, seedsBuffer);
 
-                Color4 color = bitmap.getColor(index);
-                color.head<3>() = ldrReady(color.head<3>());
+        if (seedCount == 0 || seedCount == sliceSize)
+            continue;
 
-                if (encodeReadyFlags & ENCODE_READY_FLAGS_SRGB) color.head<3>() = color.head<3>().pow(1.0f / 2.2f);
-                if (encodeReadyFlags & ENCODE_READY_FLAGS_SQRT) color.head<3>() = color.head<3>().sqrt();
+        const size_t sliceOffset = sliceSize * arrayIndex;
 
-                encoded->setColor(color, index);
+        const size_t texelSize = bitmap.getTexelSize();
+
+        // Seeds are never written, so the colors can be copied in place
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, sliceSize), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t i = range.begin(); i < range.end(); i++)
+            {
+                if (seeds[i] != i)
+                    memcpy(bitmap.getColorPtr(sliceOffset + i), bitmap.getColorPtr(sliceOffset + seeds[i]), texelSize);
             }
-        }
+        });
     }
-
-    return encoded;
 }
 
-std::unique_ptr<Bitmap> BitmapHelper::combine(const Bitmap& lightMap, const Bitmap& shadowMap)
+void BitmapHelper::dilateAndCombine(const Bitmap& lightMap, const Bitmap& shadowMap, const bool encodeReady, const EncodeReadyFlags encodeReadyFlags)
 {
-    assert(lightMap.width == shadowMap.width && lightMap.height == shadowMap.height);
+    assert(lightMap.width == shadowMap.width && lightMap.height == shadowMap.height && lightMap.arraySize == shadowMap.arraySize);
+    assert(lightMap.format == BitmapFormat::F32);
+
+    const size_t sliceSize = lightMap.width * lightMap.height;
+
+    if (sliceSize == 0)
+        return;
 
-    std::unique_ptr<Bitmap> bitmap = std::make_unique<Bitmap>(lightMap, false);
+    std::unique_ptr<uint32_t[]> seeds = std::make_unique<uint32_t[]>(sliceSize);
+    std::unique_ptr<uint32_t[]> seedsBuffer = std::make_unique<uint32_t[]>(sliceSize);
 
-    for (size_t i = 0; i < bitmap->arraySize; i++)
+    for (size_t arrayIndex = 0; arrayIndex < lightMap.arraySize; arrayIndex++)
     {
-        for (size_t x = 0; x < bitmap->width; x++)
+        // Both maps are painted from the same bake points, so the light map decides the coverage of both
+        floodDilationSeeds(lightMap, arrayIndex, seeds, seedsBuffer);
+
+        const size_t sliceOffset = sliceSize * arrayIndex;
+        Color4* const colors = (Color4*)lightMap.data + sliceOffset;
+
+        // Empty texels go first, while the valid texels they copy from are still unmodified
+        for (const bool filling : { true, false })
         {
-            for (size_t y = 0; y < bitmap->height; y++)
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, sliceSize), [&](const tbb::blocked_range<size_t>& range)
             {
-                const size_t index = bitmap->getIndex(x, y, i);
+                for (size_t i = range.begin(); i < range.end(); i++)
+                {
+                    const size_t seed = seeds[i] != UINT32_MAX ? seeds[i] : i;
+                    if ((seed != i) != filling)
+                        continue;
 
-                Color4 color = lightMap.getColor(index);
-                color.w() = shadowMap.getColor(index).head<3>().sum() / 3.0f;
+                    Color4 color = colors[seed];
+                    color.w() = shadowMap.getColor(sliceOffset + seed).head<3>().sum() / 3.0f;
 
-                bitmap->setColor(color, index);
-            }
+                    if (encodeReady)
+                        encodeColor(color, encodeReadyFlags);
+
+                    colors[i] = color;
+                }
+            });
         }
     }
+}
+
+void BitmapHelper::optimizeSeams(const Bitmap& bitmap, const Instance& instance)
+{
+    SeamOptimizer optimizer(instance);
+    optimizer.optimize(bitmap);
+}
 
-    return bitmap;
+void BitmapHelper::makeEncodeReady(const Bitmap& bitmap, const EncodeReadyFlags encodeReadyFlags)
+{
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, bitmap.width * bitmap.height * bitmap.arraySize), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t i = range.begin(); i < range.end(); i++)
+        {
+            Color4 color = bitmap.getColor(i);
+            encodeColor(color, encodeReadyFlags);
+            bitmap.setColor(color, i);
+        }
+    });
 }
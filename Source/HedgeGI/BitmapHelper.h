@@ -9,6 +9,10 @@ enum PaintFlags
 {
     PAINT_FLAGS_COLOR = 1 << 0,
     PAINT_FLAGS_SHADOW = 1 << 1,
+
+    // Denoiser guides, painted on their own
+    PAINT_FLAGS_ALBEDO = 1 << 2,
+    PAINT_FLAGS_NORMAL = 1 << 3,
 };
 
 enum EncodeReadyFlags
@@ -21,11 +25,24 @@ enum EncodeReadyFlags
 class BitmapHelper
 {
 public:
-    static std::unique_ptr<Bitmap> denoise(const Bitmap& bitmap, DenoiserType denoiserType, bool denoiseAlpha = false);
+    // Albedo and normal maps guide the denoiser when both are given, every slice of the bitmap shares them
+    static std::unique_ptr<Bitmap> denoise(const Bitmap& bitmap, DenoiserType denoiserType, bool denoiseAlpha = false,
+        const Bitmap* albedoMap = nullptr, const Bitmap* normalMap = nullptr);
+
+    // How many denoise calls can run at the same time and actually make progress
+    static size_t getDenoiserConcurrency(DenoiserType denoiserType);
+
+    // Fills every empty texel in place with the color of its nearest valid texel
+    static void dilate(const Bitmap& bitmap);
+
+    // Same as above, but takes the valid texels from the coverage bitmap, for maps that can't tell empty texels apart on their own.
+    // Slice N of the bitmap uses slice N of the coverage, so a single slice shadow map is covered by slice 0 of its light map
+    static void dilate(const Bitmap& bitmap, const Bitmap& coverage);
 
-    static std::unique_ptr<Bitmap> dilate(const Bitmap& bitmap);
+    // Dilates both maps and packs the shadow into the alpha of the light map in place, optionally making the result encode ready on the way
+    static void dilateAndCombine(const Bitmap& lightMap, const Bitmap& shadowMap, bool encodeReady = false, EncodeReadyFlags encodeReadyFlags = ENCORE_READY_FLAGS_NONE);
 
-    static std::unique_ptr<Bitmap> optimizeSeams(const Bitmap& bitmap, const Instance& instance);
+    static void optimizeSeams(const Bitmap& bitmap, const Instance& instance);
 
     template <typename TBakePoint>
     static void paint(const Bitmap& bitmap, const std::vector<TBakePoint>& bakePoints, PaintFlags paintFlags);
@@ -33,53 +50,66 @@ public:
     template<typename TBakePoint>
     static std::unique_ptr<Bitmap> createAndPaint(const std::vector<TBakePoint>& bakePoints, uint16_t width, uint16_t height, PaintFlags paintFlags);
 
-    static std::unique_ptr<Bitmap> makeEncodeReady(const Bitmap& bitmap, EncodeReadyFlags encodeReadyFlags);
-
-    static std::unique_ptr<Bitmap> combine(const Bitmap& lightMap, const Bitmap& shadowMap);
+    static void makeEncodeReady(const Bitmap& bitmap, EncodeReadyFlags encodeReadyFlags);
 };
 
 template <typename TBakePoint>
 void BitmapHelper::paint(const Bitmap& bitmap, const std::vector<TBakePoint>& bakePoints, const PaintFlags paintFlags)
 {
-    const size_t dataSize = bitmap.width * bitmap.height * bitmap.arraySize;
-    const std::unique_ptr<uint8_t[]> counts = std::make_unique<uint8_t[]>(dataSize);
-
-    memset(&counts[0], 0, dataSize * sizeof(counts[0]));
-
-    for (auto& bakePoint : bakePoints)
+    // Bake points are unique per texel, so they can be written directly and in any order
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, bakePoints.size()), [&](const tbb::blocked_range<size_t>& range)
     {
-        if (!bakePoint.valid())
-            continue;
-
-        for (size_t i = 0; i < std::min(bitmap.arraySize, TBakePoint::BASIS_COUNT); i++)
+        for (size_t r = range.begin(); r < range.end(); r++)
         {
-            Color4 color{};
+            const TBakePoint& bakePoint = bakePoints[r];
 
-            if (paintFlags & PAINT_FLAGS_COLOR)
-            {
-                for (size_t j = 0; j < 3; j++)
-                    color[j] = std::max(0.0f, std::min(65504.0f, bakePoint.colors[i][j]));
+            if (!bakePoint.valid())
+                continue;
 
-                color[3] = paintFlags & PAINT_FLAGS_SHADOW ? saturate(bakePoint.shadow) : 1.0f;
-            }
-            else if (paintFlags & PAINT_FLAGS_SHADOW)
+            for (size_t i = 0; i < std::min(bitmap.arraySize, TBakePoint::BASIS_COUNT); i++)
             {
-                for (size_t j = 0; j < 3; j++)
-                    color[j] = saturate(bakePoint.shadow);
-
-                color[3] = 1.0f;
+                Color4 color{};
+
+                if (paintFlags & PAINT_FLAGS_COLOR)
+                {
+                    for (size_t j = 0; j < 3; j++)
+                        color[j] = std::max(0.0f, std::min(65504.0f, bakePoint.colors[i][j]));
+
+                    color[3] = paintFlags & PAINT_FLAGS_SHADOW ? saturate(bakePoint.shadow) : 1.0f;
+                }
+                else if (paintFlags & PAINT_FLAGS_SHADOW)
+                {
+                    for (size_t j = 0; j < 3; j++)
+                        color[j] = saturate(bakePoint.shadow);
+
+                    color[3] = 1.0f;
+                }
+                else if (paintFlags & PAINT_FLAGS_ALBEDO)
+                {
+                    color.head<3>() = bakePoint.albedo.cwiseMax(0.0f).cwiseMin(1.0f);
+                    color[3] = 1.0f;
+                }
+                else if (paintFlags & PAINT_FLAGS_NORMAL)
+                {
+                    // Alpha keeps texels with no positive normal component valid for dilation
+                    color.head<3>() = bakePoint.normal.array();
+                    color[3] = 1.0f;
+                }
+
+                const size_t index = bitmap.getIndex(bakePoint.x, bakePoint.y, i);
+                bitmap.setColor(color, index);
             }
-
-            const size_t index = bitmap.getIndex(bakePoint.x, bakePoint.y, i);
-            bitmap.setColor((bitmap.getColor(index) * counts[index] + color) / ++counts[index], index);
         }
-    }
+    });
 }
 
 template <typename TBakePoint>
 std::unique_ptr<Bitmap> BitmapHelper::createAndPaint(const std::vector<TBakePoint>& bakePoints, uint16_t width, uint16_t height, const PaintFlags paintFlags)
 {
-    std::unique_ptr<Bitmap> bitmap = std::make_unique<Bitmap>(width, height, paintFlags != PAINT_FLAGS_SHADOW ? TBakePoint::BASIS_COUNT : 1);
+    std::unique_ptr<Bitmap> bitmap = paintFlags != PAINT_FLAGS_SHADOW ?
+        std::make_unique<Bitmap>(width, height, TBakePoint::BASIS_COUNT) :
+        std::make_unique<Bitmap>(width, height, 1, BITMAP_TYPE_2D, BitmapFormat::R8);
+
     paint(*bitmap, bakePoints, paintFlags);
     return bitmap;
 }
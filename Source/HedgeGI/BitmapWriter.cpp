@@ -0,0 +1,332 @@
+﻿#include "BitmapWriter.h"
+
+#include "FileStream.h"
+#include "Math.h"
+
+namespace
+{
+    // Rows per band, a multiple of the block size and of two so every band maps to whole rows of the next mip
+    constexpr size_t BAND_HEIGHT = 16;
+
+    using RowFetcher = std::function<void(size_t y, Color4* destination)>;
+    using BandSink = std::function<void(const uint8_t* data, size_t rowCount, size_t rowPitch)>;
+
+    // A mip level below the one being written, filled in by its bands
+    struct MipLevel
+    {
+        size_t width{};
+        size_t height{};
+        std::unique_ptr<Color4[]> colors;
+    };
+
+    size_t getPixelSize(const DXGI_FORMAT format)
+    {
+        switch (format)
+        {
+        case DXGI_FORMAT_R32G32B32A32_FLOAT: return 16;
+        case DXGI_FORMAT_R16G16B16A16_FLOAT: return 8;
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT_R32_FLOAT: return 4;
+        case DXGI_FORMAT_R16_FLOAT: return 2;
+        case DXGI_FORMAT_R8_UNORM: return 1;
+        default: return 0;
+        }
+    }
+
+    void storePixel(const Color4& color, const DXGI_FORMAT format, uint8_t* destination)
+    {
+        const DirectX::XMVECTOR vector = DirectX::XMLoadFloat4((const DirectX::XMFLOAT4*)&color);
+
+        switch (format)
+        {
+        case DXGI_FORMAT_R32G32B32A32_FLOAT:
+            DirectX::XMStoreFloat4((DirectX::XMFLOAT4*)destination, vector);
+            break;
+
+        case DXGI_FORMAT_R16G16B16A16_FLOAT:
+            DirectX::PackedVector::XMStoreHalf4((DirectX::PackedVector::XMHALF4*)destination, vector);
+            break;
+
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+            DirectX::PackedVector::XMStoreUByteN4((DirectX::PackedVector::XMUBYTEN4*)destination, vector);
+            break;
+
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+            DirectX::PackedVector::XMStoreColor((DirectX::PackedVector::XMCOLOR*)destination, vector);
+            break;
+
+        case DXGI_FORMAT_R32_FLOAT:
+            *(float*)destination = color.x();
+            break;
+
+        case DXGI_FORMAT_R16_FLOAT:
+            *(DirectX::PackedVector::HALF*)destination = DirectX::PackedVector::XMConvertFloatToHalf(color.x());
+            break;
+
+        case DXGI_FORMAT_R8_UNORM:
+            *destination = (uint8_t)(saturate(color.x()) * 255.0f + 0.5f);
+            break;
+        }
+    }
+
+    // Reads a row of a slice with the transformer applied, box filtered by the downscale factor
+    void fetchBitmapRow(const Bitmap& bitmap, const size_t arrayIndex, BitmapTransformer* const transformer, const size_t downScaleFactor,
+        const size_t width, const size_t y, Color4* destination)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            Color4 sum = Color4::Zero();
+
+            for (size_t j = 0; j < downScaleFactor; j++)
+            {
+                for (size_t i = 0; i < downScaleFactor; i++)
+                {
+                    Color4 color = bitmap.getColor(
+                        std::min(x * downScaleFactor + i, bitmap.width - 1), std::min(y * downScaleFactor + j, bitmap.height - 1), arrayIndex);
+
+                    if (transformer != nullptr)
+                        transformer(color);
+
+                    sum += color;
+                }
+            }
+
+            destination[x] = sum / (float)(downScaleFactor * downScaleFactor);
+        }
+    }
+
+    // Box filters the rows of a band into the rows of the next mip they cover, bands never share a row of it
+    void downsampleBand(const Color4* colors, const size_t width, const size_t height, const size_t y, const size_t bandHeight, MipLevel& nextLevel)
+    {
+        const size_t lastRow = std::min(nextLevel.height, (y + bandHeight + 1) / 2);
+
+        for (size_t nextY = y / 2; nextY < lastRow; nextY++)
+        {
+            const Color4* row0 = colors + (nextY * 2 - y) * width;
+            const Color4* row1 = colors + (std::min(nextY * 2 + 1, height - 1) - y) * width;
+
+            for (size_t nextX = 0; nextX < nextLevel.width; nextX++)
+            {
+                const size_t x0 = nextX * 2;
+                const size_t x1 = std::min(nextX * 2 + 1, width - 1);
+
+                nextLevel.colors[nextY * nextLevel.width + nextX] = (row0[x0] + row0[x1] + row1[x0] + row1[x1]) * 0.25f;
+            }
+        }
+    }
+
+    void encodeBand(const Color4* colors, const size_t width, const size_t bandHeight, const DXGI_FORMAT format,
+        const BlockCompressionQuality compressionQuality, const size_t rowPitch, uint8_t* destination)
+    {
+        if (!DirectX::IsCompressed(format))
+        {
+            const size_t pixelSize = getPixelSize(format);
+
+            for (size_t y = 0; y < bandHeight; y++)
+            {
+                for (size_t x = 0; x < width; x++)
+                    storePixel(colors[y * width + x], format, destination + y * rowPitch + x * pixelSize);
+            }
+
+            return;
+        }
+
+        const size_t blockSize = BlockCompressor::getBlockSize(format);
+        Color4 pixels[16];
+
+        for (size_t blockY = 0; blockY < (bandHeight + 3) / 4; blockY++)
+        {
+            for (size_t blockX = 0; blockX < (width + 3) / 4; blockX++)
+            {
+                // Edge blocks repeat the last row and column, only the last band can end in the middle of a block
+                for (size_t y = 0; y < 4; y++)
+                {
+                    for (size_t x = 0; x < 4; x++)
+                        pixels[y * 4 + x] = colors[std::min(blockY * 4 + y, bandHeight - 1) * width + std::min(blockX * 4 + x, width - 1)];
+                }
+
+                BlockCompressor::compressBlock(pixels, format, compressionQuality, destination + blockY * rowPitch + blockX * blockSize);
+            }
+        }
+    }
+
+    // Bands get fetched and encoded in parallel, but reach the sink in order, one at a time
+    void streamLevel(const size_t width, const size_t height, const DXGI_FORMAT format, const BlockCompressionQuality compressionQuality,
+        const RowFetcher& fetch, MipLevel* nextLevel, const BandSink& sink)
+    {
+        const bool compressed = DirectX::IsCompressed(format);
+        const size_t rowPitch = compressed ? (width + 3) / 4 * BlockCompressor::getBlockSize(format) : width * getPixelSize(format);
+        const size_t bandCount = (height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+
+        // Only the bands in flight hold any memory
+        std::vector<std::unique_ptr<uint8_t[]>> bands(bandCount);
+        size_t nextBand = 0;
+
+        tbb::parallel_pipeline((size_t)tbb::this_task_arena::max_concurrency() * 2,
+            tbb::make_filter<void, size_t>(tbb::filter_mode::serial_in_order, [&](tbb::flow_control& control)
+            {
+                if (nextBand == bandCount)
+                    control.stop();
+
+                return nextBand++;
+            }) &
+            tbb::make_filter<size_t, size_t>(tbb::filter_mode::parallel, [&](const size_t band)
+            {
+                const size_t y = band * BAND_HEIGHT;
+                const size_t bandHeight = std::min(BAND_HEIGHT, height - y);
+
+                std::unique_ptr<Color4[]> colors = std::make_unique<Color4[]>(width * bandHeight);
+
+                for (size_t i = 0; i < bandHeight; i++)
+                    fetch(y + i, &colors[i * width]);
+
+                if (nextLevel != nullptr)
+                    downsampleBand(colors.get(), width, height, y, bandHeight, *nextLevel);
+
+                bands[band] = std::make_unique<uint8_t[]>(rowPitch * (compressed ? (bandHeight + 3) / 4 : bandHeight));
+                encodeBand(colors.get(), width, bandHeight, format, compressionQuality, rowPitch, bands[band].get());
+
+                return band;
+            }) &
+            tbb::make_filter<size_t, void>(tbb::filter_mode::serial_in_order, [&](const size_t band)
+            {
+                const size_t bandHeight = std::min(BAND_HEIGHT, height - band * BAND_HEIGHT);
+
+                sink(bands[band].get(), compressed ? (bandHeight + 3) / 4 : bandHeight, rowPitch);
+                bands[band] = nullptr;
+            }));
+    }
+}
+
+bool BitmapWriter::isSupported(const Bitmap& bitmap, const DXGI_FORMAT format)
+{
+    // Mips are only generated per slice, volumes would need them across slices as well
+    if (DirectX::IsCompressed(format))
+        return BlockCompressor::isSupported(format) && bitmap.type != BITMAP_TYPE_3D;
+
+    return getPixelSize(format) != 0;
+}
+
+void BitmapWriter::saveDds(const Bitmap& bitmap, const std::string& filePath, const DXGI_FORMAT format, BitmapTransformer* const transformer,
+    const size_t downScaleFactor, const BlockCompressionQuality compressionQuality)
+{
+    const size_t width = std::max<size_t>(1, bitmap.width / downScaleFactor);
+    const size_t height = std::max<size_t>(1, bitmap.height / downScaleFactor);
+
+    DirectX::TexMetadata metadata{};
+    metadata.width = width;
+    metadata.height = height;
+    metadata.depth = bitmap.type == BITMAP_TYPE_3D ? bitmap.arraySize : 1;
+    metadata.arraySize = bitmap.type == BITMAP_TYPE_3D ? 1 : bitmap.arraySize;
+    metadata.mipLevels = 1;
+    metadata.miscFlags = bitmap.type == BITMAP_TYPE_CUBE ? DirectX::TEX_MISC_TEXTURECUBE : 0;
+    metadata.format = format;
+    metadata.dimension = bitmap.type == BITMAP_TYPE_3D ? DirectX::TEX_DIMENSION_TEXTURE3D : DirectX::TEX_DIMENSION_TEXTURE2D;
+
+    if (DirectX::IsCompressed(format))
+    {
+        for (size_t size = std::max(width, height); size > 1; size /= 2)
+            ++metadata.mipLevels;
+    }
+
+    size_t headerSize = 0;
+    if (FAILED(DirectX::EncodeDDSHeader(metadata, DirectX::DDS_FLAGS_NONE, nullptr, 0, headerSize)))
+        return;
+
+    std::unique_ptr<uint8_t[]> header = std::make_unique<uint8_t[]>(headerSize);
+    DirectX::EncodeDDSHeader(metadata, DirectX::DDS_FLAGS_NONE, header.get(), headerSize, headerSize);
+
+    const FileStream file(filePath.c_str(), "wb");
+    if (!file.isOpen())
+        return;
+
+    file.write(header.get(), headerSize);
+
+    const BandSink sink = [&](const uint8_t* data, const size_t rowCount, const size_t rowPitch)
+    {
+        file.write(data, rowCount * rowPitch);
+    };
+
+    // DDS files store the mips of each slice together, volumes are a single level of consecutive slices
+    for (size_t i = 0; i < bitmap.arraySize; i++)
+    {
+        MipLevel level{ width, height };
+
+        for (size_t j = 0; j < metadata.mipLevels; j++)
+        {
+            MipLevel nextLevel;
+
+            if (j + 1 < metadata.mipLevels)
+            {
+                nextLevel.width = std::max<size_t>(1, level.width / 2);
+                nextLevel.height = std::max<size_t>(1, level.height / 2);
+                nextLevel.colors = std::make_unique<Color4[]>(nextLevel.width * nextLevel.height);
+            }
+
+            const RowFetcher fetch = j == 0 ?
+                RowFetcher([&](const size_t y, Color4* destination) { fetchBitmapRow(bitmap, i, transformer, downScaleFactor, width, y, destination); }) :
+                RowFetcher([&](const size_t y, Color4* destination) { std::copy_n(&level.colors[y * level.width], level.width, destination); });
+
+            streamLevel(level.width, level.height, format, compressionQuality, fetch, nextLevel.colors != nullptr ? &nextLevel : nullptr, sink);
+
+            level = std::move(nextLevel);
+        }
+    }
+}
+
+void BitmapWriter::savePng(const Bitmap& bitmap, const std::string& filePath, BitmapTransformer* const transformer, const size_t downScaleFactor)
+{
+    const size_t width = std::max<size_t>(1, bitmap.width / downScaleFactor);
+    const size_t height = std::max<size_t>(1, bitmap.height / downScaleFactor);
+
+    WCHAR wideCharFilePath[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, NULL, filePath.c_str(), -1, wideCharFilePath, MAX_PATH);
+
+    bool iswic2 = false;
+    IWICImagingFactory* factory = DirectX::GetWICFactory(iswic2);
+
+    Microsoft::WRL::ComPtr<IWICStream> stream;
+    Microsoft::WRL::ComPtr<IWICBitmapEncoder> encoder;
+    Microsoft::WRL::ComPtr<IWICBitmapFrameEncode> frame;
+
+    if (factory == nullptr ||
+        FAILED(factory->CreateStream(stream.GetAddressOf())) ||
+        FAILED(stream->InitializeFromFilename(wideCharFilePath, GENERIC_WRITE)) ||
+        FAILED(factory->CreateEncoder(GUID_ContainerFormatPng, nullptr, encoder.GetAddressOf())) ||
+        FAILED(encoder->Initialize(stream.Get(), WICBitmapEncoderNoCache)) ||
+        FAILED(encoder->CreateNewFrame(frame.GetAddressOf(), nullptr)) ||
+        FAILED(frame->Initialize(nullptr)) ||
+        FAILED(frame->SetSize((UINT)width, (UINT)height)))
+        return;
+
+    WICPixelFormatGUID pixelFormat = GUID_WICPixelFormat32bppBGRA;
+    if (FAILED(frame->SetPixelFormat(&pixelFormat)) || pixelFormat != GUID_WICPixelFormat32bppBGRA)
+        return;
+
+    // Marked linear like DirectXTex does, so loading it back doesn't apply any gamma
+    Microsoft::WRL::ComPtr<IWICMetadataQueryWriter> metadataWriter;
+    if (SUCCEEDED(frame->GetMetadataQueryWriter(metadataWriter.GetAddressOf())))
+    {
+        PROPVARIANT value;
+        PropVariantInit(&value);
+
+        value.vt = VT_UI4;
+        value.uintVal = 100000;
+
+        metadataWriter->SetMetadataByName(L"/gAMA/ImageGamma", &value);
+        metadataWriter->RemoveMetadataByName(L"/sRGB/RenderingIntent");
+    }
+
+    bool failed = false;
+
+    streamLevel(width, height, DXGI_FORMAT_B8G8R8A8_UNORM, BlockCompressionQuality::Normal,
+        [&](const size_t y, Color4* destination) { fetchBitmapRow(bitmap, 0, transformer, downScaleFactor, width, y, destination); }, nullptr,
+        [&](const uint8_t* data, const size_t rowCount, const size_t rowPitch)
+        {
+            failed |= FAILED(frame->WritePixels((UINT)rowCount, (UINT)rowPitch, (UINT)(rowCount * rowPitch), const_cast<uint8_t*>(data)));
+        });
+
+    if (!failed && SUCCEEDED(frame->Commit()))
+        encoder->Commit();
+}
@@ -0,0 +1,19 @@
+﻿#pragma once
+
+#include "Bitmap.h"
+
+// Streams bitmaps to disk a band of rows at a time. Transforming, downscaling, mip generation and format
+// conversion happen per band while earlier bands are being written, so no full size copy of the bitmap is made.
+class BitmapWriter
+{
+public:
+    // Whether the DDS writer can produce the format on its own, DirectXTex has to handle the rest
+    static bool isSupported(const Bitmap& bitmap, DXGI_FORMAT format);
+
+    // Block compressed formats get a full mip chain
+    static void saveDds(const Bitmap& bitmap, const std::string& filePath, DXGI_FORMAT format, BitmapTransformer* transformer = nullptr,
+        size_t downScaleFactor = 1, BlockCompressionQuality compressionQuality = BlockCompressionQuality::Normal);
+
+    // Only the first slice gets written, as 8-bit BGRA
+    static void savePng(const Bitmap& bitmap, const std::string& filePath, BitmapTransformer* transformer = nullptr, size_t downScaleFactor = 1);
+};
@@ -0,0 +1,600 @@
+﻿#include "BlockCompressor.h"
+
+namespace
+{
+    struct QualitySettings
+    {
+        bool principalAxis; // Fit endpoints along the principal axis of the block instead of its bounding box
+        uint32_t refineIterations; // Least squares passes over the endpoints once indices are known
+        int32_t searchRadius; // Quantized steps tried around each endpoint channel
+    };
+
+    QualitySettings getQualitySettings(const BlockCompressionQuality quality)
+    {
+        switch (quality)
+        {
+        case BlockCompressionQuality::Fast: return { false, 0, 0 };
+        case BlockCompressionQuality::Exhaustive: return { true, 4, 2 };
+        default: return { true, 1, 0 };
+        }
+    }
+
+    using Endpoint = Eigen::Array3i;
+
+    // BC1 color endpoints, 5:6:5 bits with a palette of 4 entries. Values are in [0, 1]
+    struct Bc1Format
+    {
+        static constexpr size_t INDEX_COUNT = 4;
+        static constexpr float WEIGHTS[INDEX_COUNT] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+        static Endpoint getMaximum()
+        {
+            return { 31, 63, 31 };
+        }
+
+        static Endpoint quantize(const Color3& value)
+        {
+            return (value.cwiseMax(0.0f).cwiseMin(1.0f) * getMaximum().cast<float>()).round().cast<int>();
+        }
+
+        static Color3 unquantize(const Endpoint& endpoint)
+        {
+            return Color3(
+                (float)(endpoint.x() << 3 | endpoint.x() >> 2),
+                (float)(endpoint.y() << 2 | endpoint.y() >> 4),
+                (float)(endpoint.z() << 3 | endpoint.z() >> 2)) / 255.0f;
+        }
+
+        static void createPalette(const Endpoint& endpoint0, const Endpoint& endpoint1, Color3 (&palette)[INDEX_COUNT])
+        {
+            palette[0] = unquantize(endpoint0);
+            palette[1] = unquantize(endpoint1);
+            palette[2] = (palette[0] * 2.0f + palette[1]) / 3.0f;
+            palette[3] = (palette[0] + palette[1] * 2.0f) / 3.0f;
+        }
+    };
+
+    // BC6H mode 11 endpoints, 10 bits per channel with a palette of 16 entries.
+    // Values are in the unquantized space of the decoder, the half float bit pattern scaled by 64 / 31
+    struct Bc6hFormat
+    {
+        static constexpr size_t INDEX_COUNT = 16;
+        static constexpr int INTEGER_WEIGHTS[INDEX_COUNT] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+        static constexpr float WEIGHTS[INDEX_COUNT] =
+        {
+            0.0f / 64.0f, 4.0f / 64.0f, 9.0f / 64.0f, 13.0f / 64.0f, 17.0f / 64.0f, 21.0f / 64.0f, 26.0f / 64.0f, 30.0f / 64.0f,
+            34.0f / 64.0f, 38.0f / 64.0f, 43.0f / 64.0f, 47.0f / 64.0f, 51.0f / 64.0f, 55.0f / 64.0f, 60.0f / 64.0f, 64.0f / 64.0f
+        };
+
+        static Endpoint getMaximum()
+        {
+            return Endpoint::Constant(1023);
+        }
+
+        static Endpoint quantize(const Color3& value)
+        {
+            return ((value - 32.0f) / 64.0f).round().cast<int>().cwiseMax(0).cwiseMin(1023);
+        }
+
+        static Endpoint unquantize(const Endpoint& endpoint)
+        {
+            Endpoint result;
+
+            for (size_t i = 0; i < 3; i++)
+                result[i] = endpoint[i] == 0 ? 0 : endpoint[i] == 1023 ? 0xFFFF : ((endpoint[i] << 16) + 0x8000) >> 10;
+
+            return result;
+        }
+
+        static void createPalette(const Endpoint& endpoint0, const Endpoint& endpoint1, Color3 (&palette)[INDEX_COUNT])
+        {
+            const Endpoint value0 = unquantize(endpoint0);
+            const Endpoint value1 = unquantize(endpoint1);
+
+            for (size_t i = 0; i < INDEX_COUNT; i++)
+            {
+                for (size_t j = 0; j < 3; j++)
+                    palette[i][j] = (float)(((64 - INTEGER_WEIGHTS[i]) * value0[j] + INTEGER_WEIGHTS[i] * value1[j] + 32) >> 6);
+            }
+        }
+
+        static float toUnquantizedSpace(const float value)
+        {
+            const float clamped = value > 0.0f ? std::min(value, 65504.0f) : 0.0f; // Also catches NaN
+            return (float)DirectX::PackedVector::XMConvertFloatToHalf(clamped) * (64.0f / 31.0f);
+        }
+    };
+
+    template<typename TFormat>
+    struct BlockFit
+    {
+        Endpoint endpoints[2];
+        uint8_t indices[16];
+        float error = INFINITY;
+    };
+
+    // Endpoints spanning the values along their principal axis, or the corners of their bounding box
+    void fitEndpoints(const Color3 (&values)[16], const bool principalAxis, Color3& endpoint0, Color3& endpoint1)
+    {
+        Color3 min = values[0];
+        Color3 max = values[0];
+        Color3 mean = Color3::Zero();
+
+        for (const Color3& value : values)
+        {
+            min = min.min(value);
+            max = max.max(value);
+            mean += value;
+        }
+
+        endpoint0 = max;
+        endpoint1 = min;
+
+        if (!principalAxis || (max == min).all())
+            return;
+
+        mean /= 16.0f;
+
+        Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+
+        for (const Color3& value : values)
+        {
+            const Eigen::Vector3f delta = (value - mean).matrix();
+            covariance += delta * delta.transpose();
+        }
+
+        // Power iteration, starting from the bounding box diagonal converges in a handful of steps
+        Eigen::Vector3f axis = (max - min).matrix();
+
+        for (size_t i = 0; i < 8; i++)
+        {
+            const Eigen::Vector3f next = covariance * axis;
+            const float norm = next.norm();
+
+            if (!(norm > 0.0f))
+                break;
+
+            axis = next / norm;
+        }
+
+        axis.normalize();
+
+        float minProjection = INFINITY;
+        float maxProjection = -INFINITY;
+
+        for (const Color3& value : values)
+        {
+            const float projection = (value - mean).matrix().dot(axis);
+            minProjection = std::min(minProjection, projection);
+            maxProjection = std::max(maxProjection, projection);
+        }
+
+        endpoint0 = mean + axis.array() * maxProjection;
+        endpoint1 = mean + axis.array() * minProjection;
+    }
+
+    // Picks the closest palette entry for every value, returns the summed squared error
+    template<typename TFormat>
+    float assignIndices(const Color3 (&values)[16], const Endpoint& endpoint0, const Endpoint& endpoint1, uint8_t (&indices)[16])
+    {
+        Color3 palette[TFormat::INDEX_COUNT];
+        TFormat::createPalette(endpoint0, endpoint1, palette);
+
+        float error = 0.0f;
+
+        for (size_t i = 0; i < 16; i++)
+        {
+            float bestError = INFINITY;
+
+            for (size_t j = 0; j < TFormat::INDEX_COUNT; j++)
+            {
+                const float candidateError = (palette[j] - values[i]).square().sum();
+
+                if (candidateError < bestError)
+                {
+                    bestError = candidateError;
+                    indices[i] = (uint8_t)j;
+                }
+            }
+
+            error += bestError;
+        }
+
+        return error;
+    }
+
+    template<typename TFormat>
+    bool tryEndpoints(const Color3 (&values)[16], const Endpoint& endpoint0, const Endpoint& endpoint1, BlockFit<TFormat>& fit)
+    {
+        uint8_t indices[16];
+        const float error = assignIndices<TFormat>(values, endpoint0, endpoint1, indices);
+
+        if (!(error < fit.error))
+            return false;
+
+        fit.endpoints[0] = endpoint0;
+        fit.endpoints[1] = endpoint1;
+        std::copy(std::begin(indices), std::end(indices), std::begin(fit.indices));
+        fit.error = error;
+
+        return true;
+    }
+
+    template<typename TFormat>
+    void fitBlock(const Color3 (&values)[16], const QualitySettings& settings, BlockFit<TFormat>& fit)
+    {
+        Color3 endpoint0, endpoint1;
+        fitEndpoints(values, settings.principalAxis, endpoint0, endpoint1);
+
+        tryEndpoints(values, TFormat::quantize(endpoint0), TFormat::quantize(endpoint1), fit);
+
+        // Solve for the endpoints that best reproduce the values with the current indices
+        for (uint32_t iteration = 0; iteration < settings.refineIterations && fit.error > 0.0f; iteration++)
+        {
+            float a = 0.0f, b = 0.0f, c = 0.0f;
+            Color3 x0 = Color3::Zero();
+            Color3 x1 = Color3::Zero();
+
+            for (size_t i = 0; i < 16; i++)
+            {
+                const float weight = TFormat::WEIGHTS[fit.indices[i]];
+
+                a += (1.0f - weight) * (1.0f - weight);
+                b += (1.0f - weight) * weight;
+                c += weight * weight;
+                x0 += values[i] * (1.0f - weight);
+                x1 += values[i] * weight;
+            }
+
+            const float determinant = a * c - b * b;
+            if (std::abs(determinant) < 1e-6f)
+                break;
+
+            if (!tryEndpoints(values, TFormat::quantize((x0 * c - x1 * b) / determinant), TFormat::quantize((x1 * a - x0 * b) / determinant), fit))
+                break;
+        }
+
+        // Nudge each endpoint channel until no single step improves the block
+        bool improved = settings.searchRadius > 0;
+
+        while (improved && fit.error > 0.0f)
+        {
+            improved = false;
+
+            for (size_t i = 0; i < 2; i++)
+            {
+                for (size_t j = 0; j < 3; j++)
+                {
+                    for (int32_t delta = -settings.searchRadius; delta <= settings.searchRadius; delta++)
+                    {
+                        Endpoint endpoints[2] = { fit.endpoints[0], fit.endpoints[1] };
+                        endpoints[i][j] += delta;
+
+                        if (delta == 0 || endpoints[i][j] < 0 || endpoints[i][j] > TFormat::getMaximum()[j])
+                            continue;
+
+                        improved |= tryEndpoints(values, endpoints[0], endpoints[1], fit);
+                    }
+                }
+            }
+        }
+    }
+
+    // Writes bits from the least significant bit of the block up
+    class BitWriter
+    {
+        uint64_t* data;
+        size_t position{};
+
+    public:
+        BitWriter(uint64_t* data) : data(data)
+        {
+            data[0] = 0;
+            data[1] = 0;
+        }
+
+        void write(const uint64_t value, const size_t count)
+        {
+            for (size_t i = 0; i < count; i++, position++)
+                data[position / 64] |= ((value >> i) & 1) << (position % 64);
+        }
+    };
+
+    void encodeBc6hBlock(const Color4 (&pixels)[16], const QualitySettings& settings, uint8_t* destination)
+    {
+        Color3 values[16];
+
+        for (size_t i = 0; i < 16; i++)
+        {
+            for (size_t j = 0; j < 3; j++)
+                values[i][j] = Bc6hFormat::toUnquantizedSpace(pixels[i][j]);
+        }
+
+        BlockFit<Bc6hFormat> fit;
+        fitBlock(values, settings, fit);
+
+        // The most significant bit of the first index is implied to be 0
+        if (fit.indices[0] >= 8)
+        {
+            std::swap(fit.endpoints[0], fit.endpoints[1]);
+
+            for (uint8_t& index : fit.indices)
+                index = 15 - index;
+        }
+
+        BitWriter writer((uint64_t*)destination);
+        writer.write(0x03, 5); // Mode 11, one region with 10 bit endpoints
+
+        for (size_t i = 0; i < 2; i++)
+        {
+            for (size_t j = 0; j < 3; j++)
+                writer.write(fit.endpoints[i][j], 10);
+        }
+
+        writer.write(fit.indices[0], 3);
+
+        for (size_t i = 1; i < 16; i++)
+            writer.write(fit.indices[i], 4);
+    }
+
+    void encodeBc1Block(const Color4 (&pixels)[16], const QualitySettings& settings, uint8_t* destination)
+    {
+        Color3 values[16];
+
+        for (size_t i = 0; i < 16; i++)
+            values[i] = pixels[i].head<3>();
+
+        BlockFit<Bc1Format> fit;
+        fitBlock(values, settings, fit);
+
+        uint16_t colors[2];
+
+        for (size_t i = 0; i < 2; i++)
+            colors[i] = (uint16_t)(fit.endpoints[i].x() << 11 | fit.endpoints[i].y() << 5 | fit.endpoints[i].z());
+
+        // Keep the four color mode for decoders that don't special case BC2/BC3
+        if (colors[0] < colors[1])
+        {
+            std::swap(colors[0], colors[1]);
+
+            for (uint8_t& index : fit.indices)
+                index ^= 1;
+        }
+        else if (colors[0] == colors[1])
+        {
+            std::fill(std::begin(fit.indices), std::end(fit.indices), 0);
+        }
+
+        uint32_t indices = 0;
+
+        for (size_t i = 0; i < 16; i++)
+            indices |= (uint32_t)fit.indices[i] << (i * 2);
+
+        memcpy(destination, colors, sizeof(colors));
+        memcpy(destination + sizeof(colors), &indices, sizeof(indices));
+    }
+
+    // Palette of a BC4 style block, 8 interpolated entries if the first endpoint is greater, 6 and the extremes otherwise
+    void createAlphaPalette(const int endpoint0, const int endpoint1, float (&palette)[8])
+    {
+        palette[0] = (float)endpoint0;
+        palette[1] = (float)endpoint1;
+
+        if (endpoint0 > endpoint1)
+        {
+            for (int i = 2; i < 8; i++)
+                palette[i] = (float)((8 - i) * endpoint0 + (i - 1) * endpoint1) / 7.0f;
+        }
+        else
+        {
+            for (int i = 2; i < 6; i++)
+                palette[i] = (float)((6 - i) * endpoint0 + (i - 1) * endpoint1) / 5.0f;
+
+            palette[6] = 0.0f;
+            palette[7] = 255.0f;
+        }
+    }
+
+    float assignAlphaIndices(const float (&values)[16], const int endpoint0, const int endpoint1, uint8_t (&indices)[16])
+    {
+        float palette[8];
+        createAlphaPalette(endpoint0, endpoint1, palette);
+
+        float error = 0.0f;
+
+        for (size_t i = 0; i < 16; i++)
+        {
+            float bestError = INFINITY;
+
+            for (size_t j = 0; j < 8; j++)
+            {
+                const float candidateError = (palette[j] - values[i]) * (palette[j] - values[i]);
+
+                if (candidateError < bestError)
+                {
+                    bestError = candidateError;
+                    indices[i] = (uint8_t)j;
+                }
+            }
+
+            error += bestError;
+        }
+
+        return error;
+    }
+
+    void encodeAlphaBlock(const Color4 (&pixels)[16], const size_t channel, const QualitySettings& settings, uint8_t* destination)
+    {
+        float values[16];
+        float min = 255.0f, max = 0.0f;
+        float innerMin = 255.0f, innerMax = 0.0f;
+
+        for (size_t i = 0; i < 16; i++)
+        {
+            const float value = pixels[i][channel];
+            values[i] = value > 0.0f ? std::min(value, 1.0f) * 255.0f : 0.0f;
+
+            min = std::min(min, values[i]);
+            max = std::max(max, values[i]);
+
+            // The 6 entry palette stores 0 and 255 exactly, so those are left out of its endpoints
+            if (values[i] >= 0.5f && values[i] <= 254.5f)
+            {
+                innerMin = std::min(innerMin, values[i]);
+                innerMax = std::max(innerMax, values[i]);
+            }
+        }
+
+        int bestEndpoints[2] = { (int)std::round(max), (int)std::round(min) };
+        uint8_t bestIndices[16];
+        float bestError = assignAlphaIndices(values, bestEndpoints[0], bestEndpoints[1], bestIndices);
+
+        auto tryEndpoints = [&](const int endpoint0, const int endpoint1)
+        {
+            if (endpoint0 < 0 || endpoint0 > 255 || endpoint1 < 0 || endpoint1 > 255)
+                return;
+
+            uint8_t indices[16];
+            const float error = assignAlphaIndices(values, endpoint0, endpoint1, indices);
+
+            if (error < bestError)
+            {
+                bestEndpoints[0] = endpoint0;
+                bestEndpoints[1] = endpoint1;
+                std::copy(std::begin(indices), std::end(indices), std::begin(bestIndices));
+                bestError = error;
+            }
+        };
+
+        if (settings.principalAxis && innerMin <= innerMax)
+            tryEndpoints((int)std::round(innerMin), (int)std::round(innerMax));
+
+        if (settings.searchRadius > 0)
+        {
+            // Search around both palette modes, the endpoint order picks the mode
+            const int modeEndpoints[2][2] =
+            {
+                { (int)std::round(max), (int)std::round(min) },
+                { (int)std::round(std::min(innerMin, innerMax)), (int)std::round(std::max(innerMin, innerMax)) }
+            };
+
+            for (const auto& endpoints : modeEndpoints)
+            {
+                for (int i = -settings.searchRadius; i <= settings.searchRadius; i++)
+                {
+                    for (int j = -settings.searchRadius; j <= settings.searchRadius; j++)
+                        tryEndpoints(endpoints[0] + i, endpoints[1] + j);
+                }
+            }
+        }
+
+        uint64_t block = (uint64_t)bestEndpoints[0] | (uint64_t)bestEndpoints[1] << 8;
+
+        for (size_t i = 0; i < 16; i++)
+            block |= (uint64_t)bestIndices[i] << (16 + i * 3);
+
+        memcpy(destination, &block, sizeof(block));
+    }
+
+    void encodeBlock(const Color4 (&pixels)[16], const DXGI_FORMAT format, const QualitySettings& settings, uint8_t* destination)
+    {
+        switch (format)
+        {
+        case DXGI_FORMAT_BC6H_UF16:
+            encodeBc6hBlock(pixels, settings, destination);
+            break;
+
+        case DXGI_FORMAT_BC4_UNORM:
+            encodeAlphaBlock(pixels, 0, settings, destination);
+            break;
+
+        default:
+            encodeAlphaBlock(pixels, 3, settings, destination);
+            encodeBc1Block(pixels, settings, destination + 8);
+            break;
+        }
+    }
+
+    void loadBlock(const DirectX::Image& image, const size_t blockX, const size_t blockY, Color4 (&pixels)[16])
+    {
+        // Edge blocks repeat the last row and column of the image
+        for (size_t y = 0; y < 4; y++)
+        {
+            const float* row = (const float*)(image.pixels + std::min(blockY * 4 + y, image.height - 1) * image.rowPitch);
+
+            for (size_t x = 0; x < 4; x++)
+            {
+                const float* pixel = row + std::min(blockX * 4 + x, image.width - 1) * 4;
+                pixels[y * 4 + x] = Color4(pixel[0], pixel[1], pixel[2], pixel[3]);
+            }
+        }
+    }
+}
+
+bool BlockCompressor::isSupported(const DXGI_FORMAT format)
+{
+    return format == DXGI_FORMAT_BC6H_UF16 || format == DXGI_FORMAT_BC4_UNORM || format == DXGI_FORMAT_BC3_UNORM;
+}
+
+size_t BlockCompressor::getBlockSize(const DXGI_FORMAT format)
+{
+    return format == DXGI_FORMAT_BC4_UNORM ? 8 : 16;
+}
+
+void BlockCompressor::compressBlock(const Color4 (&pixels)[16], const DXGI_FORMAT format, const BlockCompressionQuality quality, uint8_t* destination)
+{
+    encodeBlock(pixels, format, getQualitySettings(quality), destination);
+}
+
+void BlockCompressor::compress(const DirectX::ScratchImage& source, const DXGI_FORMAT format, const BlockCompressionQuality quality, DirectX::ScratchImage& destination)
+{
+    const DirectX::ScratchImage* images = &source;
+    DirectX::ScratchImage convertedImages;
+
+    if (source.GetMetadata().format != DXGI_FORMAT_R32G32B32A32_FLOAT)
+    {
+        DirectX::Convert(source.GetImages(), source.GetImageCount(), source.GetMetadata(),
+            DXGI_FORMAT_R32G32B32A32_FLOAT, DirectX::TEX_FILTER_DEFAULT, DirectX::TEX_THRESHOLD_DEFAULT, convertedImages);
+
+        images = &convertedImages;
+    }
+
+    DirectX::TexMetadata metadata = images->GetMetadata();
+    metadata.format = format;
+
+    destination.Initialize(metadata);
+
+    const QualitySettings settings = getQualitySettings(quality);
+    const size_t blockSize = getBlockSize(format);
+
+    // Block rows of every image and mip, so small mips don't each pay for their own parallel loop
+    std::vector<std::pair<size_t, size_t>> rows;
+
+    for (size_t i = 0; i < images->GetImageCount(); i++)
+    {
+        for (size_t j = 0; j < (images->GetImages()[i].height + 3) / 4; j++)
+            rows.emplace_back(i, j);
+    }
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, rows.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        Color4 pixels[16];
+
+        for (size_t r = range.begin(); r < range.end(); r++)
+        {
+            const auto [imageIndex, blockY] = rows[r];
+
+            const DirectX::Image& sourceImage = images->GetImages()[imageIndex];
+            const DirectX::Image& destinationImage = destination.GetImages()[imageIndex];
+
+            uint8_t* destinationRow = destinationImage.pixels + blockY * destinationImage.rowPitch;
+
+            for (size_t blockX = 0; blockX < (sourceImage.width + 3) / 4; blockX++)
+            {
+                loadBlock(sourceImage, blockX, blockY, pixels);
+
+                encodeBlock(pixels, format, settings, destinationRow + blockX * blockSize);
+            }
+        }
+    });
+}
\ No newline at end of file
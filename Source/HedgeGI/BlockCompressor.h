@@ -0,0 +1,23 @@
+﻿#pragma once
+
+enum class BlockCompressionQuality
+{
+    Fast,
+    Normal,
+    Exhaustive
+};
+
+// CPU block encoder for the formats lightmaps get shipped in, BC6H_UF16, BC4_UNORM and BC3_UNORM.
+// Blocks are encoded in parallel and it needs no graphics device, unlike DirectXTex's BC6H path.
+class BlockCompressor
+{
+public:
+    static bool isSupported(DXGI_FORMAT format);
+    static size_t getBlockSize(DXGI_FORMAT format);
+
+    // Encodes a single 4x4 block, for callers that produce their pixels a band at a time
+    static void compressBlock(const Color4 (&pixels)[16], DXGI_FORMAT format, BlockCompressionQuality quality, uint8_t* destination);
+
+    // Compresses every image of the source, which gets converted to RGBA32F first if it isn't already
+    static void compress(const DirectX::ScratchImage& source, DXGI_FORMAT format, BlockCompressionQuality quality, DirectX::ScratchImage& destination);
+};
@@ -19,13 +19,29 @@ struct GIPoint : BakePoint<1, BAKE_POINT_FLAGS_ALL>
 
 GIPair GIBaker::bake(const RaytracingContext& context, const Instance& instance, const uint16_t size, const BakeParams& bakeParams)
 {
-    std::vector<GIPoint> bakePoints = createBakePoints<GIPoint>(context, instance, size);
+    GIPair pair
+    {
+        std::make_unique<Bitmap>(size, size, GIPoint::BASIS_COUNT),
+        std::make_unique<Bitmap>(size, size, 1, BITMAP_TYPE_2D, BitmapFormat::R8) // Shadows never leave the unit range
+    };
 
-    BakingFactory::bake(context, bakePoints, bakeParams);
+    if (bakeParams.postProcess.denoiserGuides && bakeParams.getDenoiserType() != DenoiserType::None)
+    {
+        pair.albedoMap = std::make_unique<Bitmap>(size, size);
+        pair.normalMap = std::make_unique<Bitmap>(size, size);
+    }
 
-    return
+    BakingFactory::bakeTiled<GIPoint>(context, instance, size, bakeParams, [&](const std::vector<GIPoint>& bakePoints)
     {
-        BitmapHelper::createAndPaint(bakePoints, size, size, PAINT_FLAGS_COLOR),
-        BitmapHelper::createAndPaint(bakePoints, size, size, PAINT_FLAGS_SHADOW)
-    };
+        BitmapHelper::paint(*pair.lightMap, bakePoints, PAINT_FLAGS_COLOR);
+        BitmapHelper::paint(*pair.shadowMap, bakePoints, PAINT_FLAGS_SHADOW);
+
+        if (pair.albedoMap != nullptr)
+        {
+            BitmapHelper::paint(*pair.albedoMap, bakePoints, PAINT_FLAGS_ALBEDO);
+            BitmapHelper::paint(*pair.normalMap, bakePoints, PAINT_FLAGS_NORMAL);
+        }
+    });
+
+    return pair;
 }
\ No newline at end of file
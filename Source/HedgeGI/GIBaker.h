@@ -12,6 +12,10 @@ struct GIPair
 {
     std::unique_ptr<Bitmap> lightMap;
     std::unique_ptr<Bitmap> shadowMap;
+
+    // Denoiser guides, only baked when the bake parameters ask for them
+    std::unique_ptr<Bitmap> albedoMap;
+    std::unique_ptr<Bitmap> normalMap;
 };
 
 class GIBaker
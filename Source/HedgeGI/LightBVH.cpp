@@ -19,6 +19,8 @@ std::unique_ptr<LightBVH::Node> LightBVH::build(const std::vector<const Light*>&
         return nullptr;
 
     AABB aabb;
+    AABB lightAabb;
+    float power = 0.0f;
 
     for (auto& item : lights)
     {
@@ -27,12 +29,18 @@ std::unique_ptr<LightBVH::Node> LightBVH::build(const std::vector<const Light*>&
 
         aabb.extend(item->position - vec3);
         aabb.extend(item->position + vec3);
+
+        lightAabb.extend(item->position);
+        power += item->color.abs().maxCoeff();
     }
 
     std::unique_ptr<Node> node = std::make_unique<Node>();
     node->aabb = aabb;
     node->center = aabb.center();
     node->radius = (aabb.min() - aabb.max()).norm() / 2.0f;
+    node->lightCenter = lightAabb.center();
+    node->lightRadius = (lightAabb.min() - lightAabb.max()).norm() / 2.0f;
+    node->power = power;
 
     if (lights.size() == 1)
     {
@@ -94,6 +102,11 @@ const Light* LightBVH::getSunLight() const
     return sunLight;
 }
 
+bool LightBVH::hasLocalLights() const
+{
+    return node != nullptr;
+}
+
 void LightBVH::reset()
 {
     sunLight = nullptr;
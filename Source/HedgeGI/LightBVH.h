@@ -1,6 +1,7 @@
 ﻿#pragma once
 
-class Light;
+#include "Light.h"
+
 struct Frustum;
 class Scene;
 
@@ -14,11 +15,59 @@ class LightBVH
         float radius{};
         const Light* light {};
 
+        // Bounds of the light positions and summed intensity, used to estimate contribution
+        Vector3 lightCenter;
+        float lightRadius{};
+        float power{};
+
         std::unique_ptr<Node> left;
         std::unique_ptr<Node> right;
 
         bool contains(const Vector3& position) const;
         bool contains(const Frustum& frustum) const;
+
+        template<typename T>
+        float computeImportance(const Vector3& position, const Vector3& normal, const T& computeAttenuation) const
+        {
+            if (!contains(position))
+                return 0.0f;
+
+            if (light)
+            {
+                const Vector3 lightDirection = light->position - position;
+                const float distance = lightDirection.norm();
+
+                if (distance == 0.0f)
+                    return power;
+
+                const float cosTheta = normal.dot(lightDirection) / distance;
+                return cosTheta > 0.0f ? power * cosTheta * computeAttenuation(distance, light->range) : 0.0f;
+            }
+
+            const Vector3 centerDirection = lightCenter - position;
+            const float squaredDistance = centerDirection.squaredNorm();
+            const float squaredRadius = lightRadius * lightRadius;
+
+            // Smallest angle between the normal and the sphere bounding the lights
+            float cosBound = 1.0f;
+
+            if (squaredDistance > squaredRadius)
+            {
+                const float distance = sqrtf(squaredDistance);
+                const float cosTheta = std::min(1.0f, std::max(-1.0f, normal.dot(centerDirection) / distance));
+                const float sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
+                const float sinSphere = lightRadius / distance;
+                const float cosSphere = sqrtf(1.0f - sinSphere * sinSphere);
+
+                if (cosTheta < cosSphere)
+                    cosBound = cosTheta * cosSphere + sinTheta * sinSphere;
+
+                if (cosBound <= 0.0f)
+                    return 0.0f;
+            }
+
+            return power * cosBound / std::max(squaredDistance, std::max(squaredRadius, 1.0f));
+        }
     };
 
     std::unique_ptr<Node> node;
@@ -46,22 +95,13 @@ class LightBVH
         if (node.right) traverse(frustum, callback, *node.right);
     }
 
-    template<int N>
-    void traverse(const Vector3& position, std::array<const Light*, N>& lights, size_t& lightCount, const Node& node) const
-    {
-        if (lightCount == N || !node.contains(position)) return;
-
-        if (node.light) lights[lightCount++] = node.light;
-        if (node.left) traverse(position, lights, lightCount, *node.left);
-        if (node.right) traverse(position, lights, lightCount, *node.right);
-    }
-
 public:
     LightBVH();
     ~LightBVH();
 
     bool valid() const;
     const Light* getSunLight() const;
+    bool hasLocalLights() const;
 
     void reset();
     void build(const Scene& scene);
@@ -80,10 +120,44 @@ public:
         if (sunLight) callback(sunLight);
     }
 
-    template<int N>
-    void traverse(const Vector3& position, std::array<const Light*, N>& lights, size_t& lightCount) const
+    // Picks a single point light with probability proportional to its estimated contribution to the surface.
+    // Returns null if no light can reach it. The sun light is never picked and should be evaluated separately.
+    template<typename T>
+    const Light* sample(const Vector3& position, const Vector3& normal, float random, float& pdf, const T& computeAttenuation) const
     {
-        if (sunLight) lights[lightCount++] = sunLight;
-        if (node) traverse(position, lights, lightCount, *node);
+        if (!node || node->computeImportance(position, normal, computeAttenuation) <= 0.0f)
+            return nullptr;
+
+        const Node* current = node.get();
+        pdf = 1.0f;
+
+        while (!current->light)
+        {
+            const float leftImportance = current->left->computeImportance(position, normal, computeAttenuation);
+            const float rightImportance = current->right->computeImportance(position, normal, computeAttenuation);
+            const float importance = leftImportance + rightImportance;
+
+            if (importance <= 0.0f)
+                return nullptr;
+
+            const float leftProbability = leftImportance / importance;
+
+            if (random < leftProbability)
+            {
+                random /= leftProbability;
+                pdf *= leftProbability;
+                current = current->left.get();
+            }
+            else
+            {
+                random = (random - leftProbability) / (1.0f - leftProbability);
+                pdf *= 1.0f - leftProbability;
+                current = current->right.get();
+            }
+
+            random = std::min(random, 0.99999994f);
+        }
+
+        return current->light;
     }
 };
@@ -13,6 +13,11 @@ struct LightFieldPoint : BakePoint<8, BAKE_POINT_FLAGS_SHADOW>
         return sampleSphere(index, sampleCount);
     }
 
+    static float pdfDirection(const Vector3& tangentSpaceDirection)
+    {
+        return 1.0f / (4.0f * PI);
+    }
+
     bool valid() const
     {
         return true;
@@ -46,16 +51,16 @@ namespace
     {
         PointQueryFuncUserData* userData = (PointQueryFuncUserData*)args->userPtr;
 
-        const Mesh& mesh = *userData->scene->meshes[args->geomID];
+        const Mesh& mesh = *userData->scene->meshes[getMeshIndex(args->geomID, args->context->instID[0])];
         const Triangle& triangle = mesh.triangles[args->primID];
-        const Vertex& a = mesh.vertices[triangle.a];
-        const Vertex& b = mesh.vertices[triangle.b];
-        const Vertex& c = mesh.vertices[triangle.c];
+        const Vector3 a = mesh.bakeVertices[triangle.a].position;
+        const Vector3 b = mesh.bakeVertices[triangle.b].position;
+        const Vector3 c = mesh.bakeVertices[triangle.c].position;
 
         AABB aabb;
-        aabb.extend(a.position);
-        aabb.extend(b.position);
-        aabb.extend(c.position);
+        aabb.extend(a);
+        aabb.extend(b);
+        aabb.extend(c);
 
         if (userData->aabb.intersects(aabb))
         {
@@ -63,9 +68,9 @@ namespace
 
             for (size_t i = 0; i < 8; i++)
             {
-                const Vector3 closestPoint = closestPointTriangle(userData->corners[i], a.position, b.position, c.position);
-                const Vector2 baryUV = getBarycentricCoords(closestPoint, a.position, b.position, c.position);
-                const Vector3 normal = barycentricLerp(a.normal, b.normal, c.normal, baryUV);
+                const Vector3 closestPoint = closestPointTriangle(userData->corners[i], a, b, c);
+                const Vector2 baryUV = getBarycentricCoords(closestPoint, a, b, c);
+                const Vector3 normal = barycentricLerp(mesh.getNormal(triangle.a), mesh.getNormal(triangle.b), mesh.getNormal(triangle.c), baryUV);
 
                 const float distance = (closestPoint - userData->corners[i]).squaredNorm();
                 if (userData->distances[i] < distance)
@@ -0,0 +1,34 @@
+﻿#include "MappedFile.h"
+
+MappedFile::MappedFile(const std::string& filePath)
+{
+    WCHAR wideCharFilePath[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, NULL, filePath.c_str(), -1, wideCharFilePath, MAX_PATH);
+
+    file = CreateFileW(wideCharFilePath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        return;
+
+    mapping = CreateFileMappingW(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (mapping == nullptr)
+        return;
+
+    data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    size = data != nullptr ? (size_t)fileSize.QuadPart : 0;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+}
@@ -0,0 +1,32 @@
+﻿#pragma once
+
+// Read only view of a whole file. Pages are mapped copy-on-write, so anything pointing into
+// the view can still be written to without touching the file.
+class MappedFile
+{
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping {};
+    uint8_t* data {};
+    size_t size {};
+
+public:
+    MappedFile(const std::string& filePath);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    bool isOpen() const
+    {
+        return data != nullptr;
+    }
+
+    uint8_t* getData() const
+    {
+        return data;
+    }
+
+    size_t getSize() const
+    {
+        return size;
+    }
+};
@@ -192,6 +192,68 @@ inline Vector2 sampleVogelDisk(const size_t index, const size_t sampleCount, con
     return { radius * std::cos(theta), radius * std::sin(theta) };
 }
 
+// https://knarkowicz.wordpress.com/2014/04/16/octahedron-normal-vector-encoding/
+
+inline Vector2 octahedralEncode(const Vector3& direction)
+{
+    const float l1 = std::abs(direction.x()) + std::abs(direction.y()) + std::abs(direction.z());
+
+    float x = direction.x() / l1;
+    float y = direction.y() / l1;
+
+    if (direction.z() < 0.0f)
+    {
+        const float tmp = x;
+        x = (1.0f - std::abs(y)) * (tmp >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - std::abs(tmp)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    return { x * 0.5f + 0.5f, y * 0.5f + 0.5f };
+}
+
+inline Vector3 octahedralDecode(const Vector2& value)
+{
+    const float x = value.x() * 2.0f - 1.0f;
+    const float y = value.y() * 2.0f - 1.0f;
+    const float z = 1.0f - std::abs(x) - std::abs(y);
+    const float t = std::max(-z, 0.0f);
+
+    return Vector3(x + (x >= 0.0f ? -t : t), y + (y >= 0.0f ? -t : t), z).normalized();
+}
+
+inline uint32_t packUnorm16x2(const Vector2& value)
+{
+    return (uint32_t)(saturate(value.x()) * 65535.0f + 0.5f) | (uint32_t)(saturate(value.y()) * 65535.0f + 0.5f) << 16;
+}
+
+inline Vector2 unpackUnorm16x2(const uint32_t value)
+{
+    return { (float)(value & 0xFFFF) / 65535.0f, (float)(value >> 16) / 65535.0f };
+}
+
+inline uint32_t packUnorm8x4(const Color4& value)
+{
+    return 
+        (uint32_t)(saturate(value.x()) * 255.0f + 0.5f) |
+        (uint32_t)(saturate(value.y()) * 255.0f + 0.5f) << 8 |
+        (uint32_t)(saturate(value.z()) * 255.0f + 0.5f) << 16 |
+        (uint32_t)(saturate(value.w()) * 255.0f + 0.5f) << 24;
+}
+
+inline Color4 unpackUnorm8x4(const uint32_t value)
+{
+    return Color4(
+        (float)(value & 0xFF),
+        (float)((value >> 8) & 0xFF),
+        (float)((value >> 16) & 0xFF),
+        (float)(value >> 24)) / 255.0f;
+}
+
+inline float getLuminance(const Color3& color)
+{
+    return color.x() * 0.2126f + color.y() * 0.7152f + color.z() * 0.0722f;
+}
+
 template<typename T>
 inline T fresnelSchlick(const T& F0, const float cosTheta)
 {
@@ -1,5 +1,6 @@
 ﻿#include "Mesh.h"
 
+#include "BakeParams.h"
 #include "Material.h"
 #include "Math.h"
 #include "RaytracingDevice.h"
@@ -21,28 +22,146 @@ void Mesh::buildAABB()
     aabb.setEmpty();
 
     for (size_t i = 0; i < vertexCount; i++)
-        aabb.extend(vertices[i].position);
+        aabb.extend(Vector3(bakeVertices[i].position));
+}
+
+void Mesh::buildBakeVertices()
+{
+    bakeVertices = std::make_unique<BakeVertex[]>(vertexCount);
+
+    for (uint32_t i = 0; i < vertexCount; i++)
+        bakeVertices[i] = { Eigen::Vector3f(vertices[i].position), vertices[i].vPos };
+}
+
+void Mesh::buildTraceGeometry()
+{
+    // Embree reads vertices with 16 byte loads, so pad the last position by a float
+    traceGeometry.positions = std::make_unique<float[]>(vertexCount * 3 + 1);
+    traceGeometry.normals = std::make_unique<uint32_t[]>(vertexCount);
+    traceGeometry.tangents = std::make_unique<uint32_t[]>(vertexCount);
+    traceGeometry.binormals = std::make_unique<uint32_t[]>(vertexCount);
+    traceGeometry.uvs = std::make_unique<uint32_t[]>(vertexCount);
+    traceGeometry.colors = std::make_unique<uint32_t[]>(vertexCount);
+
+    // UVs can tile far outside of 0-1, quantize them over the range of the mesh instead of using half floats
+    Vector2 uvMin(INFINITY, INFINITY);
+    Vector2 uvMax(-INFINITY, -INFINITY);
+
+    for (uint32_t i = 0; i < vertexCount; i++)
+    {
+        uvMin = uvMin.cwiseMin(vertices[i].uv);
+        uvMax = uvMax.cwiseMax(vertices[i].uv);
+    }
+
+    if (vertexCount == 0)
+        uvMin = uvMax = Vector2::Zero();
+
+    traceGeometry.uvMin = uvMin;
+    traceGeometry.uvScale = uvMax - uvMin;
+
+    const Vector2 uvScaleInv(
+        traceGeometry.uvScale.x() > 0.0f ? 1.0f / traceGeometry.uvScale.x() : 0.0f,
+        traceGeometry.uvScale.y() > 0.0f ? 1.0f / traceGeometry.uvScale.y() : 0.0f);
+
+    for (uint32_t i = 0; i < vertexCount; i++)
+    {
+        const Vertex& vertex = vertices[i];
+
+        traceGeometry.positions[i * 3 + 0] = vertex.position.x();
+        traceGeometry.positions[i * 3 + 1] = vertex.position.y();
+        traceGeometry.positions[i * 3 + 2] = vertex.position.z();
+
+        traceGeometry.normals[i] = packUnorm16x2(octahedralEncode(vertex.normal));
+        traceGeometry.tangents[i] = packUnorm16x2(octahedralEncode(vertex.tangent));
+        traceGeometry.binormals[i] = packUnorm16x2(octahedralEncode(vertex.binormal));
+        traceGeometry.uvs[i] = packUnorm16x2((vertex.uv - uvMin).cwiseProduct(uvScaleInv));
+        traceGeometry.colors[i] = packUnorm8x4(vertex.color);
+    }
+
+    // Everything else reads the trace geometry and bake vertices from now on
+    vertices = nullptr;
+}
+
+void Mesh::buildOpacityMicromaps()
+{
+    opacityMicromaps[(size_t)TargetEngine::HE1].build(*this, TargetEngine::HE1);
+    opacityMicromaps[(size_t)TargetEngine::HE2].build(*this, TargetEngine::HE2);
+}
+
+bool Mesh::setPrototype(const Mesh* prototype, const Affine3& transformation, const Matrix3& rotation)
+{
+    if (prototype->vertexCount != vertexCount || prototype->triangleCount != triangleCount || 
+        prototype->material != material || prototype->type != type)
+        return false;
+
+    const Matrix3 linear = transformation.linear();
+    const float determinant = linear.determinant();
+
+    if (std::abs(determinant) < 0.000001f)
+        return false;
+
+    if (memcmp(prototype->triangles.get(), triangles.get(), sizeof(Triangle) * triangleCount) != 0)
+        return false;
+
+    // Make sure the geometry actually matches, the source data might not be unique
+    for (uint32_t i = 0; i < vertexCount; i++)
+    {
+        const Eigen::Vector3f position = transformation * prototype->bakeVertices[i].position;
+
+        if ((position - bakeVertices[i].position).norm() > 0.001f * std::max(1.0f, bakeVertices[i].position.norm()))
+            return false;
+    }
+
+    this->prototype = prototype;
+    prototypeTransformation = transformation;
+    prototypeRotation = rotation;
+
+    // Transforming the edges of a triangle scales its geometry normal by the cofactor matrix, 
+    // this keeps the winding of mirrored placements intact
+    prototypeCofactor = determinant * linear.inverse().transpose();
+
+    return true;
+}
+
+unsigned Mesh::getRayMask() const
+{
+    if (material != nullptr && material->type == MaterialType::Sky)
+        return RAY_MASK_SKY;
+
+    if (type == MeshType::Transparent)
+        return RAY_MASK_TRANS;
+
+    if (type == MeshType::Punch)
+        return RAY_MASK_PUNCH_THROUGH;
+
+    return RAY_MASK_OPAQUE;
 }
 
 RTCGeometry Mesh::createRTCGeometry() const
 {
     const RTCGeometry rtcGeometry = rtcNewGeometry(RaytracingDevice::get(), RTC_GEOMETRY_TYPE_TRIANGLE);
 
-    rtcSetSharedGeometryBuffer(rtcGeometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, vertices.get(), 0, sizeof(Vertex), vertexCount);
+    rtcSetSharedGeometryBuffer(rtcGeometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, traceGeometry.positions.get(), 0, sizeof(float) * 3, vertexCount);
     rtcSetSharedGeometryBuffer(rtcGeometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, triangles.get(), 0, sizeof(Triangle), triangleCount);
 
-    unsigned geometryMask = RAY_MASK_OPAQUE;
+    rtcSetGeometryMask(rtcGeometry, getRayMask());
+    rtcCommitGeometry(rtcGeometry);
 
-    if (material != nullptr && material->type == MaterialType::Sky)
-        geometryMask = RAY_MASK_SKY;
+    return rtcGeometry;
+}
+
+RTCGeometry Mesh::createRTCInstance(const RTCScene rtcScene) const
+{
+    const RTCGeometry rtcGeometry = rtcNewGeometry(RaytracingDevice::get(), RTC_GEOMETRY_TYPE_INSTANCE);
 
-    else if (type == MeshType::Transparent)
-        geometryMask = RAY_MASK_TRANS;
+    Eigen::Matrix<float, 3, 4> transformation = Eigen::Matrix<float, 3, 4>::Identity();
 
-    else if (type == MeshType::Punch)
-        geometryMask = RAY_MASK_PUNCH_THROUGH;
+    if (prototype != nullptr)
+        transformation = prototypeTransformation.matrix().topRows<3>();
 
-    rtcSetGeometryMask(rtcGeometry, geometryMask);
+    rtcSetGeometryInstancedScene(rtcGeometry, rtcScene);
+    rtcSetGeometryTransform(rtcGeometry, 0, RTC_FORMAT_FLOAT3X4_COLUMN_MAJOR, transformation.data());
+    rtcSetGeometryMask(rtcGeometry, getRayMask());
     rtcCommitGeometry(rtcGeometry);
 
     return rtcGeometry;
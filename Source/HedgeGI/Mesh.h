@@ -1,5 +1,8 @@
 ﻿#pragma once
 
+#include "Math.h"
+#include "OpacityMicromap.h"
+
 class Material;
 
 struct Vertex
@@ -16,6 +19,13 @@ struct Vertex
 };
 
 
+// The part of a vertex bake points and seams need, kept for the lifetime of the mesh
+struct BakeVertex
+{
+    Eigen::Vector3f position;
+    Vector2 vPos;
+};
+
 struct Triangle
 {
     uint32_t a{};
@@ -31,19 +41,142 @@ enum class MeshType
     Special
 };
 
+// Vertex attributes read while tracing, stored in separate quantized streams
+// so a hit only touches the data it interpolates.
+struct TraceGeometry
+{
+    std::unique_ptr<float[]> positions; // Packed float3, padded for Embree
+    std::unique_ptr<uint32_t[]> normals; // Octahedral, unorm16x2
+    std::unique_ptr<uint32_t[]> tangents;
+    std::unique_ptr<uint32_t[]> binormals;
+    std::unique_ptr<uint32_t[]> uvs; // unorm16x2, relative to uvMin/uvScale
+    std::unique_ptr<uint32_t[]> colors; // unorm8x4
+
+    Vector2 uvMin;
+    Vector2 uvScale;
+
+    Vector3 getPosition(const uint32_t index) const
+    {
+        return Vector3(positions[index * 3 + 0], positions[index * 3 + 1], positions[index * 3 + 2]);
+    }
+
+    Vector3 getNormal(const uint32_t index) const
+    {
+        return octahedralDecode(unpackUnorm16x2(normals[index]));
+    }
+
+    Vector3 getTangent(const uint32_t index) const
+    {
+        return octahedralDecode(unpackUnorm16x2(tangents[index]));
+    }
+
+    Vector3 getBinormal(const uint32_t index) const
+    {
+        return octahedralDecode(unpackUnorm16x2(binormals[index]));
+    }
+
+    Vector2 getUV(const uint32_t index) const
+    {
+        return uvMin + unpackUnorm16x2(uvs[index]).cwiseProduct(uvScale);
+    }
+
+    Color4 getColor(const uint32_t index) const
+    {
+        return unpackUnorm8x4(colors[index]);
+    }
+};
+
+// Frees mesh arrays unless they point into a scene cache, which owns them instead
+struct MeshArrayDeleter
+{
+    bool mapped{};
+
+    MeshArrayDeleter() = default;
+
+    template<typename T>
+    MeshArrayDeleter(const std::default_delete<T[]>&)
+    {
+    }
+
+    template<typename T>
+    void operator()(T* array) const
+    {
+        if (!mapped)
+            delete[] array;
+    }
+};
+
 class Mesh
 {
 public:
     MeshType type{};
     uint32_t vertexCount{};
     uint32_t triangleCount{};
-    std::unique_ptr<Vertex[]> vertices;
-    std::unique_ptr<Triangle[]> triangles;
+    std::unique_ptr<Vertex[], MeshArrayDeleter> vertices; // Released once the trace geometry is built
+    std::unique_ptr<BakeVertex[], MeshArrayDeleter> bakeVertices;
+    std::unique_ptr<Triangle[], MeshArrayDeleter> triangles;
     const Material* material{};
     AABB aabb;
+    TraceGeometry traceGeometry;
+    OpacityMicromap opacityMicromaps[2]; // Per target engine, alpha is computed differently
+
+    // Placements of the same model mesh share the trace geometry of the first placement, the prototype.
+    // The transformations map from the prototype to this mesh and are only valid when prototype is set.
+    const Mesh* prototype{};
+    Affine3 prototypeTransformation;
+    Matrix3 prototypeRotation; // Normals, tangents and binormals
+    Matrix3 prototypeCofactor; // Geometry normals
 
     void buildAABB();
+    void buildBakeVertices();
+    void buildTraceGeometry();
+    void buildOpacityMicromaps();
+    bool setPrototype(const Mesh* prototype, const Affine3& transformation, const Matrix3& rotation);
+
+    const TraceGeometry& getTraceGeometry() const
+    {
+        return prototype != nullptr ? prototype->traceGeometry : traceGeometry;
+    }
+
+    const OpacityMicromap& getOpacityMicromap(const TargetEngine targetEngine) const
+    {
+        return (prototype != nullptr ? prototype->opacityMicromaps : opacityMicromaps)[(size_t)targetEngine];
+    }
+
+    Vector3 fromPrototypePosition(const Vector3& position) const
+    {
+        return prototypeTransformation * Eigen::Vector3f(position);
+    }
+
+    Vector3 fromPrototypeDirection(const Vector3& direction) const
+    {
+        return prototypeRotation * Eigen::Vector3f(direction);
+    }
+
+    Vector3 fromPrototypeGeometryNormal(const Vector3& normal) const
+    {
+        return prototypeCofactor * Eigen::Vector3f(normal);
+    }
+
+    // World space shading frame of a vertex, valid once the trace geometry is built
+    Vector3 getNormal(const uint32_t index) const
+    {
+        return prototype != nullptr ? fromPrototypeDirection(prototype->traceGeometry.getNormal(index)) : traceGeometry.getNormal(index);
+    }
+
+    Vector3 getTangent(const uint32_t index) const
+    {
+        return prototype != nullptr ? fromPrototypeDirection(prototype->traceGeometry.getTangent(index)) : traceGeometry.getTangent(index);
+    }
+
+    Vector3 getBinormal(const uint32_t index) const
+    {
+        return prototype != nullptr ? fromPrototypeDirection(prototype->traceGeometry.getBinormal(index)) : traceGeometry.getBinormal(index);
+    }
+
+    unsigned getRayMask() const;
     RTCGeometry createRTCGeometry() const;
+    RTCGeometry createRTCInstance(RTCScene rtcScene) const;
     void generateTangents() const;
 };
 
@@ -5,7 +5,7 @@
 #include "MetaInstancer.h"
 #include "SnapToClosestTriangle.h"
 
-struct MetaInstancerPoint : BakePoint<1, BAKE_POINT_FLAGS_SHADOW | BAKE_POINT_FLAGS_SOFT_SHADOW>
+struct MetaInstancerPoint : BakePoint<1, BAKE_POINT_FLAGS_SHADOW | BAKE_POINT_FLAGS_SOFT_SHADOW | BAKE_POINT_FLAGS_ADAPTIVE_SAMPLING>
 {
     void addSample(const Color3& color, const Vector3& worldSpaceDirection)
     {
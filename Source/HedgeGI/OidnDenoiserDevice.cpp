@@ -5,52 +5,160 @@
 #include "Logger.h"
 #include <OpenImageDenoise/oidn.h>
 
-CriticalSection OidnDenoiserDevice::criticalSection;
-bool OidnDenoiserDevice::initialized;
-OIDNDevice OidnDenoiserDevice::device;
 const bool OidnDenoiserDevice::available = true;
 
-std::unique_ptr<Bitmap> OidnDenoiserDevice::denoise(const Bitmap& bitmap, bool denoiseAlpha)
+namespace
 {
+    // A single filter execution stops scaling well past this many threads on lightmap sized images,
+    // so the cores get split between several devices instead.
+    constexpr size_t THREADS_PER_DEVICE = 8;
+
+    // OIDN splits images exceeding this budget into overlapping tiles on its own.
+    constexpr int MAX_MEMORY_MB = 1024;
+
+    class DenoiserSlot
     {
-        std::lock_guard<CriticalSection> lock(criticalSection);
+    public:
+        OIDNDevice device;
+        phmap::flat_hash_map<uint64_t, OIDNFilter> filters;
 
-        if (!initialized)
+        DenoiserSlot(const size_t threadCount)
         {
+            // The thread count only applies when the default device is the CPU
             device = oidnNewDevice(OIDN_DEVICE_TYPE_DEFAULT);
+            oidnSetDevice1i(device, "numThreads", (int)threadCount);
             oidnCommitDevice(device);
+        }
+
+        ~DenoiserSlot()
+        {
+            for (auto& [key, filter] : filters)
+                oidnReleaseFilter(filter);
+
+            oidnReleaseDevice(device);
+        }
+
+        // Filters get reused across bitmaps of the same size so the network is only set up once.
+        // RTLightmap takes no auxiliary images, guided bitmaps go through the generic filter instead
+        OIDNFilter getFilter(const size_t width, const size_t height, const bool guided)
+        {
+            OIDNFilter& filter = filters[(uint64_t)width << 33 | (uint64_t)height << 1 | (uint64_t)guided];
+
+            if (filter == nullptr)
+            {
+                filter = oidnNewFilter(device, guided ? "RT" : "RTLightmap");
+                oidnSetFilter1b(filter, "hdr", true);
+                oidnSetFilter1i(filter, "maxMemoryMB", MAX_MEMORY_MB);
+            }
+
+            return filter;
+        }
+    };
+
+    class DenoiserPool
+    {
+        CriticalSection criticalSection;
+        std::vector<std::unique_ptr<DenoiserSlot>> slots;
+        tbb::concurrent_queue<DenoiserSlot*> freeSlots;
+        size_t slotCount;
+        size_t threadsPerSlot;
+
+    public:
+        DenoiserPool()
+        {
+            const size_t threadCount = std::max<size_t>(1, tbb::info::default_concurrency());
+
+            slotCount = std::max<size_t>(1, threadCount / THREADS_PER_DEVICE);
+            threadsPerSlot = threadCount / slotCount;
+
+            for (size_t i = 0; i < slotCount; i++)
+            {
+                slots.push_back(std::make_unique<DenoiserSlot>(threadsPerSlot));
+                freeSlots.push(slots.back().get());
+            }
+        }
+
+        size_t getSlotCount() const
+        {
+            return slotCount;
+        }
+
+        // Callers run inside TBB tasks, where waiting for a slot would park the worker and could starve the flow graph.
+        // An extra slot gets created instead, denoise nodes are limited to the slot count so this only happens with outside callers.
+        DenoiserSlot* acquire()
+        {
+            DenoiserSlot* slot;
+            if (freeSlots.try_pop(slot))
+                return slot;
 
-            std::atexit([]() { oidnReleaseDevice(device); });
+            std::lock_guard lock(criticalSection);
 
-            initialized = true;
+            slots.push_back(std::make_unique<DenoiserSlot>(threadsPerSlot));
+            return slots.back().get();
         }
+
+        void release(DenoiserSlot* slot)
+        {
+            freeSlots.push(slot);
+        }
+    };
+
+    DenoiserPool& getPool()
+    {
+        static DenoiserPool pool;
+        return pool;
     }
+}
+
+size_t OidnDenoiserDevice::getConcurrency()
+{
+    return getPool().getSlotCount();
+}
+
+std::unique_ptr<Bitmap> OidnDenoiserDevice::denoise(const Bitmap& bitmap, bool denoiseAlpha, const Bitmap* albedoMap, const Bitmap* normalMap)
+{
+    // Denoising happens in place on a copy, only RGB gets written back so alpha is carried over as is
+    // TODO: Denoise alpha
+    std::unique_ptr<Bitmap> denoised = std::make_unique<Bitmap>(bitmap, true);
 
-    std::unique_ptr<Bitmap> denoised = std::make_unique<Bitmap>(bitmap, false);
+    DenoiserPool& pool = getPool();
+
+    const bool guided = albedoMap != nullptr && normalMap != nullptr;
+
+    // The slices share one slot, every filter execution already runs on all threads of its device
+    DenoiserSlot* slot = pool.acquire();
 
     for (size_t i = 0; i < bitmap.arraySize; i++)
     {
-        OIDNFilter filter = oidnNewFilter(device, "RTLightmap");
-        oidnSetSharedFilterImage(filter, "color", bitmap.getColorPtr(bitmap.width * bitmap.height * i), OIDN_FORMAT_FLOAT3, bitmap.width, bitmap.height, 0, sizeof(Color4), 0);
-        oidnSetSharedFilterImage(filter, "output", denoised->getColorPtr(denoised->width * denoised->height * i), OIDN_FORMAT_FLOAT3, denoised->width, denoised->height, 0, sizeof(Color4), 0);
-        oidnSetFilter1b(filter, "hdr", true);
+        void* data = denoised->getColorPtr(denoised->width * denoised->height * i);
+
+        OIDNFilter filter = slot->getFilter(denoised->width, denoised->height, guided);
+        oidnSetSharedFilterImage(filter, "color", data, OIDN_FORMAT_FLOAT3, denoised->width, denoised->height, 0, sizeof(Color4), 0);
+        oidnSetSharedFilterImage(filter, "output", data, OIDN_FORMAT_FLOAT3, denoised->width, denoised->height, 0, sizeof(Color4), 0);
+
+        if (guided)
+        {
+            oidnSetSharedFilterImage(filter, "albedo", albedoMap->getColorPtr(0), OIDN_FORMAT_FLOAT3, albedoMap->width, albedoMap->height, 0, sizeof(Color4), 0);
+            oidnSetSharedFilterImage(filter, "normal", normalMap->getColorPtr(0), OIDN_FORMAT_FLOAT3, normalMap->width, normalMap->height, 0, sizeof(Color4), 0);
+        }
         oidnCommitFilter(filter);
         oidnExecuteFilter(filter);
 
         const char* errorMessage;
-        if (oidnGetDeviceError(device, &errorMessage) != OIDN_ERROR_NONE)
+        if (oidnGetDeviceError(slot->device, &errorMessage) != OIDN_ERROR_NONE)
             Logger::logFormatted(LogType::Error, "OIDN Error: %s\n", errorMessage);
-
-        oidnReleaseFilter(filter);
     }
 
-    // TODO: Denoise alpha
-    for (size_t i = 0; i < bitmap.width * bitmap.height * bitmap.arraySize; i++)
-        denoised->setAlpha(bitmap.getAlpha(i), i);
+    pool.release(slot);
 
     return denoised;
 }
 
 #else
 const bool OidnDenoiserDevice::available = false;
+
+size_t OidnDenoiserDevice::getConcurrency()
+{
+    return 1;
+}
 #endif
\ No newline at end of file
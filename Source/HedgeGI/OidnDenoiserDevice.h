@@ -2,16 +2,14 @@
 
 class Bitmap;
 
-typedef struct OIDNDeviceImpl* OIDNDevice;
-
 class OidnDenoiserDevice
 {
 public:
-    static CriticalSection criticalSection;
-    static bool initialized;
-    static OIDNDevice device;
-
     static const bool available;
 
-    static std::unique_ptr<Bitmap> denoise(const Bitmap& bitmap, bool denoiseAlpha = false);
+    // Amount of bitmaps that can be denoised side by side without oversubscribing the CPU.
+    static size_t getConcurrency();
+
+    static std::unique_ptr<Bitmap> denoise(const Bitmap& bitmap, bool denoiseAlpha = false,
+        const Bitmap* albedoMap = nullptr, const Bitmap* normalMap = nullptr);
 };
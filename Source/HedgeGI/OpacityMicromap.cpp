@@ -0,0 +1,236 @@
+﻿#include "OpacityMicromap.h"
+
+#include "BakeParams.h"
+#include "Bitmap.h"
+#include "Material.h"
+#include "Mesh.h"
+
+namespace
+{
+    // Footprints larger than this are left unknown, the texture fetches in the filter are cheaper than scanning them
+    constexpr size_t MAX_FOOTPRINT_TEXEL_COUNT = 65536;
+
+    struct AlphaRange
+    {
+        float min;
+        float max;
+
+        AlphaRange(const float min, const float max) : min(min), max(max)
+        {
+        }
+
+        AlphaRange operator*(const AlphaRange& other) const
+        {
+            const float a = min * other.min;
+            const float b = min * other.max;
+            const float c = max * other.min;
+            const float d = max * other.max;
+
+            return { std::min(std::min(a, b), std::min(c, d)), std::max(std::max(a, b), std::max(c, d)) };
+        }
+
+        // Range of a lerp between both with a factor in 0-1
+        AlphaRange operator|(const AlphaRange& other) const
+        {
+            return { std::min(min, other.min), std::max(max, other.max) };
+        }
+    };
+
+    // Texel range touched by point and bilinear sampling along one axis, before wrapping
+    void getTexelRange(const float coordMin, const float coordMax, const uint32_t size, int64_t& begin, int64_t& end)
+    {
+        begin = (int64_t)std::floor(coordMin * (float)size - 0.01f);
+        end = (int64_t)std::floor(coordMax * (float)size + 0.01f) + 1;
+
+        if (end - begin >= (int64_t)size)
+        {
+            begin = 0;
+            end = (int64_t)size - 1;
+        }
+    }
+
+    // The filter samples the first level of the trace texture, so that is what gets classified
+    bool getTextureAlphaRange(const Bitmap& bitmap, const Vector2& uvMin, const Vector2& uvMax, AlphaRange& range)
+    {
+        const TraceTexture& texture = bitmap.traceTexture;
+
+        if (!texture.valid())
+            return false;
+
+        int64_t xBegin, xEnd, yBegin, yEnd;
+        getTexelRange(uvMin.x(), uvMax.x(), texture.getWidth(), xBegin, xEnd);
+        getTexelRange(uvMin.y(), uvMax.y(), texture.getHeight(), yBegin, yEnd);
+
+        if ((size_t)(xEnd - xBegin + 1) * (size_t)(yEnd - yBegin + 1) > MAX_FOOTPRINT_TEXEL_COUNT)
+            return false;
+
+        range = { INFINITY, -INFINITY };
+
+        for (int64_t y = yBegin; y <= yEnd; y++)
+        {
+            for (int64_t x = xBegin; x <= xEnd; x++)
+            {
+                const float alpha = texture.getAlpha((uint32_t)x, (uint32_t)y);
+
+                range.min = std::min(range.min, alpha);
+                range.max = std::max(range.max, alpha);
+            }
+        }
+
+        return true;
+    }
+
+    // Mirrors intersectContextFilterAlpha with ranges instead of values
+    bool getAlphaRange(const Material& material, const TargetEngine targetEngine,
+        const Vector2& uvMin, const Vector2& uvMax, const AlphaRange& vertexRed, const AlphaRange& vertexAlpha, AlphaRange& range)
+    {
+        range = { 1.0f, 1.0f };
+
+        if (material.type == MaterialType::Common || material.type == MaterialType::Blend)
+        {
+            AlphaRange blend = vertexAlpha;
+
+            if (targetEngine != TargetEngine::HE2)
+            {
+                const float opacity = material.parameters.opacityReflectionRefractionSpecType.x();
+
+                range = range * AlphaRange(opacity, opacity) * vertexAlpha;
+                blend = vertexRed;
+            }
+
+            if (material.textures.diffuse != nullptr)
+            {
+                AlphaRange diffuseRange(0.0f, 1.0f);
+                if (!getTextureAlphaRange(*material.textures.diffuse, uvMin, uvMax, diffuseRange))
+                    return false;
+
+                if (material.type == MaterialType::Blend && material.textures.diffuseBlend != nullptr && blend.max > 0.0f)
+                {
+                    AlphaRange diffuseBlendRange(0.0f, 1.0f);
+                    if (!getTextureAlphaRange(*material.textures.diffuseBlend, uvMin, uvMax, diffuseBlendRange))
+                        return false;
+
+                    diffuseRange = blend.min < 1.0f ? diffuseRange | diffuseBlendRange : diffuseBlendRange;
+                }
+
+                range = range * diffuseRange;
+            }
+        }
+
+        else if (material.type == MaterialType::IgnoreLight)
+        {
+            const float diffuse = material.parameters.diffuse.w();
+            range = vertexAlpha * AlphaRange(diffuse, diffuse);
+
+            AlphaRange textureRange(0.0f, 1.0f);
+
+            if (material.textures.diffuse != nullptr)
+            {
+                if (!getTextureAlphaRange(*material.textures.diffuse, uvMin, uvMax, textureRange))
+                    return false;
+
+                range = range * textureRange;
+            }
+
+            if (material.textures.alpha != nullptr)
+            {
+                if (!getTextureAlphaRange(*material.textures.alpha, uvMin, uvMax, textureRange))
+                    return false;
+
+                range = range * textureRange;
+            }
+        }
+
+        return true;
+    }
+
+    OpacityState classify(const MeshType type, const AlphaRange& range)
+    {
+        // Punch rejects below 0.5, transparent rejects below a random number in 0-1
+        const float threshold = type == MeshType::Punch ? 0.5f : 1.0f;
+
+        if (range.min >= threshold)
+            return OpacityState::Opaque;
+
+        if (type == MeshType::Punch ? range.max < 0.5f : range.max <= 0.0f)
+            return OpacityState::Transparent;
+
+        return OpacityState::Unknown;
+    }
+}
+
+void OpacityMicromap::build(const Mesh& mesh, const TargetEngine targetEngine)
+{
+    states = nullptr;
+
+    if (mesh.material == nullptr || (mesh.type != MeshType::Punch && mesh.type != MeshType::Transparent))
+        return;
+
+    states = std::make_unique<uint32_t[]>(mesh.triangleCount);
+
+    const TraceGeometry& geometry = mesh.getTraceGeometry();
+    const Material& material = *mesh.material;
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, mesh.triangleCount), [&](const tbb::blocked_range<uint32_t>& range)
+    {
+        for (uint32_t i = range.begin(); i < range.end(); i++)
+        {
+            const Triangle& triangle = mesh.triangles[i];
+
+            const Vector2 uvA = geometry.getUV(triangle.a);
+            const Vector2 uvB = geometry.getUV(triangle.b);
+            const Vector2 uvC = geometry.getUV(triangle.c);
+
+            const Color4 colorA = geometry.getColor(triangle.a);
+            const Color4 colorB = geometry.getColor(triangle.b);
+            const Color4 colorC = geometry.getColor(triangle.c);
+
+            uint32_t triangleStates = 0;
+            uint32_t index = 0;
+
+            for (uint32_t y = 0; y < SUBDIVISION; y++)
+            {
+                for (uint32_t x = 0; x < SUBDIVISION - y; x++)
+                {
+                    for (uint32_t upper = 0; upper < (x + y < SUBDIVISION - 1 ? 2u : 1u); upper++)
+                    {
+                        const Vector2 corners[] =
+                        {
+                            Vector2((float)(x + upper), (float)(y + upper)) / (float)SUBDIVISION,
+                            Vector2((float)(x + 1), (float)y) / (float)SUBDIVISION,
+                            Vector2((float)x, (float)(y + 1)) / (float)SUBDIVISION
+                        };
+
+                        Vector2 uvMin(INFINITY, INFINITY);
+                        Vector2 uvMax(-INFINITY, -INFINITY);
+                        AlphaRange vertexRed(INFINITY, -INFINITY);
+                        AlphaRange vertexAlpha(INFINITY, -INFINITY);
+
+                        // Vertex attributes are linear over the micro-triangle, their extremes lie on the corners
+                        for (const auto& corner : corners)
+                        {
+                            const Vector2 uv = barycentricLerp(uvA, uvB, uvC, corner);
+                            const Color4 color = barycentricLerp(colorA, colorB, colorC, corner);
+
+                            uvMin = uvMin.cwiseMin(uv);
+                            uvMax = uvMax.cwiseMax(uv);
+
+                            vertexRed = { std::min(vertexRed.min, color.x()), std::max(vertexRed.max, color.x()) };
+                            vertexAlpha = { std::min(vertexAlpha.min, color.w()), std::max(vertexAlpha.max, color.w()) };
+                        }
+
+                        AlphaRange alphaRange(0.0f, 1.0f);
+
+                        const OpacityState state = getAlphaRange(material, targetEngine, uvMin, uvMax, vertexRed, vertexAlpha, alphaRange) ?
+                            classify(mesh.type, alphaRange) : OpacityState::Unknown;
+
+                        triangleStates |= (uint32_t)state << (index * 2);
+                        index++;
+                    }
+                }
+            }
+
+            states[i] = triangleStates;
+        }
+    });
+}
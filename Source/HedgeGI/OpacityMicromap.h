@@ -0,0 +1,51 @@
+﻿#pragma once
+
+class Mesh;
+enum class TargetEngine;
+
+enum class OpacityState : uint32_t
+{
+    Unknown,
+    Opaque,
+    Transparent
+};
+
+// Opacity of every triangle of an alpha tested or transparent mesh, split into micro-triangles over its barycentric domain.
+// Each micro-triangle is classified from the alpha range of its texture footprint, only unknown ones need texture fetches.
+class OpacityMicromap
+{
+    std::unique_ptr<uint32_t[]> states; // 2 bits per micro-triangle
+
+public:
+    static constexpr uint32_t SUBDIVISION = 4;
+    static constexpr uint32_t MICRO_TRIANGLE_COUNT = SUBDIVISION * SUBDIVISION;
+
+    static_assert(MICRO_TRIANGLE_COUNT * 2 <= 32);
+
+    bool valid() const
+    {
+        return states != nullptr;
+    }
+
+    void build(const Mesh& mesh, TargetEngine targetEngine);
+
+    OpacityState getState(const uint32_t primID, const float u, const float v) const
+    {
+        const float x = std::max(0.0f, u) * (float)SUBDIVISION;
+        const float y = std::max(0.0f, v) * (float)SUBDIVISION;
+
+        uint32_t i = std::min((uint32_t)x, SUBDIVISION - 1);
+        const uint32_t j = std::min((uint32_t)y, SUBDIVISION - 1);
+        uint32_t upper = (x - (float)i) + (y - (float)j) > 1.0f ? 1 : 0;
+
+        // The last cell of a row has no upper half, hits past the hypotenuse come from floating point error
+        if (i + j >= SUBDIVISION - 1)
+        {
+            i = SUBDIVISION - 1 - j;
+            upper = 0;
+        }
+
+        const uint32_t index = j * (2 * SUBDIVISION - j) + 2 * i + upper;
+        return (OpacityState)((states[primID] >> (index * 2)) & 3);
+    }
+};
@@ -13,6 +13,72 @@
 CriticalSection OptixDenoiserDevice::criticalSection;
 OptixDeviceContext OptixDenoiserDevice::context;
 OptixDenoiser OptixDenoiserDevice::denoiser;
+OptixDenoiser OptixDenoiserDevice::guidedDenoiser;
+
+namespace
+{
+    // Device buffers stay alive between calls and only get recreated when the bitmap size changes
+    struct OptixDenoiserBuffers
+    {
+        size_t width = 0;
+        size_t height = 0;
+        OptixDenoiserSizes sizes{};
+
+        CUdeviceptr intensity = 0;
+        CUdeviceptr scratch = 0;
+        CUdeviceptr state = 0;
+        CUdeviceptr input = 0;
+        CUdeviceptr output = 0;
+        CUdeviceptr albedo = 0;
+        CUdeviceptr normal = 0;
+
+        void release()
+        {
+            cudaFree((void*)intensity);
+            cudaFree((void*)scratch);
+            cudaFree((void*)state);
+            cudaFree((void*)input);
+            cudaFree((void*)output);
+            cudaFree((void*)albedo);
+            cudaFree((void*)normal);
+
+            intensity = scratch = state = input = output = albedo = normal = 0;
+            width = height = 0;
+        }
+
+        void prepare(OptixDenoiser denoiser, const size_t newWidth, const size_t newHeight, const bool guided)
+        {
+            if (width == newWidth && height == newHeight)
+                return;
+
+            release();
+
+            width = newWidth;
+            height = newHeight;
+
+            optixDenoiserComputeMemoryResources(denoiser, (unsigned)width, (unsigned)height, &sizes);
+
+            const size_t dataSize = width * height * sizeof(Color4);
+
+            cudaMalloc((void**)&intensity, sizeof(float));
+            cudaMalloc((void**)&scratch, sizes.withoutOverlapScratchSizeInBytes);
+            cudaMalloc((void**)&state, sizes.stateSizeInBytes);
+            cudaMalloc((void**)&input, dataSize);
+            cudaMalloc((void**)&output, dataSize);
+
+            if (guided)
+            {
+                cudaMalloc((void**)&albedo, dataSize);
+                cudaMalloc((void**)&normal, dataSize);
+            }
+
+            optixDenoiserSetup(denoiser, nullptr, (unsigned)width, (unsigned)height, state, sizes.stateSizeInBytes, scratch, sizes.withoutOverlapScratchSizeInBytes);
+        }
+    };
+
+    OptixDenoiserBuffers buffers;
+    OptixDenoiserBuffers guidedBuffers;
+}
 
 const bool OptixDenoiserDevice::available = []() 
 {
@@ -33,6 +99,11 @@ const bool OptixDenoiserDevice::available = []()
     const OptixDenoiserOptions options = {0, 0};
     optixDenoiserCreate(context, OPTIX_DENOISER_MODEL_KIND_HDR, &options, &denoiser);
 
+    const OptixDenoiserOptions guidedOptions = {1, 1};
+    optixDenoiserCreate(context, OPTIX_DENOISER_MODEL_KIND_HDR, &guidedOptions, &guidedDenoiser);
+
+    std::atexit([] { buffers.release(); guidedBuffers.release(); });
+    std::atexit([] { if (guidedDenoiser != nullptr) optixDenoiserDestroy(guidedDenoiser); });
     std::atexit([] { if (denoiser != nullptr) optixDenoiserDestroy(denoiser); });
     std::atexit([] { if (context != nullptr) optixDeviceContextDestroy(context); });
     std::atexit([] { cudaFree(nullptr); });
@@ -40,52 +111,52 @@ const bool OptixDenoiserDevice::available = []()
     return true;
 }();
 
-std::unique_ptr<Bitmap> OptixDenoiserDevice::denoise(const Bitmap& bitmap, const bool denoiseAlpha)
+std::unique_ptr<Bitmap> OptixDenoiserDevice::denoise(const Bitmap& bitmap, const bool denoiseAlpha, const Bitmap* albedoMap, const Bitmap* normalMap)
 {
     std::lock_guard lock(criticalSection);
 
     std::unique_ptr<Bitmap> denoised = std::make_unique<Bitmap>(bitmap, false);
 
-    OptixDenoiserSizes returnSizes;
-    optixDenoiserComputeMemoryResources(denoiser, (unsigned)bitmap.width, (unsigned)bitmap.height, &returnSizes);
+    const bool guided = albedoMap != nullptr && normalMap != nullptr;
 
-    CUdeviceptr intensity = 0;
-    CUdeviceptr scratch = 0;
-    CUdeviceptr state = 0;
+    // World space normals stand in for the view space ones OptiX expects, lightmaps have no view to speak of
+    const OptixDenoiser activeDenoiser = guided ? guidedDenoiser : denoiser;
+    OptixDenoiserBuffers& activeBuffers = guided ? guidedBuffers : buffers;
 
-    cudaMalloc((void**)&intensity, sizeof(float));
-    cudaMalloc((void**)&scratch, returnSizes.withoutOverlapScratchSizeInBytes);
-    cudaMalloc((void**)&state, returnSizes.stateSizeInBytes);
+    activeBuffers.prepare(activeDenoiser, bitmap.width, bitmap.height, guided);
 
-    const OptixDenoiserParams params = { (OptixDenoiserAlphaMode) denoiseAlpha, intensity, 0.0f, 0 };
+    const OptixDenoiserParams params = { (OptixDenoiserAlphaMode) denoiseAlpha, activeBuffers.intensity, 0.0f, 0 };
 
     const OptixImage2D imgTmp = { 0, (unsigned)bitmap.width, (unsigned)bitmap.height, (unsigned)(bitmap.width * sizeof(Color4)), sizeof(Color4), OPTIX_PIXEL_FORMAT_FLOAT4 };
 
     OptixDenoiserLayer layer = { imgTmp, {}, imgTmp };
-    const OptixDenoiserGuideLayer guideLayer = {};
+    OptixDenoiserGuideLayer guideLayer = {};
+
+    layer.input.data = activeBuffers.input;
+    layer.output.data = activeBuffers.output;
 
     const size_t dataSize = bitmap.width * bitmap.height * sizeof(Color4);
 
-    cudaMalloc((void**)&layer.input.data, dataSize);
-    cudaMalloc((void**)&layer.output.data, dataSize);
+    if (guided)
+    {
+        guideLayer.albedo = imgTmp;
+        guideLayer.albedo.data = activeBuffers.albedo;
+        guideLayer.normal = imgTmp;
+        guideLayer.normal.data = activeBuffers.normal;
 
-    optixDenoiserSetup(denoiser, nullptr, (unsigned)bitmap.width, (unsigned)bitmap.height, state, returnSizes.stateSizeInBytes, scratch, returnSizes.withoutOverlapScratchSizeInBytes);
+        cudaMemcpy((void*)activeBuffers.albedo, albedoMap->getColorPtr(0), dataSize, cudaMemcpyHostToDevice);
+        cudaMemcpy((void*)activeBuffers.normal, normalMap->getColorPtr(0), dataSize, cudaMemcpyHostToDevice);
+    }
 
     for (size_t i = 0; i < bitmap.arraySize; i++)
     {
         cudaMemcpy((void*)layer.input.data, bitmap.getColorPtr(bitmap.width * bitmap.height * i), dataSize, cudaMemcpyHostToDevice);
 
-        optixDenoiserComputeIntensity(denoiser, nullptr, &layer.input, intensity, scratch, returnSizes.withoutOverlapScratchSizeInBytes);
-        optixDenoiserInvoke(denoiser, nullptr, &params, state, returnSizes.stateSizeInBytes, &guideLayer, &layer, 1, 0, 0, scratch, returnSizes.withoutOverlapScratchSizeInBytes);
+        optixDenoiserComputeIntensity(activeDenoiser, nullptr, &layer.input, activeBuffers.intensity, activeBuffers.scratch, activeBuffers.sizes.withoutOverlapScratchSizeInBytes);
+        optixDenoiserInvoke(activeDenoiser, nullptr, &params, activeBuffers.state, activeBuffers.sizes.stateSizeInBytes, &guideLayer, &layer, 1, 0, 0, activeBuffers.scratch, activeBuffers.sizes.withoutOverlapScratchSizeInBytes);
 
         cudaMemcpy(denoised->getColorPtr(denoised->width * denoised->height * i), (void*)layer.output.data, dataSize, cudaMemcpyDeviceToHost);
     }
 
-    cudaFree((void*)intensity);
-    cudaFree((void*)scratch);
-    cudaFree((void*)state);
-    cudaFree((void*)layer.input.data);
-    cudaFree((void*)layer.output.data);
-
     return denoised;
 }
@@ -10,9 +10,11 @@ class OptixDenoiserDevice
     static CriticalSection criticalSection;
     static OptixDeviceContext context;
     static OptixDenoiser denoiser;
+    static OptixDenoiser guidedDenoiser; // Takes albedo and normal guide layers
 
 public:
     static const bool available;
 
-    static std::unique_ptr<Bitmap> denoise(const Bitmap& bitmap, bool denoiseAlpha = false);
+    static std::unique_ptr<Bitmap> denoise(const Bitmap& bitmap, bool denoiseAlpha = false,
+        const Bitmap* albedoMap = nullptr, const Bitmap* normalMap = nullptr);
 };
@@ -3,6 +3,8 @@
 // DirectX
 #include <DirectXTex.h>
 #include <DirectXPackedVector.h>
+#include <wincodec.h>
+#include <wrl/client.h>
 
 // tbb
 #include <oneapi/tbb.h>
@@ -1,8 +1,8 @@
 ﻿#include "PostRender.h"
 
 #include "BakeParams.h"
+#include "BlockCompressor.h"
 #include "CabinetCompression.h"
-#include "D3D11Device.h"
 #include "Game.h"
 #include "Logger.h"
 #include "Utilities.h"
@@ -204,7 +204,7 @@ void PostRender::createAtlasesRecursively(std::list<Texture>& textures, std::vec
     createAtlasesRecursively(textures, atlases);
 }
 
-hl::archive PostRender::createArchive(const std::string& inputDirectoryPath, TargetEngine targetEngine,
+hl::archive PostRender::createArchive(const std::string& inputDirectoryPath, TargetEngine targetEngine, BlockCompressionQuality compressionQuality,
     hl::hh::mirage::raw_gi_texture_group* group, hl::hh::mirage::raw_gi_texture_group_info_v2* groupInfo)
 {
     const std::string levelSuffix = "-level" + std::to_string(group->level);
@@ -461,37 +461,13 @@ hl::archive PostRender::createArchive(const std::string& inputDirectoryPath, Tar
             atlasImage.swap(tmpImage);
         }
 
-        if (targetEngine == TargetEngine::HE2 && !isBc4)
-        {
-            std::unique_ptr<DirectX::ScratchImage> tmpImage = std::make_unique<DirectX::ScratchImage>();
-            {
-                const auto lock = D3D11Device::lock();
-
-                DirectX::Compress(
-                    D3D11Device::get(),
-                    atlasImage->GetImages(),
-                    atlasImage->GetImageCount(),
-                    atlasImage->GetMetadata(),
-                    DXGI_FORMAT_BC6H_UF16,
-                    DirectX::TEX_COMPRESS_PARALLEL,
-                    DirectX::TEX_THRESHOLD_DEFAULT,
-                    *tmpImage);
-            }
-
-            atlasImage.swap(tmpImage);
-        }
-
-        else
         {
             std::unique_ptr<DirectX::ScratchImage> tmpImage = std::make_unique<DirectX::ScratchImage>();
 
-            DirectX::Compress(
-                atlasImage->GetImages(),
-                atlasImage->GetImageCount(),
-                atlasImage->GetMetadata(),
-                isBc4 ? DXGI_FORMAT_BC4_UNORM : DXGI_FORMAT_BC3_UNORM,
-                DirectX::TEX_COMPRESS_PARALLEL,
-                DirectX::TEX_THRESHOLD_DEFAULT,
+            BlockCompressor::compress(
+                *atlasImage,
+                targetEngine == TargetEngine::HE2 && !isBc4 ? DXGI_FORMAT_BC6H_UF16 : isBc4 ? DXGI_FORMAT_BC4_UNORM : DXGI_FORMAT_BC3_UNORM,
+                compressionQuality,
                 *tmpImage);
 
             atlasImage.swap(tmpImage);
@@ -568,7 +544,8 @@ std::vector<PostRender::Atlas> PostRender::createAtlases(std::list<Texture>& tex
     return atlases;
 }
 
-void PostRender::process(const std::string& stageDirectoryPath, const std::string& inputDirectoryPath, Game game, TargetEngine targetEngine)
+void PostRender::process(const std::string& stageDirectoryPath, const std::string& inputDirectoryPath, Game game, TargetEngine targetEngine,
+    BlockCompressionQuality compressionQuality)
 {
     const std::string stageName = getFileName(stageDirectoryPath);
 
@@ -654,7 +631,7 @@ void PostRender::process(const std::string& stageDirectoryPath, const std::strin
 
             hl::u32 memorySize = 0;
             {
-                const hl::archive archive = createArchive(inputDirectoryPath, targetEngine, group.get(), groupInfo);
+                const hl::archive archive = createArchive(inputDirectoryPath, targetEngine, compressionQuality, group.get(), groupInfo);
 
                 for (auto& entry : archive)
                     memorySize += (hl::u32)entry.size();
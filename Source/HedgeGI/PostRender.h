@@ -1,5 +1,6 @@
 ﻿#pragma once
 
+enum class BlockCompressionQuality;
 enum class Game;
 enum class TargetEngine;
 
@@ -31,8 +32,9 @@ public:
     static void createAtlasesRecursively(std::list<Texture>& textures, std::vector<Atlas>& atlases);
     static std::vector<Atlas> createAtlases(std::list<Texture>& textures);
 
-    static hl::archive createArchive(const std::string& inputDirectoryPath, TargetEngine targetEngine,
+    static hl::archive createArchive(const std::string& inputDirectoryPath, TargetEngine targetEngine, BlockCompressionQuality compressionQuality,
         hl::hh::mirage::raw_gi_texture_group* group, hl::hh::mirage::raw_gi_texture_group_info_v2* groupInfo);
 
-    static void process(const std::string& stageDirectoryPath, const std::string& inputDirectoryPath, Game game, TargetEngine targetEngine);
+    static void process(const std::string& stageDirectoryPath, const std::string& inputDirectoryPath, Game game, TargetEngine targetEngine,
+        BlockCompressionQuality compressionQuality);
 };
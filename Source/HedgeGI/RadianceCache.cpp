@@ -0,0 +1,116 @@
+﻿#include "RadianceCache.h"
+
+#include "Sampler.h"
+
+uint64_t RadianceCache::getKey(const Vector3& position, const Vector3& normal) const
+{
+    size_t axis;
+    normal.cwiseAbs().maxCoeff(&axis);
+
+    const uint32_t normalIndex = (uint32_t)axis * 2 + (normal[axis] < 0.0f ? 1 : 0);
+
+    const uint32_t x = (uint32_t)(int32_t)floorf(position.x() / cellSize);
+    const uint32_t y = (uint32_t)(int32_t)floorf(position.y() / cellSize);
+    const uint32_t z = (uint32_t)(int32_t)floorf(position.z() / cellSize);
+
+    const uint32_t low = Sampler::hashCombine(Sampler::hashCombine(Sampler::hash(x), y), Sampler::hashCombine(z, normalIndex));
+    const uint32_t high = Sampler::hashCombine(Sampler::hash(low), Sampler::hashCombine(Sampler::hashCombine(z, x), y ^ normalIndex));
+
+    // Zero marks empty cells
+    return ((uint64_t)high << 32 | low) | 1;
+}
+
+bool RadianceCache::valid() const
+{
+    return cells != nullptr;
+}
+
+void RadianceCache::reset()
+{
+    cells = nullptr;
+}
+
+void RadianceCache::reset(const float cellSize, const uint32_t warmUpSampleCount)
+{
+    cells = std::make_unique<Cell[]>(CAPACITY);
+    this->cellSize = std::max(0.001f, cellSize);
+    this->warmUpSampleCount = std::max(1u, warmUpSampleCount);
+}
+
+bool RadianceCache::get(const Vector3& position, const Vector3& normal, Color3& radiance) const
+{
+    const uint64_t key = getKey(position, normal);
+
+    for (size_t i = 0; i < MAX_PROBE_COUNT; i++)
+    {
+        const Cell& cell = cells[(key + i) & (CAPACITY - 1)];
+        const uint64_t cellKey = cell.key.load();
+
+        if (cellKey == 0)
+            return false;
+
+        if (cellKey != key)
+            continue;
+
+        uint32_t count;
+        Color3 radianceSum;
+
+        while (true)
+        {
+            const uint32_t sequence = cell.sequence.load(std::memory_order_acquire);
+            if ((sequence & 1) != 0)
+                continue;
+
+            count = cell.count.load(std::memory_order_relaxed);
+            radianceSum = Color3(
+                cell.radiance[0].load(std::memory_order_relaxed), 
+                cell.radiance[1].load(std::memory_order_relaxed), 
+                cell.radiance[2].load(std::memory_order_relaxed));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (cell.sequence.load(std::memory_order_relaxed) == sequence)
+                break;
+        }
+
+        if (count < warmUpSampleCount)
+            return false;
+
+        radiance = radianceSum / (float)count;
+        return true;
+    }
+
+    return false;
+}
+
+void RadianceCache::add(const Vector3& position, const Vector3& normal, const Color3& radiance)
+{
+    const uint64_t key = getKey(position, normal);
+
+    for (size_t i = 0; i < MAX_PROBE_COUNT; i++)
+    {
+        Cell& cell = cells[(key + i) & (CAPACITY - 1)];
+        uint64_t cellKey = cell.key.load();
+
+        if (cellKey == 0 && cell.key.compare_exchange_strong(cellKey, key))
+            cellKey = key;
+
+        if (cellKey != key)
+            continue;
+
+        // Writers of the same cell take turns, the sequence stays odd until the sample is complete
+        uint32_t sequence = cell.sequence.load(std::memory_order_relaxed);
+
+        while ((sequence & 1) != 0 || !cell.sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            sequence = cell.sequence.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t j = 0; j < 3; j++)
+            cell.radiance[j].store(cell.radiance[j].load(std::memory_order_relaxed) + radiance[j], std::memory_order_relaxed);
+
+        cell.count.store(cell.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        cell.sequence.store(sequence + 2, std::memory_order_release);
+        return;
+    }
+}
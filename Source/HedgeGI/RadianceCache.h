@@ -0,0 +1,33 @@
+﻿#pragma once
+
+// Spatial hash of the radiance leaving surfaces, keyed on a position cell and the dominant axis of the normal.
+// Cells are filled by full paths until they are warmed up, after which paths end into them instead of bouncing further.
+class RadianceCache
+{
+    struct Cell
+    {
+        std::atomic<uint64_t> key{};
+        std::atomic<uint32_t> sequence{}; // Odd while a sample is being added, lets readers see the count and sums together
+        std::atomic<uint32_t> count{};
+        std::atomic<float> radiance[3]{};
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    float cellSize{};
+    uint32_t warmUpSampleCount{};
+
+    uint64_t getKey(const Vector3& position, const Vector3& normal) const;
+
+public:
+    static constexpr size_t CAPACITY = 1 << 20;
+    static constexpr size_t MAX_PROBE_COUNT = 16;
+
+    bool valid() const;
+
+    void reset();
+    void reset(float cellSize, uint32_t warmUpSampleCount);
+
+    // Returns false if the cell has not received enough samples yet
+    bool get(const Vector3& position, const Vector3& normal, Color3& radiance) const;
+    void add(const Vector3& position, const Vector3& normal, const Color3& radiance);
+};
@@ -1,16 +1,56 @@
 ﻿#pragma once
 
+#include "Sampler.h"
+
 class alignas(std::hardware_destructive_interference_size) Random
 {
-    std::default_random_engine engine;
-    std::uniform_real_distribution<float> distribution;
+    uint64_t state;
+    Sampler sampler;
 
-    Random() : engine(std::random_device {}()), distribution(0, 1) {}
+    Random() : state(((uint64_t)std::random_device {}() << 32) | std::random_device {}()) {}
 
 public:
+    // PCG32 (XSH RR)
     float next() 
     {
-        return distribution(engine);
+        const uint64_t oldState = state;
+        state = oldState * 6364136223846793005ull + 1442695040888963407ull;
+
+        const uint32_t xorShifted = (uint32_t)(((oldState >> 18) ^ oldState) >> 27);
+        const uint32_t rotation = (uint32_t)(oldState >> 59);
+        const uint32_t value = (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+
+        return (float)(value >> 8) / 16777216.0f;
+    }
+
+    // Draws the next dimensions of the sample set by beginSample, or uniform random numbers if there is none
+    float nextSample()
+    {
+        return sampler.valid() ? sampler.next() : next();
+    }
+
+    Vector2 nextSample2D()
+    {
+        if (sampler.valid())
+            return sampler.next2D();
+
+        const float u1 = next();
+        const float u2 = next();
+
+        return { u1, u2 };
+    }
+
+    void beginSample(const Sampler& value)
+    {
+        sampler = value;
+    }
+
+    // Returns the sampler so the sample can be continued later
+    Sampler endSample()
+    {
+        const Sampler value = sampler;
+        sampler = {};
+        return value;
     }
 
     static Random& get()
@@ -1,6 +1,7 @@
 ﻿#include "RaytracingDevice.h"
 
 RTCDevice RaytracingDevice::rtcDevice{};
+size_t RaytracingDevice::packetSize{};
 
 RTCDevice RaytracingDevice::get()
 {
@@ -12,3 +13,20 @@ RTCDevice RaytracingDevice::get()
 
     return rtcDevice;
 }
+
+size_t RaytracingDevice::getPacketSize()
+{
+    if (packetSize)
+        return packetSize;
+
+    if (rtcGetDeviceProperty(get(), RTC_DEVICE_PROPERTY_NATIVE_RAY16_SUPPORTED))
+        packetSize = 16;
+
+    else if (rtcGetDeviceProperty(get(), RTC_DEVICE_PROPERTY_NATIVE_RAY8_SUPPORTED))
+        packetSize = 8;
+
+    else
+        packetSize = 4;
+
+    return packetSize;
+}
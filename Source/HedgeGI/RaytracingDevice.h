@@ -3,7 +3,11 @@
 class RaytracingDevice
 {
     static RTCDevice rtcDevice;
+    static size_t packetSize;
 
 public:
     static RTCDevice get();
+
+    // Widest ray packet the device traverses natively
+    static size_t getPacketSize();
 };
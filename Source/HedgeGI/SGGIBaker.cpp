@@ -23,6 +23,11 @@ struct SGGIPoint : BakePoint<4, BAKE_POINT_FLAGS_ALL>
         return sampleDirectionHemisphere(u1, u2);
     }
 
+    static float pdfDirection(const Vector3& tangentSpaceDirection)
+    {
+        return tangentSpaceDirection.z() > 0.0f ? 1.0f / (2.0f * PI) : 0.0f;
+    }
+
     void addSample(const Color3& color, const Vector3& worldSpaceDirection)
     {
         const Vector3 direction(worldSpaceDirection.x(), worldSpaceDirection.y(), -worldSpaceDirection.z());
@@ -48,13 +53,29 @@ struct SGGIPoint : BakePoint<4, BAKE_POINT_FLAGS_ALL>
 
 GIPair SGGIBaker::bake(const RaytracingContext& context, const Instance& instance, const uint16_t size, const BakeParams& bakeParams)
 {
-    std::vector<SGGIPoint> bakePoints = createBakePoints<SGGIPoint>(context, instance, size);
-    
-    BakingFactory::bake(context, bakePoints, bakeParams);
-    
-    return
+    GIPair pair
     {
-        BitmapHelper::createAndPaint(bakePoints, size, size, PAINT_FLAGS_COLOR),
-        BitmapHelper::createAndPaint(bakePoints, size, size, PAINT_FLAGS_SHADOW)
+        std::make_unique<Bitmap>(size, size, SGGIPoint::BASIS_COUNT),
+        std::make_unique<Bitmap>(size, size, 1, BITMAP_TYPE_2D, BitmapFormat::R8) // Shadows never leave the unit range
     };
+
+    if (bakeParams.postProcess.denoiserGuides && bakeParams.getDenoiserType() != DenoiserType::None)
+    {
+        pair.albedoMap = std::make_unique<Bitmap>(size, size);
+        pair.normalMap = std::make_unique<Bitmap>(size, size);
+    }
+
+    BakingFactory::bakeTiled<SGGIPoint>(context, instance, size, bakeParams, [&](const std::vector<SGGIPoint>& bakePoints)
+    {
+        BitmapHelper::paint(*pair.lightMap, bakePoints, PAINT_FLAGS_COLOR);
+        BitmapHelper::paint(*pair.shadowMap, bakePoints, PAINT_FLAGS_SHADOW);
+
+        if (pair.albedoMap != nullptr)
+        {
+            BitmapHelper::paint(*pair.albedoMap, bakePoints, PAINT_FLAGS_ALBEDO);
+            BitmapHelper::paint(*pair.normalMap, bakePoints, PAINT_FLAGS_NORMAL);
+        }
+    });
+
+    return pair;
 }
@@ -20,7 +20,7 @@ const Vector3 SHLF_DIRECTIONS[6] =
 // TODO: This value has been approximated. What's the formula for calculating this?
 const float SHLF_FACTOR = 5.8369751043319704f;
 
-struct SHLightFieldPoint : BakePoint<6, BAKE_POINT_FLAGS_SHADOW | BAKE_POINT_FLAGS_SOFT_SHADOW>
+struct SHLightFieldPoint : BakePoint<6, BAKE_POINT_FLAGS_SHADOW | BAKE_POINT_FLAGS_SOFT_SHADOW | BAKE_POINT_FLAGS_ADAPTIVE_SAMPLING>
 {
     uint16_t z { (uint16_t)-1 };
 
@@ -29,6 +29,11 @@ struct SHLightFieldPoint : BakePoint<6, BAKE_POINT_FLAGS_SHADOW | BAKE_POINT_FLA
         return sampleDirectionSphere(u1, u2);
     }
 
+    static float pdfDirection(const Vector3& tangentSpaceDirection)
+    {
+        return 1.0f / (4.0f * PI);
+    }
+
     bool valid() const
     {
         return true;
@@ -0,0 +1,113 @@
+﻿#pragma once
+
+#include "Math.h"
+
+// Owen scrambled Sobol sequence, padded to any number of dimensions by shuffling the sample index of every dimension.
+// Burley, "Practical Hash-based Owen Scrambling", 2020
+class Sampler
+{
+    uint32_t seed{};
+    uint32_t index{};
+    uint32_t dimension{};
+    bool active{};
+
+    static uint32_t reverseBits(uint32_t value)
+    {
+        value = ((value >> 1) & 0x55555555) | ((value & 0x55555555) << 1);
+        value = ((value >> 2) & 0x33333333) | ((value & 0x33333333) << 2);
+        value = ((value >> 4) & 0x0F0F0F0F) | ((value & 0x0F0F0F0F) << 4);
+        value = ((value >> 8) & 0x00FF00FF) | ((value & 0x00FF00FF) << 8);
+        return (value >> 16) | (value << 16);
+    }
+
+    static uint32_t laineKarrasPermutation(uint32_t value, const uint32_t seed)
+    {
+        value += seed;
+        value ^= value * 0x6C50B47C;
+        value ^= value * 0xB82F1E52;
+        value ^= value * 0xC7AFE638;
+        value ^= value * 0x8D22F6E6;
+        return value;
+    }
+
+    static uint32_t nestedUniformScramble(const uint32_t value, const uint32_t seed)
+    {
+        return reverseBits(laineKarrasPermutation(reverseBits(value), seed));
+    }
+
+    // First two dimensions of the Sobol sequence, as 0.32 fixed point
+    static uint32_t sobol(uint32_t index, const uint32_t dimension)
+    {
+        if (dimension == 0)
+            return reverseBits(index);
+
+        uint32_t result = 0;
+
+        for (uint32_t direction = 1u << 31; index != 0; index >>= 1, direction ^= direction >> 1)
+        {
+            if (index & 1)
+                result ^= direction;
+        }
+
+        return result;
+    }
+
+    static float toFloat(const uint32_t value)
+    {
+        return (float)(value >> 8) / 16777216.0f;
+    }
+
+public:
+    static uint32_t hash(uint32_t value)
+    {
+        value ^= value >> 16;
+        value *= 0x7FEB352D;
+        value ^= value >> 15;
+        value *= 0x846CA68B;
+        value ^= value >> 16;
+        return value;
+    }
+
+    static uint32_t hashCombine(const uint32_t seed, const uint32_t value)
+    {
+        return seed ^ (hash(value) + 0x9E3779B9 + (seed << 6) + (seed >> 2));
+    }
+
+    // Seeds neighboring points differently so their sequences are not correlated
+    static uint32_t getSeed(const Vector3& position)
+    {
+        return hashCombine(hashCombine(hash(as_uint(position.x())), as_uint(position.y())), as_uint(position.z()));
+    }
+
+    Sampler() = default;
+
+    Sampler(const uint32_t seed, const uint32_t index, const uint32_t dimension = 0)
+        : seed(seed), index(index), dimension(dimension), active(true)
+    {
+    }
+
+    bool valid() const
+    {
+        return active;
+    }
+
+    float next()
+    {
+        const uint32_t dimensionSeed = hashCombine(seed, dimension++);
+        const uint32_t shuffledIndex = nestedUniformScramble(index, dimensionSeed);
+
+        return toFloat(nestedUniformScramble(sobol(shuffledIndex, 0), hash(dimensionSeed)));
+    }
+
+    Vector2 next2D()
+    {
+        const uint32_t dimensionSeed = hashCombine(seed, dimension++);
+        const uint32_t shuffledIndex = nestedUniformScramble(index, dimensionSeed);
+
+        return
+        {
+            toFloat(nestedUniformScramble(sobol(shuffledIndex, 0), hash(dimensionSeed))),
+            toFloat(nestedUniformScramble(sobol(shuffledIndex, 1), hash(dimensionSeed + 1)))
+        };
+    }
+};
@@ -1,8 +1,10 @@
 ﻿#include "Scene.h"
 
+#include "BakeParams.h"
 #include "Bitmap.h"
 #include "Instance.h"
 #include "Light.h"
+#include "MappedFile.h"
 #include "Material.h"
 #include "Mesh.h"
 #include "MetaInstancer.h"
@@ -34,20 +36,109 @@ RTCScene Scene::createRTCScene()
     if (rtcScene != nullptr)
         return rtcScene;
 
+    const auto isTraced = [](const Mesh& mesh)
+    {
+        return !(mesh.material && mesh.material->parameters.additive) && mesh.type != MeshType::Special;
+    };
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, bitmaps.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        // Materials only ever sample the trace texture, it replaces the texels of the bitmap
+        for (size_t i = range.begin(); i < range.end(); i++)
+        {
+            bitmaps[i]->traceTexture.build(*bitmaps[i]);
+            bitmaps[i]->releaseData();
+        }
+    });
+
+    // Flatten the materials into records indexed by mesh, the first one stands in for meshes without a material
+    phmap::flat_hash_map<const Material*, size_t> traceMaterialIndices;
+    traceMaterialIndices.emplace(nullptr, 0);
+
+    for (const auto& mesh : meshes)
+        traceMaterialIndices.emplace(mesh->material, traceMaterialIndices.size());
+
+    traceMaterials.resize(traceMaterialIndices.size());
+
+    for (const auto& [material, index] : traceMaterialIndices)
+        traceMaterials[index].build(material);
+
+    meshTraceMaterials.resize(meshes.size());
+
+    for (size_t i = 0; i < meshes.size(); i++)
+        meshTraceMaterials[i] = &traceMaterials[traceMaterialIndices[meshes[i]->material]];
+
+    // Build the geometry of every mesh placed more than once only once, as a child scene
+    phmap::flat_hash_map<const Mesh*, RTCScene> prototypeScenes;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, meshes.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        // Bake points read their shading frames from the trace geometry, so untraced meshes need one too
+        for (size_t i = range.begin(); i < range.end(); i++)
+        {
+            if (meshes[i]->prototype == nullptr)
+                meshes[i]->buildTraceGeometry();
+        }
+    });
+
+    for (const auto& mesh : meshes)
+    {
+        if (!isTraced(*mesh))
+            continue;
+
+        if (mesh->material != nullptr && mesh->type != MeshType::Opaque)
+            alphaGeometry = true;
+
+        if (mesh->prototype != nullptr)
+            prototypeScenes.emplace(mesh->prototype, nullptr);
+        else
+            mesh->buildOpacityMicromaps();
+    }
+
+    for (auto& [prototype, prototypeScene] : prototypeScenes)
+    {
+        prototypeScene = rtcNewScene(RaytracingDevice::get());
+
+        const RTCGeometry rtcGeometry = prototype->createRTCGeometry();
+
+        rtcAttachGeometryByID(prototypeScene, rtcGeometry, 0);
+        rtcReleaseGeometry(rtcGeometry);
+
+        rtcSetSceneBuildQuality(prototypeScene, RTC_BUILD_QUALITY_HIGH);
+        rtcSetSceneFlags(prototypeScene, RTC_SCENE_FLAG_COMPACT | RTC_SCENE_FLAG_FILTER_FUNCTION_IN_ARGUMENTS);
+
+        rtcCommitScene(prototypeScene);
+    }
+
+    resetSkyMaps();
+
     rtcScene = rtcNewScene(RaytracingDevice::get());
     for (size_t i = 0; i < meshes.size(); i++)
     {
         const auto& mesh = meshes[i];
         
-        if ((mesh->material && mesh->material->parameters.additive) || mesh->type == MeshType::Special)
+        if (!isTraced(*mesh))
             continue;
 
-        const RTCGeometry rtcGeometry = mesh->createRTCGeometry();
+        RTCGeometry rtcGeometry;
+
+        if (mesh->prototype != nullptr)
+            rtcGeometry = mesh->createRTCInstance(prototypeScenes[mesh->prototype]);
+
+        else if (const auto prototypeScene = prototypeScenes.find(mesh.get()); prototypeScene != prototypeScenes.end())
+            rtcGeometry = mesh->createRTCInstance(prototypeScene->second);
+
+        else
+            rtcGeometry = mesh->createRTCGeometry();
 
         rtcAttachGeometryByID(rtcScene, rtcGeometry, (uint32_t)i);
         rtcReleaseGeometry(rtcGeometry);
     }
 
+    // Instances hold their own reference
+    for (auto& [prototype, prototypeScene] : prototypeScenes)
+        rtcReleaseScene(prototypeScene);
+
     rtcSetSceneBuildQuality(rtcScene, RTC_BUILD_QUALITY_HIGH);
     rtcSetSceneFlags(rtcScene, RTC_SCENE_FLAG_COMPACT | RTC_SCENE_FLAG_FILTER_FUNCTION_IN_ARGUMENTS);
 
@@ -59,14 +150,62 @@ RTCScene Scene::createRTCScene()
 const LightBVH* Scene::createLightBVH(const bool force)
 {
     if ((force || !lightBVH.valid()) && !lights.empty())
+    {
         lightBVH.build(*this);
+        resetSkyMaps();
+    }
 
     return &lightBVH;
 }
 
+const SkyMap* Scene::createSkyMaps(const bool force)
+{
+    if (!force && skyMaps[0].valid())
+        return skyMaps.data();
+
+    if (!force && skyless)
+        return nullptr;
+
+    skyless = std::none_of(meshes.begin(), meshes.end(), [](const auto& mesh)
+    {
+        return mesh->material && mesh->material->type == MaterialType::Sky;
+    });
+
+    if (skyless)
+        return nullptr;
+
+    const RaytracingContext raytracingContext = { this, createRTCScene(), createLightBVH() };
+
+    skyMaps[(size_t)TargetEngine::HE1].build(raytracingContext, TargetEngine::HE1);
+    skyMaps[(size_t)TargetEngine::HE2].build(raytracingContext, TargetEngine::HE2);
+
+    return skyMaps.data();
+}
+
+void Scene::resetSkyMaps()
+{
+    for (auto& skyMap : skyMaps)
+        skyMap.reset();
+
+    skyless = false;
+}
+
+void Scene::resetRadianceCache(const BakeParams& bakeParams)
+{
+    if (bakeParams.light.radianceCache)
+        radianceCache.reset(bakeParams.light.radianceCacheCellSize, bakeParams.light.radianceCacheWarmUpSampleCount);
+    else
+        radianceCache.reset();
+}
+
+void Scene::releaseRadianceCache()
+{
+    radianceCache.reset();
+}
+
 RaytracingContext Scene::getRaytracingContext()
 {
-    return { this, createRTCScene(), createLightBVH() };
+    return { this, createRTCScene(), createLightBVH(), createSkyMaps(), radianceCache.valid() ? &radianceCache : nullptr };
 }
 
 void Scene::sortAndUnify()
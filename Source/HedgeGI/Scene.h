@@ -2,8 +2,12 @@
 
 #include "LightBVH.h"
 #include "LightField.h"
+#include "RadianceCache.h"
 #include "SceneEffect.h"
+#include "SkyMap.h"
+#include "TraceMaterial.h"
 
+class MappedFile;
 class MetaInstancer;
 class Bitmap;
 class Material;
@@ -12,27 +16,49 @@ class Model;
 class Instance;
 class Light;
 class SHLightField;
+struct BakeParams;
 
 #define RAY_MASK_OPAQUE        (1 << 0)
 #define RAY_MASK_TRANS         (1 << 1)
 #define RAY_MASK_PUNCH_THROUGH (1 << 2)
 #define RAY_MASK_SKY           (1 << 3)
 
+// Meshes sharing geometry are attached as instances by their mesh index,
+// in which case Embree reports the mesh index as the instance ID.
+inline uint32_t getMeshIndex(const uint32_t geomID, const uint32_t instID)
+{
+    return instID != RTC_INVALID_GEOMETRY_ID ? instID : geomID;
+}
+
 struct RaytracingContext
 {
     const class Scene* scene {};
     RTCScene rtcScene {};
     const LightBVH* lightBVH;
+    const SkyMap* skyMaps {}; // Indexed by TargetEngine
+    RadianceCache* radianceCache {};
 };
 
 class Scene
 {
     RTCScene rtcScene {};
     LightBVH lightBVH {};
+    std::array<SkyMap, 2> skyMaps {};
+    bool skyless {}; // No sky mesh was found, saves scanning the meshes for every context
+    RadianceCache radianceCache {};
+
+    std::vector<TraceMaterial> traceMaterials;
+    std::vector<const TraceMaterial*> meshTraceMaterials; // Indexed by mesh index
+    bool alphaGeometry{};
+
+    // The maps are traced through the Embree scene and light BVH, so they are invalid after either is rebuilt
+    void resetSkyMaps();
 
 public:
     ~Scene();
 
+    std::unique_ptr<MappedFile> cacheFile; // Set when loaded from a scene cache, bitmaps and meshes point into it
+
     std::vector<std::unique_ptr<Bitmap>> bitmaps;
     std::vector<std::unique_ptr<Material>> materials;
     std::vector<std::unique_ptr<Mesh>> meshes;
@@ -52,7 +78,27 @@ public:
     void buildAABB();
 
     RTCScene createRTCScene();
+
+    // Whether any traced mesh needs the alpha test filter, valid once the Embree scene is created
+    bool hasAlphaGeometry() const
+    {
+        return alphaGeometry;
+    }
+
+    // Valid once the Embree scene is created
+    const TraceMaterial& getTraceMaterial(const uint32_t meshIndex) const
+    {
+        return *meshTraceMaterials[meshIndex];
+    }
+
     const LightBVH* createLightBVH(bool force = false);
+    const SkyMap* createSkyMaps(bool force = false);
+
+    // Clears the radiance cache for a new bake, or releases it if the bake parameters do not use it
+    void resetRadianceCache(const BakeParams& bakeParams);
+
+    // Frees the radiance cache once the bake that reset it is done
+    void releaseRadianceCache();
     RaytracingContext getRaytracingContext();
 
     void sortAndUnify();
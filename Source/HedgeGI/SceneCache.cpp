@@ -0,0 +1,654 @@
+﻿#include "SceneCache.h"
+
+#include "Bitmap.h"
+#include "Instance.h"
+#include "Light.h"
+#include "Logger.h"
+#include "MappedFile.h"
+#include "Material.h"
+#include "Mesh.h"
+#include "MetaInstancer.h"
+#include "Model.h"
+#include "Scene.h"
+#include "SHLightField.h"
+#include "Utilities.h"
+
+namespace
+{
+    constexpr uint32_t SCENE_CACHE_SIGNATURE = 0x43534748; // HGSC
+
+    // Bump whenever the factory starts producing different data, old caches get rebuilt then
+    constexpr uint32_t SCENE_CACHE_VERSION = 3;
+
+    // Sizes of everything stored as raw memory, a build that changes any of them can't use the cache
+    struct SceneCacheLayout
+    {
+        uint32_t vertex = sizeof(Vertex);
+        uint32_t bakeVertex = sizeof(BakeVertex);
+        uint32_t triangle = sizeof(Triangle);
+        uint32_t materialParameters = sizeof(Material::Parameters);
+        uint32_t metaInstancerInstance = sizeof(MetaInstancer::Instance);
+        uint32_t lightFieldCell = sizeof(LightFieldCell);
+        uint32_t lightFieldProbe = sizeof(LightFieldProbe);
+        uint32_t sceneEffect = sizeof(SceneEffect);
+    };
+
+    struct SceneCacheHeader
+    {
+        uint32_t signature;
+        uint32_t version;
+        SceneCacheLayout layout;
+        uint32_t sourceCount;
+    };
+
+    struct SceneCacheSource
+    {
+        std::string filePath;
+        uint64_t size; // UINT64_MAX if the file doesn't exist
+        uint64_t hash;
+    };
+
+    constexpr const Bitmap* Material::Textures::* MATERIAL_TEXTURES[] =
+    {
+        &Material::Textures::diffuse,
+        &Material::Textures::specular,
+        &Material::Textures::gloss,
+        &Material::Textures::normal,
+        &Material::Textures::alpha,
+        &Material::Textures::diffuseBlend,
+        &Material::Textures::specularBlend,
+        &Material::Textures::glossBlend,
+        &Material::Textures::normalBlend,
+        &Material::Textures::emission,
+        &Material::Textures::environment
+    };
+
+    uint64_t mixHash(uint64_t value)
+    {
+        value ^= value >> 33;
+        value *= 0xFF51AFD7ED558CCDull;
+        value ^= value >> 33;
+        value *= 0xC4CEB9FE1A85EC53ull;
+        value ^= value >> 33;
+
+        return value;
+    }
+
+    uint64_t hashChunk(const uint8_t* data, const size_t size)
+    {
+        // Independent lanes so the multiplies of consecutive words don't wait on each other
+        uint64_t lanes[4] = { 1, 2, 3, 4 };
+        size_t i = 0;
+
+        for (; i + sizeof(lanes) <= size; i += sizeof(lanes))
+        {
+            for (size_t j = 0; j < 4; j++)
+            {
+                uint64_t word;
+                memcpy(&word, data + i + j * sizeof(uint64_t), sizeof(uint64_t));
+
+                lanes[j] = (lanes[j] ^ word) * 0x9E3779B97F4A7C15ull;
+                lanes[j] ^= lanes[j] >> 29;
+            }
+        }
+
+        uint64_t hash = lanes[0];
+
+        for (size_t j = 1; j < 4; j++)
+            hash = mixHash(hash ^ lanes[j]);
+
+        for (; i < size; i++)
+            hash = (hash ^ data[i]) * 0x100000001B3ull;
+
+        return mixHash(hash);
+    }
+
+    uint64_t hashData(const uint8_t* data, const size_t size)
+    {
+        constexpr size_t CHUNK_SIZE = 1 << 20;
+
+        std::vector<uint64_t> chunkHashes((size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, chunkHashes.size()), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t i = range.begin(); i < range.end(); i++)
+                chunkHashes[i] = hashChunk(data + i * CHUNK_SIZE, std::min(CHUNK_SIZE, size - i * CHUNK_SIZE));
+        });
+
+        uint64_t hash = mixHash(size);
+
+        for (const uint64_t chunkHash : chunkHashes)
+            hash = mixHash(hash ^ chunkHash);
+
+        return hash;
+    }
+
+    SceneCacheSource createSource(const std::string& filePath)
+    {
+        SceneCacheSource source{ filePath, UINT64_MAX, 0 };
+
+        if (!std::filesystem::exists(filePath))
+            return source;
+
+        const MappedFile file(filePath);
+
+        source.size = file.getSize();
+        source.hash = hashData(file.getData(), file.getSize());
+
+        return source;
+    }
+
+    template<typename T>
+    uint32_t getIndex(const phmap::flat_hash_map<const T*, uint32_t>& indices, const T* value)
+    {
+        const auto index = indices.find(value);
+        return index != indices.end() ? index->second : UINT32_MAX;
+    }
+
+    void writeString(hl::stream& stream, const std::string& value)
+    {
+        stream.write_obj((uint32_t)value.size());
+        stream.write_arr(value.size(), value.data());
+    }
+
+    // Arrays start at 16 bytes, so they can be used in place from the mapping
+    template<typename T>
+    void writeArray(hl::stream& stream, const T* values, const size_t count)
+    {
+        stream.pad(16);
+        stream.write_arr(count, values);
+    }
+
+    template<typename T>
+    void writeIndices(hl::stream& stream, const phmap::flat_hash_map<const T*, uint32_t>& indices, const std::vector<const T*>& values)
+    {
+        stream.write_obj((uint32_t)values.size());
+
+        for (const T* value : values)
+            stream.write_obj(getIndex(indices, value));
+    }
+
+    void writeBitmap(hl::stream& stream, const Bitmap& bitmap)
+    {
+        writeString(stream, bitmap.name);
+        stream.write_obj((uint32_t)bitmap.type);
+        stream.write_obj((uint32_t)bitmap.format);
+        stream.write_obj((uint64_t)bitmap.width);
+        stream.write_obj((uint64_t)bitmap.height);
+        stream.write_obj((uint64_t)bitmap.arraySize);
+        writeArray(stream, (const uint8_t*)bitmap.data, bitmap.width * bitmap.height * bitmap.arraySize * bitmap.getTexelSize());
+    }
+
+    // Reads from the mapping, any read past its end fails the whole load instead of throwing
+    class SceneCacheReader
+    {
+        uint8_t* data;
+        size_t size;
+        size_t position{};
+
+    public:
+        bool failed{};
+
+        SceneCacheReader(const MappedFile& file) : data(file.getData()), size(file.getSize())
+        {
+        }
+
+        bool check(const size_t byteSize)
+        {
+            failed |= byteSize > size - position;
+            return !failed;
+        }
+
+        template<typename T>
+        T read()
+        {
+            T value{};
+
+            if (check(sizeof(T)))
+            {
+                memcpy(&value, data + position, sizeof(T));
+                position += sizeof(T);
+            }
+
+            return value;
+        }
+
+        // Element counts can't exceed the remaining bytes, which keeps a corrupt file from allocating wildly
+        size_t readCount()
+        {
+            const uint32_t count = read<uint32_t>();
+            return check(count) ? count : 0;
+        }
+
+        std::string readString()
+        {
+            const size_t length = readCount();
+            std::string value((const char*)data + position, length);
+            position += length;
+
+            return value;
+        }
+
+        template<typename T>
+        T* readArray(const size_t count)
+        {
+            position = std::min(size, (position + 15) & ~(size_t)15);
+
+            if (count > (size - position) / sizeof(T))
+            {
+                failed = true;
+                return nullptr;
+            }
+
+            T* values = (T*)(data + position);
+            position += count * sizeof(T);
+
+            return values;
+        }
+
+        template<typename T>
+        T* readIndex(const std::vector<std::unique_ptr<T>>& values)
+        {
+            const uint32_t index = read<uint32_t>();
+
+            if (index == UINT32_MAX)
+                return nullptr;
+
+            failed |= index >= values.size();
+            return failed ? nullptr : values[index].get();
+        }
+
+        template<typename T>
+        void readIndices(const std::vector<std::unique_ptr<T>>& values, std::vector<const T*>& destination)
+        {
+            destination.resize(readCount());
+
+            for (auto& value : destination)
+                value = readIndex(values);
+        }
+
+        std::unique_ptr<Bitmap> readBitmap()
+        {
+            std::unique_ptr<Bitmap> bitmap = std::make_unique<Bitmap>();
+
+            bitmap->name = readString();
+            bitmap->type = (BitmapType)read<uint32_t>();
+            bitmap->format = (BitmapFormat)read<uint32_t>();
+            bitmap->width = read<uint64_t>();
+            bitmap->height = read<uint64_t>();
+            bitmap->arraySize = read<uint64_t>();
+            bitmap->mapped = true;
+
+            if (bitmap->format > BitmapFormat::R8 || bitmap->width == 0 || bitmap->height == 0 || bitmap->arraySize == 0 ||
+                bitmap->width * bitmap->height > (size - position) / bitmap->arraySize)
+            {
+                failed = true;
+                return bitmap;
+            }
+
+            bitmap->data = readArray<uint8_t>(bitmap->width * bitmap->height * bitmap->arraySize * bitmap->getTexelSize());
+
+            return bitmap;
+        }
+    };
+}
+
+std::unique_ptr<Scene> SceneCache::load(const std::string& filePath)
+{
+    if (!std::filesystem::exists(filePath))
+        return nullptr;
+
+    // Declared before the scene, which must never outlive it
+    std::unique_ptr<MappedFile> file = std::make_unique<MappedFile>(filePath);
+    if (!file->isOpen())
+        return nullptr;
+
+    SceneCacheReader reader(*file);
+
+    const SceneCacheHeader header = reader.read<SceneCacheHeader>();
+    const SceneCacheLayout layout;
+
+    if (reader.failed || header.signature != SCENE_CACHE_SIGNATURE || header.version != SCENE_CACHE_VERSION ||
+        memcmp(&header.layout, &layout, sizeof(SceneCacheLayout)) != 0)
+    {
+        Logger::log(LogType::Normal, "Scene cache is from a different version, rebuilding it");
+        return nullptr;
+    }
+
+    std::vector<SceneCacheSource> sources(std::min<size_t>(header.sourceCount, file->getSize()));
+
+    for (auto& source : sources)
+    {
+        source.filePath = reader.readString();
+        source.size = reader.read<uint64_t>();
+        source.hash = reader.read<uint64_t>();
+    }
+
+    if (reader.failed)
+        return nullptr;
+
+    std::atomic<bool> stale = false;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, sources.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t i = range.begin(); i < range.end() && !stale; i++)
+        {
+            const SceneCacheSource source = createSource(sources[i].filePath);
+
+            if (source.size != sources[i].size || source.hash != sources[i].hash)
+                stale = true;
+        }
+    });
+
+    if (stale)
+    {
+        Logger::log(LogType::Normal, "Stage files changed since the scene cache was created, rebuilding it");
+        return nullptr;
+    }
+
+    std::unique_ptr<Scene> scene = std::make_unique<Scene>();
+
+    scene->bitmaps.resize(reader.readCount());
+
+    for (auto& bitmap : scene->bitmaps)
+        bitmap = reader.readBitmap();
+
+    if (reader.read<uint8_t>() != 0)
+        scene->rgbTable = reader.readBitmap();
+
+    scene->materials.resize(reader.readCount());
+
+    for (auto& material : scene->materials)
+    {
+        material = std::make_unique<Material>();
+        material->name = reader.readString();
+        material->type = (MaterialType)reader.read<uint32_t>();
+        material->skyType = reader.read<uint64_t>();
+        material->skySqrt = reader.read<uint8_t>() != 0;
+        material->ignoreVertexColor = reader.read<uint8_t>() != 0;
+        material->hasMetalness = reader.read<uint8_t>() != 0;
+        material->parameters = reader.read<Material::Parameters>();
+
+        for (const auto texture : MATERIAL_TEXTURES)
+            material->textures.*texture = reader.readIndex(scene->bitmaps);
+    }
+
+    scene->meshes.resize(reader.readCount());
+
+    std::vector<uint32_t> prototypeIndices(scene->meshes.size());
+
+    for (size_t i = 0; i < scene->meshes.size(); i++)
+    {
+        std::unique_ptr<Mesh>& mesh = scene->meshes[i];
+
+        mesh = std::make_unique<Mesh>();
+        mesh->type = (MeshType)reader.read<uint32_t>();
+        mesh->vertexCount = reader.read<uint32_t>();
+        mesh->triangleCount = reader.read<uint32_t>();
+        mesh->material = reader.readIndex(scene->materials);
+        prototypeIndices[i] = reader.read<uint32_t>();
+        mesh->aabb = reader.read<AABB>();
+        mesh->prototypeTransformation = reader.read<Affine3>();
+        mesh->prototypeRotation = reader.read<Matrix3>();
+        mesh->prototypeCofactor = reader.read<Matrix3>();
+
+        MeshArrayDeleter deleter;
+        deleter.mapped = true;
+
+        // Placements of a prototype don't have their own
+        if (reader.read<uint8_t>() != 0)
+            mesh->vertices = std::unique_ptr<Vertex[], MeshArrayDeleter>(reader.readArray<Vertex>(mesh->vertexCount), deleter);
+
+        mesh->bakeVertices = std::unique_ptr<BakeVertex[], MeshArrayDeleter>(reader.readArray<BakeVertex>(mesh->vertexCount), deleter);
+        mesh->triangles = std::unique_ptr<Triangle[], MeshArrayDeleter>(reader.readArray<Triangle>(mesh->triangleCount), deleter);
+    }
+
+    for (size_t i = 0; i < scene->meshes.size(); i++)
+    {
+        if (prototypeIndices[i] == UINT32_MAX)
+        {
+            reader.failed |= scene->meshes[i]->vertices == nullptr;
+            continue;
+        }
+
+        if (prototypeIndices[i] >= scene->meshes.size())
+            reader.failed = true;
+        else
+            scene->meshes[i]->prototype = scene->meshes[prototypeIndices[i]].get();
+    }
+
+    scene->models.resize(reader.readCount());
+
+    for (auto& model : scene->models)
+    {
+        model = std::make_unique<Model>();
+        model->name = reader.readString();
+        reader.readIndices(scene->meshes, model->meshes);
+    }
+
+    scene->instances.resize(reader.readCount());
+
+    for (auto& instance : scene->instances)
+    {
+        instance = std::make_unique<Instance>();
+        instance->name = reader.readString();
+        reader.readIndices(scene->meshes, instance->meshes);
+        instance->aabb = reader.read<AABB>();
+        instance->originalResolution = reader.read<uint16_t>();
+    }
+
+    scene->lights.resize(reader.readCount());
+
+    for (auto& light : scene->lights)
+    {
+        light = std::make_unique<Light>();
+        light->name = reader.readString();
+        light->position = reader.read<Vector3>();
+        light->color = reader.read<Color3>();
+        light->type = (LightType)reader.read<uint32_t>();
+        light->range = reader.read<Vector4>();
+    }
+
+    scene->metaInstancers.resize(reader.readCount());
+
+    for (auto& metaInstancer : scene->metaInstancers)
+    {
+        metaInstancer = std::make_unique<MetaInstancer>();
+        metaInstancer->name = reader.readString();
+
+        const size_t instanceCount = reader.readCount();
+        if (const auto instances = reader.readArray<MetaInstancer::Instance>(instanceCount))
+            metaInstancer->instances.assign(instances, instances + instanceCount);
+    }
+
+    scene->shLightFields.resize(reader.readCount());
+
+    for (auto& shLightField : scene->shLightFields)
+    {
+        shLightField = std::make_unique<SHLightField>();
+        shLightField->name = reader.readString();
+        shLightField->resolution = reader.read<Eigen::Array3i>();
+        shLightField->position = reader.read<Vector3>();
+        shLightField->rotation = reader.read<Vector3>();
+        shLightField->scale = reader.read<Vector3>();
+    }
+
+    scene->lightField.aabb = reader.read<AABB>();
+
+    const size_t cellCount = reader.readCount();
+    if (const auto cells = reader.readArray<LightFieldCell>(cellCount))
+        scene->lightField.cells.assign(cells, cells + cellCount);
+
+    const size_t probeCount = reader.readCount();
+    if (const auto probes = reader.readArray<LightFieldProbe>(probeCount))
+        scene->lightField.probes.assign(probes, probes + probeCount);
+
+    const size_t indexCount = reader.readCount();
+    if (const auto indices = reader.readArray<uint32_t>(indexCount))
+        scene->lightField.indices.assign(indices, indices + indexCount);
+
+    scene->effect = reader.read<SceneEffect>();
+
+    if (reader.failed)
+    {
+        Logger::log(LogType::Warning, "Scene cache is corrupted, rebuilding it");
+        return nullptr;
+    }
+
+    scene->cacheFile = std::move(file);
+    scene->buildAABB();
+    scene->createLightBVH();
+
+    return scene;
+}
+
+void SceneCache::save(const std::string& filePath, const Scene& scene, const std::vector<std::string>& sourceFilePaths)
+{
+    std::vector<SceneCacheSource> sources(sourceFilePaths.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, sources.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t i = range.begin(); i < range.end(); i++)
+            sources[i] = createSource(sourceFilePaths[i]);
+    });
+
+    phmap::flat_hash_map<const Bitmap*, uint32_t> bitmapIndices;
+    phmap::flat_hash_map<const Material*, uint32_t> materialIndices;
+    phmap::flat_hash_map<const Mesh*, uint32_t> meshIndices;
+
+    for (const auto& bitmap : scene.bitmaps)
+        bitmapIndices.emplace(bitmap.get(), (uint32_t)bitmapIndices.size());
+
+    for (const auto& material : scene.materials)
+        materialIndices.emplace(material.get(), (uint32_t)materialIndices.size());
+
+    for (const auto& mesh : scene.meshes)
+        meshIndices.emplace(mesh.get(), (uint32_t)meshIndices.size());
+
+    try
+    {
+        hl::file_stream stream(toNchar(filePath.c_str()).data(), hl::file::mode::write);
+
+        stream.write_obj(SceneCacheHeader{ SCENE_CACHE_SIGNATURE, SCENE_CACHE_VERSION, SceneCacheLayout(), (uint32_t)sources.size() });
+
+        for (const auto& source : sources)
+        {
+            writeString(stream, source.filePath);
+            stream.write_obj(source.size);
+            stream.write_obj(source.hash);
+        }
+
+        stream.write_obj((uint32_t)scene.bitmaps.size());
+
+        for (const auto& bitmap : scene.bitmaps)
+            writeBitmap(stream, *bitmap);
+
+        stream.write_obj((uint8_t)(scene.rgbTable != nullptr ? 1 : 0));
+
+        if (scene.rgbTable != nullptr)
+            writeBitmap(stream, *scene.rgbTable);
+
+        stream.write_obj((uint32_t)scene.materials.size());
+
+        for (const auto& material : scene.materials)
+        {
+            writeString(stream, material->name);
+            stream.write_obj((uint32_t)material->type);
+            stream.write_obj((uint64_t)material->skyType);
+            stream.write_obj((uint8_t)material->skySqrt);
+            stream.write_obj((uint8_t)material->ignoreVertexColor);
+            stream.write_obj((uint8_t)material->hasMetalness);
+            stream.write_obj(material->parameters);
+
+            for (const auto texture : MATERIAL_TEXTURES)
+                stream.write_obj(getIndex(bitmapIndices, material->textures.*texture));
+        }
+
+        stream.write_obj((uint32_t)scene.meshes.size());
+
+        for (const auto& mesh : scene.meshes)
+        {
+            stream.write_obj((uint32_t)mesh->type);
+            stream.write_obj(mesh->vertexCount);
+            stream.write_obj(mesh->triangleCount);
+            stream.write_obj(getIndex(materialIndices, mesh->material));
+            stream.write_obj(getIndex(meshIndices, mesh->prototype));
+            stream.write_obj(mesh->aabb);
+            stream.write_obj(mesh->prototypeTransformation);
+            stream.write_obj(mesh->prototypeRotation);
+            stream.write_obj(mesh->prototypeCofactor);
+            stream.write_obj((uint8_t)(mesh->vertices != nullptr ? 1 : 0));
+
+            if (mesh->vertices != nullptr)
+                writeArray(stream, mesh->vertices.get(), mesh->vertexCount);
+
+            writeArray(stream, mesh->bakeVertices.get(), mesh->vertexCount);
+            writeArray(stream, mesh->triangles.get(), mesh->triangleCount);
+        }
+
+        stream.write_obj((uint32_t)scene.models.size());
+
+        for (const auto& model : scene.models)
+        {
+            writeString(stream, model->name);
+            writeIndices(stream, meshIndices, model->meshes);
+        }
+
+        stream.write_obj((uint32_t)scene.instances.size());
+
+        for (const auto& instance : scene.instances)
+        {
+            writeString(stream, instance->name);
+            writeIndices(stream, meshIndices, instance->meshes);
+            stream.write_obj(instance->aabb);
+            stream.write_obj(instance->originalResolution);
+        }
+
+        stream.write_obj((uint32_t)scene.lights.size());
+
+        for (const auto& light : scene.lights)
+        {
+            writeString(stream, light->name);
+            stream.write_obj(light->position);
+            stream.write_obj(light->color);
+            stream.write_obj((uint32_t)light->type);
+            stream.write_obj(light->range);
+        }
+
+        stream.write_obj((uint32_t)scene.metaInstancers.size());
+
+        for (const auto& metaInstancer : scene.metaInstancers)
+        {
+            writeString(stream, metaInstancer->name);
+            stream.write_obj((uint32_t)metaInstancer->instances.size());
+            writeArray(stream, metaInstancer->instances.data(), metaInstancer->instances.size());
+        }
+
+        stream.write_obj((uint32_t)scene.shLightFields.size());
+
+        for (const auto& shLightField : scene.shLightFields)
+        {
+            writeString(stream, shLightField->name);
+            stream.write_obj(shLightField->resolution);
+            stream.write_obj(shLightField->position);
+            stream.write_obj(shLightField->rotation);
+            stream.write_obj(shLightField->scale);
+        }
+
+        stream.write_obj(scene.lightField.aabb);
+        stream.write_obj((uint32_t)scene.lightField.cells.size());
+        writeArray(stream, scene.lightField.cells.data(), scene.lightField.cells.size());
+        stream.write_obj((uint32_t)scene.lightField.probes.size());
+        writeArray(stream, scene.lightField.probes.data(), scene.lightField.probes.size());
+        stream.write_obj((uint32_t)scene.lightField.indices.size());
+        writeArray(stream, scene.lightField.indices.data(), scene.lightField.indices.size());
+
+        stream.write_obj(scene.effect);
+    }
+    catch (const std::exception&)
+    {
+        // The stage directory can be read only, the scene just gets created from scratch next time
+        Logger::logFormatted(LogType::Warning, "Failed to write scene cache to %s", filePath.c_str());
+        std::filesystem::remove(filePath);
+    }
+}
@@ -0,0 +1,16 @@
+﻿#pragma once
+
+class Scene;
+
+// Binary snapshot of a scene exactly as the factory leaves it, so reopening a stage skips every archive.
+// Bitmaps and mesh arrays are stored aligned and get used straight from a memory mapping of the file.
+// The cache records a content hash of every file the scene was created from and is ignored once any of them changes.
+class SceneCache
+{
+public:
+    // Returns null if the cache is missing, was written by an incompatible build or any of its sources changed
+    static std::unique_ptr<Scene> load(const std::string& filePath);
+
+    // Source files that didn't exist are recorded too, the cache goes stale if they show up later
+    static void save(const std::string& filePath, const Scene& scene, const std::vector<std::string>& sourceFilePaths);
+};
@@ -10,6 +10,7 @@
 #include "MetaInstancer.h"
 #include "Model.h"
 #include "Scene.h"
+#include "SceneCache.h"
 #include "SHLightField.h"
 #include "Utilities.h"
 #include "FxSceneData.h"
@@ -38,7 +39,8 @@ std::unique_ptr<Bitmap> SceneFactory::createBitmap(const uint8_t* data, const si
     case DXGI_FORMAT_R32_FLOAT:
     case DXGI_FORMAT_BC6H_UF16:
     case DXGI_FORMAT_BC6H_SF16:
-        format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+        // Half precision covers the range of any texture the games ship, at half the memory
+        format = DXGI_FORMAT_R16G16B16A16_FLOAT;
         break;
 
     default:
@@ -75,17 +77,17 @@ std::unique_ptr<Bitmap> SceneFactory::createBitmap(const uint8_t* data, const si
         BITMAP_TYPE_2D;
 
     bitmap->format =
-        format == DXGI_FORMAT_R32G32B32A32_FLOAT ? 
-            BitmapFormat::F32 :
+        format == DXGI_FORMAT_R16G16B16A16_FLOAT ? 
+            BitmapFormat::F16 :
             BitmapFormat::U8;
 
     bitmap->width = metadata.width;
     bitmap->height = metadata.height;
     bitmap->arraySize = bitmap->type == BITMAP_TYPE_3D ? metadata.depth : metadata.arraySize;
-    bitmap->data = operator new(bitmap->width * bitmap->height * bitmap->arraySize * (size_t)bitmap->format);
+    bitmap->data = operator new(bitmap->width * bitmap->height * bitmap->arraySize * bitmap->getTexelSize());
 
     for (size_t i = 0; i < bitmap->arraySize; i++)
-        memcpy(bitmap->getColorPtr(bitmap->width * bitmap->height * i), scratchImage->GetImage(0, i, 0)->pixels, bitmap->width * bitmap->height * (size_t)bitmap->format);
+        memcpy(bitmap->getColorPtr(bitmap->width * bitmap->height * i), scratchImage->GetImage(0, i, 0)->pixels, bitmap->width * bitmap->height * bitmap->getTexelSize());
 
     return bitmap;
 }
@@ -410,6 +412,7 @@ std::unique_ptr<Mesh> SceneFactory::createMesh(hl::hh::mirage::raw_mesh_r1* mesh
     if (anyInvalid)
         newMesh->generateTangents();
 
+    newMesh->buildBakeVertices();
     newMesh->buildAABB();
 
     return newMesh;
@@ -423,6 +426,21 @@ void SceneFactory::createMesh(hl::hh::mirage::raw_mesh_r1* mesh, const MeshType
     meshes.push_back(newMesh.get());
 
     std::lock_guard lock(criticalSection);
+
+    // Models placed multiple times are traced through instances of the first placement
+    const auto prototype = meshPrototypes.find(mesh);
+
+    if (prototype == meshPrototypes.end() || !newMesh->setPrototype(prototype->second.first, transformation * prototype->second.second.inverse(),
+        transformation.rotation() * prototype->second.second.rotation().transpose()))
+    {
+        meshPrototypes[mesh] = std::make_pair(newMesh.get(), transformation);
+    }
+    else
+    {
+        // Everything but the bake vertices is derived from the prototype
+        newMesh->vertices = nullptr;
+    }
+
     scene->meshes.push_back(std::move(newMesh));
 }
 
@@ -922,6 +940,47 @@ void SceneFactory::loadSceneEffect(const hl::archive& archive) const
     }
 }
 
+void SceneFactory::addSourceFilePath(const std::string& filePath)
+{
+    sourceFilePaths.push_back(filePath);
+
+    // Split archives continue until the first missing part, which is recorded too as adding it changes the archive
+    const auto addSplitFilePaths = [this](const std::string& basePath, const size_t begin, const size_t digitCount)
+    {
+        const size_t end = digitCount == 2 ? 100 : 1000;
+
+        for (size_t i = begin; i < end; i++)
+        {
+            if (i != begin && !std::filesystem::exists(sourceFilePaths.back()))
+                break;
+
+            char index[8];
+            sprintf(index, "%0*lld", (int)digitCount, i);
+
+            sourceFilePaths.push_back(basePath + index);
+        }
+    };
+
+    const auto endsWith = [&](const char* suffix)
+    {
+        const size_t length = strlen(suffix);
+        return filePath.size() >= length && filePath.compare(filePath.size() - length, length, suffix) == 0;
+    };
+
+    if (!std::filesystem::exists(filePath))
+        return;
+
+    if (endsWith(".00"))
+        addSplitFilePaths(filePath.substr(0, filePath.size() - 2), 1, 2);
+
+    // Root PACs load their splits through their own split table, .pac.NN for LW and .pac.NNN for Forces
+    else if (endsWith(".pac"))
+    {
+        addSplitFilePaths(filePath + ".", 0, 2);
+        addSplitFilePaths(filePath + ".", 0, 3);
+    }
+}
+
 void SceneFactory::createFromUnleashedOrGenerations(const std::string& directoryPath)
 {
     // Load resources
@@ -934,6 +993,8 @@ void SceneFactory::createFromUnleashedOrGenerations(const std::string& directory
 
         const auto loadArchiveIfExist = [&](const std::string& filePath)
         {
+            addSourceFilePath(filePath);
+
             if (std::filesystem::exists(filePath))
                 loadArchive(archive, toNchar(filePath.c_str()).data());
         };
@@ -942,6 +1003,7 @@ void SceneFactory::createFromUnleashedOrGenerations(const std::string& directory
 
         if (!std::filesystem::exists(resArchiveFilePath)) // Very likely Unleashed
         {
+            addSourceFilePath(resArchiveFilePath);
             loadArchiveIfExist(rootDirPath + stageName + ".ar.00");
             loadArchiveIfExist(highPrioArFilePath);
 
@@ -1006,6 +1068,8 @@ void SceneFactory::createFromUnleashedOrGenerations(const std::string& directory
     {
         tbb::task_group group;
 
+        addSourceFilePath(directoryPath + "/Stage.pfd");
+
         auto pfdArchive = hl::hh::pfd::load(toNchar((directoryPath + "/Stage.pfd").c_str()).data());
 
         for (auto& entry : pfdArchive)
@@ -1043,6 +1107,8 @@ void SceneFactory::createFromLostWorldOrForces(const std::string& directoryPath)
 {
     std::vector<hl::archive> archives;
     {
+        addSourceFilePath(directoryPath + "/" + stageName + "_trr_cmn.pac");
+
         auto filePath = toNchar((directoryPath + "/" + stageName + "_trr_cmn.pac").c_str());
         auto archive = hl::pacx::load(filePath.data());
 
@@ -1057,6 +1123,8 @@ void SceneFactory::createFromLostWorldOrForces(const std::string& directoryPath)
         char slot[4];
         sprintf(slot, "%02lld", i);
 
+        addSourceFilePath(directoryPath + "/" + stageName + "_trr_s" + slot + ".pac");
+
         auto filePath = toNchar((directoryPath + "/" + stageName + "_trr_s" + slot + ".pac").c_str());
 
         if (!hl::path::exists(filePath.data()))
@@ -1084,6 +1152,8 @@ void SceneFactory::createFromLostWorldOrForces(const std::string& directoryPath)
 
     archives.clear();
 
+    addSourceFilePath(directoryPath + "/" + stageName + "_sky.pac");
+
     auto skyFilePath = toNchar((directoryPath + "/" + stageName + "_sky.pac").c_str());
 
     if (hl::path::exists(skyFilePath.data()))
@@ -1093,6 +1163,8 @@ void SceneFactory::createFromLostWorldOrForces(const std::string& directoryPath)
     scene->buildAABB();
     scene->createLightBVH();
 
+    addSourceFilePath(directoryPath + "/" + stageName + "_misc.pac");
+
     auto miscFilePath = toNchar((directoryPath + "/" + stageName + "_misc.pac").c_str());
 
     if (hl::path::exists(miscFilePath.data()))
@@ -1103,13 +1175,21 @@ std::unique_ptr<Scene> SceneFactory::create(const std::string& directoryPath)
 {
     SceneFactory factory;
 
-    factory.scene = std::make_unique<Scene>();
     factory.stageName = getFileNameWithoutExtension(directoryPath);
 
+    const std::string cacheFilePath = directoryPath + "/" + factory.stageName + ".hgscene";
+
+    if (auto scene = SceneCache::load(cacheFilePath))
+        return scene;
+
+    factory.scene = std::make_unique<Scene>();
+
     if (std::filesystem::exists(directoryPath + "/Stage.pfd"))
         factory.createFromUnleashedOrGenerations(directoryPath);
     else
         factory.createFromLostWorldOrForces(directoryPath);
 
+    SceneCache::save(cacheFilePath, *factory.scene, factory.sourceFilePaths);
+
     return std::move(factory.scene);
 }
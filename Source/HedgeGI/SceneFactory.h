@@ -16,8 +16,12 @@ class SceneFactory
 private:
     std::unique_ptr<Scene> scene;
     std::string stageName;
+    std::vector<std::string> sourceFilePaths; // Every file read or probed, missing ones included, for the scene cache
     CriticalSection criticalSection;
 
+    // First mesh created from each raw mesh and its transformation, see Mesh::prototype
+    phmap::flat_hash_map<const void*, std::pair<const Mesh*, Affine3>> meshPrototypes;
+
     std::unique_ptr<Bitmap> createBitmap(const uint8_t* data, size_t length) const;
 
     template<typename T>
@@ -39,6 +43,8 @@ private:
     void loadResolutions(const hl::archive& archive) const;
     void loadSceneEffect(const hl::archive& archive) const;
 
+    void addSourceFilePath(const std::string& filePath);
+
     void createFromUnleashedOrGenerations(const std::string& directoryPath);
     void createFromLostWorldOrForces(const std::string& directoryPath);
 
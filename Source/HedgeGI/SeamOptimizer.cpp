@@ -5,146 +5,361 @@
 #include "Instance.h"
 #include "Mesh.h"
 
-void SeamOptimizer::blend(const size_t stepCount, const Vector2& startA, const Vector2& endA,
-    const Vector2& startB, const Vector2& endB, const Bitmap& bitmap)
+namespace
 {
-    const Vector2 factor =
+    constexpr double SEAM_CELL_SIZE = 0.001;
+
+    // Twice the tolerance of nearlyEqual, so any two positions it considers equal always share a cell
+    constexpr double SEAM_CELL_MARGIN = 0.0002;
+
+    using SeamCell = std::array<int64_t, 3>;
+
+    struct EdgeNode
     {
-        0.5f * (1.0f / (float)bitmap.width),
-        0.5f * (1.0f / (float)bitmap.height),
+        uint64_t key;
+        uint32_t meshIndex;
+        uint32_t triangleIndex;
+        uint8_t edge; // Corner the edge starts at, it ends at the next one
+        bool primary; // Keyed on the cells the corners lie in rather than on a neighbor within the margin
+
+        bool operator<(const EdgeNode& other) const
+        {
+            if (key != other.key) return key < other.key;
+            if (meshIndex != other.meshIndex) return meshIndex < other.meshIndex;
+            if (triangleIndex != other.triangleIndex) return triangleIndex < other.triangleIndex;
+            if (edge != other.edge) return edge < other.edge;
+            return primary > other.primary;
+        }
+
+        bool isBefore(const EdgeNode& other) const
+        {
+            if (meshIndex != other.meshIndex) return meshIndex < other.meshIndex;
+            if (triangleIndex != other.triangleIndex) return triangleIndex < other.triangleIndex;
+            return edge < other.edge;
+        }
     };
 
-    for (size_t i = 0; i < stepCount; i++)
+    // The cell the position lies in comes first, followed by the neighbors it is within the margin of
+    size_t getCells(const Eigen::Vector3f& position, SeamCell (&cells)[8])
     {
-        const float lerpFactor = (i + 0.5f) / stepCount;
-
-        const Vector2 a = lerp(startA, endA, lerpFactor);
-        const Vector2 b = lerp(startB, endB, lerpFactor);
+        int64_t axisCells[3][2];
+        size_t axisCounts[3];
 
-        for (size_t j = 0; j < _countof(BAKE_POINT_OFFSETS); j++)
+        for (size_t i = 0; i < 3; i++)
         {
-            const Vector2 offsetA = a + BAKE_POINT_OFFSETS[j].cwiseProduct(factor);
-            const Vector2 offsetB = b + BAKE_POINT_OFFSETS[j].cwiseProduct(factor);
+            const double value = (double)position[i] / SEAM_CELL_SIZE;
+            const double cell = std::floor(value + 0.5);
+
+            axisCells[i][0] = (int64_t)cell;
+            axisCounts[i] = 1;
+
+            if (value - cell > 0.5 - SEAM_CELL_MARGIN / SEAM_CELL_SIZE)
+                axisCells[i][axisCounts[i]++] = (int64_t)cell + 1;
+
+            else if (value - cell < SEAM_CELL_MARGIN / SEAM_CELL_SIZE - 0.5)
+                axisCells[i][axisCounts[i]++] = (int64_t)cell - 1;
+        }
+
+        size_t count = 0;
 
-            for (size_t k = 0; k < bitmap.arraySize; k++)
+        for (size_t x = 0; x < axisCounts[0]; x++)
+        {
+            for (size_t y = 0; y < axisCounts[1]; y++)
             {
-                const Color4 color = (bitmap.getColor(offsetA, k) + bitmap.getColor(offsetB, k)) / 2.0f;
-                //const Color4 color { 1, 0, 0, 1 };
-                bitmap.setColor(color, offsetA, k);
-                bitmap.setColor(color, offsetB, k);
+                for (size_t z = 0; z < axisCounts[2]; z++)
+                    cells[count++] = { axisCells[0][x], axisCells[1][y], axisCells[2][z] };
             }
         }
+
+        return count;
+    }
+
+    uint64_t hashCombine(uint64_t hash, const int64_t value)
+    {
+        hash ^= (uint64_t)value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2);
+        return hash;
+    }
+
+    uint32_t getVertexIndex(const Mesh& mesh, const EdgeNode& node, const uint8_t corner)
+    {
+        const Triangle& triangle = mesh.triangles[node.triangleIndex];
+        return corner == 0 ? triangle.a : corner == 1 ? triangle.b : triangle.c;
+    }
+
+    bool isSameVertex(const Mesh& meshA, const uint32_t indexA, const Mesh& meshB, const uint32_t indexB)
+    {
+        return nearlyEqual(meshA.bakeVertices[indexA].position, meshB.bakeVertices[indexB].position) && 
+            meshA.getNormal(indexA).dot(meshB.getNormal(indexB)) > 0.9f;
+    }
+
+    size_t wrap(const int64_t value, const size_t size)
+    {
+        const int64_t wrapped = value % (int64_t)size;
+        return (size_t)(wrapped < 0 ? wrapped + (int64_t)size : wrapped);
     }
 }
 
-void SeamOptimizer::compareAndBlend(const Mesh& mA, const Mesh& mB, const Triangle& tA, const Triangle& tB, const Bitmap& bitmap)
+size_t SeamOptimizer::computeStepCount(const Vector2& p1, const Vector2& p2, const size_t width, const size_t height)
 {
-    const Vertex* vA[3];
-    const Vertex* vB[3];
+    const float x = abs(p1.x() - p2.x()) * width;
+    const float y = abs(p1.y() - p2.y()) * height;
+    return (size_t)ceilf(sqrtf(x * x + y * y));
+}
 
-    vA[0] = &mA.vertices[tA.a];
-    vA[1] = &mA.vertices[tA.b];
-    vA[2] = &mA.vertices[tA.c];
-    vB[0] = &mB.vertices[tB.a];
-    vB[1] = &mB.vertices[tB.b];
-    vB[2] = &mB.vertices[tB.c];
+void SeamOptimizer::createTexelPairs(const size_t width, const size_t height)
+{
+    this->width = width;
+    this->height = height;
 
-    for (size_t startA = 0; startA < 3; startA++)
+    const Vector2 factor =
     {
-        const int32_t startB = findVertex(vA[startA]->position, vA[startA]->normal, *vB[0], *vB[1], *vB[2]);
-        if (startB == -1)
-            continue;
+        0.5f * (1.0f / (float)width),
+        0.5f * (1.0f / (float)height),
+    };
 
-        const bool startNearlyEqual = nearlyEqual(vA[startA]->vPos, vB[startB]->vPos);
+    // Every pair goes in both directions, so each texel sees all of its partners once grouped
+    tbb::combinable<std::vector<std::pair<uint32_t, uint32_t>>> threadPairs;
 
-        for (size_t endB = 0; endB < 3; endB++)
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, edges.size()), [&](const tbb::blocked_range<size_t>& range)
+    {
+        auto& pairs = threadPairs.local();
+
+        for (size_t i = range.begin(); i < range.end(); i++)
         {
-            if (startB == endB)
-                continue;
+            const SeamEdge& edge = edges[i];
+
+            const size_t stepCount = std::max(
+                computeStepCount(edge.startA, edge.endA, width, height),
+                computeStepCount(edge.startB, edge.endB, width, height));
 
-            const int32_t endA = findVertex(vB[endB]->position, vB[endB]->normal, *vA[0], *vA[1], *vA[2]);
-            if (endA == -1)
-                continue;
+            for (size_t j = 0; j < stepCount; j++)
+            {
+                const float lerpFactor = (j + 0.5f) / stepCount;
 
-            if (startNearlyEqual && nearlyEqual(vA[endA]->vPos, vB[endB]->vPos))
-                continue;
+                const Vector2 a = lerp(edge.startA, edge.endA, lerpFactor);
+                const Vector2 b = lerp(edge.startB, edge.endB, lerpFactor);
 
-            const size_t cA = computeStepCount(vA[startA]->vPos, vA[endA]->vPos, bitmap.width, bitmap.height);
-            const size_t cB = computeStepCount(vB[startB]->vPos, vB[endB]->vPos, bitmap.width, bitmap.height);
+                for (size_t k = 0; k < _countof(BAKE_POINT_OFFSETS); k++)
+                {
+                    const Vector2 offsetA = a + BAKE_POINT_OFFSETS[k].cwiseProduct(factor);
+                    const Vector2 offsetB = b + BAKE_POINT_OFFSETS[k].cwiseProduct(factor);
 
-            blend(std::max(cA, cB), vA[startA]->vPos, vA[endA]->vPos, vB[startB]->vPos, vB[endB]->vPos, bitmap);
+                    const uint32_t texelA = (uint32_t)(wrap((int64_t)(offsetA.y() * (float)height), height) * width + wrap((int64_t)(offsetA.x() * (float)width), width));
+                    const uint32_t texelB = (uint32_t)(wrap((int64_t)(offsetB.y() * (float)height), height) * width + wrap((int64_t)(offsetB.x() * (float)width), width));
+
+                    if (texelA == texelB)
+                        continue;
+
+                    pairs.emplace_back(texelA, texelB);
+                    pairs.emplace_back(texelB, texelA);
+                }
+            }
         }
+    });
+
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;
+
+    threadPairs.combine_each([&](const std::vector<std::pair<uint32_t, uint32_t>>& local)
+    {
+        pairs.insert(pairs.end(), local.begin(), local.end());
+    });
+
+    tbb::parallel_sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    texels.clear();
+    partnerOffsets.clear();
+    partners.clear();
+    partners.reserve(pairs.size());
+
+    for (auto& [texel, partner] : pairs)
+    {
+        if (texels.empty() || texels.back() != texel)
+        {
+            texels.push_back(texel);
+            partnerOffsets.push_back((uint32_t)partners.size());
+        }
+
+        partners.push_back(partner);
     }
-}
 
-size_t SeamOptimizer::computeStepCount(const Vector2& p1, const Vector2& p2, const size_t width, const size_t height)
-{
-    const float x = abs(p1.x() - p2.x()) * width;
-    const float y = abs(p1.y() - p2.y()) * height;
-    return (size_t)ceilf(sqrtf(x * x + y * y));
+    partnerOffsets.push_back((uint32_t)partners.size());
 }
 
-int32_t SeamOptimizer::findVertex(const Vector3& position, const Vector3& normal, const Vertex& a, const Vertex& b, const Vertex& c)
+SeamOptimizer::SeamOptimizer(const Instance& instance)
 {
-    if (nearlyEqual(a.position, position) && a.normal.dot(normal) > 0.9f) return 0;
-    if (nearlyEqual(b.position, position) && b.normal.dot(normal) > 0.9f) return 1;
-    if (nearlyEqual(c.position, position) && c.normal.dot(normal) > 0.9f) return 2;
-    return -1;
-}
+    tbb::combinable<std::vector<EdgeNode>> threadNodes;
 
-SeamOptimizer::SeamOptimizer(const Instance& instance) : instance(instance)
-{
-    for (size_t i = 0; i < instance.meshes.size(); i++)
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, instance.meshes.size()), [&](const tbb::blocked_range<size_t>& range)
     {
-        const Mesh* mesh = instance.meshes[i];
+        auto& localNodes = threadNodes.local();
 
-        for (size_t j = 0; j < mesh->triangleCount; j++)
+        for (size_t i = range.begin(); i < range.end(); i++)
         {
-            const Triangle& triangle = mesh->triangles[j];
-            const Vertex& a = mesh->vertices[triangle.a];
-            const Vertex& b = mesh->vertices[triangle.b];
-            const Vertex& c = mesh->vertices[triangle.c];
+            const Mesh* mesh = instance.meshes[i];
+
+            for (uint32_t j = 0; j < mesh->triangleCount; j++)
+            {
+                const Triangle& triangle = mesh->triangles[j];
+                const BakeVertex* vertices[] = { &mesh->bakeVertices[triangle.a], &mesh->bakeVertices[triangle.b], &mesh->bakeVertices[triangle.c] };
+
+                // Skip if the triangle is degenerate
+                if (nearlyEqual(vertices[0]->vPos, vertices[1]->vPos) || nearlyEqual(vertices[1]->vPos, vertices[2]->vPos) || nearlyEqual(vertices[2]->vPos, vertices[0]->vPos))
+                    continue;
+
+                for (uint8_t k = 0; k < 3; k++)
+                {
+                    SeamCell startCells[8];
+                    SeamCell endCells[8];
+
+                    const size_t startCellCount = getCells(vertices[k]->position, startCells);
+                    const size_t endCellCount = getCells(vertices[(k + 1) % 3]->position, endCells);
+
+                    // Corners close to a cell boundary also key the edge on the neighboring cells
+                    uint64_t keys[64];
+                    size_t keyCount = 0;
 
-            // Skip if the triangle is degenerate
-            if (nearlyEqual(a.vPos, b.vPos) || nearlyEqual(b.vPos, c.vPos) || nearlyEqual(c.vPos, a.vPos))
-                continue;
+                    for (size_t l = 0; l < startCellCount; l++)
+                    {
+                        for (size_t m = 0; m < endCellCount; m++)
+                        {
+                            // Neighbors walk shared edges in the opposite direction, so the key doesn't depend on the order of the ends
+                            const SeamCell& first = std::min(startCells[l], endCells[m]);
+                            const SeamCell& second = std::max(startCells[l], endCells[m]);
 
-            nodes.push_back({ std::min(a.position.x(), std::min(b.position.x(), c.position.x())), (uint32_t)i, (uint32_t)j });
+                            uint64_t key = 0;
+
+                            for (const int64_t value : first) key = hashCombine(key, value);
+                            for (const int64_t value : second) key = hashCombine(key, value);
+
+                            if (std::find(keys, keys + keyCount, key) != keys + keyCount)
+                                continue;
+
+                            keys[keyCount++] = key;
+                            localNodes.push_back({ key, (uint32_t)i, j, k, l == 0 && m == 0 });
+                        }
+                    }
+                }
+            }
         }
+    });
+
+    std::vector<EdgeNode> nodes;
+
+    threadNodes.combine_each([&](const std::vector<EdgeNode>& local)
+    {
+        nodes.insert(nodes.end(), local.begin(), local.end());
+    });
+
+    tbb::parallel_sort(nodes.begin(), nodes.end());
+
+    // Edges sharing a key are compared with each other, groups stay tiny for manifold geometry
+    std::vector<size_t> groupOffsets;
+
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (i == 0 || nodes[i].key != nodes[i - 1].key)
+            groupOffsets.push_back(i);
     }
 
-    nodes.sort([](const auto& left, const auto& right) { return left.key < right.key; });
+    groupOffsets.push_back(nodes.size());
+
+    tbb::combinable<std::vector<SeamEdge>> threadEdges;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, groupOffsets.size() - 1), [&](const tbb::blocked_range<size_t>& range)
+    {
+        auto& localEdges = threadEdges.local();
+
+        for (size_t i = range.begin(); i < range.end(); i++)
+        {
+            for (size_t j = groupOffsets[i]; j < groupOffsets[i + 1]; j++)
+            {
+                const EdgeNode& nodeA = nodes[j];
+
+                // Matching edges always share the primary key of either one, so each pair is compared 
+                // once in the primary cell of the edge that comes first
+                if (!nodeA.primary)
+                    continue;
+
+                const Mesh& meshA = *instance.meshes[nodeA.meshIndex];
+                const uint32_t startIndexA = getVertexIndex(meshA, nodeA, nodeA.edge);
+                const uint32_t endIndexA = getVertexIndex(meshA, nodeA, (nodeA.edge + 1) % 3);
+
+                for (size_t k = groupOffsets[i]; k < groupOffsets[i + 1]; k++)
+                {
+                    const EdgeNode& nodeB = nodes[k];
+
+                    if (!nodeA.isBefore(nodeB) || (nodeA.meshIndex == nodeB.meshIndex && nodeA.triangleIndex == nodeB.triangleIndex))
+                        continue;
+
+                    const Mesh& meshB = *instance.meshes[nodeB.meshIndex];
+                    uint32_t startIndexB = getVertexIndex(meshB, nodeB, nodeB.edge);
+                    uint32_t endIndexB = getVertexIndex(meshB, nodeB, (nodeB.edge + 1) % 3);
+
+                    if (!isSameVertex(meshA, startIndexA, meshB, startIndexB) || !isSameVertex(meshA, endIndexA, meshB, endIndexB))
+                    {
+                        std::swap(startIndexB, endIndexB);
+
+                        if (!isSameVertex(meshA, startIndexA, meshB, startIndexB) || !isSameVertex(meshA, endIndexA, meshB, endIndexB))
+                            continue;
+                    }
+
+                    const Vector2& startA = meshA.bakeVertices[startIndexA].vPos;
+                    const Vector2& endA = meshA.bakeVertices[endIndexA].vPos;
+                    const Vector2& startB = meshB.bakeVertices[startIndexB].vPos;
+                    const Vector2& endB = meshB.bakeVertices[endIndexB].vPos;
+
+                    // Not a seam if both sides share their lightmap UVs
+                    if (nearlyEqual(startA, startB) && nearlyEqual(endA, endB))
+                        continue;
+
+                    localEdges.push_back({ startA, endA, startB, endB });
+                }
+            }
+        }
+    });
+
+    threadEdges.combine_each([&](const std::vector<SeamEdge>& local)
+    {
+        edges.insert(edges.end(), local.begin(), local.end());
+    });
 }
 
 SeamOptimizer::~SeamOptimizer() = default;
 
-std::unique_ptr<Bitmap> SeamOptimizer::optimize(const Bitmap& bitmap) const
+void SeamOptimizer::optimize(const Bitmap& bitmap)
 {
-    std::unique_ptr<Bitmap> optimized = std::make_unique<Bitmap>(bitmap, true);
+    if (edges.empty())
+        return;
 
-    std::list<const SeamNode*> list;
-    for (auto& node : nodes)
+    if (bitmap.width != width || bitmap.height != height)
+        createTexelPairs(bitmap.width, bitmap.height);
+
+    std::vector<Color4> colors(texels.size());
+
+    for (size_t arrayIndex = 0; arrayIndex < bitmap.arraySize; arrayIndex++)
     {
-        list.push_back(&node);
-        for (auto it = list.begin(); it != list.end();)
+        const size_t sliceOffset = bitmap.width * bitmap.height * arrayIndex;
+
+        // Every texel becomes the mean of its blends with each partner, computed from the unmodified bitmap
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, texels.size()), [&](const tbb::blocked_range<size_t>& range)
         {
-            if (abs(node.key - (*it)->key) < 0.0001f)
+            for (size_t i = range.begin(); i < range.end(); i++)
             {
-                const Mesh* meshA = instance.meshes[node.meshIndex];
-                const Triangle& triangleA = meshA->triangles[node.triangleIndex];
-                const Mesh* meshB = instance.meshes[(*it)->meshIndex];
-                const Triangle& triangleB = meshB->triangles[(*it)->triangleIndex];
+                const Color4 color = bitmap.getColor(sliceOffset + texels[i]);
+                Color4 sum = Color4::Zero();
 
-                compareAndBlend(*meshA, *meshB, triangleA, triangleB, *optimized);
+                for (uint32_t j = partnerOffsets[i]; j < partnerOffsets[i + 1]; j++)
+                    sum += (color + bitmap.getColor(sliceOffset + partners[j])) / 2.0f;
 
-                ++it;
+                colors[i] = sum / (float)(partnerOffsets[i + 1] - partnerOffsets[i]);
             }
-            else
-            {
-                it = list.erase(it);
-            }
-        }
-    }
+        });
 
-    return optimized;
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, texels.size()), [&](const tbb::blocked_range<size_t>& range)
+        {
+            for (size_t i = range.begin(); i < range.end(); i++)
+                bitmap.setColor(colors[i], sliceOffset + texels[i]);
+        });
+    }
 }
@@ -2,30 +2,34 @@
 
 class Bitmap;
 class Instance;
-class Mesh;
 
-struct Triangle;
-struct Vertex;
-
-struct SeamNode
+// Edge shared by two triangles that map it to different places in the lightmap
+struct SeamEdge
 {
-    float key;
-    uint32_t meshIndex;
-    uint32_t triangleIndex;
+    Vector2 startA;
+    Vector2 endA;
+    Vector2 startB;
+    Vector2 endB;
 };
 
 class SeamOptimizer
 {
-    const Instance& instance;
-    std::list<SeamNode> nodes;
+    std::vector<SeamEdge> edges;
+
+    // Texels blended with each other at the current resolution, partners of texels[i] are in [partnerOffsets[i], partnerOffsets[i + 1])
+    size_t width{};
+    size_t height{};
+    std::vector<uint32_t> texels;
+    std::vector<uint32_t> partnerOffsets;
+    std::vector<uint32_t> partners;
 
-    static void blend(size_t stepCount, const Vector2& startA, const Vector2& endA, const Vector2& startB, const Vector2& endB, const Bitmap& bitmap);
-    static void compareAndBlend(const Mesh& mA, const Mesh& mB, const Triangle& tA, const Triangle& tB, const Bitmap& bitmap);
     static size_t computeStepCount(const Vector2& p1, const Vector2& p2, size_t width, size_t height);
-    static int32_t findVertex(const Vector3& position, const Vector3& normal, const Vertex& a, const Vertex& b, const Vertex& c);
+    void createTexelPairs(size_t width, size_t height);
+
 public:
     SeamOptimizer(const Instance& instance);
     ~SeamOptimizer();
 
-    std::unique_ptr<Bitmap> optimize(const Bitmap& bitmap) const;
+    // Blends the texels on both sides of every seam in place, texel pairs are reused for bitmaps of the same size
+    void optimize(const Bitmap& bitmap);
 };
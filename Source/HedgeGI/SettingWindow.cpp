@@ -59,6 +59,64 @@ const Label MAX_RUSSIAN_ROULETTE_DEPTH_LABEL = { "Max Russian Roulette Depth",
     "Controls how further in the russian roulette optimization is going to be applied.\n\n"
     "Increasing this value is going to unnecessarily increase bake times with no apparent visual improvements." };
 
+const Label LOCAL_LIGHT_SAMPLE_COUNT_LABEL = { "Local Light Sample Count",
+    "Number of point lights to pick at every light bounce.\n\n"
+    "Lights are picked randomly, favoring the ones that are closer and brighter, so stages with many point lights do not get slower to bake.\n\n"
+    "Increasing this value is going to reduce noise around point lights at the cost of longer bake times." };
+
+const Label SAMPLER_RANDOM_LABEL = { "Random",
+    "Uses uniform random numbers for every sample." };
+
+const Label SAMPLER_SOBOL_LABEL = { "Sobol",
+    "Spreads the samples of every pixel evenly over light directions, light picks and shadow offsets using a scrambled Sobol sequence.\n\n"
+    "This converges faster than random numbers at the same sample count.\n\n"
+    "This value is not going to make any changes in the viewport." };
+
+const Label ADAPTIVE_SAMPLING_LABEL = { "Adaptive Sampling",
+    "Traces samples in rounds and stops sampling a pixel once its noise falls under the threshold.\n\n"
+    "Sample count becomes the maximum number of samples a pixel can receive, so flat and open areas finish early while dark corners keep getting samples.\n\n"
+    "Light field cells are always sampled fully.\n\n"
+    "This value is not going to make any changes in the viewport." };
+
+const Label MIN_SAMPLE_COUNT_LABEL = { "Min Sample Count",
+    "Number of samples every pixel receives before its noise is estimated, and in every round after that.\n\n"
+    "Values that are too low might cause noisy pixels to be considered finished by chance." };
+
+const Label SAMPLE_BUDGET_LABEL = { "Sample Budget",
+    "Average number of samples a pixel can receive in a single instance.\n\n"
+    "Samples left over by finished pixels are spent on the noisy ones. Set to 0 to only limit pixels by the sample count." };
+
+const Label NOISE_THRESHOLD_LABEL = { "Noise Threshold",
+    "Relative noise a pixel has to fall under to stop receiving samples.\n\n"
+    "Lower values are going to result in less noisy images but also longer bake times." };
+
+const Label RADIANCE_CACHE_LABEL = { "Radiance Cache",
+    "Stores the light leaving surfaces in a grid while baking, so light bounces after the first one can be looked up instead of traced.\n\n"
+    "This makes bakes with many bounces significantly faster, at the cost of slightly blurrier indirect lighting.\n\n"
+    "This value is not going to make any changes in the viewport." };
+
+const Label RADIANCE_CACHE_CELL_SIZE_LABEL = { "Cell Size",
+    "Size of a radiance cache cell in world units.\n\n"
+    "Smaller values keep more detail in indirect lighting but need more samples to warm up." };
+
+const Label RADIANCE_CACHE_WARM_UP_LABEL = { "Warm Up Sample Count",
+    "Number of fully traced samples a radiance cache cell gathers before paths start ending into it.\n\n"
+    "Lower values are faster but might cause blotches in indirect lighting." };
+
+const Label TRACER_SCALAR_LABEL = { "Scalar",
+    "Traces every light sample one ray at a time." };
+
+const Label TRACER_PACKET_LABEL = { "Packet",
+    "Traces the first bounce of light samples in packets of 8-16 rays, then continues each path one ray at a time.\n\n"
+    "This is faster on processors with wide vector units and produces the same result as the scalar tracer, with different noise.\n\n"
+    "This value is not going to make any changes in the viewport." };
+
+const Label TRACER_WAVEFRONT_LABEL = { "Wavefront",
+    "Traces all light samples breadth first, one bounce at a time.\n\n"
+    "Hits are grouped by material before shading and shadow rays are traced in bulk, which keeps caches warm in scenes with many materials.\n\n"
+    "This produces the same result as the scalar tracer, with different noise.\n\n"
+    "This value is not going to make any changes in the viewport." };
+
 const Label SHADOW_SAMPLE_COUNT_LABEL = { "Sample Count",
     "Number of samples to use for each pixel in a shadow map.\n\n"
     "As shadows don't have much variance, values between 64-128 are going to look good enough and bake fast.\n\n"
@@ -184,6 +242,35 @@ void SettingWindow::update(float deltaTime)
         property(LIGHT_BOUNCE_COUNT_LABEL, ImGuiDataType_U32, &params->light.bounceCount);
         property(LIGHT_SAMPLE_COUNT_LABEL, ImGuiDataType_U32, &params->light.sampleCount);
         property(MAX_RUSSIAN_ROULETTE_DEPTH_LABEL, ImGuiDataType_U32, &params->light.maxRussianRouletteDepth);
+        property(LOCAL_LIGHT_SAMPLE_COUNT_LABEL, ImGuiDataType_U32, &params->light.localLightSampleCount);
+        property("Tracer",
+            {
+                { TRACER_SCALAR_LABEL, TracerType::Scalar },
+                { TRACER_PACKET_LABEL, TracerType::Packet },
+                { TRACER_WAVEFRONT_LABEL, TracerType::Wavefront },
+            }, params->light.tracerType);
+        property("Sampler",
+            {
+                { SAMPLER_RANDOM_LABEL, SamplerType::Random },
+                { SAMPLER_SOBOL_LABEL, SamplerType::Sobol },
+            }, params->light.samplerType);
+
+        property(ADAPTIVE_SAMPLING_LABEL, params->light.adaptiveSampling);
+
+        if (params->light.adaptiveSampling)
+        {
+            property(MIN_SAMPLE_COUNT_LABEL, ImGuiDataType_U32, &params->light.minSampleCount);
+            property(SAMPLE_BUDGET_LABEL, ImGuiDataType_U32, &params->light.sampleBudget);
+            property(NOISE_THRESHOLD_LABEL, ImGuiDataType_Float, &params->light.noiseThreshold);
+        }
+
+        property(RADIANCE_CACHE_LABEL, params->light.radianceCache);
+
+        if (params->light.radianceCache)
+        {
+            property(RADIANCE_CACHE_CELL_SIZE_LABEL, ImGuiDataType_Float, &params->light.radianceCacheCellSize);
+            property(RADIANCE_CACHE_WARM_UP_LABEL, ImGuiDataType_U32, &params->light.radianceCacheWarmUpSampleCount);
+        }
         endProperties();
     }
 
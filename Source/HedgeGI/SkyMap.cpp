@@ -0,0 +1,128 @@
+﻿#include "SkyMap.h"
+
+#include "BakingFactory.h"
+#include "Math.h"
+
+size_t SkyMap::getIndex(const Vector3& direction) const
+{
+    const Vector2 texCoord = octahedralEncode(direction);
+
+    const size_t x = std::min(SIZE - 1, (size_t)(texCoord.x() * (float)SIZE));
+    const size_t y = std::min(SIZE - 1, (size_t)(texCoord.y() * (float)SIZE));
+
+    return y * SIZE + x;
+}
+
+bool SkyMap::valid() const
+{
+    return radiance != nullptr;
+}
+
+bool SkyMap::canSample() const
+{
+    return weightSum > 0.0f;
+}
+
+void SkyMap::reset()
+{
+    radiance = nullptr;
+    weights = nullptr;
+    marginalCdf = nullptr;
+    conditionalCdf = nullptr;
+    weightSum = 0.0f;
+}
+
+void SkyMap::build(const RaytracingContext& raytracingContext, const TargetEngine targetEngine)
+{
+    radiance = std::make_unique<Color3[]>(SIZE * SIZE);
+    weights = std::make_unique<float[]>(SIZE * SIZE);
+    marginalCdf = std::make_unique<float[]>(SIZE + 1);
+    conditionalCdf = std::make_unique<float[]>(SIZE * (SIZE + 1));
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, SIZE), [&](const tbb::blocked_range<size_t>& range)
+    {
+        for (size_t y = range.begin(); y < range.end(); y++)
+        {
+            for (size_t x = 0; x < SIZE; x++)
+            {
+                Color3 color = Color3::Zero();
+
+                for (size_t i = 0; i < SUB_SAMPLE_COUNT; i++)
+                {
+                    for (size_t j = 0; j < SUB_SAMPLE_COUNT; j++)
+                    {
+                        const Vector2 texCoord(
+                            ((float)x + ((float)i + 0.5f) / SUB_SAMPLE_COUNT) / (float)SIZE,
+                            ((float)y + ((float)j + 0.5f) / SUB_SAMPLE_COUNT) / (float)SIZE);
+
+                        color += BakingFactory::traceSky(raytracingContext, octahedralDecode(texCoord), targetEngine);
+                    }
+                }
+
+                color /= (float)(SUB_SAMPLE_COUNT * SUB_SAMPLE_COUNT);
+
+                // Weight by the solid angle the texel covers, see pdf() for the derivation.
+                const Vector3 direction = octahedralDecode({ ((float)x + 0.5f) / (float)SIZE, ((float)y + 0.5f) / (float)SIZE });
+                const float l1 = std::abs(direction.x()) + std::abs(direction.y()) + std::abs(direction.z());
+
+                radiance[y * SIZE + x] = color;
+                weights[y * SIZE + x] = getLuminance(color) * l1 * l1 * l1;
+            }
+        }
+    });
+
+    // Build the 2D distribution
+    weightSum = 0.0f;
+    marginalCdf[0] = 0.0f;
+
+    for (size_t y = 0; y < SIZE; y++)
+    {
+        float* cdf = &conditionalCdf[y * (SIZE + 1)];
+        cdf[0] = 0.0f;
+
+        for (size_t x = 0; x < SIZE; x++)
+            cdf[x + 1] = cdf[x] + weights[y * SIZE + x];
+
+        const float rowSum = cdf[SIZE];
+
+        for (size_t x = 1; x <= SIZE; x++)
+            cdf[x] = rowSum > 0.0f ? cdf[x] / rowSum : (float)x / (float)SIZE;
+
+        marginalCdf[y + 1] = marginalCdf[y] + rowSum;
+        weightSum += rowSum;
+    }
+
+    for (size_t y = 1; y <= SIZE; y++)
+        marginalCdf[y] = weightSum > 0.0f ? marginalCdf[y] / weightSum : (float)y / (float)SIZE;
+}
+
+Color3 SkyMap::getRadiance(const Vector3& direction) const
+{
+    return radiance[getIndex(direction)];
+}
+
+Vector3 SkyMap::sample(const float u1, const float u2) const
+{
+    const float* marginal = marginalCdf.get();
+    const size_t y = std::min<size_t>(SIZE - 1, std::max<ptrdiff_t>(0, std::upper_bound(marginal, marginal + SIZE + 1, u1) - marginal - 1));
+
+    const float* cdf = &conditionalCdf[y * (SIZE + 1)];
+    const size_t x = std::min<size_t>(SIZE - 1, std::max<ptrdiff_t>(0, std::upper_bound(cdf, cdf + SIZE + 1, u2) - cdf - 1));
+
+    // Reuse the remainder of the random numbers to pick a point inside the texel
+    const float marginalRange = marginal[y + 1] - marginal[y];
+    const float conditionalRange = cdf[x + 1] - cdf[x];
+
+    const float dy = marginalRange > 0.0f ? saturate((u1 - marginal[y]) / marginalRange) : 0.5f;
+    const float dx = conditionalRange > 0.0f ? saturate((u2 - cdf[x]) / conditionalRange) : 0.5f;
+
+    return octahedralDecode({ ((float)x + dx) / (float)SIZE, ((float)y + dy) / (float)SIZE });
+}
+
+float SkyMap::pdf(const Vector3& direction) const
+{
+    // The octahedral mapping changes area by a factor of 4 * |d|_1^3
+    // (unit square to sphere), so the texel probability gets scaled accordingly.
+    const float l1 = std::abs(direction.x()) + std::abs(direction.y()) + std::abs(direction.z());
+    return weights[getIndex(direction)] / weightSum * (float)(SIZE * SIZE) / (4.0f * l1 * l1 * l1);
+}
@@ -0,0 +1,33 @@
+﻿#pragma once
+
+enum class TargetEngine;
+struct RaytracingContext;
+
+// Octahedral map of the sky model's radiance, built once per scene so
+// escaped paths don't need to trace the sky geometry again. The map also
+// stores a luminance-weighted distribution for importance sampling the sky.
+class SkyMap
+{
+    std::unique_ptr<Color3[]> radiance;
+    std::unique_ptr<float[]> weights;
+    std::unique_ptr<float[]> marginalCdf;
+    std::unique_ptr<float[]> conditionalCdf;
+    float weightSum{};
+
+    size_t getIndex(const Vector3& direction) const;
+
+public:
+    static constexpr size_t SIZE = 256;
+    static constexpr size_t SUB_SAMPLE_COUNT = 2;
+
+    bool valid() const;
+    bool canSample() const;
+
+    void reset();
+    void build(const RaytracingContext& raytracingContext, TargetEngine targetEngine);
+
+    Color3 getRadiance(const Vector3& direction) const;
+
+    Vector3 sample(float u1, float u2) const;
+    float pdf(const Vector3& direction) const;
+};
@@ -7,16 +7,16 @@ bool SnapToClosestTriangle::pointQueryFunc(RTCPointQueryFunctionArguments* args)
 {
     UserData* userData = (UserData*)args->userPtr;
 
-    const Mesh& mesh = *userData->scene->meshes[args->geomID];
+    const Mesh& mesh = *userData->scene->meshes[getMeshIndex(args->geomID, args->context->instID[0])];
 
     const Triangle& triangle = mesh.triangles[args->primID];
-    const Vertex& a = mesh.vertices[triangle.a];
-    const Vertex& b = mesh.vertices[triangle.b];
-    const Vertex& c = mesh.vertices[triangle.c];
+    const Vector3 a = mesh.bakeVertices[triangle.a].position;
+    const Vector3 b = mesh.bakeVertices[triangle.b].position;
+    const Vector3 c = mesh.bakeVertices[triangle.c].position;
 
-    const Vector3 closestPoint = closestPointTriangle(userData->position, a.position, b.position, c.position);
-    const Vector2 baryUV = getBarycentricCoords(closestPoint, a.position, b.position, c.position);
-    const Vector3 normal = barycentricLerp(a.normal, b.normal, c.normal, baryUV);
+    const Vector3 closestPoint = closestPointTriangle(userData->position, a, b, c);
+    const Vector2 baryUV = getBarycentricCoords(closestPoint, a, b, c);
+    const Vector3 normal = barycentricLerp(mesh.getNormal(triangle.a), mesh.getNormal(triangle.b), mesh.getNormal(triangle.c), baryUV);
 
     const float distance = (closestPoint - userData->position).squaredNorm();
     if (distance > userData->distance)
@@ -16,7 +16,6 @@ void StageParams::loadProperties()
     outputDirectoryPath = propertyBag.getString(PROP("outputDirectoryPath"), stage->getDirectoryPath() + "-HedgeGI");
     mode = propertyBag.get(PROP("mode"), BakingFactoryMode::GI);
     skipExistingFiles = propertyBag.get(PROP("skipExistingFiles"), false);
-    resolutionSuperSampleScale = propertyBag.get(PROP("resolutionSuperSampleScale"), 1);
     useExistingLightField = propertyBag.get(PROP("useExistingLightField"), false);
 
     if (stage->getGame() == Game::Forces)
@@ -33,7 +32,6 @@ void StageParams::storeProperties()
     propertyBag.setString(PROP("outputDirectoryPath"), outputDirectoryPath);
     propertyBag.set(PROP("mode"), mode);
     propertyBag.set(PROP("skipExistingFiles"), skipExistingFiles);
-    propertyBag.set(PROP("resolutionSuperSampleScale"), resolutionSuperSampleScale);
     propertyBag.set(PROP("useExistingLightField"), useExistingLightField);
 }
 
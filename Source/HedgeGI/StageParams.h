@@ -24,8 +24,6 @@ public:
     bool skipExistingFiles{ true };
     bool useExistingLightField{};
 
-    size_t resolutionSuperSampleScale{ 1 };
-
     PropertyBag propertyBag;
 
     bool dirty{ false };
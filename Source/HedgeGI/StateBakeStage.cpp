@@ -75,14 +75,7 @@ void StateBakeStage::update(float deltaTime)
         {
             const uint16_t resolution = params->resolution.override > 0 ? params->resolution.override : lastBakedInstance->getResolution(params->propertyBag);
 
-            if (params->resolutionSuperSampleScale > 1)
-            {
-                const uint16_t resolutionSuperSampled = (uint16_t)(resolution * params->resolutionSuperSampleScale);
-                sprintf(overlay, "%s (%dx%d to %dx%d)", lastBakedInstance->name.c_str(), resolutionSuperSampled, resolutionSuperSampled, resolution, resolution);
-            }
-
-            else
-                sprintf(overlay, "%s (%dx%d)", lastBakedInstance->name.c_str(), resolution, resolution);
+            sprintf(overlay, "%s (%dx%d)", lastBakedInstance->name.c_str(), resolution, resolution);
 
             fraction = bakeProgress / (float)std::max<size_t>(1, stage->getScene()->instances.size());
         }
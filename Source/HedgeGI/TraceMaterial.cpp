@@ -0,0 +1,100 @@
+﻿#include "TraceMaterial.h"
+
+#include "BakeParams.h"
+#include "Bitmap.h"
+#include "Material.h"
+
+namespace
+{
+    const TraceTexture* getTraceTexture(const Bitmap* bitmap)
+    {
+        return bitmap != nullptr && bitmap->traceTexture.valid() ? &bitmap->traceTexture : nullptr;
+    }
+
+    TraceMaterialKernel selectKernel(const uint32_t features, const TargetEngine targetEngine)
+    {
+        // Gloss is only read by HE1, the rest is shared
+        const uint32_t usedFeatures = targetEngine == TargetEngine::HE2 ?
+            features & ~(TRACE_MATERIAL_GLOSS | TRACE_MATERIAL_GLOSS_BLEND) : features;
+
+        const TraceMaterialKernel candidates[] =
+        {
+            TraceMaterialKernel::Untextured,
+            TraceMaterialKernel::Diffuse,
+            targetEngine == TargetEngine::HE2 ? TraceMaterialKernel::DiffuseSpecular : TraceMaterialKernel::DiffuseGloss
+        };
+
+        for (const auto kernel : candidates)
+        {
+            if ((usedFeatures & ~getTraceMaterialKernelFeatures(kernel)) == 0)
+                return kernel;
+        }
+
+        return TraceMaterialKernel::Generic;
+    }
+}
+
+void TraceMaterial::build(const Material* material)
+{
+    *this = {};
+    this->material = material;
+
+    if (material == nullptr)
+        return;
+
+    type = material->type;
+    doubleSided = material->parameters.doubleSided;
+
+    if (type == MaterialType::Sky)
+        return;
+
+    const bool blend = type == MaterialType::Blend;
+
+    diffuse = getTraceTexture(material->textures.diffuse);
+    diffuseBlend = blend ? getTraceTexture(material->textures.diffuseBlend) : nullptr;
+    gloss = getTraceTexture(material->textures.gloss);
+    glossBlend = blend ? getTraceTexture(material->textures.glossBlend) : nullptr;
+    specular = getTraceTexture(material->textures.specular);
+    specularBlend = blend ? getTraceTexture(material->textures.specularBlend) : nullptr;
+    normal = getTraceTexture(material->textures.normal);
+    normalBlend = blend ? getTraceTexture(material->textures.normalBlend) : nullptr;
+    emission = getTraceTexture(material->textures.emission);
+    alpha = getTraceTexture(material->textures.alpha);
+
+    if (diffuse != nullptr) features |= TRACE_MATERIAL_DIFFUSE;
+    if (diffuseBlend != nullptr) features |= TRACE_MATERIAL_DIFFUSE_BLEND;
+    if (gloss != nullptr) features |= TRACE_MATERIAL_GLOSS;
+    if (glossBlend != nullptr) features |= TRACE_MATERIAL_GLOSS_BLEND;
+    if (specular != nullptr) features |= TRACE_MATERIAL_SPECULAR;
+    if (specularBlend != nullptr) features |= TRACE_MATERIAL_SPECULAR_BLEND;
+    if (normal != nullptr) features |= TRACE_MATERIAL_NORMAL;
+    if (normalBlend != nullptr) features |= TRACE_MATERIAL_NORMAL_BLEND;
+    if (emission != nullptr) features |= TRACE_MATERIAL_EMISSION;
+    if (alpha != nullptr) features |= TRACE_MATERIAL_ALPHA;
+    if (!material->ignoreVertexColor) features |= TRACE_MATERIAL_VERTEX_COLOR;
+    if (material->hasMetalness) features |= TRACE_MATERIAL_METALNESS;
+
+    const auto& parameters = material->parameters;
+
+    diffuseColor = parameters.diffuse;
+    specularColor = parameters.specular;
+    emissive = parameters.emissive;
+    emissionParam = parameters.emissionParam;
+    emissionScale = parameters.ambient * parameters.luminance.x();
+    emissionParamScale = parameters.ambient * parameters.emissionParam.w();
+    pbrFactor = parameters.pbrFactor.head<2>();
+    pbrFactor2 = parameters.pbrFactor2.head<2>();
+    glossPowerScale = parameters.powerGlossLevel.y() * 500.0f;
+    glossLevelScale = parameters.powerGlossLevel.z() * 5.0f;
+    opacity = parameters.opacityReflectionRefractionSpecType.x();
+
+    if (type == MaterialType::IgnoreLight)
+    {
+        kernels[0] = kernels[1] = TraceMaterialKernel::IgnoreLight;
+    }
+    else
+    {
+        kernels[(size_t)TargetEngine::HE1] = selectKernel(features, TargetEngine::HE1);
+        kernels[(size_t)TargetEngine::HE2] = selectKernel(features, TargetEngine::HE2);
+    }
+}
@@ -0,0 +1,103 @@
+﻿#pragma once
+
+class Material;
+class TraceTexture;
+enum class MaterialType : uint32_t;
+enum class TargetEngine;
+
+enum TraceMaterialFeature : uint32_t
+{
+    TRACE_MATERIAL_DIFFUSE = 1 << 0,
+    TRACE_MATERIAL_DIFFUSE_BLEND = 1 << 1, // Also selects the second PBR factor
+    TRACE_MATERIAL_GLOSS = 1 << 2,
+    TRACE_MATERIAL_GLOSS_BLEND = 1 << 3,
+    TRACE_MATERIAL_SPECULAR = 1 << 4,
+    TRACE_MATERIAL_SPECULAR_BLEND = 1 << 5,
+    TRACE_MATERIAL_NORMAL = 1 << 6,
+    TRACE_MATERIAL_NORMAL_BLEND = 1 << 7,
+    TRACE_MATERIAL_EMISSION = 1 << 8,
+    TRACE_MATERIAL_ALPHA = 1 << 9,
+    TRACE_MATERIAL_VERTEX_COLOR = 1 << 10,
+    TRACE_MATERIAL_METALNESS = 1 << 11,
+
+    // Cheap enough to stay runtime checks in every kernel, normal maps only apply in the viewport
+    TRACE_MATERIAL_RUNTIME_FEATURES = TRACE_MATERIAL_NORMAL | TRACE_MATERIAL_NORMAL_BLEND | TRACE_MATERIAL_ALPHA |
+        TRACE_MATERIAL_VERTEX_COLOR | TRACE_MATERIAL_METALNESS,
+
+    TRACE_MATERIAL_ALL = ~0u
+};
+
+// Shading function a material is specialized into, features missing from the kernel are compiled out
+enum class TraceMaterialKernel : uint8_t
+{
+    None, // No material or sky, surfaces keep their defaults
+    Untextured,
+    Diffuse,
+    DiffuseGloss, // HE1
+    DiffuseSpecular, // HE2
+    Generic,
+    IgnoreLight
+};
+
+constexpr uint32_t getTraceMaterialKernelFeatures(const TraceMaterialKernel kernel)
+{
+    switch (kernel)
+    {
+    case TraceMaterialKernel::Untextured: return TRACE_MATERIAL_RUNTIME_FEATURES;
+    case TraceMaterialKernel::Diffuse: return TRACE_MATERIAL_RUNTIME_FEATURES | TRACE_MATERIAL_DIFFUSE;
+    case TraceMaterialKernel::DiffuseGloss: return TRACE_MATERIAL_RUNTIME_FEATURES | TRACE_MATERIAL_DIFFUSE | TRACE_MATERIAL_GLOSS | TRACE_MATERIAL_SPECULAR;
+    case TraceMaterialKernel::DiffuseSpecular: return TRACE_MATERIAL_RUNTIME_FEATURES | TRACE_MATERIAL_DIFFUSE | TRACE_MATERIAL_SPECULAR;
+    default: return TRACE_MATERIAL_ALL;
+    }
+}
+
+// Flattened copy of a material for hit shading, parameters are premultiplied
+// and textures point straight at their trace textures.
+struct TraceMaterial
+{
+    const Material* material{};
+    MaterialType type{};
+    uint32_t features{};
+    TraceMaterialKernel kernels[2]{}; // Indexed by TargetEngine
+
+    const TraceTexture* diffuse{};
+    const TraceTexture* diffuseBlend{};
+    const TraceTexture* gloss{};
+    const TraceTexture* glossBlend{};
+    const TraceTexture* specular{};
+    const TraceTexture* specularBlend{};
+    const TraceTexture* normal{};
+    const TraceTexture* normalBlend{};
+    const TraceTexture* emission{};
+    const TraceTexture* alpha{};
+
+    Color4 diffuseColor { 1, 1, 1, 1 };
+    Color4 specularColor { 1, 1, 1, 1 };
+    Color4 emissive { 0, 0, 0, 0 };
+    Color4 emissionParam { 0, 0, 0, 0 };
+    Color4 emissionScale { 1, 1, 1, 1 }; // Ambient times luminance
+    Color4 emissionParamScale { 1, 1, 1, 1 }; // Ambient times emission parameter, HE1 ignore light
+    Eigen::Array2f pbrFactor { 0.04f, 0.5f };
+    Eigen::Array2f pbrFactor2 { 0.04f, 0.5f };
+    float glossPowerScale{};
+    float glossLevelScale{};
+    float opacity { 1 };
+    bool doubleSided{};
+
+    void build(const Material* material);
+
+    // Always false for features the kernel compiled out
+    template<uint32_t kernelFeatures, uint32_t feature>
+    bool has() const
+    {
+        if constexpr ((kernelFeatures & feature) == 0)
+            return false;
+        else
+            return (features & feature) != 0;
+    }
+
+    TraceMaterialKernel getKernel(const TargetEngine targetEngine) const
+    {
+        return kernels[(size_t)targetEngine];
+    }
+};
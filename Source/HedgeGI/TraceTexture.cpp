@@ -0,0 +1,104 @@
+﻿#include "TraceTexture.h"
+
+#include "Bitmap.h"
+
+void TraceTexture::build(const Bitmap& bitmap)
+{
+    data = nullptr;
+    levels.clear();
+
+    if (bitmap.data == nullptr || bitmap.width == 0 || bitmap.height == 0)
+        return;
+
+    halfFloat = bitmap.format == BitmapFormat::F32 || bitmap.format == BitmapFormat::F16 ||
+        bitmap.format == BitmapFormat::R32F || bitmap.format == BitmapFormat::R16F;
+
+    size_t width = nextPowerOfTwo(bitmap.width);
+    size_t height = nextPowerOfTwo(bitmap.height);
+
+    log2Size = 0.5f * log2f((float)(width * height));
+
+    // Textures are almost always powers of two already, resample the odd ones out at texel centers
+    std::vector<Color4> colors(width * height);
+
+    for (size_t y = 0; y < height; y++)
+    {
+        for (size_t x = 0; x < width; x++)
+        {
+            if (width == bitmap.width && height == bitmap.height)
+                colors[y * width + x] = bitmap.getColor(x, y);
+            else
+                colors[y * width + x] = bitmap.getColor<true>(Vector2(((float)x + 0.5f) / (float)width, ((float)y + 0.5f) / (float)height));
+        }
+    }
+
+    size_t texelCount = 0;
+
+    while (true)
+    {
+        const uint32_t mortonBits = (uint32_t)std::round(std::log2((double)std::min(width, height)));
+
+        levels.push_back({ texelCount, (uint32_t)width - 1, (uint32_t)height - 1, mortonBits });
+        texelCount += width * height;
+
+        if (width == 1 && height == 1)
+            break;
+
+        width = std::max<size_t>(1, width / 2);
+        height = std::max<size_t>(1, height / 2);
+    }
+
+    const size_t texelSize = halfFloat ? sizeof(DirectX::PackedVector::XMHALF4) : sizeof(Color4i);
+    data = std::make_unique<uint8_t[]>(texelCount * texelSize);
+
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        const Level& level = levels[i];
+
+        width = level.widthMask + 1;
+        height = level.heightMask + 1;
+
+        // Box filter the previous level, a side that already reached 1 only averages along the other
+        if (i > 0)
+        {
+            const size_t previousWidth = levels[i - 1].widthMask + 1;
+            const size_t previousHeight = levels[i - 1].heightMask + 1;
+
+            const size_t strideX = previousWidth / width;
+            const size_t strideY = previousHeight / height;
+
+            for (size_t y = 0; y < height; y++)
+            {
+                for (size_t x = 0; x < width; x++)
+                {
+                    Color4 color = Color4::Zero();
+
+                    for (size_t j = 0; j < strideY; j++)
+                    {
+                        for (size_t k = 0; k < strideX; k++)
+                            color += colors[(y * strideY + j) * previousWidth + x * strideX + k];
+                    }
+
+                    colors[y * width + x] = color / (float)(strideX * strideY);
+                }
+            }
+        }
+
+        for (size_t y = 0; y < height; y++)
+        {
+            for (size_t x = 0; x < width; x++)
+            {
+                const size_t index = getIndex(level, (uint32_t)x, (uint32_t)y);
+                const Color4& color = colors[y * width + x];
+
+                if (halfFloat)
+                {
+                    DirectX::PackedVector::XMStoreHalf4((DirectX::PackedVector::XMHALF4*)data.get() + index,
+                        DirectX::XMLoadFloat4((const DirectX::XMFLOAT4*)&color));
+                }
+                else
+                    ((Color4i*)data.get())[index] = (color.cwiseMax(0.0f).cwiseMin(1.0f) * 255.0f + 0.5f).cast<uint8_t>();
+            }
+        }
+    }
+}
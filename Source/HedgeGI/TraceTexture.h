@@ -0,0 +1,138 @@
+﻿#pragma once
+
+#include "Math.h"
+
+class Bitmap;
+
+// Copy of a bitmap laid out for sampling while tracing. Levels are padded to powers of two so taps wrap with masks
+// and store texels in Morton order, a full mip chain lets wide path footprints read from small levels that stay in cache.
+// Texels keep the width of the source, floating point textures are stored as half floats and widened when sampled.
+class TraceTexture
+{
+    struct Level
+    {
+        size_t offset;
+        uint32_t widthMask;
+        uint32_t heightMask;
+        uint32_t mortonBits; // Log2 of the shorter side, the remainder of the longer side is stored above
+    };
+
+    std::unique_ptr<uint8_t[]> data;
+    std::vector<Level> levels;
+    bool halfFloat{};
+    float log2Size{}; // Log2 of the first level's texel footprint, half of log2(width * height)
+
+    static uint32_t spreadBits(uint32_t value)
+    {
+        value &= 0xFFFF;
+        value = (value | (value << 8)) & 0x00FF00FF;
+        value = (value | (value << 4)) & 0x0F0F0F0F;
+        value = (value | (value << 2)) & 0x33333333;
+        value = (value | (value << 1)) & 0x55555555;
+        return value;
+    }
+
+    static size_t getIndex(const Level& level, const uint32_t x, const uint32_t y)
+    {
+        const uint32_t mask = (1u << level.mortonBits) - 1;
+        return level.offset + (spreadBits(x & mask) | (spreadBits(y & mask) << 1)) + ((size_t)((x | y) >> level.mortonBits) << (level.mortonBits * 2));
+    }
+
+    Color4 load(const size_t index) const
+    {
+        if (halfFloat)
+        {
+            Color4 color;
+
+            DirectX::XMStoreFloat4((DirectX::XMFLOAT4*)&color,
+                DirectX::PackedVector::XMLoadHalf4((const DirectX::PackedVector::XMHALF4*)data.get() + index));
+
+            return color;
+        }
+
+        return ((const Color4i*)data.get())[index].cast<float>() * (1.0f / 255.0f);
+    }
+
+    float loadAlpha(const size_t index) const
+    {
+        if (halfFloat)
+            return half_to_float(((const uint16_t*)data.get())[index * 4 + 3]);
+
+        return (float)((const Color4i*)data.get())[index].w() * (1.0f / 255.0f);
+    }
+
+    const Level& getLevel(const float lod) const
+    {
+        const float level = std::min(lod + log2Size + 0.5f, (float)(levels.size() - 1));
+        return levels[level >= 1.0f ? (size_t)level : 0];
+    }
+
+    template<bool useLinearFiltering, typename T, typename TLoad>
+    T sample(const Vector2& texCoord, const float lod, const TLoad& loadFunc) const
+    {
+        const Level& level = getLevel(lod);
+
+        const float x = texCoord.x() * (float)(level.widthMask + 1);
+        const float y = texCoord.y() * (float)(level.heightMask + 1);
+
+        const float floorX = std::floor(x);
+        const float floorY = std::floor(y);
+
+        const uint32_t x0 = (uint32_t)(int64_t)floorX & level.widthMask;
+        const uint32_t y0 = (uint32_t)(int64_t)floorY & level.heightMask;
+
+        if (!useLinearFiltering)
+            return loadFunc(getIndex(level, x0, y0));
+
+        const uint32_t x1 = (x0 + 1) & level.widthMask;
+        const uint32_t y1 = (y0 + 1) & level.heightMask;
+
+        const T x0y0 = loadFunc(getIndex(level, x0, y0));
+        const T x1y0 = loadFunc(getIndex(level, x1, y0));
+        const T x0y1 = loadFunc(getIndex(level, x0, y1));
+        const T x1y1 = loadFunc(getIndex(level, x1, y1));
+
+        const float factorX = x - floorX;
+        const float factorY = y - floorY;
+
+        return lerp(lerp(x0y0, x1y0, factorX), lerp(x0y1, x1y1, factorX), factorY);
+    }
+
+public:
+    bool valid() const
+    {
+        return data != nullptr;
+    }
+
+    uint32_t getWidth() const
+    {
+        return levels[0].widthMask + 1;
+    }
+
+    uint32_t getHeight() const
+    {
+        return levels[0].heightMask + 1;
+    }
+
+    void build(const Bitmap& bitmap);
+
+    // The level of detail is log2 of the texture coordinate footprint, without the texture size.
+    // Negative infinity always samples the first level.
+    template<bool useLinearFiltering = false>
+    Color4 getColor(const Vector2& texCoord, const float lod = -INFINITY) const
+    {
+        return sample<useLinearFiltering, Color4>(texCoord, lod, [this](const size_t index) { return load(index); });
+    }
+
+    template<bool useLinearFiltering = false>
+    float getAlpha(const Vector2& texCoord, const float lod = -INFINITY) const
+    {
+        return sample<useLinearFiltering, float>(texCoord, lod, [this](const size_t index) { return loadAlpha(index); });
+    }
+
+    // Reads the first level, coordinates wrap around
+    float getAlpha(const uint32_t x, const uint32_t y) const
+    {
+        return loadAlpha(getIndex(levels[0], x & levels[0].widthMask, y & levels[0].heightMask));
+    }
+};
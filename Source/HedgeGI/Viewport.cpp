@@ -74,11 +74,11 @@ void Viewport::validate()
         rgbTable = sceneRgbTable.get();
         rgbTableTex = rgbTable ? std::make_unique<Texture>(
             GL_TEXTURE_2D,
-            rgbTable->format == BitmapFormat::U8 ? GL_RGBA8 : GL_RGBA32F, 
+            rgbTable->format == BitmapFormat::U8 ? GL_RGBA8 : rgbTable->format == BitmapFormat::F16 ? GL_RGBA16F : GL_RGBA32F, 
             (GLsizei)rgbTable->width, 
             (GLsizei)rgbTable->height,
             GL_RGBA, 
-            rgbTable->format == BitmapFormat::U8 ? GL_UNSIGNED_BYTE : GL_FLOAT, 
+            rgbTable->format == BitmapFormat::U8 ? GL_UNSIGNED_BYTE : rgbTable->format == BitmapFormat::F16 ? GL_HALF_FLOAT : GL_FLOAT, 
             rgbTable->data) : nullptr;
     }
 
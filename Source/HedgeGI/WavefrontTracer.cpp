@@ -0,0 +1,451 @@
+﻿#include "WavefrontTracer.h"
+
+#include "BakeParams.h"
+#include "BakingFactory.h"
+#include "Light.h"
+#include "Material.h"
+#include "Random.h"
+#include "RaytracingDevice.h"
+#include "Scene.h"
+#include "Utilities.h"
+
+namespace
+{
+    struct PathQueue
+    {
+        std::vector<Color4> throughputs;
+        std::vector<Color4> radiances;
+        std::vector<uint8_t> backFacing;
+        std::vector<Color3> albedos;
+        std::vector<Sampler> samplers;
+        std::vector<float> coneWidths;
+
+        // Radiance gathered past the first bounce, used to warm up the radiance cache
+        std::vector<Vector3> cachePositions;
+        std::vector<Vector3> cacheNormals;
+        std::vector<Color4> cacheThroughputs;
+        std::vector<Color4> cacheRadiances;
+
+        PathQueue(const size_t count)
+            : throughputs(count, Color4::Ones()), radiances(count, Color4::Zero()), backFacing(count), albedos(count, Color3::Zero()), samplers(count), coneWidths(count)
+        {
+        }
+    };
+
+    struct ExtensionQueue
+    {
+        std::vector<Vector3> origins;
+        std::vector<Vector3> directions;
+        std::vector<uint32_t> paths;
+
+        // Filled by intersect
+        std::vector<Vector3> normals;
+        std::vector<float> distances;
+        std::vector<float> us;
+        std::vector<float> vs;
+        std::vector<uint32_t> primIDs;
+        std::vector<uint32_t> meshIndices;
+
+        size_t size() const
+        {
+            return paths.size();
+        }
+
+        void clear()
+        {
+            origins.clear();
+            directions.clear();
+            paths.clear();
+        }
+
+        void push(const Vector3& origin, const Vector3& direction, const uint32_t path)
+        {
+            origins.push_back(origin);
+            directions.push_back(direction);
+            paths.push_back(path);
+        }
+
+        RTCRayHit getRayHit(const size_t index) const
+        {
+            RTCRayHit query {};
+
+            setRayOrigin(query.ray, origins[index], 0.001f);
+            setRayDirection(query.ray, directions[index]);
+
+            query.ray.tfar = distances[index];
+            query.hit.Ng_x = normals[index].x();
+            query.hit.Ng_y = normals[index].y();
+            query.hit.Ng_z = normals[index].z();
+            query.hit.u = us[index];
+            query.hit.v = vs[index];
+            query.hit.primID = primIDs[index];
+            query.hit.geomID = meshIndices[index];
+            query.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+
+            return query;
+        }
+    };
+
+    struct ShadowQueue
+    {
+        std::vector<Vector3> origins;
+        std::vector<Vector3> directions;
+        std::vector<float> distances;
+        std::vector<Color4> contributions;
+        std::vector<uint32_t> paths;
+
+        size_t size() const
+        {
+            return paths.size();
+        }
+
+        void clear()
+        {
+            origins.clear();
+            directions.clear();
+            distances.clear();
+            contributions.clear();
+            paths.clear();
+        }
+
+        void push(const Vector3& origin, const Vector3& direction, const float distance, const Color4& contribution, const uint32_t path)
+        {
+            origins.push_back(origin);
+            directions.push_back(direction);
+            distances.push_back(distance);
+            contributions.push_back(contribution);
+            paths.push_back(path);
+        }
+    };
+
+    template<int N>
+    void intersect(const RaytracingContext& raytracingContext, ExtensionQueue& queue, RTCIntersectArguments* intersectArgs)
+    {
+        queue.normals.resize(queue.size());
+        queue.distances.resize(queue.size());
+        queue.us.resize(queue.size());
+        queue.vs.resize(queue.size());
+        queue.primIDs.resize(queue.size());
+        queue.meshIndices.resize(queue.size());
+
+        for (size_t i = 0; i < queue.size(); i += N)
+        {
+            alignas(64) RTCRayHitNt<N> packet;
+            alignas(64) int valid[N];
+
+            const size_t count = std::min<size_t>(N, queue.size() - i);
+
+            for (size_t j = 0; j < N; j++)
+            {
+                if (j >= count)
+                {
+                    valid[j] = 0;
+                    continue;
+                }
+
+                const Vector3& origin = queue.origins[i + j];
+                const Vector3& direction = queue.directions[i + j];
+
+                valid[j] = -1;
+                packet.ray.org_x[j] = origin.x();
+                packet.ray.org_y[j] = origin.y();
+                packet.ray.org_z[j] = origin.z();
+                packet.ray.tnear[j] = 0.001f;
+                packet.ray.dir_x[j] = direction.x();
+                packet.ray.dir_y[j] = direction.y();
+                packet.ray.dir_z[j] = direction.z();
+                packet.ray.time[j] = 0.0f;
+                packet.ray.tfar[j] = INFINITY;
+                packet.ray.mask[j] = RAY_MASK_OPAQUE | RAY_MASK_TRANS | RAY_MASK_PUNCH_THROUGH;
+                packet.ray.id[j] = 0;
+                packet.ray.flags[j] = 0;
+                packet.hit.geomID[j] = RTC_INVALID_GEOMETRY_ID;
+                packet.hit.instID[0][j] = RTC_INVALID_GEOMETRY_ID;
+            }
+
+            intersectPacket<N>(valid, raytracingContext.rtcScene, packet, intersectArgs);
+
+            for (size_t j = 0; j < count; j++)
+            {
+                queue.normals[i + j] = Vector3(packet.hit.Ng_x[j], packet.hit.Ng_y[j], packet.hit.Ng_z[j]);
+                queue.distances[i + j] = packet.ray.tfar[j];
+                queue.us[i + j] = packet.hit.u[j];
+                queue.vs[i + j] = packet.hit.v[j];
+                queue.primIDs[i + j] = packet.hit.primID[j];
+                queue.meshIndices[i + j] = packet.hit.geomID[j] != RTC_INVALID_GEOMETRY_ID ? 
+                    getMeshIndex(packet.hit.geomID[j], packet.hit.instID[0][j]) : RTC_INVALID_GEOMETRY_ID;
+            }
+        }
+    }
+
+    template<int N>
+    void occluded(const RaytracingContext& raytracingContext, const ShadowQueue& queue, const BakeParams& bakeParams, RTCOccludedArguments* occludedArgs, PathQueue& paths)
+    {
+        for (size_t i = 0; i < queue.size(); i += N)
+        {
+            alignas(64) RTCRayNt<N> packet;
+            alignas(64) int valid[N];
+
+            const size_t count = std::min<size_t>(N, queue.size() - i);
+
+            for (size_t j = 0; j < N; j++)
+            {
+                if (j >= count)
+                {
+                    valid[j] = 0;
+                    continue;
+                }
+
+                const Vector3& origin = queue.origins[i + j];
+                const Vector3& direction = queue.directions[i + j];
+
+                valid[j] = -1;
+                packet.org_x[j] = origin.x();
+                packet.org_y[j] = origin.y();
+                packet.org_z[j] = origin.z();
+                packet.tnear[j] = bakeParams.shadow.bias;
+                packet.dir_x[j] = direction.x();
+                packet.dir_y[j] = direction.y();
+                packet.dir_z[j] = direction.z();
+                packet.time[j] = 0.0f;
+                packet.tfar[j] = queue.distances[i + j];
+                packet.mask[j] = RAY_MASK_OPAQUE | RAY_MASK_PUNCH_THROUGH;
+                packet.id[j] = 0;
+                packet.flags[j] = 0;
+            }
+
+            occludedPacket<N>(valid, raytracingContext.rtcScene, packet, occludedArgs);
+
+            for (size_t j = 0; j < count; j++)
+            {
+                if (packet.tfar[j] >= 0)
+                    paths.radiances[queue.paths[i + j]] += queue.contributions[i + j];
+            }
+        }
+    }
+
+    template<TargetEngine targetEngine, int N>
+    void traceWavefront(const RaytracingContext& raytracingContext, std::vector<WavefrontTracer::Path>& paths, const BakeParams& bakeParams, Random& random)
+    {
+        IntersectContext context(raytracingContext, random);
+
+        RTCIntersectArguments intersectArgs;
+        rtcInitIntersectArguments(&intersectArgs);
+
+        intersectArgs.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+        intersectArgs.context = &context;
+        intersectArgs.filter = intersectContextFilter<targetEngine, false>;
+
+        RTCOccludedArguments occludedArgs;
+        rtcInitOccludedArguments(&occludedArgs);
+
+        occludedArgs.flags = RTC_RAY_QUERY_FLAG_INVOKE_ARGUMENT_FILTER;
+        occludedArgs.context = &context;
+        occludedArgs.filter = intersectContextFilter<targetEngine, false>;
+
+        PathQueue pathQueue(paths.size());
+        ExtensionQueue extensionQueue;
+        ExtensionQueue nextExtensionQueue;
+        ShadowQueue shadowQueue;
+
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            extensionQueue.push(paths[i].position, paths[i].direction, (uint32_t)i);
+            pathQueue.samplers[i] = paths[i].sampler;
+        }
+
+        if (raytracingContext.radianceCache != nullptr)
+        {
+            pathQueue.cachePositions.resize(paths.size());
+            pathQueue.cacheNormals.resize(paths.size());
+            pathQueue.cacheThroughputs.resize(paths.size(), Color4::Zero());
+            pathQueue.cacheRadiances.resize(paths.size());
+        }
+
+        std::vector<uint32_t> order;
+        std::vector<const Material*> materials;
+
+        const float coneSpreadAngle = BakingFactory::getConeSpreadAngle(bakeParams);
+
+        for (size_t depth = 0; depth < bakeParams.light.bounceCount && extensionQueue.size() > 0; depth++)
+        {
+            intersect<N>(raytracingContext, extensionQueue, &intersectArgs);
+
+            order.clear();
+            materials.resize(extensionQueue.size());
+
+            for (size_t i = 0; i < extensionQueue.size(); i++)
+            {
+                const uint32_t meshIndex = extensionQueue.meshIndices[i];
+
+                if (meshIndex == RTC_INVALID_GEOMETRY_ID)
+                {
+                    const uint32_t path = extensionQueue.paths[i];
+
+                    if (depth == 0)
+                        pathQueue.albedos[path] = Color3::Ones();
+
+                    pathQueue.radiances[path].head<3>() += pathQueue.throughputs[path].head<3>() * 
+                        BakingFactory::sampleSky<targetEngine, false>(raytracingContext, extensionQueue.directions[i], bakeParams, depth);
+                }
+                else
+                {
+                    materials[i] = raytracingContext.scene->meshes[meshIndex]->material;
+                    order.push_back((uint32_t)i);
+                }
+            }
+
+            // Group hits by material first and mesh second so shading stays coherent
+            std::sort(order.begin(), order.end(), [&](const uint32_t lhs, const uint32_t rhs)
+            {
+                if (materials[lhs] != materials[rhs])
+                    return materials[lhs] < materials[rhs];
+
+                return extensionQueue.meshIndices[lhs] < extensionQueue.meshIndices[rhs];
+            });
+
+            nextExtensionQueue.clear();
+            shadowQueue.clear();
+
+            for (const uint32_t index : order)
+            {
+                const uint32_t path = extensionQueue.paths[index];
+
+                pathQueue.coneWidths[path] += coneSpreadAngle * extensionQueue.distances[index];
+
+                BakingFactory::HitSurface surface;
+
+                if (!BakingFactory::getHitSurface<targetEngine, false>(raytracingContext, extensionQueue.getRayHit(index), depth, bakeParams, pathQueue.coneWidths[path], surface))
+                {
+                    pathQueue.backFacing[path] = depth == 0;
+
+                    if (depth == 0)
+                        pathQueue.albedos[path] = Color3::Zero();
+
+                    continue;
+                }
+
+                if (depth == 0)
+                    pathQueue.albedos[path] = surface.diffuse.head<3>();
+
+                Color4& throughput = pathQueue.throughputs[path];
+                Color4& radiance = pathQueue.radiances[path];
+
+                if (depth == 1 && raytracingContext.radianceCache != nullptr)
+                {
+                    Color3 cachedRadiance;
+
+                    if (raytracingContext.radianceCache->get(surface.position, surface.normal, cachedRadiance))
+                    {
+                        radiance.head<3>() += throughput.head<3>() * cachedRadiance;
+                        continue;
+                    }
+
+                    pathQueue.cachePositions[path] = surface.position;
+                    pathQueue.cacheNormals[path] = surface.normal;
+                    pathQueue.cacheThroughputs[path] = throughput;
+                    pathQueue.cacheRadiances[path] = radiance;
+                }
+
+                random.beginSample(pathQueue.samplers[path]);
+
+                if (surface.material == nullptr || surface.material->type == MaterialType::Common || surface.material->type == MaterialType::Blend)
+                {
+                    for (uint32_t j = 0; j <= bakeParams.light.localLightSampleCount; j++)
+                    {
+                        const Light* light = raytracingContext.lightBVH->getSunLight();
+                        float lightWeight = 1.0f;
+
+                        if (j > 0)
+                            light = BakingFactory::sampleLocalLight<targetEngine>(raytracingContext, surface, bakeParams, random, lightWeight);
+
+                        if (light == nullptr)
+                            continue;
+
+                        Vector3 lightDirection;
+                        float attenuation;
+
+                        if (!BakingFactory::getLightDirection<targetEngine>(surface.position, *light, lightDirection, attenuation))
+                            continue;
+
+                        const Color4 contribution = throughput * 
+                            BakingFactory::evaluateDirectLighting<targetEngine>(surface, *light, lightDirection, attenuation, bakeParams) * lightWeight;
+
+                        if ((contribution == 0.0f).all())
+                            continue;
+
+                        // Defer the shadow test to the bulk shadow pass
+                        if (targetEngine == TargetEngine::HE1 || light->type == LightType::Directional)
+                        {
+                            shadowQueue.push(surface.position, -lightDirection, 
+                                light->type == LightType::Point ? (light->position - surface.position).norm() : INFINITY, contribution, path);
+                        }
+                        else
+                        {
+                            radiance += contribution;
+                        }
+                    }
+
+                    radiance += throughput * surface.emission;
+                }
+                else if (surface.material->type == MaterialType::IgnoreLight)
+                {
+                    radiance += throughput * (surface.diffuse + surface.emission);
+                    random.endSample();
+                    continue;
+                }
+
+                Vector3 hitDirection;
+
+                if (BakingFactory::sampleNextDirection<targetEngine>(surface, depth, bakeParams, random, throughput, hitDirection))
+                    nextExtensionQueue.push(surface.position, hitDirection, path);
+
+                pathQueue.samplers[path] = random.endSample();
+            }
+
+            occluded<N>(raytracingContext, shadowQueue, bakeParams, &occludedArgs, pathQueue);
+
+            std::swap(extensionQueue, nextExtensionQueue);
+        }
+
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            if (raytracingContext.radianceCache != nullptr && (pathQueue.cacheThroughputs[i].head<3>() > 0.0f).all())
+            {
+                raytracingContext.radianceCache->add(pathQueue.cachePositions[i], pathQueue.cacheNormals[i],
+                    (pathQueue.radiances[i].head<3>() - pathQueue.cacheRadiances[i].head<3>()) / pathQueue.cacheThroughputs[i].head<3>());
+            }
+
+            paths[i].color = pathQueue.radiances[i].head<3>().cwiseMax(0);
+            paths[i].backFacing = pathQueue.backFacing[i] != 0;
+            paths[i].albedo = pathQueue.albedos[i];
+        }
+    }
+
+    template<TargetEngine targetEngine>
+    void traceWavefront(const RaytracingContext& raytracingContext, std::vector<WavefrontTracer::Path>& paths, const BakeParams& bakeParams, Random& random)
+    {
+        switch (RaytracingDevice::getPacketSize())
+        {
+        case 16:
+            traceWavefront<targetEngine, 16>(raytracingContext, paths, bakeParams, random);
+            break;
+
+        case 8:
+            traceWavefront<targetEngine, 8>(raytracingContext, paths, bakeParams, random);
+            break;
+
+        default:
+            traceWavefront<targetEngine, 4>(raytracingContext, paths, bakeParams, random);
+            break;
+        }
+    }
+}
+
+void WavefrontTracer::trace(const RaytracingContext& raytracingContext, std::vector<Path>& paths, const BakeParams& bakeParams, Random& random)
+{
+    if (bakeParams.targetEngine == TargetEngine::HE2)
+        traceWavefront<TargetEngine::HE2>(raytracingContext, paths, bakeParams, random);
+    else
+        traceWavefront<TargetEngine::HE1>(raytracingContext, paths, bakeParams, random);
+}
@@ -0,0 +1,29 @@
+﻿#pragma once
+
+#include "Sampler.h"
+
+struct BakeParams;
+struct RaytracingContext;
+class Random;
+
+// Breadth-first alternative to BakingFactory::pathTrace. Every bounce of all paths is processed
+// as a wave: extension rays are traced together, hits are sorted by material and mesh before shading,
+// and the shadow rays spawned by the wave are traced in bulk afterwards.
+class WavefrontTracer
+{
+public:
+    struct Path
+    {
+        // Input
+        Vector3 position;
+        Vector3 direction;
+        Sampler sampler; // Continues the sample of the first bounce, see Random::beginSample
+
+        // Output
+        Color3 color;
+        bool backFacing;
+        Color3 albedo; // See BakingFactory::TraceResult::albedo
+    };
+
+    static void trace(const RaytracingContext& raytracingContext, std::vector<Path>& paths, const BakeParams& bakeParams, Random& random);
+};